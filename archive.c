@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <ogg/ogg.h>
+#include <opus/opus.h>
+
+#include "util.h"
+#include "archive.h"
+
+/**
+ * Archive thread: takes packets off the queue and hands them to the file
+ * writer, which takes care of rotating segments.  The queue is never locked
+ * while writing, so a slow disk only makes the queue grow.
+ */
+static void *archive_thread(void *arg) {
+    archive_t *ar = (archive_t*)arg;
+    queued_packet_t *pkt;
+    ogg_packet op;
+    bool first = true;
+    bool failed = false;
+
+    memset(&op, 0, sizeof(op));
+
+    while((pkt = packet_queue_pop(&ar->queue)) != NULL) {
+        /* set before the first packet was queued */
+        if(first) file_writer_set_start_time(&ar->fw, ar->start_time);
+        first = false;
+        op.packet = pkt->data;
+        op.bytes = pkt->bytes;
+        /* the stream carries on without the archive; the queue is still
+         * drained so that the encoder never waits on it */
+        if(!failed && file_writer_input(&ar->fw, &op) < 0) {
+            fprintf(stderr, "archive: stopped, could not start a new file\n");
+            failed = true;
+        }
+        free(pkt);
+    }
+
+    file_writer_free(&ar->fw);
+    return NULL;
+}
+
+/**
+ * Starts an archive of Opus packets, written as a series of files of
+ * max_length samples named <name>-<n>.opus.  Pages go through a write pool
+ * with a single I/O thread, so neither writes nor syncs hold up the archive
+ * thread.  Each file is written as <name>-<n>.opus.part and renamed once it
+ * is complete and on disk.  Each file is tagged with the wall clock time of
+ * its first sample, as START_TIME.
+ * @param prealloc bytes to preallocate for each file
+ * @param sync_bytes fdatasync each file after this many bytes, or 0
+ */
+archive_t *archive_new(const char *name, const OpusHeader *header,
+  const char *tags, int tag_len, int64_t max_length, int64_t prealloc,
+  size_t sync_bytes) {
+    archive_t *ar = (archive_t*)malloc(sizeof(archive_t));
+    CHECK_MALLOC(ar);
+
+    ar->pool = write_pool_new(1, ARCHIVE_BUFFER_SIZE, ARCHIVE_BUFFERS);
+    write_pool_set_durability(ar->pool, sync_bytes, true);
+
+    file_writer_init(&ar->fw, name, header, tags, tag_len);
+    file_writer_set_max_length(&ar->fw, max_length);
+    file_writer_set_pool(&ar->fw, ar->pool, prealloc);
+
+    packet_queue_init(&ar->queue, ARCHIVE_MAX_QUEUED);
+    ar->dropped = 0;
+    ar->preskip = header->preskip;
+    ar->start_time = 0;
+
+    if(pthread_create(&ar->thread, NULL, archive_thread, ar) != 0) {
+        perror("error: starting archive thread");
+        packet_queue_destroy(&ar->queue);
+        file_writer_free(&ar->fw);
+        write_pool_free(ar->pool);
+        free(ar);
+        return NULL;
+    }
+
+    return ar;
+}
+
+/**
+ * Queues a copy of a packet for the archive thread.
+ * @return 0 on success, -1 if the packet was dropped because the archive
+ *  is too far behind
+ */
+int archive_write(archive_t *ar, const unsigned char *packet, int bytes) {
+    if(ar->start_time == 0) {
+        /* the first packet ends with the audio captured about now, and
+         * granule position 0 is the encoder's lookahead before its start */
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        int nframes = opus_packet_get_samples_per_frame(packet, 48000);
+        ar->start_time = ts.tv_sec + ts.tv_nsec / 1e9 -
+            (double)(nframes + ar->preskip) / 48000;
+    }
+    if(packet_queue_push(&ar->queue, packet, bytes, -1, false) < 0) {
+        if(ar->dropped++ == 0) {
+            fprintf(stderr, "warning: archive is not keeping up, dropping packets\n");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes out everything still queued, closes the current segment and frees
+ * the archive.
+ */
+void archive_free(archive_t *ar) {
+    packet_queue_close(&ar->queue);
+    pthread_join(ar->thread, NULL);
+
+    if(ar->dropped) {
+        fprintf(stderr, "warning: archive dropped %d packets\n", ar->dropped);
+    }
+
+    packet_queue_destroy(&ar->queue);
+    write_pool_free(ar->pool);
+    free(ar);
+}
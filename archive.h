@@ -0,0 +1,37 @@
+#ifndef __archive_h_
+#define __archive_h_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "opus_header.h"
+#include "file_writer.h"
+#include "packet_queue.h"
+
+/* packets queued beyond this many bytes are dropped rather than blocking
+ * the encoder */
+#define ARCHIVE_MAX_QUEUED (64 << 20)
+/* kept small so that little sits in memory between syncs at stream
+ * bitrates */
+#define ARCHIVE_BUFFER_SIZE (64 << 10)
+#define ARCHIVE_BUFFERS 4
+
+typedef struct {
+    OpusFileWriter fw;      /* only touched by the archive thread */
+    write_pool_t *pool;     /* the I/O thread the file writer hands pages to */
+
+    pthread_t thread;
+    packet_queue_t queue;   /* packets waiting to be written */
+    int dropped;            /* packets dropped because the queue was full */
+    int preskip;
+    double start_time;      /* wall clock time of granule position 0, set
+                               with the first packet */
+} archive_t;
+
+archive_t *archive_new(const char *name, const OpusHeader *header,
+  const char *tags, int tag_len, int64_t max_length, int64_t prealloc,
+  size_t sync_bytes);
+int archive_write(archive_t *ar, const unsigned char *packet, int bytes);
+void archive_free(archive_t *ar);
+
+#endif // __archive_h_
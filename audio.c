@@ -2,21 +2,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "util.h"
 #include "circbuf.h"
 #include "audio.h"
+#include "trace.h"
+#include "probes.h"
 
 #define AUDIO_BUFFER_SIZE 48000
 
-int n_channels;
-circbuf_t **channel_buffers;
-jack_client_t *jack_client;
-jack_port_t **ports_in;
-jack_nframes_t audio_srate;
-const char *cname;
-
 static int audio_srate_change_cb(jack_nframes_t nframes, void *arg) {
-    fprintf(stderr, "audio: sample rate changed to %lu Hz\n", nframes);
-    audio_srate = nframes;
+    audio_t *a = (audio_t*)arg;
+    fprintf(stderr, "audio: %s: sample rate changed to %lu Hz\n", a->cname,
+        (unsigned long)nframes);
+    a->srate = nframes;
     return 0;
 }
 
@@ -25,17 +23,18 @@ static void audio_error_cb(const char *desc) {
 }
 
 static void audio_jack_shutdown_cb(void *arg) {
-    fprintf(stderr, "audio: JACK shutdown\n");
+    audio_t *a = (audio_t*)arg;
+    fprintf(stderr, "audio: %s: JACK shutdown\n", a->cname);
 }
 
-void audio_connect_inputs(int offset) {
+void audio_connect_inputs(audio_t *a, int offset) {
     char src[256];
     char dst[256];
 
-    for(int i=0; i<n_channels; i++) {
+    for(int i=0; i<a->n_channels; i++) {
         snprintf(src, sizeof(src), "system:capture_%d", i+offset);
-        snprintf(dst, sizeof(dst), "%s:in_%d", cname, i+1);
-        int ret = jack_connect(jack_client, src, dst);
+        snprintf(dst, sizeof(dst), "%s:in_%d", a->cname, i+1);
+        int ret = jack_connect(a->jack_client, src, dst);
         if(ret) {
             fprintf(stderr, "error connecting %s -> %s\n", src, dst);
         } else {
@@ -44,69 +43,174 @@ void audio_connect_inputs(int offset) {
     }
 }
 
+/**
+ * Notes when the period ending at frame end was captured, so that the
+ * encoder can tell how long its audio waited.  Written by the process
+ * callback alone; an entry is invalidated while it is rewritten.
+ */
+static void audio_trace_capture(audio_t *a, uint64_t end, uint64_t time) {
+    audio_capture_t *c = &a->capture_times[a->captures & (AUDIO_TRACE_PERIODS - 1)];
+
+    __atomic_store_n(&c->end, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&c->time, time, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->end, end, __ATOMIC_RELEASE);
+    __atomic_store_n(&a->captures, a->captures + 1, __ATOMIC_RELEASE);
+}
+
 int audio_process_cb(jack_nframes_t nframes, void *arg) {
+    audio_t *a = (audio_t*)arg;
     int32_t length = nframes * sizeof(jack_default_audio_sample_t);
-    for(int i=0; i<n_channels; i++) {
+    uint64_t start = trace_enabled() ? trace_now() : 0;
+    int overruns = 0;
+
+    for(int i=0; i<a->n_channels; i++) {
         jack_default_audio_sample_t *ch =
             (jack_default_audio_sample_t*)jack_port_get_buffer(
-                ports_in[i], nframes);
-        if(circbuf_write(channel_buffers[i], ch, length) < length) {
-            fprintf(stderr, "buffer overrun (%d)\n", i);
+                a->ports_in[i], nframes);
+        if(circbuf_write(a->channel_buffers[i], ch, length) < length) {
+            fprintf(stderr, "%s: buffer overrun (%d)\n", a->cname, i);
+            overruns++;
         }
     }
+    a->frames_captured += nframes;
+    /* client, frames, channels that overran */
+    PROBE3(capture, a->cname, nframes, overruns);
+
+    if(start) {
+        audio_trace_capture(a, a->frames_captured, start);
+        trace_complete("capture", a->cname, start, "frame_time",
+            jack_last_frame_time(a->jack_client));
+    }
     return 0;
 }
 
-void audio_setup(const char *client_name, int channels) {
-    n_channels = channels;
-    cname = client_name;
+/**
+ * Opens a JACK client with one input port and capture buffer per channel,
+ * and starts capturing.  Each capture is independent, so one process can
+ * run several.
+ * @return the capture, or NULL on error
+ */
+audio_t *audio_new(const char *client_name, int channels) {
+    audio_t *a = (audio_t*)calloc(1, sizeof(audio_t));
+    CHECK_MALLOC(a);
+    a->n_channels = channels;
+    a->cname = client_name;
 
     jack_set_error_function(audio_error_cb);
 
-    if(!(jack_client = jack_client_open(client_name, 0, NULL))) {
+    if(!(a->jack_client = jack_client_open(client_name, 0, NULL))) {
         fprintf(stderr, "cannot connect to JACK\n");
-        exit(2);
+        free(a);
+        return NULL;
     }
 
-    jack_set_process_callback(jack_client, audio_process_cb, NULL);
-    jack_set_sample_rate_callback(jack_client, audio_srate_change_cb, NULL);
-    jack_on_shutdown(jack_client, audio_jack_shutdown_cb, NULL);
+    jack_set_process_callback(a->jack_client, audio_process_cb, a);
+    jack_set_sample_rate_callback(a->jack_client, audio_srate_change_cb, a);
+    jack_on_shutdown(a->jack_client, audio_jack_shutdown_cb, a);
 
-    channel_buffers = malloc(sizeof(circbuf_t*) * n_channels);
-    ports_in = malloc(sizeof(jack_port_t*) * n_channels);
+    a->channel_buffers = calloc(a->n_channels, sizeof(circbuf_t*));
+    a->ports_in = calloc(a->n_channels, sizeof(jack_port_t*));
+    CHECK_MALLOC(a->channel_buffers);
+    CHECK_MALLOC(a->ports_in);
 
-    for(int i=0; i<n_channels; i++) {
-        channel_buffers[i] = circbuf_new(AUDIO_BUFFER_SIZE * 
+    for(int i=0; i<a->n_channels; i++) {
+        a->channel_buffers[i] = circbuf_new(AUDIO_BUFFER_SIZE * 
             sizeof(jack_default_audio_sample_t));
-        if(!channel_buffers[i]) {
+        if(!a->channel_buffers[i]) {
             fprintf(stderr, "cannot allocate channel buffers\n");
-            exit(1);
+            audio_free(a);
+            return NULL;
         }
         
         char port_name[128];
         snprintf(port_name, sizeof(port_name), "in_%d", i+1);
 
-        ports_in[i] = jack_port_register(jack_client, port_name, 
+        a->ports_in[i] = jack_port_register(a->jack_client, port_name, 
             JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
     }
 
-    cname = jack_get_client_name(jack_client);
+    a->cname = jack_get_client_name(a->jack_client);
 
-    if(jack_activate(jack_client)) {
+    if(jack_activate(a->jack_client)) {
         fprintf(stderr, "cannot activate JACK client\n");
-        exit(3);
+        audio_free(a);
+        return NULL;
     }
+
+    return a;
+}
+
+/**
+ * Stops capturing and closes the JACK client.
+ */
+void audio_free(audio_t *a) {
+    if(!a) return;
+
+    /* closing the client also stops the process callback */
+    jack_client_close(a->jack_client);
+    for(int i=0; i<a->n_channels; i++) circbuf_free(a->channel_buffers[i]);
+    free(a->channel_buffers);
+    free(a->ports_in);
+    free(a);
 }
 
-int32_t audio_get_available(void) {
-    return circbuf_get_available(channel_buffers[0]);
+int32_t audio_get_available(audio_t *a) {
+    return circbuf_get_available(a->channel_buffers[0]);
 }
 
-void audio_get_data(float **data, int nframes) {
-    for(int i=0; i<n_channels; i++) {
-        circbuf_read(channel_buffers[i], data[i], 
+/**
+ * @return the fraction of the capture buffer waiting to be read; near 1 the
+ *  buffer is about to overrun
+ */
+float audio_get_fill(audio_t *a) {
+    return (float)circbuf_get_available(a->channel_buffers[0]) /
+        a->channel_buffers[0]->length;
+}
+
+/**
+ * Points data at the audio waiting in each channel's capture buffer, without
+ * copying it.  There are at least audio_get_available bytes of it, valid
+ * until audio_consume.
+ */
+void audio_peek(audio_t *a, float **data) {
+    for(int i=0; i<a->n_channels; i++) {
+        circbuf_peek(a->channel_buffers[i], (void**)&data[i]);
+    }
+}
+
+/**
+ * Hands the first nframes frames seen with audio_peek back to the capture.
+ */
+void audio_consume(audio_t *a, int nframes) {
+    for(int i=0; i<a->n_channels; i++) {
+        circbuf_consume(a->channel_buffers[i],
             nframes * sizeof(jack_default_audio_sample_t));
     }
+    a->frames_read += nframes;
+}
+
+/**
+ * @return when the nframes-th frame waiting to be consumed was captured, in
+ *  trace_now time, or 0 if that was not traced
+ */
+uint64_t audio_capture_time(audio_t *a, int nframes) {
+    uint64_t captures = __atomic_load_n(&a->captures, __ATOMIC_ACQUIRE);
+    uint64_t frame = a->frames_read + nframes;
+    uint64_t time = 0;
+
+    /* the oldest period that ends at or after the frame holds it */
+    for(uint64_t i=captures; i>0 && captures-i<AUDIO_TRACE_PERIODS; i--) {
+        audio_capture_t *c = &a->capture_times[(i - 1) & (AUDIO_TRACE_PERIODS - 1)];
+        uint64_t end = __atomic_load_n(&c->end, __ATOMIC_ACQUIRE);
+        uint64_t t = __atomic_load_n(&c->time, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(end < frame || end != __atomic_load_n(&c->end, __ATOMIC_RELAXED)) {
+            break;
+        }
+        time = t;
+    }
+    return time;
 }
 
 void audio_interleave(float **data, float *interleaved, int channels, int nframes) {
@@ -4,14 +4,41 @@
 #include <stdint.h>
 #include <jack/jack.h>
 
-void audio_connect_inputs(int offset);
+#include "circbuf.h"
+
+#define AUDIO_TRACE_PERIODS 1024    /* capture times kept, a power of two */
+
+/* when the period ending at frame end was captured */
+typedef struct {
+    uint64_t end;
+    uint64_t time;
+} audio_capture_t;
+
+typedef struct {
+    int n_channels;
+    circbuf_t **channel_buffers;
+    jack_client_t *jack_client;
+    jack_port_t **ports_in;
+    volatile jack_nframes_t srate;
+    const char *cname;          /* the name JACK gave the client */
+
+    uint64_t frames_captured;   /* written by the process callback */
+    uint64_t frames_read;
+    uint64_t captures;          /* entries written to capture_times */
+    audio_capture_t capture_times[AUDIO_TRACE_PERIODS];
+} audio_t;
+
+audio_t *audio_new(const char *client_name, int channels);
+void audio_connect_inputs(audio_t *a, int offset);
 int audio_process_cb(jack_nframes_t nframes, void *arg);
-void audio_setup(const char *client_name, int channels);
+void audio_free(audio_t *a);
 
-int32_t audio_get_available(void);
-void audio_get_data(float **data, int nframes);
+int32_t audio_get_available(audio_t *a);
+float audio_get_fill(audio_t *a);
+void audio_peek(audio_t *a, float **data);
+void audio_consume(audio_t *a, int nframes);
+uint64_t audio_capture_time(audio_t *a, int nframes);
 
 void audio_interleave(float **data, float *interleaved, int channels, int nframes);
 
 #endif // __audio_h_
-
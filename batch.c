@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "batch.h"
+
+typedef struct {
+    dev_t dev;
+    int active;         /* files on this device being processed */
+} batch_device_t;
+
+typedef struct {
+    batch_t *b;
+    batch_fn fn;
+    void *arg;
+    int per_device;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    /* signalled when a file is finished */
+    bool *started;
+    int next;               /* first item that has not been started */
+    batch_device_t *devices;
+    int n_devices;
+} batch_state_t;
+
+void batch_init(batch_t *b) {
+    b->items = NULL;
+    b->n_items = 0;
+    b->capacity = 0;
+}
+
+static int batch_add_file(batch_t *b, const char *path, const struct stat *st) {
+    if(b->n_items == b->capacity) {
+        b->capacity = b->capacity ? b->capacity * 2 : 256;
+        b->items = (batch_item_t*)realloc(b->items, b->capacity * sizeof(batch_item_t));
+        CHECK_MALLOC(b->items);
+    }
+
+    batch_item_t *item = &b->items[b->n_items++];
+    memset(item, 0, sizeof(batch_item_t));
+    item->filename = strdup(path);
+    CHECK_MALLOC(item->filename);
+    item->file_size = st->st_size;
+    item->dev = st->st_dev;
+    return 0;
+}
+
+/**
+ * Adds a file, or every .opus file found under a directory.
+ * @return 0 on success, -1 if the path could not be read
+ */
+int batch_add(batch_t *b, const char *path) {
+    struct stat st;
+    if(stat(path, &st) < 0) {
+        fprintf(stderr, "error: %s: ", path);
+        perror(NULL);
+        return -1;
+    }
+
+    if(!S_ISDIR(st.st_mode)) {
+        return batch_add_file(b, path, &st);
+    }
+
+    DIR *dir = opendir(path);
+    if(!dir) {
+        fprintf(stderr, "error: %s: ", path);
+        perror(NULL);
+        return -1;
+    }
+
+    int ret = 0;
+    struct dirent *de;
+    while((de = readdir(dir)) != NULL) {
+        if(de->d_name[0] == '.') continue;
+
+        char child[4096];
+        snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+        if(stat(child, &st) < 0) continue;
+
+        int n = strlen(de->d_name);
+        if(S_ISDIR(st.st_mode)) {
+            if(batch_add(b, child) < 0) ret = -1;
+        } else if(n > 5 && strcmp(".opus", de->d_name + n - 5) == 0) {
+            batch_add_file(b, child, &st);
+        }
+    }
+    closedir(dir);
+
+    return ret;
+}
+
+/**
+ * Adds the files and directories listed one per line in listfile ("-" reads
+ * the list from stdin).
+ */
+int batch_add_list(batch_t *b, const char *listfile) {
+    FILE *fp = strcmp(listfile, "-") == 0 ? stdin : fopen(listfile, "r");
+    if(!fp) {
+        fprintf(stderr, "error: %s: ", listfile);
+        perror(NULL);
+        return -1;
+    }
+
+    int ret = 0;
+    char line[4096];
+    while(fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if(line[0] == '\0') continue;
+        if(batch_add(b, line) < 0) ret = -1;
+    }
+
+    if(fp != stdin) fclose(fp);
+    return ret;
+}
+
+void batch_free(batch_t *b) {
+    for(int i=0; i<b->n_items; i++) {
+        free(b->items[i].filename);
+    }
+    free(b->items);
+    batch_init(b);
+}
+
+static int compare_size(const void *a, const void *b) {
+    int64_t sa = ((const batch_item_t*)a)->file_size;
+    int64_t sb = ((const batch_item_t*)b)->file_size;
+    return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+static batch_device_t *batch_device(batch_state_t *bs, dev_t dev) {
+    for(int i=0; i<bs->n_devices; i++) {
+        if(bs->devices[i].dev == dev) return &bs->devices[i];
+    }
+    return NULL;
+}
+
+static void print_string(const char *s) {
+    putchar('"');
+    for(; *s; s++) {
+        if(*s == '"' || *s == '\\') putchar('\\');
+        if((unsigned char)*s < 0x20) {
+            printf("\\u%04x", *s);
+        } else {
+            putchar(*s);
+        }
+    }
+    putchar('"');
+}
+
+static void print_item(const batch_item_t *item) {
+    printf("{\"file\": ");
+    print_string(item->filename);
+    printf(", \"status\": %d, \"duration\": %0.03f, \"streams\": %d, "
+        "\"bytes\": %lld, \"seconds\": %0.03f}\n", item->status, item->duration,
+        item->streams, (long long)item->bytes, item->elapsed);
+    fflush(stdout);
+}
+
+/**
+ * Picks the next file to process: the largest one not started yet whose
+ * device is below its limit of concurrent files.  Waits while every
+ * remaining file is on a busy device.
+ * @return the item index, or -1 once every file has been started
+ */
+static int batch_next(batch_state_t *bs) {
+    for(;;) {
+        while(bs->next < bs->b->n_items && bs->started[bs->next]) bs->next++;
+        if(bs->next == bs->b->n_items) return -1;
+
+        for(int i=bs->next; i<bs->b->n_items; i++) {
+            if(bs->started[i]) continue;
+            batch_device_t *d = batch_device(bs, bs->b->items[i].dev);
+            if(d->active < bs->per_device) {
+                bs->started[i] = true;
+                d->active++;
+                return i;
+            }
+        }
+        pthread_cond_wait(&bs->cond, &bs->lock);
+    }
+}
+
+static void *batch_worker(void *arg) {
+    batch_state_t *bs = (batch_state_t*)arg;
+
+    pthread_mutex_lock(&bs->lock);
+    for(;;) {
+        int i = batch_next(bs);
+        if(i < 0) break;
+        pthread_mutex_unlock(&bs->lock);
+
+        batch_item_t *item = &bs->b->items[i];
+        struct timespec t_start, t_end;
+        clock_gettime(CLOCK_MONOTONIC, &t_start);
+        item->status = bs->fn(item, bs->arg);
+        clock_gettime(CLOCK_MONOTONIC, &t_end);
+        item->elapsed = (t_end.tv_sec - t_start.tv_sec) +
+            (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+
+        pthread_mutex_lock(&bs->lock);
+        batch_device(bs, item->dev)->active--;
+        print_item(item);
+        pthread_cond_broadcast(&bs->cond);
+    }
+    pthread_mutex_unlock(&bs->lock);
+
+    return NULL;
+}
+
+/**
+ * Processes every file with fn on a pool of n_workers threads, largest files
+ * first.  At most per_device files are processed at once from any one
+ * device, so that workers spread across disks instead of all seeking on the
+ * same one.  A JSON summary line is printed on stdout as each file finishes,
+ * followed by a line with the totals.
+ * @return the number of files for which fn returned non-zero
+ */
+int batch_run(batch_t *b, batch_fn fn, void *arg, int n_workers, int per_device) {
+    batch_state_t bs;
+
+    qsort(b->items, b->n_items, sizeof(batch_item_t), compare_size);
+
+    bs.b = b;
+    bs.fn = fn;
+    bs.arg = arg;
+    bs.per_device = per_device > 0 ? per_device : n_workers;
+    pthread_mutex_init(&bs.lock, NULL);
+    pthread_cond_init(&bs.cond, NULL);
+    bs.started = (bool*)calloc(b->n_items, sizeof(bool));
+    CHECK_MALLOC(bs.started);
+    bs.next = 0;
+    bs.devices = (batch_device_t*)malloc((b->n_items + 1) * sizeof(batch_device_t));
+    CHECK_MALLOC(bs.devices);
+    bs.n_devices = 0;
+    for(int i=0; i<b->n_items; i++) {
+        if(!batch_device(&bs, b->items[i].dev)) {
+            bs.devices[bs.n_devices].dev = b->items[i].dev;
+            bs.devices[bs.n_devices].active = 0;
+            bs.n_devices++;
+        }
+    }
+
+    struct timespec t_start, t_end;
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+    if(n_workers < 1) n_workers = 1;
+    pthread_t *threads = (pthread_t*)malloc(n_workers * sizeof(pthread_t));
+    CHECK_MALLOC(threads);
+    for(int i=0; i<n_workers; i++) {
+        pthread_create(&threads[i], NULL, batch_worker, &bs);
+    }
+    for(int i=0; i<n_workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    double elapsed = (t_end.tv_sec - t_start.tv_sec) +
+        (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+
+    int failed = 0;
+    int64_t bytes = 0;
+    double duration = 0;
+    for(int i=0; i<b->n_items; i++) {
+        if(b->items[i].status) failed++;
+        bytes += b->items[i].bytes;
+        duration += b->items[i].duration;
+    }
+
+    printf("{\"files\": %d, \"failed\": %d, \"duration\": %0.03f, \"bytes\": %lld, "
+        "\"seconds\": %0.03f, \"mb_per_s\": %0.02f, \"realtime\": %0.01f}\n",
+        b->n_items, failed, duration, (long long)bytes, elapsed,
+        elapsed > 0 ? bytes / elapsed / 1e6 : 0, elapsed > 0 ? duration / elapsed : 0);
+    fflush(stdout);
+
+    free(bs.devices);
+    free(bs.started);
+    pthread_cond_destroy(&bs.cond);
+    pthread_mutex_destroy(&bs.lock);
+
+    return failed;
+}
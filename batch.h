@@ -0,0 +1,38 @@
+#ifndef __batch_h_
+#define __batch_h_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* default limit on files being processed at once from the same device */
+#define BATCH_PER_DEVICE 2
+
+typedef struct {
+    char *filename;
+    int64_t file_size;
+    dev_t dev;
+
+    /* filled in by the processing function */
+    int status;
+    double duration;    /* seconds of audio */
+    int streams;
+    int64_t bytes;      /* bytes of input processed */
+    double elapsed;     /* wall clock seconds spent on the file */
+} batch_item_t;
+
+typedef int (*batch_fn)(batch_item_t *item, void *arg);
+
+typedef struct {
+    batch_item_t *items;
+    int n_items;
+    int capacity;
+} batch_t;
+
+void batch_init(batch_t *b);
+int batch_add(batch_t *b, const char *path);
+int batch_add_list(batch_t *b, const char *listfile);
+int batch_run(batch_t *b, batch_fn fn, void *arg, int n_workers, int per_device);
+void batch_free(batch_t *b);
+
+#endif // __batch_h_
@@ -13,6 +13,7 @@
 #endif
 
 #include "circbuf.h"
+#include "probes.h"
 
 #define bufdebug(...) fprintf(stderr, __VA_ARGS__)
 
@@ -133,6 +134,9 @@ circbuf_t *circbuf_new(size_t length) {
         // TODO: cleanup
         return NULL;
     }
+    /* the segment goes away with its last mapping, so buffers of a process
+     * that dies are not left behind */
+    shmctl(shm_id, IPC_RMID, NULL);
     
     buf->buffer = (void*)plower;
     buf->length = buf_size;
@@ -144,6 +148,26 @@ circbuf_t *circbuf_new(size_t length) {
 }
 #endif
 
+#ifdef __APPLE__
+void circbuf_free(circbuf_t *buf) {
+    if(!buf) return;
+    vm_deallocate(mach_task_self(), (vm_address_t)buf->buffer, buf->length * 2);
+    free(buf);
+}
+#else
+void circbuf_free(circbuf_t *buf) {
+    if(!buf) return;
+    size_t page_size = getpagesize();
+    uint8_t *plower = (uint8_t*)buf->buffer;
+
+    shmdt(plower);
+    shmdt(plower + buf->length);
+    munmap(plower - page_size, page_size);
+    munmap(plower + 2 * buf->length, page_size);
+    free(buf);
+}
+#endif
+
 int32_t circbuf_get_space(circbuf_t *buf) {
     return buf->length - buf->fill;
 }
@@ -154,6 +178,8 @@ int32_t circbuf_get_available(circbuf_t *buf) {
 
 int32_t circbuf_write(circbuf_t *buf, void *data, int32_t length) {
     int32_t available = circbuf_get_space(buf);
+    /* buffer, bytes offered, bytes free */
+    PROBE3(circbuf_write, buf, length, available);
     if(length > available) length = available;
     void *wrptr = &((uint8_t*)buf->buffer)[buf->wr];
     memcpy(wrptr, data, length);
@@ -165,6 +191,8 @@ int32_t circbuf_write(circbuf_t *buf, void *data, int32_t length) {
 
 int32_t circbuf_read(circbuf_t *buf, void *data, int32_t length) {
     int32_t available = circbuf_get_available(buf);
+    /* buffer, bytes wanted, bytes waiting */
+    PROBE3(circbuf_read, buf, length, available);
     if(available < length) length = available;
     void *rdptr = ((uint8_t *)buf->buffer) + buf->rd;
     memcpy(data, rdptr, length);
@@ -174,5 +202,30 @@ int32_t circbuf_read(circbuf_t *buf, void *data, int32_t length) {
     return length;
 }
 
+/**
+ * Gives the reader the data waiting in place.  The second mapping makes it
+ * one contiguous block even where it wraps around, so it can be used as is
+ * until circbuf_consume hands it back to the writer.
+ * @param data set to the start of the data
+ * @return the number of bytes waiting
+ */
+int32_t circbuf_peek(circbuf_t *buf, void **data) {
+    *data = ((uint8_t *)buf->buffer) + buf->rd;
+    return circbuf_get_available(buf);
+}
+
+/**
+ * Frees the first length bytes returned by circbuf_peek for writing.
+ */
+void circbuf_consume(circbuf_t *buf, int32_t length) {
+    int32_t available = circbuf_get_available(buf);
+    /* the same probe as circbuf_read: the reads are just done in place */
+    PROBE3(circbuf_read, buf, length, available);
+    if(available < length) length = available;
+    buf->rd += length;
+    if(buf->rd >= buf->length) buf->rd -= buf->length;
+    buf->fill -= length;
+}
+
 
 
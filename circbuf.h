@@ -12,11 +12,14 @@ typedef struct {
 } circbuf_t;
 
 circbuf_t *circbuf_new(size_t length);
+void circbuf_free(circbuf_t *buf);
 
 int32_t circbuf_get_space(circbuf_t *buf);
 int32_t circbuf_get_available(circbuf_t *buf);
 int32_t circbuf_write(circbuf_t *buf, void *data, int32_t length);
 int32_t circbuf_read(circbuf_t *buf, void *data, int32_t length);
+int32_t circbuf_peek(circbuf_t *buf, void **data);
+void circbuf_consume(circbuf_t *buf, int32_t length);
 
 #endif // __circbuf_h_
 
@@ -0,0 +1,69 @@
+#include <stdbool.h>
+
+#include "complexity_control.h"
+
+/**
+ * Starts a controller at its highest complexity.
+ * @param budget fraction of real time the encoder may spend encoding
+ */
+void complexity_control_init(complexity_control_t *cc, double budget,
+  int max_complexity) {
+    cc->budget = budget;
+    cc->max_complexity = max_complexity;
+    cc->complexity = max_complexity;
+    cc->encode_time = 0;
+    cc->frame_time = 0;
+    cc->packets = 0;
+    cc->load = 0;
+    cc->good_windows = 0;
+    cc->wait = COMPLEXITY_CONTROL_WAIT;
+    cc->stepped_up = false;
+}
+
+/**
+ * Records one encoded packet, and once a window of packets is complete,
+ * picks the complexity for the next one.  Complexity drops a step when the
+ * encoder goes over budget or the capture buffer is filling up, and rises a
+ * step after a run of windows well under budget.  A step up that has to be
+ * taken back doubles the wait before the next one, so the level settles
+ * instead of bouncing off the budget.
+ * @param encode_time seconds spent encoding the packet
+ * @param frame_time seconds of audio in the packet
+ * @param fill fraction of the capture buffer waiting to be encoded
+ * @return the complexity the encoder should use
+ */
+int complexity_control_update(complexity_control_t *cc, double encode_time,
+  double frame_time, double fill) {
+    cc->encode_time += encode_time;
+    cc->frame_time += frame_time;
+
+    /* a buffer close to overrunning can't wait for the window to end */
+    bool behind = fill > COMPLEXITY_CONTROL_FILL_HIGH;
+    if(++cc->packets < COMPLEXITY_CONTROL_WINDOW && !behind) return cc->complexity;
+
+    cc->load = cc->frame_time > 0 ? cc->encode_time / cc->frame_time : 0;
+    cc->encode_time = 0;
+    cc->frame_time = 0;
+    cc->packets = 0;
+
+    if(behind || cc->load > cc->budget) {
+        cc->good_windows = 0;
+        if(cc->stepped_up && cc->wait < COMPLEXITY_CONTROL_MAX_WAIT) cc->wait *= 2;
+        cc->stepped_up = false;
+        if(cc->complexity > 0) cc->complexity--;
+    } else if(fill < COMPLEXITY_CONTROL_FILL_LOW &&
+      cc->load < cc->budget * COMPLEXITY_CONTROL_HEADROOM) {
+        if(++cc->good_windows >= cc->wait && cc->complexity < cc->max_complexity) {
+            cc->complexity++;
+            cc->good_windows = 0;
+            cc->stepped_up = true;
+        } else if(cc->good_windows >= COMPLEXITY_CONTROL_WAIT) {
+            /* the last step up has held */
+            cc->stepped_up = false;
+        }
+    } else {
+        cc->good_windows = 0;
+    }
+
+    return cc->complexity;
+}
@@ -0,0 +1,34 @@
+#ifndef __complexity_control_h_
+#define __complexity_control_h_
+
+#include <stdbool.h>
+
+#define COMPLEXITY_CONTROL_WINDOW 50        /* packets per decision */
+#define COMPLEXITY_CONTROL_FILL_HIGH 0.5    /* capture buffer filling up */
+#define COMPLEXITY_CONTROL_FILL_LOW 0.1
+#define COMPLEXITY_CONTROL_HEADROOM 0.7     /* step up only below this much of
+                                               the budget */
+#define COMPLEXITY_CONTROL_WAIT 5           /* windows to wait before a step up */
+#define COMPLEXITY_CONTROL_MAX_WAIT 120
+
+typedef struct {
+    double budget;          /* fraction of real time the encoder may take */
+    int max_complexity;
+    int complexity;
+
+    double encode_time;     /* totals over the current window */
+    double frame_time;
+    int packets;
+
+    double load;            /* encode time / audio time over the last window */
+    int good_windows;       /* windows in a row with room to spare */
+    int wait;               /* good windows needed before stepping up */
+    bool stepped_up;        /* the last change was a step up */
+} complexity_control_t;
+
+void complexity_control_init(complexity_control_t *cc, double budget,
+  int max_complexity);
+int complexity_control_update(complexity_control_t *cc, double encode_time,
+  double frame_time, double fill);
+
+#endif // __complexity_control_h_
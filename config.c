@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "util.h"
+#include "config.h"
+
+/**
+ * Strips leading and trailing white space in place.
+ */
+static char *config_trim(char *s) {
+    while(isspace((unsigned char)*s)) s++;
+    char *end = s + strlen(s);
+    while(end > s && isspace((unsigned char)end[-1])) end--;
+    *end = '\0';
+    return s;
+}
+
+static void config_add(config_t *cfg, const char *section, const char *key,
+  const char *value, int line) {
+    config_entry_t *entries = (config_entry_t*)realloc(cfg->entries,
+        (cfg->n_entries + 1) * sizeof(config_entry_t));
+    CHECK_MALLOC(entries);
+    cfg->entries = entries;
+
+    config_entry_t *e = &cfg->entries[cfg->n_entries++];
+    e->section = strdup(section);
+    e->key = strdup(key);
+    e->value = strdup(value);
+    e->line = line;
+    CHECK_MALLOC(e->section);
+    CHECK_MALLOC(e->key);
+    CHECK_MALLOC(e->value);
+}
+
+/**
+ * Reads an INI-style file: "[section]" headers, "key = value" lines, and
+ * comments from '#' or ';' at the start of a line.  Entries are kept in file
+ * order, so a caller can walk them section by section and report problems
+ * with line numbers.
+ * @return the file's entries, or NULL on error
+ */
+config_t *config_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if(!f) {
+        perror(path);
+        return NULL;
+    }
+
+    config_t *cfg = (config_t*)calloc(1, sizeof(config_t));
+    CHECK_MALLOC(cfg);
+    cfg->path = strdup(path);
+    CHECK_MALLOC(cfg->path);
+
+    char buf[CONFIG_LINE_MAX];
+    char *section = strdup("");
+    CHECK_MALLOC(section);
+    int line = 0;
+    int ret = 0;
+
+    while(fgets(buf, sizeof(buf), f)) {
+        line++;
+        if(!strchr(buf, '\n') && !feof(f)) {
+            fprintf(stderr, "%s:%d: line too long\n", path, line);
+            ret = -1;
+            break;
+        }
+
+        char *s = config_trim(buf);
+        if(!*s || *s == '#' || *s == ';') continue;
+
+        if(*s == '[') {
+            char *end = strchr(s, ']');
+            if(!end || end[1]) {
+                fprintf(stderr, "%s:%d: bad section header\n", path, line);
+                ret = -1;
+                break;
+            }
+            *end = '\0';
+            free(section);
+            section = strdup(config_trim(s + 1));
+            CHECK_MALLOC(section);
+            continue;
+        }
+
+        char *eq = strchr(s, '=');
+        if(!eq) {
+            fprintf(stderr, "%s:%d: expected key = value\n", path, line);
+            ret = -1;
+            break;
+        }
+        *eq = '\0';
+        char *key = config_trim(s);
+        if(!*key) {
+            fprintf(stderr, "%s:%d: missing key\n", path, line);
+            ret = -1;
+            break;
+        }
+        config_add(cfg, section, key, config_trim(eq + 1), line);
+    }
+    if(ret == 0 && ferror(f)) {
+        perror(path);
+        ret = -1;
+    }
+
+    free(section);
+    fclose(f);
+    if(ret < 0) {
+        config_free(cfg);
+        return NULL;
+    }
+    return cfg;
+}
+
+/**
+ * @return the last value given for key in section, or NULL if there is none
+ */
+const char *config_get(config_t *cfg, const char *section, const char *key) {
+    for(int i=cfg->n_entries-1; i>=0; i--) {
+        config_entry_t *e = &cfg->entries[i];
+        if(!strcmp(e->section, section) && !strcmp(e->key, key)) return e->value;
+    }
+    return NULL;
+}
+
+void config_free(config_t *cfg) {
+    if(!cfg) return;
+
+    for(int i=0; i<cfg->n_entries; i++) {
+        free(cfg->entries[i].section);
+        free(cfg->entries[i].key);
+        free(cfg->entries[i].value);
+    }
+    free(cfg->entries);
+    free(cfg->path);
+    free(cfg);
+}
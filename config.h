@@ -0,0 +1,24 @@
+#ifndef __config_h_
+#define __config_h_
+
+#define CONFIG_LINE_MAX 1024
+
+/* one key = value line, with the [section] it appeared under */
+typedef struct {
+    char *section;          /* "" before the first section header */
+    char *key;
+    char *value;
+    int line;
+} config_entry_t;
+
+typedef struct {
+    char *path;
+    config_entry_t *entries;
+    int n_entries;
+} config_t;
+
+config_t *config_load(const char *path);
+const char *config_get(config_t *cfg, const char *section, const char *key);
+void config_free(config_t *cfg);
+
+#endif // __config_h_
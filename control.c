@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "util.h"
+#include "control.h"
+
+static const char *control_help =
+    "commands: bitrate <kbps> | complexity <0-10> | flush <ms> | "
+    "gain <channel|all> <dB> | stats | help";
+
+/**
+ * Parses one command line.
+ * @return 0 if it is a command for the encoder, 1 if it was answered here,
+ *  -1 if it is invalid; reply holds the answer or error in the last two cases
+ */
+static int control_parse(char *line, control_cmd_t *cmd, char *reply, size_t len) {
+    char *argv[3];
+    int argc = 0;
+    char *save;
+
+    for(char *tok = strtok_r(line, " \t\r", &save); tok && argc < 3;
+      tok = strtok_r(NULL, " \t\r", &save)) {
+        argv[argc++] = tok;
+    }
+    if(argc == 0 || !strcmp(argv[0], "help")) {
+        snprintf(reply, len, "%s", control_help);
+        return 1;
+    }
+
+    memset(cmd, 0, sizeof(*cmd));
+    char *end = NULL;
+    if(!strcmp(argv[0], "bitrate") && argc == 2) {
+        cmd->op = CONTROL_BITRATE;
+        cmd->value = strtod(argv[1], &end) * 1000;
+    } else if(!strcmp(argv[0], "complexity") && argc == 2) {
+        cmd->op = CONTROL_COMPLEXITY;
+        cmd->value = strtod(argv[1], &end);
+    } else if(!strcmp(argv[0], "flush") && argc == 2) {
+        cmd->op = CONTROL_FLUSH;
+        cmd->value = strtod(argv[1], &end);
+    } else if(!strcmp(argv[0], "gain") && argc == 3) {
+        cmd->op = CONTROL_GAIN;
+        if(strcmp(argv[1], "all")) {
+            cmd->channel = strtol(argv[1], &end, 10);
+            if(*end || cmd->channel < 1) {
+                snprintf(reply, len, "bad channel %s", argv[1]);
+                return -1;
+            }
+        }
+        cmd->value = strtod(argv[2], &end);
+    } else if(!strcmp(argv[0], "stats") && argc == 1) {
+        cmd->op = CONTROL_STATS;
+        return 0;
+    } else {
+        snprintf(reply, len, "unknown command; %s", control_help);
+        return -1;
+    }
+
+    if(!end || *end || (cmd->value < 0 && cmd->op != CONTROL_GAIN)) {
+        snprintf(reply, len, "bad value for %s", argv[0]);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Hands a command to the encoder's thread and waits for its answer.
+ */
+static int control_submit(control_t *c, const control_cmd_t *cmd, char *reply,
+  size_t len) {
+    struct timespec deadline;
+    int ret = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CONTROL_TIMEOUT;
+
+    pthread_mutex_lock(&c->lock);
+    c->cmd = *cmd;
+    c->pending = true;
+    c->done = false;
+    while(!c->done && ret != ETIMEDOUT) {
+        ret = pthread_cond_timedwait(&c->cond, &c->lock, &deadline);
+    }
+    c->pending = false;
+    if(c->done) {
+        snprintf(reply, len, "%s", c->reply);
+        ret = c->result;
+    } else {
+        snprintf(reply, len, "encoder not responding");
+        ret = -1;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return ret;
+}
+
+static void control_client(control_t *c, int fd) {
+    char line[CONTROL_LINE_MAX];
+    size_t used = 0;
+
+    while(c->running) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if(poll(&pfd, 1, 200) <= 0) continue;
+
+        ssize_t n = recv(fd, line + used, sizeof(line) - 1 - used, 0);
+        if(n <= 0) return;
+        used += n;
+
+        char *nl;
+        while((nl = memchr(line, '\n', used)) != NULL) {
+            char reply[CONTROL_REPLY_MAX];
+            char out[CONTROL_REPLY_MAX + 16];
+            control_cmd_t cmd;
+
+            *nl = '\0';
+            int ret = control_parse(line, &cmd, reply, sizeof(reply));
+            if(ret == 0) ret = control_submit(c, &cmd, reply, sizeof(reply));
+
+            int len = snprintf(out, sizeof(out), "%s%s%s\n",
+                ret < 0 ? "error: " : "ok", ret < 0 || !reply[0] ? "" : " ", reply);
+            if(len > sizeof(out) - 1) len = sizeof(out) - 1;
+            if(send(fd, out, len, MSG_NOSIGNAL) < 0) return;
+
+            used -= nl + 1 - line;
+            memmove(line, nl + 1, used);
+        }
+        if(used == sizeof(line) - 1) {
+            send(fd, "error: line too long\n", 21, MSG_NOSIGNAL);
+            return;
+        }
+    }
+}
+
+/**
+ * Control thread: serves one client at a time, one command per line.
+ */
+static void *control_thread(void *arg) {
+    control_t *c = (control_t*)arg;
+
+    while(c->running) {
+        struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+        if(poll(&pfd, 1, 200) <= 0) continue;
+
+        int fd = accept(c->fd, NULL, NULL);
+        if(fd < 0) continue;
+        control_client(c, fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+/**
+ * Opens a control socket, a UNIX domain socket on which the running
+ * encoder can be reconfigured or queried.  Replaces any stale socket left
+ * at the path.
+ * @return the control socket, or NULL on error
+ */
+control_t *control_new(const char *path) {
+    struct sockaddr_un addr;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "error: control socket path too long\n");
+        return NULL;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        perror("error: creating control socket");
+        return NULL;
+    }
+    unlink(path);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        fprintf(stderr, "error: control socket %s: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    control_t *c = (control_t*)calloc(1, sizeof(control_t));
+    CHECK_MALLOC(c);
+    c->path = strdup(path);
+    CHECK_MALLOC(c->path);
+    c->fd = fd;
+    c->running = true;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+
+    if(pthread_create(&c->thread, NULL, control_thread, c) != 0) {
+        perror("error: starting control thread");
+        close(fd);
+        unlink(path);
+        pthread_cond_destroy(&c->cond);
+        pthread_mutex_destroy(&c->lock);
+        free(c->path);
+        free(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+/**
+ * Applies a waiting command, if there is one.  Called from the encoder's
+ * thread between packets, so handlers never race with encoding; never
+ * blocks.
+ */
+void control_process(control_t *c, control_handler_fn handler, void *arg) {
+    if(!c) return;
+
+    pthread_mutex_lock(&c->lock);
+    if(c->pending && !c->done) {
+        c->reply[0] = '\0';
+        c->result = handler(arg, &c->cmd, c->reply, sizeof(c->reply));
+        c->done = true;
+        pthread_cond_broadcast(&c->cond);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * @return true if a command is waiting for control_process
+ */
+bool control_pending(control_t *c) {
+    if(!c) return false;
+
+    pthread_mutex_lock(&c->lock);
+    bool pending = c->pending && !c->done;
+    pthread_mutex_unlock(&c->lock);
+    return pending;
+}
+
+void control_free(control_t *c) {
+    if(!c) return;
+
+    c->running = false;
+    pthread_join(c->thread, NULL);
+    close(c->fd);
+    unlink(c->path);
+
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->lock);
+    free(c->path);
+    free(c);
+}
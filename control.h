@@ -0,0 +1,52 @@
+#ifndef __control_h_
+#define __control_h_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define CONTROL_LINE_MAX 256
+#define CONTROL_REPLY_MAX 1024
+#define CONTROL_TIMEOUT 2       /* seconds to wait for the encoder to answer */
+#define CONTROL_FLUSH_MAX 10000 /* longest page latency, in milliseconds */
+
+typedef enum {
+    CONTROL_BITRATE,        /* value: bits per second */
+    CONTROL_COMPLEXITY,     /* value: 0-10 */
+    CONTROL_FLUSH,          /* value: milliseconds of audio per page */
+    CONTROL_GAIN,           /* channel (0 for all), value: dB */
+    CONTROL_STATS
+} control_op_t;
+
+typedef struct {
+    control_op_t op;
+    int channel;
+    double value;
+} control_cmd_t;
+
+/* applies a command on the encoder's thread and writes a reply line;
+ * returns 0 on success, or -1 with the error in the reply */
+typedef int (*control_handler_fn)(void *arg, const control_cmd_t *cmd,
+  char *reply, size_t len);
+
+typedef struct {
+    char *path;
+    int fd;
+    pthread_t thread;
+    volatile bool running;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool pending;           /* cmd is waiting for the encoder */
+    bool done;              /* the encoder has answered */
+    control_cmd_t cmd;
+    int result;
+    char reply[CONTROL_REPLY_MAX];
+} control_t;
+
+control_t *control_new(const char *path);
+void control_process(control_t *c, control_handler_fn handler, void *arg);
+bool control_pending(control_t *c);
+void control_free(control_t *c);
+
+#endif // __control_h_
@@ -6,8 +6,16 @@
 #include <time.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
+#include "util.h"
 #include "enc_opus.h"
 #include "opus_header.h"
+#include "archive.h"
+#include "ogg_mux.h"
+#include "rate_control.h"
+#include "complexity_control.h"
+#include "trace.h"
+#include "probes.h"
 
 #define writeint(buf, base, val) { buf[base+3]=((val)>>24)&0xff; \
                                      buf[base+2]=((val)>>16)&0xff; \
@@ -15,183 +23,453 @@
                                      buf[base]=(val)&0xff; \
                                  }
 
-struct {
-    ogg_stream_state os;
+static int enc_opus_page(void *arg, const unsigned char *page, size_t len) {
+    enc_opus_t *eo = (enc_opus_t*)arg;
+    uint64_t start = trace_enabled() ? trace_now() : 0;
+    eo->packets = 0;
 
-    ogg_page og;
-    ogg_packet op;
-
-    OpusMSEncoder *opus;
-    unsigned char *data_out;
-    int max_data_bytes;
-    
-    int n_channels;
-
-    time_t last_stats;
-} oo;
-
-static int enc_opus_flush(shout_t *shout) {
-    for(;;) {
-        int result = ogg_stream_flush(&oo.os, &oo.og);
-        if(result == 0) break;
-        
-        int ret = shout_send(shout, oo.og.header, oo.og.header_len);
-        if(ret != SHOUTERR_SUCCESS) {
-            fprintf(stderr, "shout error: %s\n", shout_get_error(shout));
-            return -4;
-        }
-        
-        ret = shout_send(shout, oo.og.body, oo.og.body_len);
-        if(ret != SHOUTERR_SUCCESS) {
-            fprintf(stderr, "shout error: %s\n", shout_get_error(shout));
-            return -4;
-        }
+    /* stream, bytes */
+    PROBE2(page, eo->label, len);
+    if(stream_send(eo->stream, page, len) < 0) return -4;
+    if(start) {
+        trace_complete("page", eo->label, start, "age_us",
+            eo->capture_time ? (int64_t)(trace_now() - eo->capture_time) / 1000 : -1);
     }
     return 0;
 }
 
-int enc_opus_setup(shout_t *shout, int rate, int channels, int bitrate) {
-    oo.last_stats = time(NULL);
-    oo.n_channels = channels;
+static int enc_opus_flush(enc_opus_t *eo) {
+    if(!eo->stream) return 0;
+
+    return ogg_mux_flush(&eo->mux);
+}
 
-    srand(time(NULL));
-    ogg_stream_init(&oo.os, rand());
+/**
+ * Creates an encoder context.  Several can run at once, each feeding its
+ * own stream.
+ * @param label name shown on status lines, or NULL when this is the only
+ *  encoder in the process
+ */
+enc_opus_t *enc_opus_new(const char *label) {
+    enc_opus_t *eo = (enc_opus_t*)calloc(1, sizeof(enc_opus_t));
+    CHECK_MALLOC(eo);
+    eo->label = label;
+    eo->complexity = -1;
+    eo->flush_ms = 340;
+    return eo;
+}
+
+/**
+ * Also write the encoded packets to a rolling archive of files of
+ * max_length samples each.  Must be called before enc_opus_setup; the
+ * archive then carries on across encoder restarts.
+ * @param sync_bytes flush archive files to disk after this many bytes, or 0
+ *  to only flush them when they are closed
+ */
+void enc_opus_set_archive(enc_opus_t *eo, const char *name, int64_t max_length,
+  size_t sync_bytes) {
+    eo->archive_name = name;
+    eo->archive_length = max_length;
+    eo->archive_sync = sync_bytes;
+}
+
+/**
+ * Lets the bitrate follow the bandwidth available to the live stream,
+ * between min_bitrate and the bitrate passed to enc_opus_setup.  Must be
+ * called before enc_opus_setup.
+ */
+void enc_opus_set_adaptive(enc_opus_t *eo, int min_bitrate) {
+    eo->min_bitrate = min_bitrate;
+}
 
-    OpusHeader header;
-    header.channels = channels;
-    header.channel_mapping = 255;
-    header.input_sample_rate = rate;
-    header.gain = 0;
-    header.nb_streams = channels;
-    header.nb_coupled = 0;
+/**
+ * Sets the encoder complexity, and optionally lets it drop below that to keep
+ * encoding within a share of real time.  Must be called before
+ * enc_opus_setup.
+ * @param complexity 0-10, or -1 for the library's default
+ * @param cpu_budget fraction of real time the encoder may take, or 0 to keep
+ *  the complexity fixed
+ */
+void enc_opus_set_complexity(enc_opus_t *eo, int complexity, double cpu_budget) {
+    eo->complexity = complexity;
+    eo->cpu_budget = cpu_budget;
+}
+
+/**
+ * Writes out and closes the archive, if there is one, and frees the
+ * encoder.  The stream is left to its owner.
+ */
+void enc_opus_free(enc_opus_t *eo) {
+    if(!eo) return;
+
+    if(eo->archive) archive_free(eo->archive);
+    if(eo->opus) opus_multistream_encoder_destroy(eo->opus);
+    if(eo->mux.page) ogg_mux_clear(&eo->mux);
+    free(eo->data_out);
+    free(eo->gains);
+    free(eo);
+}
+
+/**
+ * Creates a multistream encoder with one uncoupled stream per channel, as
+ * used for the live stream and archives, and fills in its ID header.
+ * @param bitrate total bitrate of all streams, in bits per second
+ * @return the encoder, or NULL on error
+ */
+OpusMSEncoder *enc_opus_create(int rate, int channels, int bitrate,
+  OpusHeader *header) {
+    memset(header, 0, sizeof(OpusHeader));
+    header->version = 1;
+    header->channels = channels;
+    header->channel_mapping = 255;
+    header->input_sample_rate = rate;
+    header->gain = 0;
+    header->nb_streams = channels;
+    header->nb_coupled = 0;
     
     // allocate linear channel mapping
     for(int i=0; i<channels; i++) {
-        header.stream_map[i] = i;
+        header->stream_map[i] = i;
     }
 
-    // ID Header
-    unsigned char header_buf[300];
-    int header_size = opus_header_to_packet(&header, header_buf, 300);
+    // create encoder
+    int error;
+    OpusMSEncoder *opus = opus_multistream_encoder_create(rate, channels,
+        channels, 0, header->stream_map, OPUS_APPLICATION_AUDIO, &error);
+    if(error != OPUS_OK) {
+        fprintf(stderr, "opus error\n");
+        return NULL;
+    }
+
+    int ret = opus_multistream_encoder_ctl(opus, OPUS_SET_BITRATE(bitrate));
+    if(ret != OPUS_OK) {
+        fprintf(stderr, "failed to set bitrate: %s\n", opus_strerror(ret));
+    }
 
-    oo.op.packet = header_buf;
-    oo.op.bytes = header_size;
-    oo.op.b_o_s = 1;
-    oo.op.e_o_s = 0;
-    oo.op.granulepos = 0;
-    oo.op.packetno = 0;
-    ogg_stream_packetin(&oo.os, &oo.op);
-    enc_opus_flush(shout);
+    opus_int32 lookahead = 0;
+    opus_multistream_encoder_ctl(opus, OPUS_GET_LOOKAHEAD(&lookahead));
+    header->preskip = lookahead * (48000 / rate);
 
+    return opus;
+}
+
+/**
+ * Builds the comment header written by tidstream.
+ * @param buf at least 1024 bytes
+ * @return the length of the header
+ */
+int enc_opus_comments(char *buf) {
     // Comment header (why is there not a library that does this!?)
-    char comment_buf[1024];
-    memset(comment_buf, 0, sizeof(comment_buf));
+    memset(buf, 0, 1024);
     const char *vendor_string = opus_get_version_string();
-    strcpy(comment_buf, "OpusTags");
+    strcpy(buf, "OpusTags");
     int p = 8;
     int vendor_length = strlen(vendor_string);
-    writeint(comment_buf, p, vendor_length);
+    writeint(buf, p, vendor_length);
     p += 4;
-    memcpy(&comment_buf[p], vendor_string, vendor_length);
+    memcpy(&buf[p], vendor_string, vendor_length);
     p += vendor_length;
     const char *encoder_string="ENCODER=tidstream";
     int encoder_length = strlen(encoder_string);
-    writeint(comment_buf, p, 1);
+    writeint(buf, p, 1);
     p += 4;
-    writeint(comment_buf, p, encoder_length);
+    writeint(buf, p, encoder_length);
     p += 4;
-    memcpy(&comment_buf[p], encoder_string, encoder_length);
+    memcpy(&buf[p], encoder_string, encoder_length);
     p += encoder_length;
-    
-    oo.op.packet = comment_buf;
-    oo.op.bytes = p;
-    oo.op.b_o_s = 0;
-    oo.op.e_o_s = 0;
-    oo.op.granulepos = 0;
-    oo.op.packetno = 1;
-    ogg_stream_packetin(&oo.os, &oo.op);
-    enc_opus_flush(shout);
 
-    // create encoder
-    int error;
-    oo.opus = opus_multistream_encoder_create(rate, oo.n_channels, 
-        oo.n_channels, 0, header.stream_map, OPUS_APPLICATION_AUDIO, &error);
-    if(error != OPUS_OK) {
-        fprintf(stderr, "opus error\n");
-        return -1;
+    return p;
+}
+
+/**
+ * Creates the encoder, and the archive if there is one.  Both then run
+ * whether or not a stream is attached, so that the archive carries on
+ * through stream outages; this is only called again after an encoder error.
+ */
+int enc_opus_setup(enc_opus_t *eo, int rate, int channels, int bitrate) {
+    eo->last_stats = time(NULL);
+    eo->n_channels = channels;
+
+    /* changes made over the control socket outlast a restart */
+    if(eo->bitrate) bitrate = eo->bitrate;
+
+    if(eo->opus) opus_multistream_encoder_destroy(eo->opus);
+    eo->opus = enc_opus_create(rate, channels, bitrate, &eo->header);
+    if(!eo->opus) return -1;
+    eo->op.granulepos = 0;
+    eo->op.packetno = 1;
+
+    /* like the bitrate, the complexity carries over a restart */
+    if(eo->cpu_budget > 0) {
+        if(!eo->cc.budget) {
+            complexity_control_init(&eo->cc, eo->cpu_budget,
+                eo->complexity >= 0 ? eo->complexity : 10);
+        }
+        opus_multistream_encoder_ctl(eo->opus, OPUS_SET_COMPLEXITY(eo->cc.complexity));
+    } else if(eo->complexity >= 0) {
+        opus_multistream_encoder_ctl(eo->opus, OPUS_SET_COMPLEXITY(eo->complexity));
     }
 
-    int ret = opus_multistream_encoder_ctl(oo.opus, OPUS_SET_BITRATE(bitrate));
-    if(ret != OPUS_OK) {
-        fprintf(stderr, "failed to set bitrate: %s\n", opus_strerror(ret));
+    /* a restart starts again at the bitrate the link last managed */
+    if(eo->min_bitrate) {
+        if(!eo->rc.max_bitrate) rate_control_init(&eo->rc, eo->min_bitrate, bitrate);
+        opus_multistream_encoder_ctl(eo->opus, OPUS_SET_BITRATE(eo->rc.bitrate));
+    }
+
+    if(eo->archive_name && !eo->archive) {
+        char comment_buf[1024];
+        int p = enc_opus_comments(comment_buf);
+
+        /* room for a whole segment at the nominal bitrate, plus a margin
+         * for VBR and framing */
+        int64_t prealloc = eo->archive_length / 48000 * (bitrate / 8) / 8 * 9;
+        eo->archive = archive_new(eo->archive_name, &eo->header, comment_buf, p,
+            eo->archive_length, prealloc, eo->archive_sync);
+        if(!eo->archive) return -2;
     }
 
-    oo.max_data_bytes = (1275 * 3 + 7) * header.nb_streams;
-    oo.data_out = malloc(oo.max_data_bytes * sizeof(unsigned char));
+    eo->max_data_bytes = (1275 * 3 + 7) * eo->header.nb_streams;
+    free(eo->data_out);
+    eo->data_out = malloc(eo->max_data_bytes * sizeof(unsigned char));
+    CHECK_MALLOC(eo->data_out);
 
     return 0;
 }
 
-int enc_opus_encode(shout_t *shout, float *pcm, int nframes) {
-    static int packets = 0;
+/**
+ * Starts a new Ogg stream on a freshly opened connection, fed by the running
+ * encoder.  Called again after every reconnect.
+ * @return 0 on success, -4 if the headers could not be sent
+ */
+int enc_opus_attach(enc_opus_t *eo, stream_t *stream) {
+    unsigned char header_buf[300];
+    char comment_buf[1024];
+    int ret;
 
-    static int bytes_sent = 0;
+    eo->stream = stream;
+    eo->packets = 0;
+    eo->stream_start = eo->op.granulepos;
+    if(eo->mux.page) ogg_mux_clear(&eo->mux);
+    ogg_mux_init(&eo->mux, rand(), OGG_MUX_PAGE_SIZE, enc_opus_page, eo);
 
-    int bytes = opus_multistream_encode_float(oo.opus, pcm, nframes, oo.data_out,
-        oo.max_data_bytes);
-    if(bytes < 0) {
-        fprintf(stderr, "opus encoding failed: %s\n", opus_strerror(bytes));
-        return -1;
+    int header_size = opus_header_to_packet(&eo->header, header_buf, 300);
+    int comment_size = enc_opus_comments(comment_buf);
+    if((ret = ogg_mux_packet(&eo->mux, header_buf, header_size, 0, false)) < 0 ||
+            (ret = enc_opus_flush(eo)) < 0 ||
+            (ret = ogg_mux_packet(&eo->mux, (unsigned char*)comment_buf,
+                comment_size, 0, false)) < 0 ||
+            (ret = enc_opus_flush(eo)) < 0) {
+        return ret;
     }
 
-    oo.op.packet = oo.data_out;
-    oo.op.bytes = bytes;
-    oo.op.packetno++;
-    oo.op.granulepos += nframes;
-    ogg_stream_packetin(&oo.os, &oo.op);
-    packets++;
+    if(eo->min_bitrate) clock_gettime(CLOCK_MONOTONIC, &eo->last_update);
+    return 0;
+}
+
+/**
+ * Stops sending to the stream, which is left to its owner to close.  Encoding
+ * and archiving carry on.
+ */
+void enc_opus_detach(enc_opus_t *eo) {
+    eo->stream = NULL;
+}
+
+static void enc_opus_adapt(enc_opus_t *eo) {
+    struct timespec now;
+    size_t backlog;
+    double blocked;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - eo->last_update.tv_sec) +
+        (now.tv_nsec - eo->last_update.tv_nsec) / 1e9;
+    eo->last_update = now;
 
-    bytes_sent += bytes;
+    stream_feedback(eo->stream, &backlog, &blocked);
+    int old_bitrate = eo->rc.bitrate;
+    int bitrate = rate_control_update(&eo->rc, backlog, blocked, elapsed);
+    if(bitrate != old_bitrate) {
+        opus_multistream_encoder_ctl(eo->opus, OPUS_SET_BITRATE(bitrate));
+        fprintf(stderr, "%s%sbitrate %s to %d kbps\n",
+            eo->label ? eo->label : "\n", eo->label ? ": " : "",
+            bitrate < old_bitrate ? "lowered" : "raised", bitrate / 1000);
+    }
+}
 
-    //printf("%d %d %d\n", oo.op.granulepos, oo.op.bytes, oo.op.packetno);
+static void enc_opus_adapt_complexity(enc_opus_t *eo,
+  const struct timespec *start, int nframes, float fill) {
+    struct timespec end;
 
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double encode_time = (end.tv_sec - start->tv_sec) +
+        (end.tv_nsec - start->tv_nsec) / 1e9;
 
-    for(;;) {
-        int result = ogg_stream_pageout(&oo.os, &oo.og);
-        if(result == 0) break;
+    int old_complexity = eo->cc.complexity;
+    int complexity = complexity_control_update(&eo->cc, encode_time,
+        nframes / 48000.0, fill);
+    if(complexity != old_complexity) {
+        opus_multistream_encoder_ctl(eo->opus, OPUS_SET_COMPLEXITY(complexity));
+        fprintf(stderr, "%s%scomplexity %s to %d (load %0.0f%%, buffer %0.0f%% full)\n",
+            eo->label ? eo->label : "\n", eo->label ? ": " : "", complexity < old_complexity ? "lowered" : "raised", complexity,
+            100 * eo->cc.load, 100 * fill);
+    }
+}
 
-        //printf("page\n");
-        packets = 0;
-        
-        int ret = shout_send(shout, oo.og.header, oo.og.header_len);
-        if(ret != SHOUTERR_SUCCESS) {
-            fprintf(stderr, "shout error: %s\n", shout_get_error(shout));
-            return -4;
+/**
+ * Sets the gain of one channel, or all of them if channel is 0.
+ */
+static void enc_opus_set_gain(enc_opus_t *eo, int channel, float gain) {
+    if(!eo->gains) {
+        eo->gains = (float*)malloc(eo->n_channels * sizeof(float));
+        CHECK_MALLOC(eo->gains);
+        for(int c=0; c<eo->n_channels; c++) eo->gains[c] = 1.0f;
+    }
+    for(int c=0; c<eo->n_channels; c++) {
+        if(!channel || c == channel - 1) eo->gains[c] = gain;
+    }
+}
+
+/**
+ * Handles a command from the control socket, between packets.
+ */
+int enc_opus_control(void *arg, const control_cmd_t *cmd, char *reply, size_t len) {
+    enc_opus_t *eo = (enc_opus_t*)arg;
+    opus_int32 bitrate = 0, complexity = 0;
+    int ret = OPUS_BAD_ARG;
+
+    switch(cmd->op) {
+        case CONTROL_BITRATE:
+            if(cmd->value < 500 * eo->n_channels) {
+                snprintf(reply, len, "bitrate too low for %d channels", eo->n_channels);
+                return -1;
+            }
+            if(cmd->value > 512000.0 * eo->n_channels) {
+                snprintf(reply, len, "bitrate too high for %d channels", eo->n_channels);
+                return -1;
+            }
+            ret = opus_multistream_encoder_ctl(eo->opus, OPUS_SET_BITRATE((opus_int32)cmd->value));
+            if(ret != OPUS_OK) break;
+            eo->bitrate = cmd->value;
+            if(eo->min_bitrate) rate_control_init(&eo->rc, eo->min_bitrate, eo->bitrate);
+            return 0;
+        case CONTROL_COMPLEXITY:
+            if(cmd->value > 10) {
+                snprintf(reply, len, "complexity must be 0-10");
+                return -1;
+            }
+            ret = opus_multistream_encoder_ctl(eo->opus, OPUS_SET_COMPLEXITY((opus_int32)cmd->value));
+            if(ret != OPUS_OK) break;
+            eo->complexity = cmd->value;
+            if(eo->cpu_budget > 0) complexity_control_init(&eo->cc, eo->cpu_budget, eo->complexity);
+            return 0;
+        case CONTROL_FLUSH:
+            if(cmd->value > CONTROL_FLUSH_MAX) {
+                snprintf(reply, len, "flush must be at most %d ms", CONTROL_FLUSH_MAX);
+                return -1;
+            }
+            eo->flush_ms = cmd->value;
+            return 0;
+        case CONTROL_GAIN:
+            if(cmd->channel > eo->n_channels) {
+                snprintf(reply, len, "no channel %d", cmd->channel);
+                return -1;
+            }
+            enc_opus_set_gain(eo, cmd->channel, powf(10.0f, cmd->value / 20.0f));
+            return 0;
+        case CONTROL_STATS: {
+            opus_multistream_encoder_ctl(eo->opus, OPUS_GET_BITRATE(&bitrate));
+            opus_multistream_encoder_ctl(eo->opus, OPUS_GET_COMPLEXITY(&complexity));
+            int n = snprintf(reply, len, "codec=opus channels=%d bitrate=%d "
+                "complexity=%d load=%0.2f flush_ms=%d packets=%lld bytes=%lld gains=",
+                eo->n_channels, bitrate, complexity, eo->cc.load, eo->flush_ms,
+                (long long)eo->op.packetno, (long long)eo->bytes_total);
+            for(int c=0; c<eo->n_channels && n < len; c++) {
+                n += snprintf(reply + n, len - n, "%s%0.1f", c ? "," : "",
+                    eo->gains ? 20 * log10f(eo->gains[c]) : 0.0f);
+            }
+            return 0;
         }
-        
-        ret = shout_send(shout, oo.og.body, oo.og.body_len);
-        if(ret != SHOUTERR_SUCCESS) {
-            fprintf(stderr, "shout error: %s\n", shout_get_error(shout));
-            return -4;
+    }
+
+    snprintf(reply, len, "%s", opus_strerror(ret));
+    return -1;
+}
+
+/**
+ * Encodes a packet, archives it and sends it to the stream, if one is
+ * attached.
+ * @param fill fraction of the capture buffer still waiting to be encoded,
+ *  for adapting the complexity
+ * @return 0 on success, -1 if encoding failed, -4 if sending failed; the
+ *  packet is archived either way
+ */
+int enc_opus_encode(enc_opus_t *eo, float *pcm, int nframes, float fill) {
+    struct timespec start;
+
+    if(eo->gains) {
+        for(int i=0; i<nframes; i++) {
+            for(int c=0; c<eo->n_channels; c++) pcm[i * eo->n_channels + c] *= eo->gains[c];
         }
-    }  
+    }
 
+    uint64_t encode_start = trace_enabled() ? trace_now() : 0;
+    if(eo->cpu_budget > 0) clock_gettime(CLOCK_MONOTONIC, &start);
+    /* stream, frames; encode_done adds the bytes out, or the error */
+    PROBE2(encode_start, eo->label, nframes);
+    int bytes = opus_multistream_encode_float(eo->opus, pcm, nframes, eo->data_out,
+        eo->max_data_bytes);
+    PROBE3(encode_done, eo->label, nframes, bytes);
+    if(bytes < 0) {
+        fprintf(stderr, "opus encoding failed: %s\n", opus_strerror(bytes));
+        return -1;
+    }
+    if(encode_start) trace_complete("encode", eo->label, encode_start, "bytes", bytes);
+    if(eo->cpu_budget > 0) enc_opus_adapt_complexity(eo, &start, nframes, fill);
+
+    eo->op.packet = eo->data_out;
+    eo->op.bytes = bytes;
+    eo->op.packetno++;
+    eo->op.granulepos += nframes;
+    eo->bytes_sent += bytes;
+    eo->bytes_total += bytes;
 
-    if(packets > 16) {
-        packets = 0;
-        //printf("flush\n");
-        enc_opus_flush(shout);
+    if(eo->archive) {
+        archive_write(eo->archive, eo->data_out, bytes);
     }
-    shout_sync(shout);
+    if(!eo->stream) goto stats;
 
+    eo->packets++;
+    int ret = ogg_mux_packet(&eo->mux, eo->op.packet, eo->op.bytes,
+        eo->op.granulepos - eo->stream_start, false);
+    if(ret < 0) return ret;
+
+    /* keep pages short so that listeners get audio promptly */
+    if((int64_t)eo->packets * nframes >= eo->flush_ms * 48) {
+        ret = enc_opus_flush(eo);
+        if(ret < 0) return ret;
+    }
+    if(stream_sync(eo->stream) < 0) return -4;
+    if(eo->min_bitrate) enc_opus_adapt(eo);
+
+  stats:;
     time_t now = time(NULL);
-    if(now - oo.last_stats > 2) {
-        printf("  opus %d channels - % 8.02f kbps avg - %d packets        \r",
-            oo.n_channels, 8 * bytes_sent / (float)(now - oo.last_stats) / 1000.,
-            oo.op.packetno);
-        oo.last_stats = now;
-        bytes_sent = 0;
+    if(now - eo->last_stats > 2) {
+        char line[160];
+        int n = snprintf(line, sizeof(line), "opus %d channels - % 8.02f kbps avg - %lld packets",
+            eo->n_channels, 8 * eo->bytes_sent / (float)(now - eo->last_stats) / 1000.,
+            (long long)eo->op.packetno);
+        if(eo->cpu_budget > 0 && n < sizeof(line)) {
+            snprintf(line + n, sizeof(line) - n, " - complexity %d - load %0.0f%%",
+                eo->cc.complexity, 100 * eo->cc.load);
+        }
+        /* encoders sharing the terminal each get whole lines */
+        if(eo->label) {
+            printf("%s: %s\n", eo->label, line);
+        } else {
+            printf("  %s        \r", line);
+        }
         fflush(stdout);
+        eo->last_stats = now;
+        eo->bytes_sent = 0;
     }
 
     return 0;
@@ -1,10 +1,73 @@
 #ifndef __enc_opus_h_
 #define __enc_opus_h_
 
-#include <shout/shout.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <ogg/ogg.h>
+#include <opus/opus_multistream.h>
 
-int enc_opus_setup(shout_t *shout, int rate, int channels, int bitrate);
-int enc_opus_encode(shout_t *shout, float *pcm, int nframes);
+#include "opus_header.h"
+#include "ogg_mux.h"
+#include "archive.h"
+#include "rate_control.h"
+#include "complexity_control.h"
+#include "stream.h"
+#include "control.h"
 
-#endif // __enc_opus_h_
+typedef struct {
+    const char *label;      /* prefixes status lines, or NULL for a single
+                               encoder that redraws one line */
+    ogg_mux_t mux;
+    stream_t *stream;       /* or NULL while not streaming */
+    int packets;            /* packets since the last page was sent */
+    int64_t stream_start;   /* granule position the stream started at */
+    OpusHeader header;      /* ID header each new stream starts with */
+
+    ogg_packet op;
+
+    OpusMSEncoder *opus;
+    unsigned char *data_out;
+    int max_data_bytes;
+
+    int n_channels;
+    float *gains;           /* per channel, linear; NULL while all are unity */
+    int flush_ms;           /* audio on a page before it is sent */
+    int bitrate;            /* set over the control socket, or 0 */
+    int64_t bytes_total;
+    uint64_t capture_time;  /* when the newest audio given to encode was
+                               captured, for tracing, or 0 */
+
+    time_t last_stats;
+    int bytes_sent;         /* since the last status line */
 
+    int min_bitrate;        /* lowest adaptive bitrate, or 0 for a fixed one */
+    rate_control_t rc;
+    struct timespec last_update;
+
+    int complexity;         /* -1 for the library's default */
+    double cpu_budget;      /* fraction of real time, or 0 for a fixed complexity */
+    complexity_control_t cc;
+
+    const char *archive_name;
+    int64_t archive_length;
+    size_t archive_sync;
+    archive_t *archive;
+} enc_opus_t;
+
+OpusMSEncoder *enc_opus_create(int rate, int channels, int bitrate,
+  OpusHeader *header);
+int enc_opus_comments(char *buf);
+enc_opus_t *enc_opus_new(const char *label);
+void enc_opus_set_archive(enc_opus_t *eo, const char *name, int64_t max_length,
+  size_t sync_bytes);
+void enc_opus_set_adaptive(enc_opus_t *eo, int min_bitrate);
+void enc_opus_set_complexity(enc_opus_t *eo, int complexity, double cpu_budget);
+int enc_opus_setup(enc_opus_t *eo, int rate, int channels, int bitrate);
+int enc_opus_attach(enc_opus_t *eo, stream_t *stream);
+void enc_opus_detach(enc_opus_t *eo);
+int enc_opus_encode(enc_opus_t *eo, float *pcm, int nframes, float fill);
+int enc_opus_control(void *arg, const control_cmd_t *cmd, char *reply, size_t len);
+void enc_opus_free(enc_opus_t *eo);
+
+#endif // __enc_opus_h_
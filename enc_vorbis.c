@@ -4,110 +4,238 @@
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <math.h>
+#include "util.h"
 #include "enc_vorbis.h"
+#include "ogg_mux.h"
+#include "trace.h"
+#include "probes.h"
+
+static int enc_vorbis_page(void *arg, const unsigned char *page, size_t len) {
+    enc_vorbis_t *ev = (enc_vorbis_t*)arg;
+    uint64_t start = trace_enabled() ? trace_now() : 0;
+
+    PROBE2(page, ev->label, len);
+    if(stream_send(ev->stream, page, len) < 0) return -4;
+    if(start) {
+        trace_complete("page", ev->label, start, "age_us",
+            ev->capture_time ? (int64_t)(trace_now() - ev->capture_time) / 1000 : -1);
+    }
+    return 0;
+}
 
-struct {
-    ogg_stream_state os; /* take physical pages, weld into a logical
-                          stream of packets */
-    ogg_page         og; /* one Ogg bitstream page.  Vorbis packets are inside */
-    ogg_packet       op; /* one raw packet of data for decode */
-    vorbis_info      vi; /* struct that stores all the static vorbis bitstream
-                          settings */
-    vorbis_comment   vc; /* struct that stores all the user comments */
-    vorbis_dsp_state vd; /* central working state for the packet->PCM decoder */
-    vorbis_block     vb; /* local working space for packet->PCM decode */
-
-    int n_channels;
-} ov;
-
-int enc_vorbis_setup(shout_t *shout, int rate, int channels, int min_bitrate, 
-  int avg_bitrate, int max_bitrate) {
-    ov.n_channels = channels;
+/**
+ * Sets up the encoder settings and comments used by tidstream.
+ * @param quality -1 to 10 to encode at that quality rather than manage the
+ *  bitrate, or NAN.  min_bitrate and max_bitrate are then unused, and
+ *  avg_bitrate, unless 0, is a soft target for the average.
+ * @return 0 on success, -3 if the settings are not supported
+ */
+int enc_vorbis_init(vorbis_info *vi, vorbis_comment *vc, int rate, int channels,
+  int min_bitrate, int avg_bitrate, int max_bitrate, float quality) {
     int ret;
 
-    vorbis_info_init(&ov.vi);
-    ret = vorbis_encode_init(&ov.vi, ov.n_channels, rate, max_bitrate, avg_bitrate,
-        min_bitrate);
+    vorbis_info_init(vi);
+    if(isnan(quality)) {
+        ret = vorbis_encode_init(vi, channels, rate, max_bitrate, avg_bitrate,
+            min_bitrate);
+    } else {
+        /* unmanaged, each block is analysed once; with bitrate management
+         * on, it is encoded at every level the manager can pick from */
+        ret = vorbis_encode_setup_vbr(vi, channels, rate, quality / 10.0f);
+        if(!ret && avg_bitrate) {
+            struct ovectl_ratemanage2_arg ai;
+            vorbis_encode_ctl(vi, OV_ECTL_RATEMANAGE2_GET, &ai);
+            ai.management_active = 1;
+            ai.bitrate_limit_min_kbps = -1;
+            ai.bitrate_limit_max_kbps = -1;
+            ai.bitrate_limit_reservoir_bits = avg_bitrate * 2;
+            ai.bitrate_limit_reservoir_bias = 0.1;
+            ai.bitrate_average_kbps = avg_bitrate / 1000;
+            ret = vorbis_encode_ctl(vi, OV_ECTL_RATEMANAGE2_SET, &ai);
+        }
+        if(!ret) ret = vorbis_encode_setup_init(vi);
+    }
     if(ret) {
         fprintf(stderr, "fatal vorbis error\n");
         return -3;
     }
 
-    vorbis_comment_init(&ov.vc);
-    vorbis_comment_add_tag(&ov.vc, "ENCODER", "tidstream");
-
-    vorbis_analysis_init(&ov.vd, &ov.vi);
-    vorbis_block_init(&ov.vd, &ov.vb);
-
-    srand(time(NULL));
-    ogg_stream_init(&ov.os, rand());
+    vorbis_comment_init(vc);
+    vorbis_comment_add_tag(vc, "ENCODER", "tidstream");
+    return 0;
+}
 
+/**
+ * Writes the three Vorbis headers to a stream.
+ * @return 0 on success, or the error returned by the mux's write function
+ */
+int enc_vorbis_headers(vorbis_dsp_state *vd, vorbis_comment *vc, ogg_mux_t *mux) {
     ogg_packet header;
     ogg_packet header_comm;
     ogg_packet header_code;
+    int ret;
 
-    vorbis_analysis_headerout(&ov.vd, &ov.vc, &header, &header_comm, &header_code);
-    ogg_stream_packetin(&ov.os, &header);
-    ogg_stream_packetin(&ov.os, &header_comm);
-    ogg_stream_packetin(&ov.os, &header_code);
+    /* the identification header goes on a page of its own, and the other
+     * two headers on the next one */
+    vorbis_analysis_headerout(vd, vc, &header, &header_comm, &header_code);
+    if((ret = ogg_mux_packet(mux, header.packet, header.bytes, 0, false)) < 0 ||
+            (ret = ogg_mux_flush(mux)) < 0 ||
+            (ret = ogg_mux_packet(mux, header_comm.packet, header_comm.bytes, 0, false)) < 0 ||
+            (ret = ogg_mux_packet(mux, header_code.packet, header_code.bytes, 0, false)) < 0 ||
+            (ret = ogg_mux_flush(mux)) < 0) {
+        return ret;
+    }
+    return 0;
+}
 
-    for(;;) {
-        int result = ogg_stream_flush(&ov.os, &ov.og);
-        if(result == 0) break;
+/**
+ * Creates an encoder context; enc_vorbis_setup starts the stream.
+ * @param label names the stream in traces, or NULL
+ */
+enc_vorbis_t *enc_vorbis_new(const char *label) {
+    enc_vorbis_t *ev = (enc_vorbis_t*)calloc(1, sizeof(enc_vorbis_t));
+    CHECK_MALLOC(ev);
+    ev->label = label;
+    return ev;
+}
 
-        ret = shout_send(shout, ov.og.header, ov.og.header_len);
-        if(ret != SHOUTERR_SUCCESS) {
-            fprintf(stderr, "shout error: %s\n", shout_get_error(shout));
-            return -4;
-        }
+static void enc_vorbis_clear(enc_vorbis_t *ev) {
+    if(!ev->started) return;
 
-        ret = shout_send(shout, ov.og.body, ov.og.body_len);
-        if(ret != SHOUTERR_SUCCESS) {
-            fprintf(stderr, "shout error: %s\n", shout_get_error(shout));
-            return -4;
-        }
-    }
+    vorbis_block_clear(&ev->vb);
+    vorbis_dsp_clear(&ev->vd);
+    vorbis_comment_clear(&ev->vc);
+    vorbis_info_clear(&ev->vi);
+    ev->started = false;
+}
 
-    return 0;
+void enc_vorbis_free(enc_vorbis_t *ev) {
+    if(!ev) return;
+
+    enc_vorbis_clear(ev);
+    if(ev->mux.page) ogg_mux_clear(&ev->mux);
+    free(ev->gains);
+    free(ev);
 }
 
-int enc_vorbis_encode(shout_t *shout, float **data, int nframes) {
-    float **vorbis_input = vorbis_analysis_buffer(&ov.vd, nframes);
-    for(int i=0; i<ov.n_channels; i++) {
-        memcpy(vorbis_input[i], data[i], nframes * sizeof(float));
-    }
-    vorbis_analysis_wrote(&ov.vd, nframes);
+/**
+ * Starts a new Ogg stream on a freshly opened connection.  Called again
+ * after every reconnect.
+ */
+int enc_vorbis_setup(enc_vorbis_t *ev, stream_t *stream, int rate, int channels,
+  int min_bitrate, int avg_bitrate, int max_bitrate, float quality) {
+    ev->n_channels = channels;
+    int ret;
 
-    while(vorbis_analysis_blockout(&ov.vd, &ov.vb) == 1) {
-        vorbis_analysis(&ov.vb, NULL);
-        vorbis_bitrate_addblock(&ov.vb);
+    enc_vorbis_clear(ev);
+    ret = enc_vorbis_init(&ev->vi, &ev->vc, rate, channels, min_bitrate,
+        avg_bitrate, max_bitrate, quality);
+    if(ret) return ret;
 
-        while(vorbis_bitrate_flushpacket(&ov.vd, &ov.op)) {
-            ogg_stream_packetin(&ov.os, &ov.op);
+    vorbis_analysis_init(&ev->vd, &ev->vi);
+    vorbis_block_init(&ev->vd, &ev->vb);
+    ev->started = true;
 
-            int eos = 0;
-            while(!eos) {
-                int result = ogg_stream_pageout(&ov.os, &ov.og);
-                if(result == 0) break;
+    ev->stream = stream;
+    if(ev->mux.page) ogg_mux_clear(&ev->mux);
+    ogg_mux_init(&ev->mux, rand(), OGG_MUX_PAGE_SIZE, enc_vorbis_page, ev);
+    ev->flushed = 0;
 
-                int ret = shout_send(shout, ov.og.header, ov.og.header_len);
-                if(ret != SHOUTERR_SUCCESS) {
-                    fprintf(stderr, "shout error: %s\n", shout_get_error(shout));
-                    return -4;
-                }
-                
-                ret = shout_send(shout, ov.og.body, ov.og.body_len);
-                if(ret != SHOUTERR_SUCCESS) {
-                    fprintf(stderr, "shout error: %s\n", shout_get_error(shout));
-                    return -4;
-                }
+    return enc_vorbis_headers(&ev->vd, &ev->vc, &ev->mux);
+}
 
-                shout_sync(shout);
-            }
+int enc_vorbis_encode(enc_vorbis_t *ev, float **data, int nframes) {
+    uint64_t start = trace_enabled() ? trace_now() : 0;
+    int64_t bytes = ev->bytes_total;
+    PROBE2(encode_start, ev->label, nframes);
+
+    float **vorbis_input = vorbis_analysis_buffer(&ev->vd, nframes);
+    for(int i=0; i<ev->n_channels; i++) {
+        if(ev->gains) {
+            for(int j=0; j<nframes; j++) vorbis_input[i][j] = data[i][j] * ev->gains[i];
+        } else {
+            memcpy(vorbis_input[i], data[i], nframes * sizeof(float));
+        }
+    }
+    vorbis_analysis_wrote(&ev->vd, nframes);
+
+    while(vorbis_analysis_blockout(&ev->vd, &ev->vb) == 1) {
+        vorbis_analysis(&ev->vb, NULL);
+        vorbis_bitrate_addblock(&ev->vb);
+
+        while(vorbis_bitrate_flushpacket(&ev->vd, &ev->op)) {
+            int ret = ogg_mux_packet(&ev->mux, ev->op.packet, ev->op.bytes,
+                ev->op.granulepos, ev->op.e_o_s);
+            if(ret < 0) return ret;
+            ev->packets++;
+            ev->bytes_total += ev->op.bytes;
+        }
+    }
+    /* pages filled by these packets went out on the way */
+    PROBE3(encode_done, ev->label, nframes, ev->bytes_total - bytes);
+    if(start) trace_complete("encode", ev->label, start, "bytes", ev->bytes_total - bytes);
+
+    if(ev->flush_ms &&
+      ev->op.granulepos - ev->flushed >= (int64_t)ev->flush_ms * ev->vi.rate / 1000) {
+        int ret = ogg_mux_flush(&ev->mux);
+        if(ret < 0) return ret;
+        ev->flushed = ev->op.granulepos;
+    }
 
-            if(ogg_page_eos(&ov.og)) {
-                eos = 1;
+    /* the pages finished by this block go out together */
+    if(stream_sync(ev->stream) < 0) return -4;
+    return 0;
+}
+
+/**
+ * Handles a command from the control socket, between blocks.  libvorbis
+ * fixes the bitrate once encoding has started, so only the gains and page
+ * latency can change.
+ */
+int enc_vorbis_control(void *arg, const control_cmd_t *cmd, char *reply, size_t len) {
+    enc_vorbis_t *ev = (enc_vorbis_t*)arg;
+
+    switch(cmd->op) {
+        case CONTROL_BITRATE:
+        case CONTROL_COMPLEXITY:
+            snprintf(reply, len, "not supported with vorbis");
+            return -1;
+        case CONTROL_FLUSH:
+            if(cmd->value > CONTROL_FLUSH_MAX) {
+                snprintf(reply, len, "flush must be at most %d ms", CONTROL_FLUSH_MAX);
+                return -1;
+            }
+            ev->flush_ms = cmd->value;
+            return 0;
+        case CONTROL_GAIN:
+            if(cmd->channel > ev->n_channels) {
+                snprintf(reply, len, "no channel %d", cmd->channel);
+                return -1;
             }
+            if(!ev->gains) {
+                ev->gains = (float*)malloc(ev->n_channels * sizeof(float));
+                CHECK_MALLOC(ev->gains);
+                for(int c=0; c<ev->n_channels; c++) ev->gains[c] = 1.0f;
+            }
+            for(int c=0; c<ev->n_channels; c++) {
+                if(!cmd->channel || c == cmd->channel - 1) {
+                    ev->gains[c] = powf(10.0f, cmd->value / 20.0f);
+                }
+            }
+            return 0;
+        case CONTROL_STATS: {
+            int n = snprintf(reply, len, "codec=vorbis channels=%d bitrate=%ld "
+                "flush_ms=%d packets=%lld bytes=%lld gains=", ev->n_channels,
+                ev->vi.bitrate_nominal, ev->flush_ms, (long long)ev->packets,
+                (long long)ev->bytes_total);
+            for(int c=0; c<ev->n_channels && n < len; c++) {
+                n += snprintf(reply + n, len - n, "%s%0.1f", c ? "," : "",
+                    ev->gains ? 20 * log10f(ev->gains[c]) : 0.0f);
+            }
+            return 0;
         }
     }
+
+    return -1;
 }
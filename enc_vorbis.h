@@ -1,11 +1,45 @@
 #ifndef __enc_vorbis_h_
 #define __enc_vorbis_h_
 
-#include <shout/shout.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <vorbis/vorbisenc.h>
 
-int enc_vorbis_setup(shout_t *shout, int rate, int channels, int min_bitrate, 
-    int avg_bitrate, int max_bitrate);
-int enc_vorbis_encode(shout_t *shout, float **data, int nframes);
+#include "ogg_mux.h"
+#include "stream.h"
+#include "control.h"
 
-#endif // __enc_vorbis_h_
+typedef struct {
+    const char *label;  /* names the stream in traces, or NULL */
+    ogg_mux_t      mux; /* builds Ogg pages out of the encoded packets */
+    stream_t   *stream; /* where finished pages are sent */
+    ogg_packet       op; /* one raw packet of data for decode */
+    vorbis_info      vi; /* struct that stores all the static vorbis bitstream
+                          settings */
+    vorbis_comment   vc; /* struct that stores all the user comments */
+    vorbis_dsp_state vd; /* central working state for the packet->PCM decoder */
+    vorbis_block     vb; /* local working space for packet->PCM decode */
+    bool started;       /* vi, vc, vd and vb are initialized */
+
+    int n_channels;
+    float *gains;       /* per channel, linear; NULL while all are unity */
+    int flush_ms;       /* audio on a page before it is sent, or 0 to send
+                           pages only once they are full */
+    int64_t flushed;    /* granule position of the last page sent */
+    int64_t packets;
+    int64_t bytes_total;
+    uint64_t capture_time; /* when the newest audio given to encode was
+                              captured, for tracing, or 0 */
+} enc_vorbis_t;
 
+int enc_vorbis_init(vorbis_info *vi, vorbis_comment *vc, int rate, int channels,
+    int min_bitrate, int avg_bitrate, int max_bitrate, float quality);
+int enc_vorbis_headers(vorbis_dsp_state *vd, vorbis_comment *vc, ogg_mux_t *mux);
+enc_vorbis_t *enc_vorbis_new(const char *label);
+int enc_vorbis_setup(enc_vorbis_t *ev, stream_t *stream, int rate, int channels,
+    int min_bitrate, int avg_bitrate, int max_bitrate, float quality);
+int enc_vorbis_encode(enc_vorbis_t *ev, float **data, int nframes);
+int enc_vorbis_control(void *arg, const control_cmd_t *cmd, char *reply, size_t len);
+void enc_vorbis_free(enc_vorbis_t *ev);
+
+#endif // __enc_vorbis_h_
@@ -1,14 +1,26 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
 #include <opus/opus.h>
 
 #include "util.h"
 #include "file_writer.h"
+#include "probes.h"
+
+static int file_writer_page(void *arg, const unsigned char *page, size_t len) {
+    OpusFileWriter *fw = (OpusFileWriter*)arg;
+
+    if(fw->ws) {
+        return write_stream_write(fw->ws, page, len);
+    }
+    return fwrite(page, 1, len, fw->fd) == len ? 0 : -1;
+}
 
 void file_writer_init(OpusFileWriter *fw, const char *name, const OpusHeader *id,
   const char *tags, int tag_len) {
-    fw->name = (char*)malloc(strlen(name));
+    fw->name = (char*)malloc(strlen(name) + 1);
     CHECK_MALLOC(fw->name);
     strcpy(fw->name, name);
 
@@ -18,11 +30,15 @@ void file_writer_init(OpusFileWriter *fw, const char *name, const OpusHeader *id
     memcpy(fw->tags, tags, tag_len);
     fw->tag_len = tag_len;
 
+    fw->pending = false;
     fw->fd = NULL;
+    fw->ws = NULL;
+    fw->pool = NULL;
+    fw->prealloc = 0;
 
     fw->id.channels = id->channels;
     fw->id.channel_mapping = id->channel_mapping;
-    ogg_stream_init(&fw->os, rand());
+    ogg_mux_init(&fw->mux, rand(), OGG_MUX_PAGE_SIZE, file_writer_page, fw);
 
     fw->granulepos = 0;
     fw->max_length = 3600 * id->input_sample_rate;
@@ -32,36 +48,130 @@ void file_writer_init(OpusFileWriter *fw, const char *name, const OpusHeader *id
     fw->hist_frames = 0;
 
     fw->filecount = 0;
+    fw->single = false;
     fw->timefmt = NULL;
+    fw->start_time = 0;
 }
 
-static void file_writer_write(OpusFileWriter *fw, bool flush) {
-    ogg_page og;
+static void file_writer_put_le32(unsigned char *buf, uint32_t v) {
+    buf[0] = v & 0xff;
+    buf[1] = (v >> 8) & 0xff;
+    buf[2] = (v >> 16) & 0xff;
+    buf[3] = (v >> 24) & 0xff;
+}
 
-    while(ogg_stream_pageout(&fw->os, &og) > 0) {
-        fwrite(og.header, 1, og.header_len, fw->fd);
-        fwrite(og.body, 1, og.body_len, fw->fd);
+/**
+ * Builds the comment header of a new file: the writer's tags, plus a
+ * START_TIME tag with the wall clock time of the file's first sample when
+ * that is known, which opusindex reads.
+ * @param len set to the length of the header
+ * @return the header, which the caller frees
+ */
+static unsigned char *file_writer_tags(OpusFileWriter *fw, int *len) {
+    char start[64];
+    int start_len = 0;
+    const unsigned char *tags = (const unsigned char*)fw->tags;
+    int vendor_length = fw->tag_len >= 16 ? tags[8] | tags[9] << 8 |
+        tags[10] << 16 | (uint32_t)tags[11] << 24 : -1;
+
+    if(fw->start_time > 0 && memcmp(tags, "OpusTags", 8) == 0 &&
+            vendor_length >= 0 && 16 + vendor_length <= fw->tag_len) {
+        /* the first file starts playing after the encoder's delay; later
+         * ones right where the previous one stopped */
+        int64_t first = fw->granulepos + (fw->hist ? 0 : fw->id.preskip);
+        start_len = snprintf(start, sizeof(start), "START_TIME=%0.6f",
+            fw->start_time + first / 48000.0);
     }
 
+    unsigned char *buf = (unsigned char*)malloc(fw->tag_len + 4 + start_len);
+    CHECK_MALLOC(buf);
+    memcpy(buf, fw->tags, fw->tag_len);
+    *len = fw->tag_len;
+    if(start_len) {
+        /* the comments follow the vendor string and their count */
+        unsigned char *count = buf + 12 + vendor_length;
+        file_writer_put_le32(count, (count[0] | count[1] << 8 | count[2] << 16 |
+            (uint32_t)count[3] << 24) + 1);
+        file_writer_put_le32(buf + *len, start_len);
+        memcpy(buf + *len + 4, start, start_len);
+        *len += 4 + start_len;
+    }
+    return buf;
+}
+
+bool file_writer_is_open(const OpusFileWriter *fw) {
+    return fw->fd != NULL || fw->ws != NULL;
+}
+
+/**
+ * Adds fw->op to the current file, optionally ending the page after it.
+ */
+static void file_writer_write(OpusFileWriter *fw, bool flush) {
+    ogg_mux_packet(&fw->mux, fw->op.packet, fw->op.bytes, fw->op.granulepos,
+        fw->op.e_o_s);
     if(flush) {
-        if(ogg_stream_flush(&fw->os, &og) > 0) {
-            fwrite(og.header, 1, og.header_len, fw->fd);
-            fwrite(og.body, 1, og.body_len, fw->fd);
-        }
+        ogg_mux_flush(&fw->mux);
+    }
+}
+
+static void file_writer_push_history(OpusFileWriter *fw, ogg_packet *op, int nframes) {
+    /* Manage the history queue: create the new packet */
+    packet_hist *cur_packet = (packet_hist*)malloc(sizeof(packet_hist) + op->bytes);
+    CHECK_MALLOC(cur_packet);
+    cur_packet->bytes = op->bytes;
+    cur_packet->nframes = nframes;
+    cur_packet->next = NULL;
+    memcpy(&cur_packet->packet[0], op->packet, op->bytes);
+
+    /* Insert at end of queue */
+    if(fw->hist == NULL) {
+        fw->hist = cur_packet;
+    } else {
+        fw->hist_last->next = cur_packet;
     }
+    fw->hist_last = cur_packet;
+    fw->hist_frames += cur_packet->nframes;
 }
 
-void file_writer_input(OpusFileWriter *fw, ogg_packet *op) {
-    if(fw->fd == NULL) {
+static void file_writer_trim_history(OpusFileWriter *fw) {
+    while((fw->hist_frames - fw->hist->nframes) >= (MIN_HIST + fw->unused_frames)) {
+        fw->hist_frames -= fw->hist->nframes;
+        packet_hist *hist_del = fw->hist;
+        fw->hist = fw->hist->next;
+        free(hist_del);
+    }
+}
+
+/**
+ * Writes a packet, starting a new file first if none is open.
+ * @return 0 on success, -1 if a new file could not be opened, in which case
+ *  the packet is dropped
+ */
+int file_writer_input(OpusFileWriter *fw, ogg_packet *op) {
+    /* writer, packet bytes, granule position */
+    PROBE3(file_writer_input, fw, op->bytes, op->granulepos);
+    if(!file_writer_is_open(fw)) {
+        /* a single file writer ignores everything after its file is done */
+        if(fw->single && fw->filecount > 0) return 0;
+
         char namebuf[4096];
-        if(fw->max_length > 0) {
-            snprintf(namebuf, sizeof(namebuf), "%s-%d.opus", fw->name, fw->filecount++);
+        if(fw->max_length > 0 && !fw->single) {
+            snprintf(namebuf, sizeof(namebuf), "%s-%d.opus", fw->name, fw->filecount);
         } else {
             snprintf(namebuf, sizeof(namebuf), "%s.opus", fw->name);
         }
-        fw->fd = fopen(namebuf, "wb");
+        fw->filecount++;
+        if(fw->pool) {
+            fw->ws = write_stream_open(fw->pool, namebuf, fw->prealloc);
+        } else {
+            fw->fd = fopen(namebuf, "wb");
+        }
+        if(!file_writer_is_open(fw)) {
+            fprintf(stderr, "error: opening %s: %s\n", namebuf, strerror(errno));
+            return -1;
+        }
 
-        ogg_stream_reset_serialno(&fw->os, rand());
+        ogg_mux_reset(&fw->mux, rand());
 
         if(fw->hist != NULL) {
             fw->id.preskip = fw->hist_frames - fw->unused_frames;
@@ -78,16 +188,17 @@ void file_writer_input(OpusFileWriter *fw, ogg_packet *op) {
         fw->op.packetno = 0;
         fw->op.granulepos = 0;
 
-        ogg_stream_packetin(&fw->os, &fw->op);
         file_writer_write(fw, true);
 
-        fw->op.packet = fw->tags;
-        fw->op.bytes = fw->tag_len;
+        int tag_len;
+        unsigned char *tags = file_writer_tags(fw, &tag_len);
+        fw->op.packet = tags;
+        fw->op.bytes = tag_len;
         fw->op.b_o_s = 0;
         fw->op.packetno++;
 
-        ogg_stream_packetin(&fw->os, &fw->op);
         file_writer_write(fw, true);
+        free(tags);
 
         /* write history buffer to file (used to help decoder converge before
          * decoded samples appear */
@@ -98,32 +209,21 @@ void file_writer_input(OpusFileWriter *fw, ogg_packet *op) {
             fw->op.e_o_s = 0;
             fw->op.granulepos += pkt->nframes;
 
-            ogg_stream_packetin(&fw->os, &fw->op);
             file_writer_write(fw, false);
         }
     }
 
     int nframes = opus_packet_get_samples_per_frame(op->packet, 48000);
+    file_writer_push_history(fw, op, nframes);
 
-    /* Manage the history queue: create the new packet */
-    packet_hist *cur_packet = (packet_hist*)malloc(sizeof(packet_hist) + op->bytes);
-    CHECK_MALLOC(cur_packet);
-    cur_packet->bytes = op->bytes;
-    cur_packet->nframes = nframes;
-    cur_packet->next = NULL;
-    memcpy(&cur_packet->packet[0], op->packet, op->bytes);
-
-    /* Insert at end of queue */
-    if(fw->hist == NULL) {
-        fw->hist = cur_packet;
-    } else {
-        fw->hist_last->next = cur_packet;
+    /* the packet held back last time is not the last one after all */
+    if(fw->pending) {
+        file_writer_write(fw, false);
+        fw->pending = false;
     }
-    fw->hist_last = cur_packet;
-    fw->hist_frames += cur_packet->nframes;
 
-    /* Write packet out */
-    fw->op.packet = op->packet;
+    /* Write packet out; the copy in the history outlives op */
+    fw->op.packet = fw->hist_last->packet;
     fw->op.bytes = op->bytes;
     fw->op.packetno++;
     fw->op.e_o_s = op->e_o_s;
@@ -143,34 +243,130 @@ void file_writer_input(OpusFileWriter *fw, ogg_packet *op) {
         }
     }
 
-    ogg_stream_packetin(&fw->os, &fw->op);
-    file_writer_write(fw, close);
+    if(close || fw->op.e_o_s) {
+        file_writer_write(fw, close);
+    } else {
+        fw->pending = true;
+    }
 
     if(close) {
         file_writer_close(fw);
     }
 
-    /* Trim queue */
-    while((fw->hist_frames - fw->hist->nframes) >= (MIN_HIST + fw->unused_frames)) {
-        fw->hist_frames -= fw->hist->nframes;
-        packet_hist *hist_del = fw->hist;
-        fw->hist = fw->hist->next;
-        free(hist_del);
-    }
+    file_writer_trim_history(fw);
+    return 0;
 }
 
+/**
+ * Closes the current file, if any.  A file closed before it is full ends
+ * with the last packet written to it, marked as the end of the stream.
+ */
 void file_writer_close(OpusFileWriter *fw) {
+    if(fw->pending) {
+        fw->op.e_o_s = 1;
+        file_writer_write(fw, true);
+        fw->pending = false;
+    }
+
+    if(fw->ws) {
+        ogg_mux_flush(&fw->mux);
+        if(write_stream_close(fw->ws) < 0) {
+            perror("error: writing output file");
+        }
+        fw->ws = NULL;
+        return;
+    }
+
     if(!fw->fd) return;
 
-    file_writer_write(fw, true);
+    ogg_mux_flush(&fw->mux);
     fclose(fw->fd);
     fw->fd = NULL;
 }
 
+/**
+ * Closes the current file, if any, and frees everything the writer holds.
+ */
+void file_writer_free(OpusFileWriter *fw) {
+    file_writer_close(fw);
+
+    while(fw->hist) {
+        packet_hist *next = fw->hist->next;
+        free(fw->hist);
+        fw->hist = next;
+    }
+    fw->hist_last = NULL;
+    fw->hist_frames = 0;
+
+    ogg_mux_clear(&fw->mux);
+    free(fw->name);
+    free(fw->tags);
+    fw->name = NULL;
+    fw->tags = NULL;
+}
+
 void file_writer_set_max_length(OpusFileWriter *fw, int64_t max_length) {
     fw->max_length = max_length;
 }
 
+/**
+ * Sets the body size at which pages are finished (OGG_MUX_PAGE_SIZE by
+ * default).  Larger pages cost less framing and fewer writes; smaller ones
+ * let readers seek more precisely.
+ */
+void file_writer_set_page_size(OpusFileWriter *fw, int page_size) {
+    ogg_mux_set_page_size(&fw->mux, page_size);
+}
+
+/**
+ * Routes output through a write pool instead of stdio: pages are gathered in
+ * large aligned buffers that the pool's threads write out, so many writers
+ * can share the disk without interleaving small writes.
+ * @param prealloc number of bytes to preallocate for each output file
+ */
+void file_writer_set_pool(OpusFileWriter *fw, write_pool_t *pool, int64_t prealloc) {
+    fw->pool = pool;
+    fw->prealloc = prealloc;
+}
+
+/**
+ * Limits the writer to a single file named exactly after the writer, which
+ * ends once max_length samples have been written.
+ */
+void file_writer_set_single(OpusFileWriter *fw, bool single) {
+    fw->single = single;
+}
+
+/**
+ * Sets the segment number used to name the next file.
+ */
+void file_writer_set_filecount(OpusFileWriter *fw, int filecount) {
+    fw->filecount = filecount;
+}
+
+/**
+ * Adds a packet to the history queue without writing it, as if it had been
+ * the last packet of a previous file, so that output can start partway
+ * through a stream with the same pre-roll a continuous run would produce.
+ * @param unused_frames number of frames at the end of the packet that the
+ *  next file should still play
+ */
+void file_writer_prime(OpusFileWriter *fw, ogg_packet *op, int unused_frames) {
+    int nframes = opus_packet_get_samples_per_frame(op->packet, 48000);
+    file_writer_push_history(fw, op, nframes);
+    fw->unused_frames = unused_frames;
+    file_writer_trim_history(fw);
+}
+
 void file_writer_update_granulepos(OpusFileWriter *fw, int64_t granulepos) {
     fw->granulepos = granulepos;
 }
+
+/**
+ * Sets when granule position 0 was captured, so that each file is tagged
+ * with the wall clock time of its first sample.
+ * @param start_time seconds since the epoch
+ */
+void file_writer_set_start_time(OpusFileWriter *fw, double start_time) {
+    fw->start_time = start_time;
+}
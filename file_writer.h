@@ -2,12 +2,16 @@
 #define __file_writer_h_
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <ogg/ogg.h>
 #include <time.h>
 
 #include "opus_header.h"
+#include "write_pool.h"
+#include "ogg_mux.h"
 
 #define MIN_HIST 3840
+#define MAX_PACKET_SAMPLES 5760 /* longest possible Opus packet */
 
 typedef struct packet_hist {
     int bytes;
@@ -23,9 +27,14 @@ typedef struct {
     char *name;
 
     ogg_packet op;
+    bool pending;       /* op, the newest packet, is held back so that a file
+                           closed early can still end on it */
     
     FILE *fd;
-    ogg_stream_state os;
+    write_stream_t *ws; /* used instead of fd when writing through a pool */
+    write_pool_t *pool;
+    int64_t prealloc;   /* bytes to preallocate for each file in the pool */
+    ogg_mux_t mux;
 
     int64_t granulepos; /* global sample position (not reset on new file) */
     int64_t max_length; /* maximum number of playable samples to write to a 
@@ -38,17 +47,28 @@ typedef struct {
     packet_hist *hist_last; /* convenience pointer to end of history queue */
 
     int filecount;
+    bool single;        /* write one file, without a segment number */
+    double start_time;  /* wall clock time of granule position 0, in seconds,
+                           or 0 if unknown */
     char *timefmt;
     struct tm starttime;
 } OpusFileWriter;
 
 void file_writer_init(OpusFileWriter *fw, const char *name, const OpusHeader *id, 
   const char *tags, int tag_len);
-void file_writer_input(OpusFileWriter *fw, ogg_packet *op);
+int file_writer_input(OpusFileWriter *fw, ogg_packet *op);
+void file_writer_prime(OpusFileWriter *fw, ogg_packet *op, int unused_frames);
 void file_writer_close(OpusFileWriter *fw);
+void file_writer_free(OpusFileWriter *fw);
+bool file_writer_is_open(const OpusFileWriter *fw);
 
 void file_writer_set_max_length(OpusFileWriter *fw, int64_t max_length);
+void file_writer_set_single(OpusFileWriter *fw, bool single);
+void file_writer_set_filecount(OpusFileWriter *fw, int filecount);
+void file_writer_set_page_size(OpusFileWriter *fw, int page_size);
+void file_writer_set_pool(OpusFileWriter *fw, write_pool_t *pool, int64_t prealloc);
 void file_writer_update_granulepos(OpusFileWriter *fw, int64_t granulepos);
+void file_writer_set_start_time(OpusFileWriter *fw, double start_time);
 
 
 #endif // __file_writer_h_
@@ -0,0 +1,612 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "util.h"
+#include "net_engine.h"
+#include "trace.h"
+
+#define NET_EVENTS 64
+#define NET_QUEUE_SIZE (64 << 10)
+
+static double net_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void net_set_deadline(net_conn_t *c, double deadline) {
+    c->deadline = deadline;
+    if(deadline < c->loop->next_deadline) c->loop->next_deadline = deadline;
+}
+
+static void net_set_state(net_conn_t *c, net_state_t state) {
+    pthread_mutex_lock(&c->lock);
+    c->state = state;
+    if(state == NET_FAILED) c->queue_sent = c->queue_used = 0;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * Queues a connection for the loop's attention and wakes the loop if it
+ * isn't already due to look at its kicks.
+ * @param close true if the owner is letting go of c; the loop may free it
+ *  as soon as the lock is released, so c is not touched after that
+ */
+static void net_kick(net_conn_t *c, bool close) {
+    net_loop_t *l = c->loop;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&l->lock);
+    bool wake = !l->kicks;
+    if(close) c->closing = true;
+    if(!c->kicked) {
+        c->kicked = true;
+        c->kick_next = l->kicks;
+        l->kicks = c;
+    }
+    pthread_mutex_unlock(&l->lock);
+    if(wake && write(l->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("net: waking loop");
+    }
+}
+
+static void net_close_fd(net_conn_t *c) {
+    if(c->fd < 0) return;
+    /* closing the socket also takes it out of the epoll set */
+    close(c->fd);
+    c->fd = -1;
+}
+
+static void net_conn_try(net_conn_t *c);
+
+/**
+ * Gives up on a connection attempt: tries the server's next address if the
+ * connect itself failed, otherwise waits before starting over.
+ */
+static void net_conn_retry(net_conn_t *c, const char *reason) {
+    net_close_fd(c);
+
+    if(c->state == NET_CONNECTING && c->addr && c->addr->ai_next) {
+        c->addr = c->addr->ai_next;
+        net_conn_try(c);
+        return;
+    }
+
+    fprintf(stderr, "stream: %s: %s, retrying in %0.0f s\n", c->label, reason,
+        c->backoff);
+    net_set_state(c, NET_BACKOFF);
+    net_set_deadline(c, net_now() + c->backoff);
+    c->backoff = fmin(c->backoff * 2, NET_BACKOFF_MAX);
+}
+
+/**
+ * Drops a connection that was streaming.  The owner sees its next send
+ * fail, and starts a new stream on a new connection.
+ */
+static void net_conn_lost(net_conn_t *c, const char *reason) {
+    net_close_fd(c);
+    fprintf(stderr, "stream: %s: connection lost: %s\n", c->label, reason);
+    net_set_state(c, NET_FAILED);
+    /* a closing connection is now done; let the timer pass free it */
+    c->loop->next_deadline = 0;
+}
+
+/**
+ * Starts a non-blocking connect to the current address, moving on to the
+ * next ones if it fails straight away.
+ */
+static void net_conn_try(net_conn_t *c) {
+    const char *reason = "no address";
+
+    for(; c->addr; c->addr = c->addr->ai_next) {
+        c->fd = socket(c->addr->ai_family, c->addr->ai_socktype | SOCK_NONBLOCK |
+            SOCK_CLOEXEC, c->addr->ai_protocol);
+        if(c->fd < 0) {
+            reason = strerror(errno);
+            continue;
+        }
+        if(c->sndbuf > 0) {
+            setsockopt(c->fd, SOL_SOCKET, SO_SNDBUF, &c->sndbuf, sizeof(c->sndbuf));
+        }
+        if(connect(c->fd, c->addr->ai_addr, c->addr->ai_addrlen) == 0 ||
+          errno == EINPROGRESS) {
+            struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET,
+                .data.ptr = c };
+            if(epoll_ctl(c->loop->epfd, EPOLL_CTL_ADD, c->fd, &ev) == 0) {
+                net_set_state(c, NET_CONNECTING);
+                c->request_sent = 0;
+                c->response_len = 0;
+                net_set_deadline(c, net_now() + NET_CONNECT_TIMEOUT);
+                return;
+            }
+        }
+        reason = strerror(errno);
+        net_close_fd(c);
+    }
+
+    /* every address failed at once; start over from the first after a wait */
+    c->addr = c->addrs;
+    net_set_state(c, NET_HANDSHAKE);
+    net_conn_retry(c, reason);
+}
+
+/**
+ * Hands the socket as much of the queue as it will take.
+ */
+static void net_conn_flush_queue(net_conn_t *c) {
+    const char *error = NULL;
+    uint64_t start = trace_enabled() ? trace_now() : 0;
+    size_t sent = 0;
+
+    pthread_mutex_lock(&c->lock);
+    while(c->queue_sent < c->queue_used) {
+        ssize_t n = send(c->fd, c->queue + c->queue_sent,
+            c->queue_used - c->queue_sent, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) error = strerror(errno);
+            break;
+        }
+        c->queue_sent += n;
+        sent += n;
+    }
+    if(c->queue_sent == c->queue_used) c->queue_sent = c->queue_used = 0;
+    pthread_mutex_unlock(&c->lock);
+
+    if(start && sent) trace_complete("send", c->label, start, "bytes", sent);
+    if(error) net_conn_lost(c, error);
+}
+
+static void net_conn_send_request(net_conn_t *c) {
+    while(c->request_sent < c->request_len) {
+        ssize_t n = send(c->fd, c->request + c->request_sent,
+            c->request_len - c->request_sent, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) net_conn_retry(c, strerror(errno));
+            return;
+        }
+        c->request_sent += n;
+    }
+}
+
+/**
+ * Reads the server's answer to the source request; on acceptance the
+ * connection starts streaming whatever has been queued meanwhile.
+ */
+static void net_conn_read_response(net_conn_t *c) {
+    for(;;) {
+        ssize_t n = recv(c->fd, c->response + c->response_len,
+            sizeof(c->response) - 1 - c->response_len, 0);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) net_conn_retry(c, strerror(errno));
+            return;
+        }
+        if(n == 0) {
+            net_conn_retry(c, "connection closed by server");
+            return;
+        }
+        c->response_len += n;
+        c->response[c->response_len] = '\0';
+        if(strstr(c->response, "\r\n\r\n") || strstr(c->response, "\n\n")) break;
+        if(c->response_len == sizeof(c->response) - 1) break;
+    }
+
+    int status = 0;
+    if(sscanf(c->response, "HTTP/%*d.%*d %d", &status) != 1 || status != 200) {
+        char *eol = strpbrk(c->response, "\r\n");
+        if(eol) *eol = '\0';
+        char reason[sizeof(c->response) + 32];
+        snprintf(reason, sizeof(reason), "server refused source: %s", c->response);
+        net_conn_retry(c, reason);
+        return;
+    }
+
+    if(c->nodelay) {
+        int on = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    fprintf(stderr, "connected to http://%s\n", c->label);
+    c->backoff = NET_BACKOFF_MIN;
+    net_set_state(c, NET_STREAMING);
+    net_conn_flush_queue(c);
+}
+
+static void net_conn_event(net_conn_t *c, uint32_t events) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    char discard[512];
+
+    switch(c->state) {
+        case NET_CONNECTING:
+            getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if(err || (events & (EPOLLERR | EPOLLHUP))) {
+                net_conn_retry(c, strerror(err ? err : ECONNREFUSED));
+                return;
+            }
+            if(!(events & EPOLLOUT)) return;
+            net_set_state(c, NET_HANDSHAKE);
+            /* the answer may already be waiting with the first event */
+            events |= EPOLLIN;
+            /* fall through */
+        case NET_HANDSHAKE:
+            if(c->request_sent < c->request_len) net_conn_send_request(c);
+            if(c->state == NET_HANDSHAKE && c->request_sent == c->request_len &&
+              (events & EPOLLIN)) {
+                net_conn_read_response(c);
+            }
+            return;
+        case NET_STREAMING:
+            if(events & EPOLLIN) {
+                /* the server has nothing to say while streaming but goodbye */
+                for(;;) {
+                    ssize_t n = recv(c->fd, discard, sizeof(discard), 0);
+                    if(n > 0 || (n < 0 && errno == EINTR)) continue;
+                    if(n == 0) {
+                        net_conn_lost(c, "connection closed by server");
+                        return;
+                    }
+                    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                        net_conn_lost(c, strerror(errno));
+                        return;
+                    }
+                    break;
+                }
+            }
+            if(events & (EPOLLERR | EPOLLHUP)) {
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                net_conn_lost(c, strerror(err ? err : EPIPE));
+                return;
+            }
+            if(events & EPOLLOUT) net_conn_flush_queue(c);
+            return;
+        default:
+            return;
+    }
+}
+
+/**
+ * @return true once a closing connection has nothing left to send, or has
+ *  run out of time to send it
+ */
+static bool net_conn_done(net_conn_t *c, double now) {
+    pthread_mutex_lock(&c->lock);
+    bool done = c->close_started && (c->state != NET_STREAMING ||
+        c->queue_sent == c->queue_used || now >= c->deadline);
+    pthread_mutex_unlock(&c->lock);
+    return done;
+}
+
+static void net_conn_free(net_conn_t *c) {
+    net_loop_t *l = c->loop;
+
+    for(net_conn_t **p = &l->conns; *p; p = &(*p)->next) {
+        if(*p == c) {
+            *p = c->next;
+            break;
+        }
+    }
+    net_close_fd(c);
+    freeaddrinfo(c->addrs);
+    pthread_mutex_destroy(&c->lock);
+    free(c->request);
+    free(c->queue);
+    free(c->label);
+    free(c);
+}
+
+/**
+ * Picks up new, closing and newly fed connections.
+ */
+static void net_loop_kicks(net_loop_t *l) {
+    net_conn_t *ready = NULL;
+    double now = net_now();
+
+    pthread_mutex_lock(&l->lock);
+    for(net_conn_t *c = l->kicks; c; c = c->kick_next) {
+        c->kicked = false;
+        /* closing is only seen here, once the owner is done with c */
+        if(c->closing && !c->close_started) {
+            c->close_started = true;
+            net_set_deadline(c, now + NET_CLOSE_TIMEOUT);
+        }
+        c->ready_next = ready;
+        ready = c;
+    }
+    l->kicks = NULL;
+    pthread_mutex_unlock(&l->lock);
+
+    for(net_conn_t *c = ready, *next; c; c = next) {
+        next = c->ready_next;
+
+        if(!c->attached) {
+            c->attached = true;
+            c->next = l->conns;
+            l->conns = c;
+            c->addr = c->addrs;
+            net_conn_try(c);
+        }
+        if(c->state == NET_STREAMING) net_conn_flush_queue(c);
+        if(net_conn_done(c, now)) net_conn_free(c);
+    }
+}
+
+/**
+ * Acts on the deadlines that have passed, and works out the next one.
+ */
+static void net_loop_timers(net_loop_t *l) {
+    double now = net_now();
+    l->next_deadline = INFINITY;
+
+    for(net_conn_t *c = l->conns, *next; c; c = next) {
+        next = c->next;
+
+        if(net_conn_done(c, now)) {
+            net_conn_free(c);
+            continue;
+        }
+        if(c->deadline > now) {
+            if(c->deadline < l->next_deadline &&
+              (c->state != NET_STREAMING || c->close_started)) {
+                l->next_deadline = c->deadline;
+            }
+            continue;
+        }
+
+        switch(c->state) {
+            case NET_CONNECTING:
+            case NET_HANDSHAKE:
+                net_conn_retry(c, "timed out");
+                break;
+            case NET_BACKOFF:
+                c->addr = c->addrs;
+                net_conn_try(c);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void *net_loop_run(void *arg) {
+    net_loop_t *l = (net_loop_t*)arg;
+    struct epoll_event events[NET_EVENTS];
+
+    for(;;) {
+        pthread_mutex_lock(&l->lock);
+        bool stop = !l->running && !l->conns && !l->kicks;
+        pthread_mutex_unlock(&l->lock);
+        if(stop) break;
+
+        /* wake for the next deadline, and at least once a second */
+        double wait = l->next_deadline - net_now();
+        int timeout = wait < 0 ? 0 : wait > 1.0 ? 1000 : (int)ceil(wait * 1000);
+
+        int n = epoll_wait(l->epfd, events, NET_EVENTS, timeout);
+        if(n < 0 && errno != EINTR) {
+            perror("net: epoll_wait");
+            break;
+        }
+        for(int i=0; i<n; i++) {
+            if(!events[i].data.ptr) {
+                uint64_t count;
+                while(read(l->evfd, &count, sizeof(count)) > 0);
+                continue;
+            }
+            net_conn_event((net_conn_t*)events[i].data.ptr, events[i].events);
+        }
+
+        net_loop_kicks(l);
+        if(net_now() >= l->next_deadline) net_loop_timers(l);
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the threads that drive outgoing connections.  Each thread waits on
+ * all of its connections at once with epoll, so a thread or two can carry
+ * hundreds of streams.
+ * @param n_threads number of event loops; connections are spread over them
+ * @return the engine, or NULL on error
+ */
+net_engine_t *net_engine_new(int n_threads) {
+    if(n_threads < 1) n_threads = 1;
+
+    net_engine_t *e = (net_engine_t*)calloc(1, sizeof(net_engine_t));
+    CHECK_MALLOC(e);
+    e->loops = (net_loop_t*)calloc(n_threads, sizeof(net_loop_t));
+    CHECK_MALLOC(e->loops);
+    pthread_mutex_init(&e->lock, NULL);
+
+    for(int i=0; i<n_threads; i++) {
+        net_loop_t *l = &e->loops[i];
+        l->epfd = epoll_create1(EPOLL_CLOEXEC);
+        l->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if(l->epfd < 0 || l->evfd < 0 ||
+          epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->evfd, &ev) < 0) {
+            perror("net: creating event loop");
+            if(l->epfd >= 0) close(l->epfd);
+            if(l->evfd >= 0) close(l->evfd);
+            net_engine_free(e);
+            return NULL;
+        }
+        pthread_mutex_init(&l->lock, NULL);
+        l->next_deadline = INFINITY;
+        l->running = true;
+        if(pthread_create(&l->thread, NULL, net_loop_run, l) != 0) {
+            perror("net: starting event loop");
+            close(l->epfd);
+            close(l->evfd);
+            pthread_mutex_destroy(&l->lock);
+            net_engine_free(e);
+            return NULL;
+        }
+        char name[16];
+        snprintf(name, sizeof(name), "net %d", i);
+        pthread_setname_np(l->thread, name);
+        e->n_loops++;
+    }
+
+    return e;
+}
+
+/**
+ * Stops the event loops.  Every connection must have been closed; the
+ * loops finish sending what they hold first.
+ */
+void net_engine_free(net_engine_t *e) {
+    if(!e) return;
+
+    for(int i=0; i<e->n_loops; i++) {
+        net_loop_t *l = &e->loops[i];
+        uint64_t one = 1;
+        pthread_mutex_lock(&l->lock);
+        l->running = false;
+        pthread_mutex_unlock(&l->lock);
+        if(write(l->evfd, &one, sizeof(one)) < 0) perror("net: waking loop");
+    }
+    for(int i=0; i<e->n_loops; i++) {
+        net_loop_t *l = &e->loops[i];
+        pthread_join(l->thread, NULL);
+        close(l->epfd);
+        close(l->evfd);
+        pthread_mutex_destroy(&l->lock);
+    }
+    pthread_mutex_destroy(&e->lock);
+    free(e->loops);
+    free(e);
+}
+
+/**
+ * Opens a connection driven by the engine: it connects in the background,
+ * sends request, and once the server answers 200 streams whatever has been
+ * queued.  Failed attempts are retried with a growing delay; a connection
+ * that is lost once streaming is not, since the owner must start its stream
+ * over.  Resolves host on the calling thread.
+ * @param label shown in messages
+ * @return the connection, or NULL if host can't be resolved
+ */
+net_conn_t *net_conn_new(net_engine_t *e, const char *host, int port,
+  const char *label, const char *request, size_t request_len, int sndbuf,
+  bool nodelay) {
+    struct addrinfo hints, *res;
+    char service[16];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+
+    int ret = getaddrinfo(host, service, &hints, &res);
+    if(ret) {
+        fprintf(stderr, "stream: error resolving %s: %s\n", host, gai_strerror(ret));
+        return NULL;
+    }
+
+    net_conn_t *c = (net_conn_t*)calloc(1, sizeof(net_conn_t));
+    CHECK_MALLOC(c);
+    c->label = strdup(label);
+    c->request = (char*)malloc(request_len);
+    c->queue_size = NET_QUEUE_SIZE;
+    c->queue = (unsigned char*)malloc(c->queue_size);
+    CHECK_MALLOC(c->label);
+    CHECK_MALLOC(c->request);
+    CHECK_MALLOC(c->queue);
+    memcpy(c->request, request, request_len);
+    c->request_len = request_len;
+    c->addrs = res;
+    c->fd = -1;
+    c->sndbuf = sndbuf;
+    c->nodelay = nodelay;
+    c->backoff = NET_BACKOFF_MIN;
+    c->state = NET_CONNECTING;
+    pthread_mutex_init(&c->lock, NULL);
+
+    pthread_mutex_lock(&e->lock);
+    c->loop = &e->loops[e->next];
+    e->next = (e->next + 1) % e->n_loops;
+    pthread_mutex_unlock(&e->lock);
+
+    net_kick(c, false);
+    return c;
+}
+
+/**
+ * Queues data for the server.  Data queued before the connection is up
+ * goes out once it is.
+ * @return 0 on success, -1 if the connection was lost or the server has
+ *  fallen NET_MAX_BACKLOG bytes behind
+ */
+int net_conn_send(net_conn_t *c, const unsigned char *data, size_t len) {
+    int ret = 0;
+
+    pthread_mutex_lock(&c->lock);
+    size_t backlog = c->queue_used - c->queue_sent;
+    if(c->state == NET_FAILED) {
+        ret = -1;
+    } else if(backlog + len > NET_MAX_BACKLOG) {
+        fprintf(stderr, "stream: %s: server is not keeping up\n", c->label);
+        ret = -1;
+    } else {
+        if(c->queue_used + len > c->queue_size) {
+            /* reuse the space already sent before growing */
+            memmove(c->queue, c->queue + c->queue_sent, backlog);
+            c->queue_used = backlog;
+            c->queue_sent = 0;
+            while(c->queue_used + len > c->queue_size) c->queue_size *= 2;
+            c->queue = (unsigned char*)realloc(c->queue, c->queue_size);
+            CHECK_MALLOC(c->queue);
+        }
+        memcpy(c->queue + c->queue_used, data, len);
+        c->queue_used += len;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return ret;
+}
+
+/**
+ * Has the loop send what has been queued, in one go.
+ */
+void net_conn_flush(net_conn_t *c) {
+    pthread_mutex_lock(&c->lock);
+    bool kick = c->state == NET_STREAMING && c->queue_sent < c->queue_used;
+    pthread_mutex_unlock(&c->lock);
+    if(kick) net_kick(c, false);
+}
+
+/**
+ * @return the bytes queued and not yet taken by the socket
+ */
+size_t net_conn_backlog(net_conn_t *c) {
+    pthread_mutex_lock(&c->lock);
+    size_t backlog = c->queue_used - c->queue_sent;
+    pthread_mutex_unlock(&c->lock);
+    return backlog;
+}
+
+/**
+ * Lets go of a connection.  The loop sends what is left, for up to
+ * NET_CLOSE_TIMEOUT seconds, then frees it; c must not be used again.
+ */
+void net_conn_close(net_conn_t *c) {
+    if(!c) return;
+
+    net_kick(c, true);
+}
@@ -0,0 +1,93 @@
+#ifndef __net_engine_h_
+#define __net_engine_h_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <netdb.h>
+
+#define NET_CONNECT_TIMEOUT 10.0    /* seconds to connect and be accepted */
+#define NET_CLOSE_TIMEOUT 2.0       /* seconds to send what is left on close */
+#define NET_BACKOFF_MIN 1.0         /* seconds before retrying a failed connect, */
+#define NET_BACKOFF_MAX 60.0        /* doubling up to this */
+#define NET_MAX_BACKLOG (4 << 20)   /* bytes queued before sends fail */
+
+typedef enum {
+    NET_CONNECTING,
+    NET_HANDSHAKE,          /* request sent, waiting for the server's answer */
+    NET_STREAMING,
+    NET_BACKOFF,            /* waiting to try connecting again */
+    NET_FAILED              /* the connection was lost; sends fail */
+} net_state_t;
+
+struct net_loop;
+
+/* one outgoing connection: a source request, then a stream of data */
+typedef struct net_conn {
+    struct net_loop *loop;
+    char *label;                /* host:port/mount, for messages */
+
+    /* only touched by the loop's thread */
+    struct addrinfo *addrs;
+    struct addrinfo *addr;      /* address being tried */
+    int fd;
+    double deadline;            /* of the connect, handshake, backoff or close */
+    double backoff;
+    char *request;
+    size_t request_len;
+    size_t request_sent;
+    char response[1024];
+    size_t response_len;
+    int sndbuf;
+    bool nodelay;
+    bool attached;              /* on the loop's list */
+    bool close_started;         /* closing seen; free once sent */
+    struct net_conn *next;      /* on the loop's list */
+    struct net_conn *ready_next; /* kicks being handled */
+
+    /* shared with the owner, under lock */
+    pthread_mutex_t lock;
+    net_state_t state;
+    unsigned char *queue;       /* data not yet taken by the socket */
+    size_t queue_sent;
+    size_t queue_used;
+    size_t queue_size;
+
+    /* shared with the owner, under the loop's lock */
+    bool kicked;                /* on the loop's kick list */
+    bool closing;               /* the owner has let go */
+    struct net_conn *kick_next;
+} net_conn_t;
+
+/* one thread and epoll set, driving its share of the connections */
+typedef struct net_loop {
+    pthread_t thread;
+    int epfd;
+    int evfd;                   /* wakes the loop for kicks and new connections */
+    net_conn_t *conns;          /* only touched by the loop's thread */
+    double next_deadline;
+
+    pthread_mutex_t lock;
+    net_conn_t *kicks;          /* connections with new data, new or closing */
+    bool running;
+} net_loop_t;
+
+typedef struct net_engine {
+    int n_loops;
+    net_loop_t *loops;
+    pthread_mutex_t lock;
+    int next;                   /* loop for the next connection */
+} net_engine_t;
+
+net_engine_t *net_engine_new(int n_threads);
+void net_engine_free(net_engine_t *e);
+
+net_conn_t *net_conn_new(net_engine_t *e, const char *host, int port,
+  const char *label, const char *request, size_t request_len, int sndbuf,
+  bool nodelay);
+int net_conn_send(net_conn_t *c, const unsigned char *data, size_t len);
+void net_conn_flush(net_conn_t *c);
+size_t net_conn_backlog(net_conn_t *c);
+void net_conn_close(net_conn_t *c);
+
+#endif // __net_engine_h_
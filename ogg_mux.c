@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "ogg_mux.h"
+
+/* CRC-32 as used by Ogg: polynomial 0x04c11db7, most significant bit first,
+ * no reflection, zero initial value and no final xor.  crc_table[k] advances
+ * a byte through k further zero bytes, so eight bytes are folded in per
+ * step (slice-by-8). */
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for(int i=0; i<256; i++) {
+        uint32_t r = (uint32_t)i << 24;
+        for(int j=0; j<8; j++) {
+            r = (r & 0x80000000) ? (r << 1) ^ 0x04c11db7 : r << 1;
+        }
+        crc_table[0][i] = r;
+    }
+    for(int k=1; k<8; k++) {
+        for(int i=0; i<256; i++) {
+            uint32_t r = crc_table[k-1][i];
+            crc_table[k][i] = (r << 8) ^ crc_table[0][r >> 24];
+        }
+    }
+}
+
+uint32_t ogg_crc32(uint32_t crc, const unsigned char *data, size_t len) {
+    pthread_once(&crc_once, crc_init);
+
+    while(len >= 8) {
+        crc ^= ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+            ((uint32_t)data[2] << 8) | data[3];
+        crc = crc_table[7][crc >> 24] ^ crc_table[6][(crc >> 16) & 0xff] ^
+            crc_table[5][(crc >> 8) & 0xff] ^ crc_table[4][crc & 0xff] ^
+            crc_table[3][data[4]] ^ crc_table[2][data[5]] ^
+            crc_table[1][data[6]] ^ crc_table[0][data[7]];
+        data += 8;
+        len -= 8;
+    }
+    while(len--) {
+        crc = (crc << 8) ^ crc_table[0][(crc >> 24) ^ *data++];
+    }
+
+    return crc;
+}
+
+static void put_le32(unsigned char *buf, uint32_t val) {
+    for(int i=0; i<4; i++) buf[i] = (val >> (8*i)) & 0xff;
+}
+
+/**
+ * Starts a logical stream whose pages are handed to write.
+ * @param page_size target body size; pages are finished at the first packet
+ *  boundary at or past it (or when they run out of lacing values)
+ */
+void ogg_mux_init(ogg_mux_t *m, uint32_t serialno, int page_size,
+  ogg_mux_write_fn write, void *arg) {
+    m->page = (unsigned char*)malloc(OGG_MUX_HEADER_MAX + OGG_MUX_BODY_MAX);
+    CHECK_MALLOC(m->page);
+    m->write = write;
+    m->arg = arg;
+    ogg_mux_set_page_size(m, page_size);
+    ogg_mux_reset(m, serialno);
+}
+
+/**
+ * Starts a new logical stream, discarding anything not yet written.
+ */
+void ogg_mux_reset(ogg_mux_t *m, uint32_t serialno) {
+    m->serialno = serialno;
+    m->pageno = 0;
+    m->n_segments = 0;
+    m->body_len = 0;
+    m->granulepos = -1;
+    m->bos = true;
+    m->continued = false;
+    m->eos = false;
+}
+
+void ogg_mux_set_page_size(ogg_mux_t *m, int page_size) {
+    if(page_size <= 0) page_size = OGG_MUX_PAGE_SIZE;
+    if(page_size > OGG_MUX_BODY_MAX) page_size = OGG_MUX_BODY_MAX;
+    m->page_size = page_size;
+}
+
+/**
+ * Finishes the current page, if it has any segments, and writes it out.
+ * @return 0 on success, or the error returned by the write function
+ */
+int ogg_mux_flush(ogg_mux_t *m) {
+    if(m->n_segments == 0) return 0;
+
+    int header_len = 27 + m->n_segments;
+    unsigned char *h = m->page + OGG_MUX_HEADER_MAX - header_len;
+    uint64_t granulepos = (uint64_t)m->granulepos;
+
+    memcpy(h, "OggS", 4);
+    h[4] = 0;
+    h[5] = (m->continued ? 0x01 : 0) | (m->bos ? 0x02 : 0) | (m->eos ? 0x04 : 0);
+    for(int i=0; i<8; i++) h[6+i] = (granulepos >> (8*i)) & 0xff;
+    put_le32(h + 14, m->serialno);
+    put_le32(h + 18, m->pageno);
+    put_le32(h + 22, 0);
+    h[26] = m->n_segments;
+    memcpy(h + 27, m->lacing, m->n_segments);
+    put_le32(h + 22, ogg_crc32(0, h, header_len + m->body_len));
+
+    int ret = m->write(m->arg, h, header_len + m->body_len);
+
+    m->pageno++;
+    m->n_segments = 0;
+    m->body_len = 0;
+    m->granulepos = -1;
+    m->bos = false;
+    m->continued = false;
+
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * Appends a packet to the stream.  The packet is copied straight into the
+ * page being built, and full pages are written out as they fill up.  The
+ * page holding the end of an eos packet is flushed immediately.
+ * @return 0 on success, or the error returned by the write function
+ */
+int ogg_mux_packet(ogg_mux_t *m, const unsigned char *data, int bytes,
+  int64_t granulepos, bool eos) {
+    /* a packet of n bytes takes n/255 + 1 lacing values, the last one < 255 */
+    int n_laces = bytes / 255 + 1;
+    bool started = false;
+    int ret;
+
+    while(n_laces > 0) {
+        if(m->n_segments == 255) {
+            if((ret = ogg_mux_flush(m)) < 0) return ret;
+            m->continued = started;
+        }
+        started = true;
+
+        int n = 255 - m->n_segments;
+        if(n > n_laces) n = n_laces;
+        int len = n == n_laces ? bytes : n * 255;
+
+        memset(m->lacing + m->n_segments, 255, n);
+        m->n_segments += n;
+        n_laces -= n;
+        if(n_laces == 0) m->lacing[m->n_segments - 1] = bytes % 255;
+
+        memcpy(m->page + OGG_MUX_HEADER_MAX + m->body_len, data, len);
+        m->body_len += len;
+        data += len;
+        bytes -= len;
+    }
+
+    m->granulepos = granulepos;
+    if(eos) {
+        m->eos = true;
+        return ogg_mux_flush(m);
+    }
+    if(m->body_len >= m->page_size) {
+        return ogg_mux_flush(m);
+    }
+    return 0;
+}
+
+void ogg_mux_clear(ogg_mux_t *m) {
+    free(m->page);
+    m->page = NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef __ogg_mux_h_
+#define __ogg_mux_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define OGG_MUX_PAGE_SIZE 4096      /* default target page body size */
+#define OGG_MUX_HEADER_MAX (27 + 255)
+#define OGG_MUX_BODY_MAX (255 * 255)
+
+/* called with each finished page, header and body in one contiguous block;
+ * returns a negative value on error */
+typedef int (*ogg_mux_write_fn)(void *arg, const unsigned char *page, size_t len);
+
+typedef struct {
+    uint32_t serialno;
+    uint32_t pageno;
+    int page_size;          /* a page is finished once its body reaches this */
+
+    ogg_mux_write_fn write;
+    void *arg;
+
+    /* page being built: the body starts at OGG_MUX_HEADER_MAX, and the
+     * header is filled in just in front of it once its length is known */
+    unsigned char *page;
+    unsigned char lacing[255];
+    int n_segments;
+    int body_len;
+    int64_t granulepos;     /* of the last packet finished on the page, or -1 */
+    bool bos;               /* first page of the stream not written yet */
+    bool continued;         /* page starts with the rest of a packet */
+    bool eos;
+} ogg_mux_t;
+
+uint32_t ogg_crc32(uint32_t crc, const unsigned char *data, size_t len);
+
+void ogg_mux_init(ogg_mux_t *m, uint32_t serialno, int page_size,
+  ogg_mux_write_fn write, void *arg);
+void ogg_mux_reset(ogg_mux_t *m, uint32_t serialno);
+void ogg_mux_set_page_size(ogg_mux_t *m, int page_size);
+int ogg_mux_packet(ogg_mux_t *m, const unsigned char *data, int bytes,
+  int64_t granulepos, bool eos);
+int ogg_mux_flush(ogg_mux_t *m);
+void ogg_mux_clear(ogg_mux_t *m);
+
+#endif // __ogg_mux_h_
@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "opus_index.h"
+
+/* Index file layout, all values little endian:
+ *   0  "OpIx"
+ *   4  version (u32)
+ *   8  serial number of the indexed stream (u32)
+ *  12  preskip (u32)
+ *  16  number of streams (u32)
+ *  20  number of entries (u32)
+ *  24  size of the indexed file (u64)
+ *  32  last granule position (i64)
+ *  40  wall clock start time in microseconds (i64)
+ *  48  entries: byte offset (u64), granule position (i64)
+ */
+#define OPUS_INDEX_MAGIC "OpIx"
+#define OPUS_INDEX_VERSION 1
+#define OPUS_INDEX_HEADER_SIZE 48
+#define OPUS_INDEX_ENTRY_SIZE 16
+
+static void put_le32(unsigned char *buf, uint32_t val) {
+    for(int i=0; i<4; i++) buf[i] = (val >> (8*i)) & 0xff;
+}
+
+static void put_le64(unsigned char *buf, uint64_t val) {
+    for(int i=0; i<8; i++) buf[i] = (val >> (8*i)) & 0xff;
+}
+
+static uint32_t get_le32(const unsigned char *buf) {
+    uint32_t val = 0;
+    for(int i=3; i>=0; i--) val = (val << 8) | buf[i];
+    return val;
+}
+
+static uint64_t get_le64(const unsigned char *buf) {
+    uint64_t val = 0;
+    for(int i=7; i>=0; i--) val = (val << 8) | buf[i];
+    return val;
+}
+
+/**
+ * Builds an index of the file open in r in a single pass over its pages.
+ * An entry is recorded at the first clean page boundary after every
+ * interval samples.  The read position of r is left at the end of the file.
+ */
+int opus_index_build(OpusIndex *idx, OpusReader *r, int64_t interval) {
+    int capacity = 1024;
+
+    memset(idx, 0, sizeof(OpusIndex));
+    idx->entries = (OpusIndexEntry*)malloc(capacity * sizeof(OpusIndexEntry));
+    CHECK_MALLOC(idx->entries);
+    idx->serialno = ogg_page_serialno(&r->og);
+    idx->preskip = r->header.preskip;
+    idx->nb_streams = r->header.nb_streams;
+    idx->file_size = r->file_size;
+
+    int64_t granulepos = r->base_granulepos;
+    int64_t last_indexed = 0;
+    ogg_page og;
+
+    if(opus_reader_seek(r, r->data_offset, granulepos) < 0) return -1;
+
+    while(opus_reader_page(r, &og)) {
+        if((uint32_t)ogg_page_serialno(&og) != idx->serialno) continue;
+
+        if(!ogg_page_continued(&og) &&
+                (idx->n_entries == 0 || granulepos - last_indexed >= interval)) {
+            if(idx->n_entries == capacity) {
+                capacity *= 2;
+                idx->entries = (OpusIndexEntry*)realloc(idx->entries,
+                    capacity * sizeof(OpusIndexEntry));
+                CHECK_MALLOC(idx->entries);
+            }
+            idx->entries[idx->n_entries].offset = r->page_offset;
+            idx->entries[idx->n_entries].granulepos = granulepos;
+            idx->n_entries++;
+            last_indexed = granulepos;
+        }
+
+        if(ogg_page_granulepos(&og) >= 0) {
+            granulepos = ogg_page_granulepos(&og);
+        }
+    }
+    idx->last_granulepos = granulepos;
+
+    /* Prefer the start time recorded by the writer; otherwise assume the
+     * file was last modified when its final sample was written. */
+    char value[64];
+    if(opus_reader_tag(r, "START_TIME", value, sizeof(value)) > 0) {
+        idx->start_time = (int64_t)(strtod(value, NULL) * 1e6);
+    } else {
+        struct stat st;
+        fstat(fileno(r->fp), &st);
+        idx->start_time = (int64_t)st.st_mtime * 1000000 -
+            (idx->last_granulepos - idx->preskip) * 1000000 / 48000;
+    }
+
+    return 0;
+}
+
+int opus_index_write(const OpusIndex *idx, const char *filename) {
+    FILE *fp = fopen(filename, "wb");
+    if(!fp) return -1;
+
+    unsigned char buf[OPUS_INDEX_HEADER_SIZE];
+    memcpy(buf, OPUS_INDEX_MAGIC, 4);
+    put_le32(buf + 4, OPUS_INDEX_VERSION);
+    put_le32(buf + 8, idx->serialno);
+    put_le32(buf + 12, idx->preskip);
+    put_le32(buf + 16, idx->nb_streams);
+    put_le32(buf + 20, idx->n_entries);
+    put_le64(buf + 24, idx->file_size);
+    put_le64(buf + 32, idx->last_granulepos);
+    put_le64(buf + 40, idx->start_time);
+    fwrite(buf, 1, OPUS_INDEX_HEADER_SIZE, fp);
+
+    for(int i=0; i<idx->n_entries; i++) {
+        put_le64(buf, idx->entries[i].offset);
+        put_le64(buf + 8, idx->entries[i].granulepos);
+        fwrite(buf, 1, OPUS_INDEX_ENTRY_SIZE, fp);
+    }
+
+    if(ferror(fp)) {
+        fclose(fp);
+        return -1;
+    }
+    return fclose(fp);
+}
+
+/**
+ * Loads an index written by opus_index_write.
+ * @return 0 on success, -1 if the file could not be read, -2 if it is not a
+ *  valid index
+ */
+int opus_index_read(OpusIndex *idx, const char *filename) {
+    memset(idx, 0, sizeof(OpusIndex));
+
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) return -1;
+
+    unsigned char header[OPUS_INDEX_HEADER_SIZE];
+    if(fread(header, 1, OPUS_INDEX_HEADER_SIZE, fp) != OPUS_INDEX_HEADER_SIZE ||
+            memcmp(header, OPUS_INDEX_MAGIC, 4) != 0 ||
+            get_le32(header + 4) != OPUS_INDEX_VERSION) {
+        fclose(fp);
+        return -2;
+    }
+
+    idx->serialno = get_le32(header + 8);
+    idx->preskip = get_le32(header + 12);
+    idx->nb_streams = get_le32(header + 16);
+    idx->n_entries = get_le32(header + 20);
+    idx->file_size = get_le64(header + 24);
+    idx->last_granulepos = get_le64(header + 32);
+    idx->start_time = get_le64(header + 40);
+
+    size_t size = (size_t)idx->n_entries * OPUS_INDEX_ENTRY_SIZE;
+    unsigned char *buf = (unsigned char*)malloc(size + 1);
+    CHECK_MALLOC(buf);
+    idx->entries = (OpusIndexEntry*)malloc((idx->n_entries + 1) * sizeof(OpusIndexEntry));
+    CHECK_MALLOC(idx->entries);
+
+    if(fread(buf, 1, size, fp) != size) {
+        free(buf);
+        opus_index_free(idx);
+        fclose(fp);
+        return -2;
+    }
+    fclose(fp);
+
+    for(int i=0; i<idx->n_entries; i++) {
+        idx->entries[i].offset = get_le64(buf + i * OPUS_INDEX_ENTRY_SIZE);
+        idx->entries[i].granulepos = get_le64(buf + i * OPUS_INDEX_ENTRY_SIZE + 8);
+    }
+    free(buf);
+
+    return 0;
+}
+
+/**
+ * Finds the last entry at or before the given granule position (or the
+ * first entry, if the position precedes all of them).
+ */
+const OpusIndexEntry *opus_index_find(const OpusIndex *idx, int64_t granulepos) {
+    if(idx->n_entries == 0) return NULL;
+
+    int lo = 0;
+    int hi = idx->n_entries - 1;
+    while(lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if(idx->entries[mid].granulepos <= granulepos) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return &idx->entries[lo];
+}
+
+void opus_index_free(OpusIndex *idx) {
+    free(idx->entries);
+    idx->entries = NULL;
+    idx->n_entries = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef __opus_index_h_
+#define __opus_index_h_
+
+#include <stdint.h>
+
+#include "opus_reader.h"
+
+#define OPUS_INDEX_INTERVAL 48000
+
+typedef struct {
+    int64_t offset;     /* byte offset of a page not starting with a continued
+                           packet */
+    int64_t granulepos; /* granule position at the start of the first packet
+                           on that page */
+} OpusIndexEntry;
+
+typedef struct {
+    uint32_t serialno;
+    int preskip;
+    int nb_streams;
+    int64_t file_size;  /* size of the indexed file, to detect stale indexes */
+    int64_t last_granulepos;
+    int64_t start_time; /* wall clock time of the first sample, microseconds
+                           since the epoch */
+    int n_entries;
+    OpusIndexEntry *entries;
+} OpusIndex;
+
+int opus_index_build(OpusIndex *idx, OpusReader *r, int64_t interval);
+int opus_index_write(const OpusIndex *idx, const char *filename);
+int opus_index_read(OpusIndex *idx, const char *filename);
+const OpusIndexEntry *opus_index_find(const OpusIndex *idx, int64_t granulepos);
+void opus_index_free(OpusIndex *idx);
+
+#endif // __opus_index_h_
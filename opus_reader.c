@@ -0,0 +1,287 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <opus/opus.h>
+
+#include "util.h"
+#include "opus_reader.h"
+
+#define READ_SIZE 65536
+
+#define readint(buf, base) ( (buf[base]) + (buf[base+1] << 8) + \
+                             (buf[base+2] << 16) + (buf[base+3] << 24) )
+
+static size_t opus_reader_fill(OpusReader *r) {
+    char *buf = ogg_sync_buffer(&r->oy, READ_SIZE);
+    size_t n = fread(buf, 1, READ_SIZE, r->fp);
+    ogg_sync_wrote(&r->oy, n);
+    return n;
+}
+
+/**
+ * Opens an Ogg Opus file and reads its ID and comment headers.
+ * @return 0 on success, -1 if the file could not be opened, -2 if it does not
+ *  start with a usable Opus stream
+ */
+int opus_reader_open(OpusReader *r, const char *filename) {
+    memset(r, 0, sizeof(OpusReader));
+
+    r->fp = fopen(filename, "rb");
+    if(!r->fp) return -1;
+
+    struct stat st;
+    if(fstat(fileno(r->fp), &st) == 0) {
+        r->file_size = st.st_size;
+    }
+
+    ogg_sync_init(&r->oy);
+
+    ogg_packet op;
+    int n_headers = 0;
+    bool stream_init = false;
+
+    while(n_headers < 2) {
+        if(!opus_reader_page(r, &r->og)) {
+            opus_reader_close(r);
+            return -2;
+        }
+
+        if(!stream_init) {
+            r->serialno = ogg_page_serialno(&r->og);
+            ogg_stream_init(&r->os, r->serialno);
+            stream_init = true;
+        }
+        if(ogg_stream_pagein(&r->os, &r->og) < 0) continue;
+
+        while(n_headers < 2 && ogg_stream_packetout(&r->os, &op) == 1) {
+            if(n_headers == 0) {
+                if(!opus_header_parse(op.packet, op.bytes, &r->header)) {
+                    opus_reader_close(r);
+                    return -2;
+                }
+            } else {
+                r->tags = (unsigned char*)malloc(op.bytes);
+                CHECK_MALLOC(r->tags);
+                memcpy(r->tags, op.packet, op.bytes);
+                r->tag_len = op.bytes;
+            }
+            n_headers++;
+        }
+    }
+
+    r->data_offset = r->sync_offset;
+    r->base_granulepos = ogg_page_granulepos(&r->og) > 0 ? ogg_page_granulepos(&r->og) : 0;
+    r->granulepos = r->base_granulepos;
+
+    return 0;
+}
+
+void opus_reader_close(OpusReader *r) {
+    if(r->fp) {
+        fclose(r->fp);
+        ogg_sync_clear(&r->oy);
+        ogg_stream_clear(&r->os);
+    }
+    free(r->tags);
+    r->fp = NULL;
+    r->tags = NULL;
+}
+
+/**
+ * Reads the next page of the file, recording its byte offset in page_offset.
+ * @return 1 if a page was read, 0 at the end of the file
+ */
+int opus_reader_page(OpusReader *r, ogg_page *og) {
+    for(;;) {
+        long ret = ogg_sync_pageseek(&r->oy, og);
+        if(ret > 0) {
+            r->page_offset = r->sync_offset;
+            r->sync_offset += ret;
+            return 1;
+        } else if(ret < 0) {
+            r->sync_offset -= ret;
+        } else if(opus_reader_fill(r) == 0) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * Reads the next audio packet.  granulepos is advanced by the duration of
+ * the packet, and corrected whenever a page gives an exact position.
+ * @return 1 if a packet was read, 0 at the end of the file
+ */
+int opus_reader_packet(OpusReader *r, ogg_packet *op) {
+    for(;;) {
+        int ret = ogg_stream_packetout(&r->os, op);
+        if(ret == 1) {
+            int n = opus_packet_get_nb_samples(op->packet, op->bytes, 48000);
+            r->packet_samples = n > 0 ? n : 0;
+            r->granulepos += r->packet_samples;
+            if(op->granulepos >= 0) {
+                r->granulepos = op->granulepos;
+            }
+            return 1;
+        }
+        /* a gap is reported once, then packets continue after it */
+        if(ret < 0) continue;
+
+        if(!opus_reader_page(r, &r->og)) return 0;
+        ogg_stream_pagein(&r->os, &r->og);
+    }
+}
+
+/**
+ * Continues reading at the page starting at offset.
+ * @param granulepos the position at the start of the first packet that
+ *  begins on that page (the granule position of the preceding page)
+ */
+int opus_reader_seek(OpusReader *r, int64_t offset, int64_t granulepos) {
+    if(fseeko(r->fp, offset, SEEK_SET) < 0) return -1;
+
+    ogg_sync_reset(&r->oy);
+    ogg_stream_reset(&r->os);
+    r->sync_offset = offset;
+    r->granulepos = granulepos;
+    r->packet_samples = 0;
+
+    return 0;
+}
+
+/**
+ * Finds the granule position of the first page at or after offset.
+ * @return the granule position, or -1 if there is none before the end
+ */
+static int64_t opus_reader_granulepos_at(OpusReader *r, int64_t offset) {
+    ogg_page og;
+
+    opus_reader_seek(r, offset, -1);
+    while(opus_reader_page(r, &og)) {
+        if(ogg_page_serialno(&og) == r->serialno && ogg_page_granulepos(&og) >= 0) {
+            return ogg_page_granulepos(&og);
+        }
+    }
+    return -1;
+}
+
+/**
+ * Positions the reader at the last clean page boundary (one not starting
+ * with a continued packet) where the next packet starts at or before the
+ * target granule position.  The file is bisected down to a small window,
+ * which is then scanned page by page.
+ */
+int opus_reader_seek_granule(OpusReader *r, int64_t target) {
+    int64_t base = r->base_granulepos;
+    int64_t lo = r->data_offset;
+    int64_t hi = r->file_size;
+
+    /* invariant: the first granule position found from lo is <= target */
+    while(hi - lo > 2 * READ_SIZE) {
+        int64_t mid = lo + (hi - lo) / 2;
+        int64_t granulepos = opus_reader_granulepos_at(r, mid);
+        if(granulepos < 0 || granulepos > target) {
+            hi = mid;
+        } else {
+            lo = mid;
+        }
+    }
+
+    /* the start of the data is always a clean boundary; elsewhere the
+     * position is only known once a page with a granule position is seen */
+    int64_t granulepos = lo == r->data_offset ? base : -1;
+    int64_t best_offset = r->data_offset;
+    int64_t best_granulepos = base;
+    ogg_page og;
+
+    opus_reader_seek(r, lo, -1);
+    while(opus_reader_page(r, &og)) {
+        if(ogg_page_serialno(&og) != r->serialno) continue;
+        if(granulepos > target) break;
+        if(granulepos >= 0 && !ogg_page_continued(&og)) {
+            best_offset = r->page_offset;
+            best_granulepos = granulepos;
+        }
+        if(ogg_page_granulepos(&og) >= 0) {
+            granulepos = ogg_page_granulepos(&og);
+        }
+    }
+
+    return opus_reader_seek(r, best_offset, best_granulepos);
+}
+
+/**
+ * Finds the granule position of the last page of the file by scanning
+ * backwards from the end.  The read position is left unchanged.
+ * @return the granule position, or -1 if there is none
+ */
+int64_t opus_reader_last_granulepos(OpusReader *r) {
+    ogg_sync_state oy;
+    ogg_page og;
+    int64_t granulepos = -1;
+    off_t pos = ftello(r->fp);
+
+    ogg_sync_init(&oy);
+    for(int64_t chunk = READ_SIZE; granulepos < 0; chunk *= 2) {
+        int64_t start = r->file_size > chunk ? r->file_size - chunk : 0;
+        fseeko(r->fp, start, SEEK_SET);
+        ogg_sync_reset(&oy);
+
+        for(;;) {
+            char *buf = ogg_sync_buffer(&oy, READ_SIZE);
+            size_t n = fread(buf, 1, READ_SIZE, r->fp);
+            if(n == 0) break;
+            ogg_sync_wrote(&oy, n);
+
+            long ret;
+            while((ret = ogg_sync_pageseek(&oy, &og)) != 0) {
+                if(ret > 0 && ogg_page_granulepos(&og) >= 0) {
+                    granulepos = ogg_page_granulepos(&og);
+                }
+            }
+        }
+
+        if(start == 0) break;
+    }
+    ogg_sync_clear(&oy);
+
+    fseeko(r->fp, pos, SEEK_SET);
+    return granulepos;
+}
+
+/**
+ * Looks up a KEY=value tag in the comment header (keys are case-insensitive).
+ * @return the length of the value copied into value, or -1 if not present
+ */
+int opus_reader_tag(OpusReader *r, const char *key, char *value, int len) {
+    const unsigned char *buf = r->tags;
+    int length = r->tag_len;
+    int key_length = strlen(key);
+
+    if(length < 16 || memcmp(buf, "OpusTags", 8) != 0) return -1;
+    int p = 8;
+    int vendor_length = readint(buf, p);
+    p += 4 + vendor_length;
+    if(vendor_length < 0 || p + 4 > length) return -1;
+    int ntags = readint(buf, p);
+    p += 4;
+
+    for(int i=0; i<ntags; i++) {
+        if(p + 4 > length) return -1;
+        int tag_length = readint(buf, p);
+        p += 4;
+        if(tag_length < 0 || p + tag_length > length) return -1;
+
+        if(tag_length > key_length && buf[p + key_length] == '=' &&
+                strncasecmp((const char*)buf + p, key, key_length) == 0) {
+            int n = tag_length - key_length - 1;
+            if(n > len - 1) n = len - 1;
+            memcpy(value, buf + p + key_length + 1, n);
+            value[n] = '\0';
+            return n;
+        }
+        p += tag_length;
+    }
+
+    return -1;
+}
@@ -0,0 +1,42 @@
+#ifndef __opus_reader_h_
+#define __opus_reader_h_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ogg/ogg.h>
+
+#include "opus_header.h"
+
+typedef struct {
+    FILE *fp;
+    ogg_sync_state oy;
+    ogg_stream_state os;
+    ogg_page og;
+
+    int serialno;
+    OpusHeader header;
+    unsigned char *tags;
+    int tag_len;
+
+    int64_t file_size;
+    int64_t data_offset;    /* byte offset of the first page after the headers */
+    int64_t base_granulepos; /* granule position at the end of the headers */
+    int64_t sync_offset;    /* byte offset of the next byte the sync layer sees */
+    int64_t page_offset;    /* byte offset of the last page read */
+    int64_t granulepos;     /* granule position at the end of the last packet */
+    int packet_samples;     /* duration of the last packet read */
+} OpusReader;
+
+int opus_reader_open(OpusReader *r, const char *filename);
+void opus_reader_close(OpusReader *r);
+
+int opus_reader_page(OpusReader *r, ogg_page *og);
+int opus_reader_packet(OpusReader *r, ogg_packet *op);
+int opus_reader_seek(OpusReader *r, int64_t offset, int64_t granulepos);
+int opus_reader_seek_granule(OpusReader *r, int64_t target);
+
+int64_t opus_reader_last_granulepos(OpusReader *r);
+int opus_reader_tag(OpusReader *r, const char *key, char *value, int len);
+
+#endif // __opus_reader_h_
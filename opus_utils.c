@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "opus_utils.h"
 
 int opus_parse_size(const unsigned char *data, opus_int32 len, opus_int16 *size)
@@ -207,5 +208,64 @@ int opus_multistream_packet_validate(const unsigned char *data,
    return samples;
 }
 
+/* Converts the self-delimited packet at the start of data (as found in all
+   but the last stream of a multistream packet) into a regular packet by
+   dropping the extra length of the last frame, which always sits just
+   before the frame data. Returns the length written to out, which must
+   have room for len bytes, and sets *packet_offset to the number of input
+   bytes the packet occupied. */
+opus_int32 opus_packet_undelimit(const unsigned char *data, opus_int32 len,
+      unsigned char *out, opus_int32 *packet_offset)
+{
+   int count;
+   int payload_offset;
+   int delim_bytes;
+   opus_int16 size[48];
 
+   count = opus_packet_parse_impl(data, len, 1, NULL, NULL, size,
+                                  &payload_offset, packet_offset);
+   if (count<0)
+      return count;
+   delim_bytes = size[count-1] < 252 ? 1 : 2;
+   memcpy(out, data, payload_offset-delim_bytes);
+   memcpy(out+payload_offset-delim_bytes, data+payload_offset,
+          *packet_offset-payload_offset);
+   return *packet_offset-delim_bytes;
+}
 
+static int opus_encode_size(int size, unsigned char *data)
+{
+   if (size < 252)
+   {
+      data[0] = size;
+      return 1;
+   } else {
+      data[0] = 252+(size&0x3);
+      data[1] = (size-(int)data[0])>>2;
+      return 2;
+   }
+}
+
+/* Converts a regular packet into the self-delimited form used by all but
+   the last stream of a multistream packet, by writing the length of the
+   last frame just before the frame data (the inverse of
+   opus_packet_undelimit). Returns the length written to out, which must
+   have room for len+2 bytes. */
+opus_int32 opus_packet_delimit(const unsigned char *data, opus_int32 len,
+      unsigned char *out)
+{
+   int count;
+   int payload_offset;
+   int delim_bytes;
+   opus_int16 size[48];
+
+   count = opus_packet_parse_impl(data, len, 0, NULL, NULL, size,
+                                  &payload_offset, NULL);
+   if (count<0)
+      return count;
+   memcpy(out, data, payload_offset);
+   delim_bytes = opus_encode_size(size[count-1], out+payload_offset);
+   memcpy(out+payload_offset+delim_bytes, data+payload_offset,
+          len-payload_offset);
+   return len+delim_bytes;
+}
@@ -10,6 +10,10 @@ int opus_packet_parse_impl(const unsigned char *data, opus_int32 len,
       int self_delimited, unsigned char *out_toc,
       const unsigned char *frames[48], opus_int16 size[48],
       int *payload_offset, opus_int32 *packet_offset);
+opus_int32 opus_packet_undelimit(const unsigned char *data, opus_int32 len,
+      unsigned char *out, opus_int32 *packet_offset);
+opus_int32 opus_packet_delimit(const unsigned char *data, opus_int32 len,
+      unsigned char *out);
 
 #endif // __opus_utils_h_
 
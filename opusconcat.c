@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ogg/ogg.h>
+
+#include "opus_header.h"
+#include "opus_reader.h"
+#include "file_writer.h"
+#include "ogg_mux.h"
+#include "util.h"
+
+/* a segment's pre-roll repeats at most this much of the previous segment:
+ * MIN_HIST plus the samples the previous segment did not play, plus the
+ * packet that took the history past MIN_HIST */
+#define CONCAT_TAIL_SAMPLES (MIN_HIST + 2 * MAX_PACKET_SAMPLES)
+
+typedef struct tail_packet {
+    struct tail_packet *next;
+    int bytes;
+    int samples;
+    unsigned char data[1];
+} tail_packet_t;
+
+/* the last packets written, to check each segment's pre-roll against */
+typedef struct {
+    tail_packet_t *head;
+    tail_packet_t *tail;
+    int samples;
+} tail_t;
+
+typedef struct {
+    ogg_mux_t mux;
+    unsigned char *pending;     /* last packet read, written once the next one is */
+    int pending_bytes;
+    int pending_size;
+    int64_t granulepos;         /* samples written, including the pending packet */
+    int64_t packets;
+} concat_output_t;
+
+void usage(char *exe) {
+    fprintf(stderr, "usage: %s [options] -o outfile.opus segment.opus...\n", exe);
+    fprintf(stderr, "    -o <file>       output file\n");
+    fprintf(stderr, "    -P <bytes>      target size of output pages (%d)\n",
+        OGG_MUX_PAGE_SIZE);
+}
+
+static int concat_page(void *arg, const unsigned char *data, size_t length) {
+    return fwrite(data, 1, length, (FILE*)arg) == length ? 0 : -1;
+}
+
+static void tail_push(tail_t *t, const unsigned char *data, int bytes, int samples) {
+    tail_packet_t *pkt = (tail_packet_t*)malloc(sizeof(tail_packet_t) + bytes);
+    CHECK_MALLOC(pkt);
+    pkt->next = NULL;
+    pkt->bytes = bytes;
+    pkt->samples = samples;
+    memcpy(pkt->data, data, bytes);
+
+    if(t->tail) {
+        t->tail->next = pkt;
+    } else {
+        t->head = pkt;
+    }
+    t->tail = pkt;
+    t->samples += samples;
+
+    while(t->samples - t->head->samples >= CONCAT_TAIL_SAMPLES) {
+        tail_packet_t *old = t->head;
+        t->head = old->next;
+        t->samples -= old->samples;
+        free(old);
+    }
+}
+
+static void tail_clear(tail_t *t) {
+    while(t->head) {
+        tail_packet_t *next = t->head->next;
+        free(t->head);
+        t->head = next;
+    }
+    t->tail = NULL;
+    t->samples = 0;
+}
+
+/**
+ * Finds the packet where the last `samples` samples of the tail start.
+ * @return the packet, or NULL if no packet boundary is that far from the end
+ */
+static tail_packet_t *tail_find(tail_t *t, int samples) {
+    int remaining = t->samples;
+    for(tail_packet_t *pkt = t->head; pkt; pkt = pkt->next) {
+        if(remaining == samples) return pkt;
+        remaining -= pkt->samples;
+    }
+    return NULL;
+}
+
+static void output_packet(concat_output_t *out, const unsigned char *data,
+  int bytes, int samples) {
+    if(out->pending_bytes >= 0) {
+        ogg_mux_packet(&out->mux, out->pending, out->pending_bytes,
+            out->granulepos, false);
+    }
+    if(out->pending_size < bytes) {
+        out->pending_size = bytes;
+        out->pending = (unsigned char*)realloc(out->pending, bytes);
+        CHECK_MALLOC(out->pending);
+    }
+    memcpy(out->pending, data, bytes);
+    out->pending_bytes = bytes;
+    out->granulepos += samples;
+    out->packets++;
+}
+
+static bool same_layout(const OpusHeader *a, const OpusHeader *b) {
+    if(a->channels != b->channels || a->channel_mapping != b->channel_mapping) {
+        return false;
+    }
+    if(a->channel_mapping == 0) return true;
+    return a->nb_streams == b->nb_streams && a->nb_coupled == b->nb_coupled &&
+        memcmp(a->stream_map, b->stream_map, a->channels) == 0;
+}
+
+int main(int argc, char **argv) {
+    const char *output = NULL;
+    int page_size = 0;
+    int status = 0;
+    int c;
+
+    while((c = getopt(argc, argv, "o:P:")) != -1) {
+        switch(c) {
+            case 'o':
+                output = optarg;
+                break;
+            case 'P':
+                page_size = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if(!output || optind >= argc) {
+        fprintf(stderr, "error: no %s specified\n", output ? "input files" : "output file");
+        usage(argv[0]);
+        return 2;
+    }
+
+    FILE *fp = fopen(output, "wb");
+    if(!fp) {
+        fprintf(stderr, "error: opening %s: ", output);
+        perror(NULL);
+        return 10;
+    }
+    setvbuf(fp, NULL, _IOFBF, 1 << 20);
+
+    concat_output_t out;
+    memset(&out, 0, sizeof(out));
+    out.pending_bytes = -1;
+    srand(time(NULL));
+    ogg_mux_init(&out.mux, rand(), page_size, concat_page, fp);
+
+    tail_t tail;
+    memset(&tail, 0, sizeof(tail));
+    OpusHeader first;
+    int64_t unused = 0;         /* samples of the last segment it did not play */
+
+    for(int i=optind; i<argc && status == 0; i++) {
+        const char *filename = argv[i];
+        OpusReader r;
+        ogg_packet op;
+
+        int ret = opus_reader_open(&r, filename);
+        if(ret == -1) {
+            fprintf(stderr, "error: opening %s: ", filename);
+            perror(NULL);
+            status = 10;
+            break;
+        } else if(ret < 0) {
+            fprintf(stderr, "error: %s: not a usable opus stream\n", filename);
+            status = 12;
+            break;
+        }
+
+        /* The first segment's headers are used for the output.  Each later
+         * segment starts with a pre-roll repeating the end of the previous
+         * one: pre-skip samples it played, and the samples it cut off. */
+        tail_packet_t *dup = NULL;
+        int64_t dup_samples = 0;
+        if(i == optind) {
+            memcpy(&first, &r.header, sizeof(OpusHeader));
+            unsigned char id_buf[300];
+            int id_size = opus_header_to_packet(&first, id_buf, sizeof(id_buf));
+            ogg_mux_packet(&out.mux, id_buf, id_size, 0, false);
+            ogg_mux_flush(&out.mux);
+            ogg_mux_packet(&out.mux, r.tags, r.tag_len, 0, false);
+            ogg_mux_flush(&out.mux);
+        } else if(!same_layout(&first, &r.header)) {
+            fprintf(stderr, "error: %s: channel layout differs from %s\n",
+                filename, argv[optind]);
+            status = 3;
+        } else {
+            dup_samples = r.header.preskip + unused;
+            dup = tail_find(&tail, dup_samples);
+            if(!dup && dup_samples > 0) {
+                fprintf(stderr, "error: %s: pre-roll does not line up with the"
+                    " end of %s; not consecutive segments?\n", filename, argv[i-1]);
+                status = 3;
+            }
+        }
+
+        int64_t samples = 0;
+        while(status == 0 && opus_reader_packet(&r, &op) == 1) {
+            int n = r.packet_samples;
+            samples += n;
+
+            if(dup_samples > 0) {
+                if(!dup || dup->bytes != op.bytes ||
+                  memcmp(dup->data, op.packet, op.bytes) != 0) {
+                    fprintf(stderr, "error: %s: pre-roll differs from the end of"
+                        " %s; not consecutive segments?\n", filename, argv[i-1]);
+                    status = 3;
+                    break;
+                }
+                dup_samples -= n;
+                dup = dup->next;
+                continue;
+            }
+
+            output_packet(&out, op.packet, op.bytes, n);
+            tail_push(&tail, op.packet, op.bytes, n);
+        }
+
+        /* the segment's end was trimmed by its final granule position */
+        unused = samples + r.base_granulepos - r.granulepos;
+        if(unused < 0) unused = 0;
+        opus_reader_close(&r);
+    }
+
+    if(out.pending_bytes >= 0) {
+        ogg_mux_packet(&out.mux, out.pending, out.pending_bytes,
+            out.granulepos - unused, true);
+    }
+    ogg_mux_flush(&out.mux);
+
+    if(ferror(fp) | fclose(fp)) {
+        fprintf(stderr, "error: writing %s\n", output);
+        if(!status) status = 13;
+    }
+
+    if(status == 0) {
+        printf("Joined %d segments: %lld packets, %0.02f s\n", argc - optind,
+            (long long)out.packets,
+            (out.granulepos - unused - first.preskip) / 48000.0);
+    }
+
+    tail_clear(&tail);
+    ogg_mux_clear(&out.mux);
+    free(out.pending);
+    return status;
+}
@@ -4,21 +4,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <ogg/ogg.h>
 
 #include "opus_header.h"
 #include "opus_utils.h"
+#include "opus_reader.h"
 #include "file_writer.h"
+#include "batch.h"
+#include "util.h"
 
 #define readint(buf, base) ( (buf[base]) + (buf[base+1] << 8) + \
                              (buf[base+2] << 16) + (buf[base+3] << 24) );
 
+typedef struct {
+    const char *output_dir;
+    int chunk_size;
+} segment_options_t;
+
 void usage(char *exe) {
-    fprintf(stderr, "usage: %s [options] infile.opus\n", exe);
+    fprintf(stderr, "usage: %s [options] infile.opus|directory...\n", exe);
     fprintf(stderr, "\t--file <string>\t Specify the input file.\n");
     fprintf(stderr, "\t--out <string>\t Specify the destination filename (default: input filename).\n");
     fprintf(stderr, "\t--chuck-size <int>\t Specify the chuck size in seconds (default: 3600).\n");
+    fprintf(stderr, "\t--jobs <int>\t Number of chunks to write in parallel (default: 1).\n");
+    fprintf(stderr, "\t--list <string>\t Also process the files listed in this file (- for stdin).\n");
+    fprintf(stderr, "\t--workers <int>\t Number of files to process at once (default: number of CPUs).\n");
+    fprintf(stderr, "\t--per-device <int>\t Files to read at once from one device (default: %d).\n",
+        BATCH_PER_DEVICE);
+    fprintf(stderr, "\tIn batch mode, --out names the output directory.\n");
 }
 
 /**
@@ -62,49 +78,159 @@ char **decode_comment_header(char *buf, int length) {
     return comments;
 }
 
+typedef struct {
+    const char *filename_input;
+    const char *filename_output;
+    int64_t max_length;
 
-int main(int argc, char **argv) {
-    int status = 0;
-    char *filename_output     = NULL;
-    char *filename_input      = NULL;
-    int  chuck_size           = 3600;
-    int c;
-    int digit_optind = 0;
+    pthread_mutex_t lock;
+    int next_chunk;     /* next chunk to hand out to a worker */
+    int n_chunks;       /* number of chunks, once the end has been found */
+    int status;
+} segment_job;
 
-    while (1) {
-      int this_option_optind = optind ? optind : 1;
-      int option_index = 0;
-      static struct option long_options[] = {
-          {"out",         optional_argument, NULL,  0 },
-          {"file",        required_argument, NULL,  1 },
-          {"chunck-size", optional_argument, NULL,  2 },
-          {0,             0,                 0,     0 }
-        };
-      c = getopt_long(argc, argv, "o:f:",long_options, &option_index);
-      if (c == -1) break;
+/**
+ * Writes a single chunk, exactly as a sequential run would have written it.
+ * The reader is positioned a little before the start of the chunk, and the
+ * packets leading up to it are replayed into the writer's history so that
+ * the pre-roll and preskip come out the same.
+ * @return 1 if the chunk contained any packets, 0 if it is past the end of
+ *  the input, or -1 if its file could not be opened
+ */
+static int segment_chunk(segment_job *job, OpusReader *r, int chunk) {
+    /* chunk boundary, counted in samples from the start of the stream */
+    int64_t boundary = r->header.preskip + chunk * job->max_length;
+    bool straddled = chunk == 0;
+    int written = 0;
+
+    OpusFileWriter fw;
+    file_writer_init(&fw, job->filename_output, &r->header, (char*)r->tags,
+        r->tag_len);
+    file_writer_set_max_length(&fw, job->max_length);
+    file_writer_set_filecount(&fw, chunk);
+
+    if(chunk == 0) {
+        opus_reader_seek(r, r->data_offset, r->base_granulepos);
+    } else {
+        opus_reader_seek_granule(r, r->base_granulepos + boundary - MIN_HIST -
+            2 * MAX_PACKET_SAMPLES);
+    }
 
-      switch (c) {
-        case 0: filename_output = optarg;           break;
-        case 1: filename_input  = optarg;           break;
-        case 2: chuck_size      = atoi(optarg);     break;
-        default: usage(argv[0]);
+    int64_t pos = r->granulepos - r->base_granulepos;
+    ogg_packet op;
+
+    while(opus_reader_packet(r, &op)) {
+        pos += opus_packet_get_samples_per_frame(op.packet, 48000);
+
+        if(!straddled) {
+            /* the packet crossing the boundary ends the previous chunk; the
+             * part of it past the boundary is played by this one */
+            if(pos >= boundary) {
+                file_writer_prime(&fw, &op, pos - boundary);
+                straddled = true;
+            } else {
+                file_writer_prime(&fw, &op, 0);
+            }
+            continue;
         }
+
+        if(file_writer_input(&fw, &op) < 0) {
+            written = -1;
+            break;
+        }
+        written = 1;
+        if(!file_writer_is_open(&fw)) break;
     }
+    file_writer_free(&fw);
 
-    if (filename_input == NULL){
-      usage(argv[0]);
-      return -1;
+    return written;
+}
+
+static void *segment_worker(void *arg) {
+    segment_job *job = (segment_job*)arg;
+    OpusReader r;
+
+    if(opus_reader_open(&r, job->filename_input) < 0) {
+        pthread_mutex_lock(&job->lock);
+        job->status = 10;
+        pthread_mutex_unlock(&job->lock);
+        return NULL;
     }
 
-    if (filename_output == NULL) filename_output = filename_input;
+    for(;;) {
+        pthread_mutex_lock(&job->lock);
+        int chunk = job->next_chunk++;
+        bool done = chunk >= job->n_chunks;
+        pthread_mutex_unlock(&job->lock);
+        if(done) break;
+
+        int written = segment_chunk(job, &r, chunk);
+        if(written > 0) {
+            printf("Wrote chunk %d\n", chunk);
+        } else {
+            /* no chunk past this one is written either way */
+            pthread_mutex_lock(&job->lock);
+            if(chunk < job->n_chunks) job->n_chunks = chunk;
+            if(written < 0) job->status = 13;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
 
-    printf("Input : %s\n",      filename_input);
-    printf("Output : %s\n",     filename_output);
-    printf("Chuck size : %d\n", chuck_size);
+    opus_reader_close(&r);
+    return NULL;
+}
+
+/**
+ * Splits the input into chunks using a pool of worker threads, each with its
+ * own reader.  Chunks are handed out in order until one turns out to be past
+ * the end of the input.
+ */
+int segment_parallel(const char *filename_input, const char *filename_output,
+  int chunk_size, int jobs) {
+    OpusReader r;
+    segment_job job;
+
+    if(opus_reader_open(&r, filename_input) < 0) {
+        fprintf(stderr, "error: %s is not a usable opus stream\n", filename_input);
+        return 10;
+    }
+
+    job.filename_input = filename_input;
+    job.filename_output = filename_output;
+    job.max_length = (int64_t)r.header.input_sample_rate * chunk_size;
+    pthread_mutex_init(&job.lock, NULL);
+    job.next_chunk = 0;
+    job.n_chunks = INT_MAX;
+    job.status = 0;
+    opus_reader_close(&r);
+
+    pthread_t *threads = (pthread_t*)malloc(jobs * sizeof(pthread_t));
+    for(int i=0; i<jobs; i++) {
+        pthread_create(&threads[i], NULL, segment_worker, &job);
+    }
+    for(int i=0; i<jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    printf("Wrote %d chunks\n", job.n_chunks);
+    pthread_mutex_destroy(&job.lock);
+    return job.status;
+}
+
+/**
+ * Cuts one file into chunks of chunk_size seconds named
+ * <filename_output>-<n>.opus.
+ * @return 0 on success, or an exit status
+ */
+int segment_file(const char *filename_input, const char *filename_output,
+  int chunk_size, bool verbose, batch_item_t *item) {
+    int status = 0;
 
     FILE *fp = fopen(filename_input, "rb");
     if(!fp) {
-        perror("error: opening file:");
+        fprintf(stderr, "error: opening %s: ", filename_input);
+        perror(NULL);
         return 10;
     }
 
@@ -120,14 +246,15 @@ int main(int argc, char **argv) {
     ogg_sync_init(&oy);
     bool stream_init = false;
 
-    printf("Reading file: %s\n", filename_input);
+    if(verbose) printf("Reading file: %s\n", filename_input);
 
     bool have_headers = false;
 
 
     while(!have_headers) {
         if(feof(fp)) {
-            fprintf(stderr, "error: end of file reached before header found\n");
+            fprintf(stderr, "error: %s: end of file reached before header found\n",
+                filename_input);
             status = 11;
             goto cleanup;
         }
@@ -152,8 +279,6 @@ int main(int argc, char **argv) {
                 continue;
             }
 
-            printf("page\n");
-
             while((err = ogg_stream_packetout(&os, &op)) && !have_headers) {
                 if(err == -1) {
                     fprintf(stderr, "warning: gap in stream\n");
@@ -163,7 +288,9 @@ int main(int argc, char **argv) {
                 if(!header) {
                     header = (OpusHeader*)malloc(sizeof(OpusHeader));
                     if(!opus_header_parse(op.packet, op.bytes, header)) {
-                        fprintf(stderr, "error: not a usable opus stream\n");
+                        fprintf(stderr, "error: %s: not a usable opus stream\n",
+                            filename_input);
+                        status = 12;
                         goto cleanup;
                     }
 
@@ -184,51 +311,58 @@ int main(int argc, char **argv) {
         }
     }
 
-    printf("Opus header:\n");
-    printf("  number of channels:   %d\n", header->channels);
-    printf("             preskip:   %d samples\n", header->preskip);
-    printf("         sample rate:   %d Hz\n", header->input_sample_rate);
-    printf("                gain:   %0.02f dB\n", header->gain / 256.0f);
-    printf("     channel mapping:   %d\n", header->channel_mapping);
-    printf("   number of streams:   %d streams\n", header->nb_streams);
-    printf("   number of coupled:   %d streams\n", header->nb_coupled);
-    printf("\n");
-    printf("Comments:\n");
-    char **comments = decode_comment_header(comment_header, comment_length);
-    if(comments) {
-        for(int i=0; comments[i] != NULL; i++) {
-            printf("  %s\n", comments[i]);
+    if(verbose) {
+        printf("Opus header:\n");
+        printf("  number of channels:   %d\n", header->channels);
+        printf("             preskip:   %d samples\n", header->preskip);
+        printf("         sample rate:   %d Hz\n", header->input_sample_rate);
+        printf("                gain:   %0.02f dB\n", header->gain / 256.0f);
+        printf("     channel mapping:   %d\n", header->channel_mapping);
+        printf("   number of streams:   %d streams\n", header->nb_streams);
+        printf("   number of coupled:   %d streams\n", header->nb_coupled);
+        printf("\n");
+        printf("Comments:\n");
+        char **comments = decode_comment_header(comment_header, comment_length);
+        if(comments) {
+            for(int i=0; comments[i] != NULL; i++) {
+                printf("  %s\n", comments[i]);
+            }
+        } else {
+            printf("  failed to decode comment header\n");
         }
-    } else {
-        printf("  failed to decode comment header\n");
     }
 
-    printf("Creating file writer for %s\n", filename_output);
+    if(verbose) printf("Creating file writer for %s\n", filename_output);
     OpusFileWriter* file_writers = (OpusFileWriter*)malloc(sizeof(OpusFileWriter));
     file_writer_init(file_writers, filename_output, header, comment_header, comment_length);
-    file_writer_set_max_length(file_writers, header->input_sample_rate * chuck_size);
+    file_writer_set_max_length(file_writers, header->input_sample_rate * chunk_size);
 
     int64_t granulepos = 0;
 
     for(;;) {
         if(feof(fp)) {
-            printf("end of file reached\n");
+            if(verbose) printf("end of file reached\n");
             break;
         }
 
         while(ogg_sync_pageout(&oy, &og) == 1) {
             int err = ogg_stream_pagein(&os, &og);
             if(err) {
-                printf( "error: ogg stream error\n");
+                fprintf(stderr, "error: %s: ogg stream error\n", filename_input);
                 continue;
             }
 
             while(err = ogg_stream_packetout(&os, &op)) {
                 if(err == -1) {
-                    printf( "warning: gap in stream\n");
+                    fprintf(stderr, "warning: %s: gap in stream\n", filename_input);
                     continue;
                 }
-                file_writer_input(file_writers, &op);
+                if(file_writer_input(file_writers, &op) < 0) {
+                    file_writer_free(file_writers);
+                    free(file_writers);
+                    status = 13;
+                    goto cleanup;
+                }
                 file_writer_update_granulepos(file_writers, op.granulepos);
                 if(op.granulepos > 0) {
                     granulepos = op.granulepos;
@@ -244,14 +378,121 @@ int main(int argc, char **argv) {
         }
     }
 
-    printf("Closing file writers\n");
-    file_writer_close(file_writers);
-
+    if(verbose) printf("Closing file writers\n");
+    file_writer_free(file_writers);
+    free(file_writers);
 
+    item->streams = header->nb_streams;
+    item->bytes = ftello(fp);
+    if(granulepos > header->preskip) {
+        item->duration = (granulepos - header->preskip) / 48000.0;
+    }
 
   cleanup:
     if(fp) fclose(fp);
     if(header) free(header);
-    //ogg_sync_destroy(&oy);
+    free(comment_header);
+    if(stream_init) ogg_stream_clear(&os);
+    ogg_sync_clear(&oy);
     return status;
 }
+
+static int segment_batch_item(batch_item_t *item, void *arg) {
+    const segment_options_t *opt = (const segment_options_t*)arg;
+    char output[4096];
+
+    const char *name = item->filename;
+    if(opt->output_dir) {
+        const char *slash = strrchr(name, '/');
+        if(slash) name = slash + 1;
+        snprintf(output, sizeof(output), "%s/%s", opt->output_dir, name);
+    } else {
+        snprintf(output, sizeof(output), "%s", name);
+    }
+    int n = strlen(output);
+    if(n > 5 && strcmp(".opus", output + n - 5) == 0) {
+        output[n - 5] = '\0';
+    }
+
+    return segment_file(item->filename, output, opt->chunk_size, false, item);
+}
+
+int main(int argc, char **argv) {
+    int status = 0;
+    char *filename_output     = NULL;
+    char *filename_input      = NULL;
+    int  chuck_size           = 3600;
+    int  jobs                 = 1;
+    char *listfile            = NULL;
+    int  workers              = sysconf(_SC_NPROCESSORS_ONLN);
+    int  per_device           = BATCH_PER_DEVICE;
+    int c;
+    int digit_optind = 0;
+
+    while (1) {
+      int this_option_optind = optind ? optind : 1;
+      int option_index = 0;
+      static struct option long_options[] = {
+          {"out",         optional_argument, NULL,  0 },
+          {"file",        required_argument, NULL,  1 },
+          {"chunck-size", optional_argument, NULL,  2 },
+          {"jobs",        required_argument, NULL,  3 },
+          {"list",        required_argument, NULL,  4 },
+          {"workers",     required_argument, NULL,  5 },
+          {"per-device",  required_argument, NULL,  6 },
+          {0,             0,                 0,     0 }
+        };
+      c = getopt_long(argc, argv, "o:f:",long_options, &option_index);
+      if (c == -1) break;
+
+      switch (c) {
+        case 0: filename_output = optarg;           break;
+        case 1: filename_input  = optarg;           break;
+        case 2: chuck_size      = atoi(optarg);     break;
+        case 3: jobs            = atoi(optarg);     break;
+        case 4: listfile        = optarg;           break;
+        case 5: workers         = atoi(optarg);     break;
+        case 6: per_device      = atoi(optarg);     break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if (filename_input == NULL && (optind < argc || listfile)) {
+      segment_options_t opt;
+      opt.output_dir = filename_output;
+      opt.chunk_size = chuck_size;
+
+      batch_t b;
+      batch_init(&b);
+      for (int i=optind; i<argc; i++) {
+        if (batch_add(&b, argv[i]) < 0) status = 10;
+      }
+      if (listfile && batch_add_list(&b, listfile) < 0) status = 10;
+
+      if (batch_run(&b, segment_batch_item, &opt, workers, per_device) > 0) {
+        status = 1;
+      }
+      batch_free(&b);
+      return status;
+    }
+
+    if (filename_input == NULL){
+      usage(argv[0]);
+      return -1;
+    }
+
+    if (filename_output == NULL) filename_output = filename_input;
+
+    printf("Input : %s\n",      filename_input);
+    printf("Output : %s\n",     filename_output);
+    printf("Chuck size : %d\n", chuck_size);
+
+    if (jobs > 1) {
+        return segment_parallel(filename_input, filename_output, chuck_size, jobs);
+    }
+
+    batch_item_t item;
+    memset(&item, 0, sizeof(item));
+    return segment_file(filename_input, filename_output, chuck_size, true, &item);
+}
+
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ogg/ogg.h>
+
+#include "opus_header.h"
+#include "opus_reader.h"
+#include "opus_index.h"
+#include "file_writer.h"
+
+void usage(char *exe) {
+    fprintf(stderr, "usage: %s [options] infile.opus...\n", exe);
+    fprintf(stderr, "    -i <seconds>    spacing of index entries (%d)\n",
+        OPUS_INDEX_INTERVAL / 48000);
+    fprintf(stderr, "    -x              extract a time range instead of indexing\n");
+    fprintf(stderr, "    -s <seconds>    start of the range, from the start of the file\n");
+    fprintf(stderr, "    -t <time>       start of the range, as a unix time\n");
+    fprintf(stderr, "    -d <seconds>    duration of the range\n");
+    fprintf(stderr, "    -o <name>       output file name\n");
+}
+
+/**
+ * Loads the sidecar index of a file, building (and saving) it if it is
+ * missing or was made for a different version of the file.
+ */
+int load_index(OpusIndex *idx, OpusReader *r, const char *filename,
+  int64_t interval, bool force) {
+    char idxname[4096];
+    snprintf(idxname, sizeof(idxname), "%s.idx", filename);
+
+    if(!force && opus_index_read(idx, idxname) == 0) {
+        if(idx->file_size == r->file_size) return 0;
+        opus_index_free(idx);
+    }
+
+    if(opus_index_build(idx, r, interval) < 0) {
+        return -1;
+    }
+    if(opus_index_write(idx, idxname) < 0) {
+        perror("warning: writing index");
+    }
+    return 0;
+}
+
+int index_file(const char *filename, int64_t interval) {
+    OpusReader r;
+    OpusIndex idx;
+
+    int ret = opus_reader_open(&r, filename);
+    if(ret < 0) {
+        fprintf(stderr, "error: %s: %s\n", filename,
+            ret == -1 ? "cannot open file" : "not a usable opus stream");
+        return 10;
+    }
+
+    if(load_index(&idx, &r, filename, interval, true) < 0) {
+        fprintf(stderr, "error: %s: cannot index file\n", filename);
+        opus_reader_close(&r);
+        return 11;
+    }
+
+    time_t start = idx.start_time / 1000000;
+    char timebuf[64];
+    strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", localtime(&start));
+    printf("%s: %d entries, %0.02f s, starting %s\n", filename, idx.n_entries,
+        (idx.last_granulepos - idx.preskip) / 48000.0, timebuf);
+
+    opus_index_free(&idx);
+    opus_reader_close(&r);
+    return 0;
+}
+
+int extract(const char *filename, const char *outname, double start,
+  bool absolute, double duration, int64_t interval) {
+    OpusReader r;
+    OpusIndex idx;
+    int status = 0;
+
+    int ret = opus_reader_open(&r, filename);
+    if(ret < 0) {
+        fprintf(stderr, "error: %s: %s\n", filename,
+            ret == -1 ? "cannot open file" : "not a usable opus stream");
+        return 10;
+    }
+
+    if(load_index(&idx, &r, filename, interval, false) < 0) {
+        fprintf(stderr, "error: %s: cannot index file\n", filename);
+        opus_reader_close(&r);
+        return 11;
+    }
+
+    int64_t start_sample;
+    if(absolute) {
+        start_sample = (int64_t)((start * 1e6 - idx.start_time) * 48000 / 1e6);
+    } else {
+        start_sample = (int64_t)(start * 48000);
+    }
+    int64_t start_granule = start_sample + r.header.preskip;
+
+    if(start_sample < 0 || start_granule >= idx.last_granulepos) {
+        fprintf(stderr, "error: range is outside of %s\n", filename);
+        status = 12;
+        goto cleanup;
+    }
+
+    /* Start far enough back to rebuild the same pre-roll history that
+     * file_writer keeps when it starts a new file */
+    const OpusIndexEntry *entry = opus_index_find(&idx,
+        start_granule - MIN_HIST - 2 * MAX_PACKET_SAMPLES);
+    if(!entry || opus_reader_seek(&r, entry->offset, entry->granulepos) < 0) {
+        perror("error: seeking");
+        status = 13;
+        goto cleanup;
+    }
+
+    OpusFileWriter fw;
+    file_writer_init(&fw, outname, &r.header, (char*)r.tags, r.tag_len);
+    file_writer_set_max_length(&fw, (int64_t)(duration * 48000));
+    file_writer_set_single(&fw, true);
+
+    ogg_packet op;
+    while(opus_reader_packet(&r, &op)) {
+        int64_t packet_start = r.granulepos - r.packet_samples;
+
+        if(r.granulepos <= start_granule) {
+            file_writer_prime(&fw, &op, 0);
+        } else if(packet_start < start_granule) {
+            file_writer_prime(&fw, &op, r.granulepos - start_granule);
+        } else {
+            if(file_writer_input(&fw, &op) < 0) {
+                status = 14;
+                break;
+            }
+            if(!file_writer_is_open(&fw)) break;
+        }
+    }
+    file_writer_free(&fw);
+    if(status) goto cleanup;
+
+    printf("%s: extracted %0.03f s from %0.03f s into %s.opus\n", filename,
+        duration, start_sample / 48000.0, outname);
+
+  cleanup:
+    opus_index_free(&idx);
+    opus_reader_close(&r);
+    return status;
+}
+
+int main(int argc, char **argv) {
+    int status = 0;
+    int64_t interval = OPUS_INDEX_INTERVAL;
+    bool extract_mode = false;
+    bool absolute = false;
+    double start = 0;
+    double duration = -1;
+    const char *outname = NULL;
+    int c;
+
+    while((c = getopt(argc, argv, "i:xs:t:d:o:")) != -1) {
+        switch(c) {
+            case 'i':
+                interval = (int64_t)(atof(optarg) * 48000);
+                break;
+            case 'x':
+                extract_mode = true;
+                break;
+            case 's':
+                start = atof(optarg);
+                absolute = false;
+                break;
+            case 't':
+                start = atof(optarg);
+                absolute = true;
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'o':
+                outname = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if(optind >= argc) {
+        fprintf(stderr, "error: no input file specified\n");
+        usage(argv[0]);
+        return 2;
+    }
+
+    if(!extract_mode) {
+        for(int i=optind; i<argc; i++) {
+            int ret = index_file(argv[i], interval);
+            if(ret) status = ret;
+        }
+        return status;
+    }
+
+    if(duration <= 0) {
+        fprintf(stderr, "error: no duration specified\n");
+        usage(argv[0]);
+        return 2;
+    }
+
+    char *filename = argv[optind];
+
+    char basename[4096];
+    strncpy(basename, outname ? outname : filename, sizeof(basename)-1);
+    basename[sizeof(basename)-1] = '\0';
+    if(strlen(basename) > 5 && strcmp(".opus", basename + (strlen(basename) - 5)) == 0) {
+        basename[strlen(basename) - 5] = '\0';
+    }
+    if(!outname) {
+        int n = strlen(basename);
+        snprintf(basename + n, sizeof(basename) - n, "-%lld", (long long)start);
+    }
+
+    return extract(filename, basename, start, absolute, duration, interval);
+}
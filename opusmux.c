@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ogg/ogg.h>
+
+#include "opus_header.h"
+#include "opus_utils.h"
+#include "opus_reader.h"
+#include "ogg_mux.h"
+#include "util.h"
+
+typedef struct {
+    const char *filename;
+    OpusReader r;
+    ogg_packet op;
+    int stream;             /* index of the input's stream in the output */
+} mux_input_t;
+
+void usage(char *exe) {
+    fprintf(stderr, "usage: %s [options] -o outfile.opus infile.opus...\n", exe);
+    fprintf(stderr, "    -o <file>       output file\n");
+    fprintf(stderr, "    -P <bytes>      target size of output pages (%d)\n",
+        OGG_MUX_PAGE_SIZE);
+}
+
+static int mux_page(void *arg, const unsigned char *data, size_t length) {
+    return fwrite(data, 1, length, (FILE*)arg) == length ? 0 : -1;
+}
+
+/**
+ * Builds the ID header for a multistream file carrying the inputs, one
+ * stream each.  Stereo inputs become coupled streams, which have to come
+ * first, but the channel map keeps the channels in the order the inputs
+ * were given.
+ * @return 0 on success, -1 if the inputs cannot be combined
+ */
+static int mux_header(mux_input_t *in, int n_inputs, OpusHeader *out) {
+    const OpusHeader *first = &in[0].r.header;
+    int nb_coupled = 0;
+
+    memset(out, 0, sizeof(OpusHeader));
+    out->version = 1;
+    out->preskip = first->preskip;
+    out->input_sample_rate = first->input_sample_rate;
+    out->gain = first->gain;
+    out->channel_mapping = 255;
+
+    for(int i=0; i<n_inputs; i++) {
+        const OpusHeader *h = &in[i].r.header;
+        if(h->nb_streams != 1 || h->channels > 2) {
+            fprintf(stderr, "error: %s: not a mono or stereo file\n", in[i].filename);
+            return -1;
+        }
+        /* a multistream header has one pre-skip and gain for all streams */
+        if(h->preskip != first->preskip || h->gain != first->gain) {
+            fprintf(stderr, "error: %s: pre-skip or gain differs from %s\n",
+                in[i].filename, in[0].filename);
+            return -1;
+        }
+        if(h->channels == 2) nb_coupled++;
+        out->channels += h->channels;
+    }
+    if(out->channels > 255) {
+        fprintf(stderr, "error: too many channels (%d)\n", out->channels);
+        return -1;
+    }
+
+    int coupled = 0;
+    int mono = nb_coupled;
+    int c = 0;
+    for(int i=0; i<n_inputs; i++) {
+        if(in[i].r.header.channels == 2) {
+            in[i].stream = coupled;
+            out->stream_map[c++] = 2 * coupled;
+            out->stream_map[c++] = 2 * coupled + 1;
+            coupled++;
+        } else {
+            in[i].stream = mono;
+            out->stream_map[c++] = nb_coupled + mono;
+            mono++;
+        }
+    }
+    out->nb_streams = n_inputs;
+    out->nb_coupled = nb_coupled;
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *output = NULL;
+    int page_size = 0;
+    int status = 0;
+    int c;
+
+    while((c = getopt(argc, argv, "o:P:")) != -1) {
+        switch(c) {
+            case 'o':
+                output = optarg;
+                break;
+            case 'P':
+                page_size = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    int n_inputs = argc - optind;
+    if(!output || n_inputs < 1) {
+        fprintf(stderr, "error: no %s specified\n", output ? "input files" : "output file");
+        usage(argv[0]);
+        return 2;
+    }
+    if(n_inputs > 255) {
+        fprintf(stderr, "error: too many input files (%d)\n", n_inputs);
+        return 2;
+    }
+
+    mux_input_t *in = (mux_input_t*)calloc(n_inputs, sizeof(mux_input_t));
+    CHECK_MALLOC(in);
+    int n_open = 0;
+    for(int i=0; i<n_inputs; i++, n_open++) {
+        in[i].filename = argv[optind + i];
+        int ret = opus_reader_open(&in[i].r, in[i].filename);
+        if(ret == -1) {
+            fprintf(stderr, "error: opening %s: ", in[i].filename);
+            perror(NULL);
+            status = 10;
+            break;
+        } else if(ret < 0) {
+            fprintf(stderr, "error: %s: not a usable opus stream\n", in[i].filename);
+            status = 12;
+            break;
+        }
+    }
+
+    OpusHeader header;
+    FILE *fp = NULL;
+    ogg_mux_t mux;
+    bool mux_init = false;
+    mux_input_t **order = NULL;
+    unsigned char *packet[2] = {NULL, NULL};
+    int packet_size = 0;
+
+    if(status || mux_header(in, n_inputs, &header) < 0) {
+        if(!status) status = 2;
+        goto cleanup;
+    }
+
+    order = (mux_input_t**)malloc(n_inputs * sizeof(mux_input_t*));
+    CHECK_MALLOC(order);
+    for(int i=0; i<n_inputs; i++) order[in[i].stream] = &in[i];
+
+    fp = fopen(output, "wb");
+    if(!fp) {
+        fprintf(stderr, "error: opening %s: ", output);
+        perror(NULL);
+        status = 10;
+        goto cleanup;
+    }
+
+    srand(time(NULL));
+    ogg_mux_init(&mux, rand(), page_size, mux_page, fp);
+    mux_init = true;
+
+    unsigned char id_buf[300];
+    int id_size = opus_header_to_packet(&header, id_buf, sizeof(id_buf));
+    ogg_mux_packet(&mux, id_buf, id_size, 0, false);
+    ogg_mux_flush(&mux);
+    ogg_mux_packet(&mux, in[0].r.tags, in[0].r.tag_len, 0, false);
+    ogg_mux_flush(&mux);
+
+    /* Each packet is written once the next one has been read, so the last
+     * one can be marked as the end of the stream. */
+    int64_t packetno = 0;
+    int pending_bytes = -1;
+    int64_t pending_granulepos = 0;
+    int n_ended = 0;
+
+    for(;;) {
+        int bytes = 0;
+
+        for(int i=0; i<n_inputs; i++) {
+            if(opus_reader_packet(&in[i].r, &in[i].op) != 1) {
+                n_ended++;
+                continue;
+            }
+            bytes += in[i].op.bytes + 2;
+        }
+        if(n_ended > 0) break;
+
+        if(packet_size < bytes) {
+            packet_size = bytes;
+            for(int k=0; k<2; k++) {
+                packet[k] = (unsigned char*)realloc(packet[k], packet_size);
+                CHECK_MALLOC(packet[k]);
+            }
+        }
+
+        /* inputs are visited in stream order; all streams of a packet
+         * must cover the same time */
+        unsigned char *out = packet[packetno & 1];
+        int len = 0;
+        for(int s=0; s<n_inputs && status == 0; s++) {
+            mux_input_t *mi = order[s];
+
+            if(mi->r.packet_samples != in[0].r.packet_samples) {
+                fprintf(stderr, "error: %s: packet %lld is %d samples, %s has %d;"
+                    " inputs must have the same framing\n", mi->filename,
+                    (long long)packetno, mi->r.packet_samples, in[0].filename,
+                    in[0].r.packet_samples);
+                status = 3;
+                break;
+            }
+
+            int n;
+            if(s < n_inputs - 1) {
+                n = opus_packet_delimit(mi->op.packet, mi->op.bytes, out + len);
+            } else {
+                memcpy(out + len, mi->op.packet, mi->op.bytes);
+                n = mi->op.bytes;
+            }
+            if(n < 0) {
+                fprintf(stderr, "error: %s: invalid packet %lld\n", mi->filename,
+                    (long long)packetno);
+                status = 3;
+                break;
+            }
+            len += n;
+        }
+        if(status) break;
+
+        if(pending_bytes >= 0) {
+            ogg_mux_packet(&mux, packet[(packetno - 1) & 1], pending_bytes,
+                pending_granulepos, false);
+        }
+        pending_bytes = len;
+        pending_granulepos = in[0].r.granulepos;
+        packetno++;
+    }
+
+    if(status == 0 && n_ended < n_inputs) {
+        fprintf(stderr, "warning: inputs have different lengths, output stops"
+            " at the shortest\n");
+    }
+    if(pending_bytes >= 0) {
+        ogg_mux_packet(&mux, packet[(packetno - 1) & 1], pending_bytes,
+            pending_granulepos, true);
+    }
+    ogg_mux_flush(&mux);
+
+    if(ferror(fp)) {
+        fprintf(stderr, "error: writing %s\n", output);
+        if(!status) status = 13;
+    }
+
+  cleanup:
+    if(mux_init) ogg_mux_clear(&mux);
+    if(fp) fclose(fp);
+    for(int i=0; i<n_open; i++) opus_reader_close(&in[i].r);
+    free(packet[0]);
+    free(packet[1]);
+    free(order);
+    free(in);
+    return status;
+}
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <ogg/ogg.h>
+
+#include "opus_header.h"
+#include "opus_utils.h"
+#include "opus_reader.h"
+#include "stream_decoder.h"
+#include "overview.h"
+#include "batch.h"
+#include "util.h"
+
+typedef struct {
+    int bin_samples[OVERVIEW_MAX_LEVELS];
+    int n_levels;
+    const char *output;
+} overview_options_t;
+
+void usage(char *exe) {
+    fprintf(stderr, "usage: %s [options] infile.opus|directory...\n", exe);
+    fprintf(stderr, "       %s -p file.ovw...\n", exe);
+    fprintf(stderr, "    -l <list>       bin lengths in seconds, e.g. 1,10,60 (default)\n");
+    fprintf(stderr, "    -o <file>       output file (default: input with .ovw extension)\n");
+    fprintf(stderr, "    -L <file>       also process the files listed in <file> (- for stdin)\n");
+    fprintf(stderr, "    -J <workers>    number of files to process at once (1)\n");
+    fprintf(stderr, "    -I <n>          files to read at once from one device (%d)\n",
+        BATCH_PER_DEVICE);
+    fprintf(stderr, "    -p              print a summary of existing overview files\n");
+}
+
+/**
+ * Parses a comma separated list of bin lengths in seconds.  Every length
+ * must be a whole multiple of the first, which is the one samples are
+ * reduced at.
+ * @return number of levels, or -1 if the list is malformed
+ */
+static int parse_levels(const char *list, int *bin_samples) {
+    const char *p = list;
+    int n = 0;
+    for(;;) {
+        char *end;
+        double seconds = strtod(p, &end);
+        if(end == p || seconds <= 0 || seconds > 3600 || n == OVERVIEW_MAX_LEVELS) {
+            return -1;
+        }
+        bin_samples[n] = (int)lrint(seconds * 48000);
+        if(bin_samples[n] < 1) return -1;
+        if(n > 0 && (bin_samples[n] <= bin_samples[n-1] ||
+          bin_samples[n] % bin_samples[0] != 0)) {
+            return -1;
+        }
+        n++;
+        if(*end == '\0') return n;
+        if(*end != ',') return -1;
+        p = end + 1;
+    }
+}
+
+static int overview_sink(void *arg, const float *pcm, int n) {
+    overview_add((overview_t*)arg, pcm, n);
+    return 0;
+}
+
+/**
+ * Decodes every stream of a file, each on its own thread, and writes the
+ * overview of all of their channels.
+ * @return 0 on success, or an exit status
+ */
+static int overview_file(const char *filename, const char *output,
+  const overview_options_t *opt, batch_item_t *item) {
+    OpusReader r;
+    ogg_packet op;
+    int status = 0;
+
+    int ret = opus_reader_open(&r, filename);
+    if(ret == -1) {
+        fprintf(stderr, "error: opening %s: ", filename);
+        perror(NULL);
+        return 10;
+    } else if(ret < 0) {
+        fprintf(stderr, "error: %s: not a usable opus stream\n", filename);
+        return 12;
+    }
+
+    const OpusHeader *header = &r.header;
+    int64_t last_granulepos = opus_reader_last_granulepos(&r);
+    int64_t length = last_granulepos >= 0 ? last_granulepos - header->preskip : -1;
+    if(length < -1) length = 0;
+
+    overview_t *overviews = (overview_t*)calloc(header->nb_streams, sizeof(overview_t));
+    overview_t **ovs = (overview_t**)malloc(header->nb_streams * sizeof(overview_t*));
+    stream_decoder_t **decoders = (stream_decoder_t**)calloc(header->nb_streams,
+        sizeof(stream_decoder_t*));
+    unsigned char *packet_buf = NULL;
+    int packet_buf_size = 0;
+    CHECK_MALLOC(overviews);
+    CHECK_MALLOC(ovs);
+    CHECK_MALLOC(decoders);
+
+    for(int s=0; s<header->nb_streams; s++) {
+        int channels = s < header->nb_coupled ? 2 : 1;
+        char name[4096];
+        snprintf(name, sizeof(name), "%s stream %d", filename, s+1);
+
+        ovs[s] = &overviews[s];
+        overview_init(ovs[s], channels, opt->bin_samples, opt->n_levels);
+        decoders[s] = stream_decoder_new_fn(name, channels, header->preskip,
+            header->gain, length, overview_sink, ovs[s]);
+        if(!decoders[s]) {
+            status = 13;
+            goto cleanup;
+        }
+    }
+
+    while(opus_reader_packet(&r, &op) == 1) {
+        const unsigned char *data = op.packet;
+        opus_int32 len = op.bytes;
+        opus_int32 packet_offset;
+
+        if(packet_buf_size < op.bytes) {
+            packet_buf_size = op.bytes;
+            packet_buf = (unsigned char*)realloc(packet_buf, packet_buf_size);
+            CHECK_MALLOC(packet_buf);
+        }
+
+        for(int s=0; s<header->nb_streams; s++) {
+            const unsigned char *packet = data;
+            opus_int32 bytes;
+
+            if(s != header->nb_streams - 1) {
+                bytes = opus_packet_undelimit(data, len, packet_buf, &packet_offset);
+                packet = packet_buf;
+            } else {
+                bytes = packet_offset = len;
+            }
+            if(bytes < 0) {
+                fprintf(stderr, "warning: %s: invalid packet %lld in stream %d\n",
+                    filename, (long long)op.packetno, s+1);
+                break;
+            }
+
+            stream_decoder_packet(decoders[s], packet, bytes);
+            data += packet_offset;
+            len -= packet_offset;
+        }
+    }
+
+  cleanup:
+    for(int s=0; s<header->nb_streams; s++) {
+        if(decoders[s] && stream_decoder_close(decoders[s]) < 0 && !status) {
+            status = 13;
+        }
+        overview_finish(&overviews[s]);
+    }
+
+    if(status == 0) {
+        if(overview_write(output, ovs, header->nb_streams,
+          length >= 0 ? length : 0) < 0) {
+            status = 14;
+        }
+        item->streams = header->nb_streams;
+        item->bytes = r.file_size;
+        if(length > 0) item->duration = length / 48000.0;
+    }
+
+    for(int s=0; s<header->nb_streams; s++) overview_free(&overviews[s]);
+    free(packet_buf);
+    free(decoders);
+    free(ovs);
+    free(overviews);
+    opus_reader_close(&r);
+    return status;
+}
+
+static int overview_batch_item(batch_item_t *item, void *arg) {
+    const overview_options_t *opt = (const overview_options_t*)arg;
+    char output[4096];
+
+    if(opt->output) {
+        snprintf(output, sizeof(output), "%s", opt->output);
+    } else {
+        size_t len = strlen(item->filename);
+        if(len > 5 && strcmp(item->filename + len - 5, ".opus") == 0) len -= 5;
+        snprintf(output, sizeof(output), "%.*s.ovw", (int)len, item->filename);
+    }
+    return overview_file(item->filename, output, opt, item);
+}
+
+/**
+ * Prints the header of an overview file and the loudest bin of each level,
+ * read straight from the mapping.
+ */
+static int print_overview(const char *filename) {
+    overview_map_t m;
+
+    if(overview_map(&m, filename) < 0) return 10;
+
+    printf("%s: %d channels, %0.02f s\n", filename, m.channels, m.samples / 48000.0);
+    for(int l=0; l<m.n_levels; l++) {
+        int bin_samples;
+        int64_t n_bins;
+        overview_level(&m, l, &bin_samples, &n_bins);
+
+        uint16_t peak = 0;
+        for(int c=0; c<m.channels; c++) {
+            const uint16_t *bins = overview_bins(&m, l, c);
+            for(int64_t b=0; b<n_bins; b++) {
+                if(bins[2*b] > peak) peak = bins[2*b];
+            }
+        }
+        printf("  level %d: %0.03f s bins, %lld bins, peak %0.02f dBFS\n", l,
+            bin_samples / 48000.0, (long long)n_bins,
+            peak ? 20 * log10(peak / 65535.0) : -INFINITY);
+    }
+
+    overview_unmap(&m);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    overview_options_t opt;
+    const char *listfile = NULL;
+    int n_workers = 1;
+    int per_device = BATCH_PER_DEVICE;
+    bool print = false;
+    int status = 0;
+    int c;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.n_levels = parse_levels("1,10,60", opt.bin_samples);
+
+    while((c = getopt(argc, argv, "l:o:L:J:I:p")) != -1) {
+        switch(c) {
+            case 'l':
+                opt.n_levels = parse_levels(optarg, opt.bin_samples);
+                if(opt.n_levels < 0) {
+                    fprintf(stderr, "error: invalid bin lengths: %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'o':
+                opt.output = optarg;
+                break;
+            case 'L':
+                listfile = optarg;
+                break;
+            case 'J':
+                n_workers = atoi(optarg);
+                break;
+            case 'I':
+                per_device = atoi(optarg);
+                break;
+            case 'p':
+                print = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if(optind >= argc && !listfile) {
+        fprintf(stderr, "error: no input file specified\n");
+        usage(argv[0]);
+        return 2;
+    }
+
+    if(print) {
+        for(int i=optind; i<argc; i++) {
+            if(print_overview(argv[i]) != 0) status = 10;
+        }
+        return status;
+    }
+
+    batch_t b;
+    batch_init(&b);
+    for(int i=optind; i<argc; i++) {
+        if(batch_add(&b, argv[i]) < 0) status = 10;
+    }
+    if(listfile && batch_add_list(&b, listfile) < 0) status = 10;
+
+    if(opt.output && b.n_items > 1) {
+        fprintf(stderr, "error: -o can only be used with a single input file\n");
+        batch_free(&b);
+        return 2;
+    }
+
+    if(batch_run(&b, overview_batch_item, &opt, n_workers, per_device) > 0) {
+        status = 1;
+    }
+    batch_free(&b);
+
+    return status;
+}
@@ -3,18 +3,143 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include <ogg/ogg.h>
 
 #include "opus_header.h"
 #include "opus_utils.h"
 #include "file_writer.h"
+#include "write_pool.h"
+#include "stream_decoder.h"
+#include "batch.h"
+#include "util.h"
 
 #define readint(buf, base) ( (buf[base]) + (buf[base+1] << 8) + \
                              (buf[base+2] << 16) + (buf[base+3] << 24) );
 
+typedef struct {
+    write_pool_t *pool;
+    const char *stream_list;
+    int page_size;
+    bool merge;
+    bool decode;
+    decode_format_t format;
+    bool verbose;
+} split_options_t;
+
 void usage(char *exe) {
-    fprintf(stderr, "usage: %s [options] infile.opus\n", exe);
+    fprintf(stderr, "usage: %s [options] infile.opus|directory...\n", exe);
+    fprintf(stderr, "    -b              write outputs through a pool of writer threads\n");
+    fprintf(stderr, "    -j <threads>    number of writer threads (%d)\n", WRITE_POOL_THREADS);
+    fprintf(stderr, "    -B <KiB>        write buffer size per output (%d)\n",
+        WRITE_POOL_BUFFER_SIZE / 1024);
+    fprintf(stderr, "    -s <list>       only extract the given streams, e.g. 3,7,12\n");
+    fprintf(stderr, "    -m              write the extracted streams to one multistream file\n");
+    fprintf(stderr, "    -d wav|raw      decode each stream to 32-bit float WAV or raw PCM\n");
+    fprintf(stderr, "    -P <bytes>      target size of output pages (%d)\n",
+        OGG_MUX_PAGE_SIZE);
+    fprintf(stderr, "    -L <file>       also process the files listed in <file> (- for stdin)\n");
+    fprintf(stderr, "    -J <workers>    number of files to process at once (number of CPUs)\n");
+    fprintf(stderr, "    -I <n>          files to read at once from one device (%d)\n",
+        BATCH_PER_DEVICE);
+}
+
+/**
+ * Parses a comma separated list of (1-based) stream numbers.
+ * @param selected array of nb_streams flags, set for each listed stream
+ * @return 0 on success, -1 if the list is malformed or out of range
+ */
+int parse_stream_list(const char *list, bool *selected, int nb_streams) {
+    const char *p = list;
+    for(;;) {
+        char *end;
+        long s = strtol(p, &end, 10);
+        if(end == p || s < 1 || s > nb_streams) return -1;
+        selected[s-1] = true;
+        if(*end == '\0') return 0;
+        if(*end != ',') return -1;
+        p = end + 1;
+    }
+}
+
+/**
+ * Builds the ID header for a multistream file holding only the selected
+ * streams of the original.  Streams keep their relative order, so coupled
+ * streams stay first, and every channel carried by a selected stream is
+ * remapped to the stream's new index.
+ */
+void subset_header(const OpusHeader *in, const bool *selected, OpusHeader *out) {
+    int stream_index[255];
+    int nb_streams = 0;
+    int nb_coupled = 0;
+
+    for(int s=0; s<in->nb_streams; s++) {
+        if(!selected[s]) {
+            stream_index[s] = -1;
+            continue;
+        }
+        if(s < in->nb_coupled) nb_coupled++;
+        stream_index[s] = nb_streams++;
+    }
+
+    memcpy(out, in, sizeof(OpusHeader));
+    out->channel_mapping = 255;
+    out->nb_streams = nb_streams;
+    out->nb_coupled = nb_coupled;
+    out->channels = 0;
+
+    for(int c=0; c<in->channels; c++) {
+        int v = in->stream_map[c];
+        int s, side = 0;
+        if(v == 255) continue;
+        if(v < 2 * in->nb_coupled) {
+            s = v / 2;
+            side = v & 1;
+        } else {
+            s = v - in->nb_coupled;
+        }
+        if(stream_index[s] < 0) continue;
+
+        int ns = stream_index[s];
+        out->stream_map[out->channels++] = ns < nb_coupled ?
+            2 * ns + side : ns + nb_coupled;
+    }
+}
+
+/**
+ * Finds the granule position of the last page in the file, leaving the file
+ * position unchanged.
+ * @return the last granule position, or -1 if none was found
+ */
+int64_t find_last_granulepos(FILE *fp, int64_t file_size) {
+    ogg_sync_state oy;
+    ogg_page og;
+    int64_t granulepos = -1;
+    off_t pos = ftello(fp);
+
+    int64_t start = file_size > 65536 ? file_size - 65536 : 0;
+    fseeko(fp, start, SEEK_SET);
+
+    ogg_sync_init(&oy);
+    for(;;) {
+        char *buf = ogg_sync_buffer(&oy, 4096);
+        size_t n = fread(buf, 1, 4096, fp);
+        if(n == 0) break;
+        ogg_sync_wrote(&oy, n);
+
+        long ret;
+        while((ret = ogg_sync_pageseek(&oy, &og)) != 0) {
+            if(ret > 0 && ogg_page_granulepos(&og) >= 0) {
+                granulepos = ogg_page_granulepos(&og);
+            }
+        }
+    }
+    ogg_sync_clear(&oy);
+
+    fseeko(fp, pos, SEEK_SET);
+    return granulepos;
 }
 
 /**
@@ -59,21 +184,19 @@ char **decode_comment_header(char *buf, int length) {
 }
 
 
-int main(int argc, char **argv) {
+/**
+ * Splits one file into a file per stream (or one file of the selected
+ * streams).  Progress is only printed when opt->verbose is set, so that
+ * batch runs keep stdout for their summaries.
+ * @return 0 on success, or an exit status
+ */
+int split_file(const char *filename, const split_options_t *opt, batch_item_t *item) {
     int status = 0;
-    char *filename_base = NULL;
-
-    if(optind >= argc) {
-        fprintf(stderr, "error: no input file specified\n");
-        usage(argv[0]);
-        return 2;
-    }
-
-    char *filename = argv[optind];
 
     FILE *fp = fopen(filename, "rb");
     if(!fp) {
-        perror("error: opening file:");
+        fprintf(stderr, "error: opening %s: ", filename);
+        perror(NULL);
         return 10;
     }
 
@@ -85,28 +208,33 @@ int main(int argc, char **argv) {
     OpusHeader *header = NULL;
     char *comment_header = NULL;
     int comment_length = 0;
+    bool *selected = NULL;
+    OpusFileWriter **file_writers = NULL;
+    OpusFileWriter *merged = NULL;
+    stream_decoder_t **decoders = NULL;
+    unsigned char *packet_buf = NULL;
 
     ogg_sync_init(&oy);
     bool stream_init = false;
 
-    printf("Reading file: %s\n", filename);
+    if(opt->verbose) printf("Reading file: %s\n", filename);
 
     bool have_headers = false;
 
 
     while(!have_headers) {
         if(feof(fp)) {
-            fprintf(stderr, "error: end of file reached before header found\n");
+            fprintf(stderr, "error: %s: end of file reached before header found\n",
+                filename);
             status = 11;
             goto cleanup;
         }
 
-        //printf("read\n");
         char *buf = ogg_sync_buffer(&oy, 4096);
         size_t n = fread(buf, 1, 4096, fp);
         int err = ogg_sync_wrote(&oy, n);
         if(err) {
-            fprintf(stderr, "error: ogg sync error\n");
+            fprintf(stderr, "error: %s: ogg sync error\n", filename);
         }
 
         while((ogg_sync_pageout(&oy, &og) == 1) && !have_headers) {
@@ -117,22 +245,23 @@ int main(int argc, char **argv) {
 
             err = ogg_stream_pagein(&os, &og);
             if(err < 0)  {
-                fprintf(stderr, "error: ogg stream error\n");
+                fprintf(stderr, "error: %s: ogg stream error\n", filename);
                 continue;
             }
 
-            printf("page\n");
-
             while((err = ogg_stream_packetout(&os, &op)) && !have_headers) {
                 if(err == -1) {
-                    fprintf(stderr, "warning: gap in stream\n");
+                    fprintf(stderr, "warning: %s: gap in stream\n", filename);
                     continue;
                 }
 
                 if(!header) {
                     header = (OpusHeader*)malloc(sizeof(OpusHeader));
+                    CHECK_MALLOC(header);
                     if(!opus_header_parse(op.packet, op.bytes, header)) {
-                        fprintf(stderr, "error: not a usable opus stream\n");
+                        fprintf(stderr, "error: %s: not a usable opus stream\n",
+                            filename);
+                        status = 12;
                         goto cleanup;
                     }
 
@@ -141,6 +270,7 @@ int main(int argc, char **argv) {
 
                 if(!comment_header) {
                     comment_header = (char*)malloc(op.bytes);
+                    CHECK_MALLOC(comment_header);
                     comment_length = op.bytes;
                     memcpy(comment_header, op.packet, op.bytes);
 
@@ -153,63 +283,163 @@ int main(int argc, char **argv) {
         }
     }
 
-    printf("Opus header:\n");
-    printf("  number of channels:   %d\n", header->channels);
-    printf("             preskip:   %d samples\n", header->preskip);
-    printf("         sample rate:   %d Hz\n", header->input_sample_rate);
-    printf("                gain:   %0.02f dB\n", header->gain / 256.0f);
-    printf("     channel mapping:   %d\n", header->channel_mapping);
-    printf("   number of streams:   %d streams\n", header->nb_streams);
-    printf("   number of coupled:   %d streams\n", header->nb_coupled);
-    printf("\n");
-    printf("Comments:\n");
-    char **comments = decode_comment_header(comment_header, comment_length);
-    if(comments) {
-        for(int i=0; comments[i] != NULL; i++) {
-            printf("  %s\n", comments[i]);
+    if(opt->verbose) {
+        printf("Opus header:\n");
+        printf("  number of channels:   %d\n", header->channels);
+        printf("             preskip:   %d samples\n", header->preskip);
+        printf("         sample rate:   %d Hz\n", header->input_sample_rate);
+        printf("                gain:   %0.02f dB\n", header->gain / 256.0f);
+        printf("     channel mapping:   %d\n", header->channel_mapping);
+        printf("   number of streams:   %d streams\n", header->nb_streams);
+        printf("   number of coupled:   %d streams\n", header->nb_coupled);
+        printf("\n");
+        printf("Comments:\n");
+        char **comments = decode_comment_header(comment_header, comment_length);
+        if(comments) {
+            for(int i=0; comments[i] != NULL; i++) {
+                printf("  %s\n", comments[i]);
+            }
+        } else {
+            printf("  failed to decode comment header\n");
         }
-    } else {
-        printf("  failed to decode comment header\n");
     }
 
     char basename[4096];
     strncpy(basename, filename, sizeof(basename)-1);
+    basename[sizeof(basename)-1] = '\0';
     if(strlen(filename) > 5 && strcmp(".opus", filename + (strlen(filename) - 5)) == 0) {
         basename[strlen(basename) - 5] = '\0';
     }
 
 
-    printf("Creating file writers\n");
-    header->channels = 1;
-    header->channel_mapping = 0;
-    OpusFileWriter **file_writers = (OpusFileWriter**)malloc(header->nb_streams *
-        sizeof(OpusFileWriter*));
+    selected = (bool*)calloc(header->nb_streams, sizeof(bool));
+    CHECK_MALLOC(selected);
+    if(opt->stream_list) {
+        if(parse_stream_list(opt->stream_list, selected, header->nb_streams) < 0) {
+            fprintf(stderr, "error: %s: invalid stream list: %s\n", filename,
+                opt->stream_list);
+            status = 2;
+            goto cleanup;
+        }
+    } else {
+        for(int i=0; i<header->nb_streams; i++) selected[i] = true;
+    }
+
+    int n_selected = 0;
+    int last_selected = 0;
     for(int i=0; i<header->nb_streams; i++) {
-        file_writers[i] = (OpusFileWriter*)malloc(sizeof(OpusFileWriter));
-        char namebuf[4096];
-        snprintf(namebuf, sizeof(namebuf), "%s-%02d", basename, i+1);
-        file_writer_init(file_writers[i], namebuf, header, comment_header, comment_length);
+        if(selected[i]) {
+            n_selected++;
+            last_selected = i;
+        }
+    }
+
+    struct stat st;
+    int64_t file_size = fstat(fileno(fp), &st) == 0 ? st.st_size : 0;
+    int64_t last_granulepos = find_last_granulepos(fp, file_size);
+
+    /* Each output gets roughly an equal share of the input; scale that by the
+     * fraction of the input that fits in one output file. */
+    int64_t prealloc = 0;
+    if(opt->pool) {
+        prealloc = file_size / header->nb_streams;
+        if(opt->merge) prealloc *= n_selected;
+        int64_t max_length = 3600 * header->input_sample_rate;
+        if(last_granulepos > max_length) {
+            prealloc = prealloc * max_length / last_granulepos;
+        }
+        prealloc += 65536;
+    }
+
+    if(opt->decode) {
+        /* decoded streams are never segmented, so each output holds the
+         * whole stream */
+        int64_t length = last_granulepos >= 0 ?
+            last_granulepos - header->preskip : -1;
+        if(length < -1) length = 0;
+
+        if(opt->verbose) printf("Creating decoders\n");
+        decoders = (stream_decoder_t**)calloc(header->nb_streams,
+            sizeof(stream_decoder_t*));
+        CHECK_MALLOC(decoders);
+        for(int i=0; i<header->nb_streams; i++) {
+            if(!selected[i]) continue;
+            int channels = i < header->nb_coupled ? 2 : 1;
+            int64_t prealloc = length >= 0 ?
+                length * channels * sizeof(float) + WAV_HEADER_SIZE : 0;
+
+            char namebuf[4096];
+            snprintf(namebuf, sizeof(namebuf), "%s-%02d.%s", basename, i+1,
+                opt->format == DECODE_WAV ? "wav" : "raw");
+            decoders[i] = stream_decoder_new(namebuf, opt->format, channels,
+                header->preskip, header->gain, length, opt->pool, prealloc);
+            if(!decoders[i]) {
+                status = 13;
+                goto cleanup;
+            }
+        }
     }
 
+    if(opt->verbose && !decoders) printf("Creating file writers\n");
+    file_writers = (OpusFileWriter**)calloc(header->nb_streams,
+        sizeof(OpusFileWriter*));
+    CHECK_MALLOC(file_writers);
+    if(opt->merge) {
+        OpusHeader subset;
+        subset_header(header, selected, &subset);
+
+        char namebuf[4096];
+        int p = snprintf(namebuf, sizeof(namebuf), "%s", basename);
+        for(int i=0; i<header->nb_streams && p < sizeof(namebuf); i++) {
+            if(selected[i]) {
+                p += snprintf(namebuf + p, sizeof(namebuf) - p, "-%02d", i+1);
+            }
+        }
+
+        merged = (OpusFileWriter*)malloc(sizeof(OpusFileWriter));
+        CHECK_MALLOC(merged);
+        file_writer_init(merged, namebuf, &subset, comment_header, comment_length);
+        file_writer_set_page_size(merged, opt->page_size);
+        if(opt->pool) {
+            file_writer_set_pool(merged, opt->pool, prealloc);
+        }
+    } else if(!decoders) {
+        OpusHeader mono;
+        memcpy(&mono, header, sizeof(OpusHeader));
+        mono.channel_mapping = 0;
+        for(int i=0; i<header->nb_streams; i++) {
+            if(!selected[i]) continue;
+            mono.channels = i < header->nb_coupled ? 2 : 1;
+            file_writers[i] = (OpusFileWriter*)malloc(sizeof(OpusFileWriter));
+            CHECK_MALLOC(file_writers[i]);
+            char namebuf[4096];
+            snprintf(namebuf, sizeof(namebuf), "%s-%02d", basename, i+1);
+            file_writer_init(file_writers[i], namebuf, &mono, comment_header, comment_length);
+            file_writer_set_page_size(file_writers[i], opt->page_size);
+            if(opt->pool) {
+                file_writer_set_pool(file_writers[i], opt->pool, prealloc);
+            }
+        }
+    }
 
-    int64_t granulepos = 0;
+    int packet_buf_size = 0;
 
     for(;;) {
         if(feof(fp)) {
-            printf("end of file reached\n");
+            if(opt->verbose) printf("end of file reached\n");
             break;
         }
 
         while(ogg_sync_pageout(&oy, &og) == 1) {
             int err = ogg_stream_pagein(&os, &og);
             if(err) {
-                fprintf(stderr, "error: ogg stream error\n");
+                fprintf(stderr, "error: %s: ogg stream error\n", filename);
                 continue;
             }
 
             while(err = ogg_stream_packetout(&os, &op)) {
                 if(err == -1) {
-                    fprintf(stderr, "warning: gap in stream\n");
+                    fprintf(stderr, "warning: %s: gap in stream\n", filename);
                     continue;
                 }
 
@@ -217,54 +447,80 @@ int main(int argc, char **argv) {
                 opus_int32 len = op.bytes;
                 opus_int32 packet_offset;
                 opus_int16 size[48];
-                unsigned char toc;
                 ogg_packet opo;
+                int merged_bytes = 0;
+                bool valid = true;
+
+                if(packet_buf_size < op.bytes) {
+                    packet_buf_size = op.bytes;
+                    packet_buf = (unsigned char*)realloc(packet_buf, packet_buf_size);
+                    CHECK_MALLOC(packet_buf);
+                }
 
+                opo.b_o_s = 0;
+                opo.e_o_s = op.e_o_s;
+                opo.granulepos = op.granulepos;
+                opo.packetno = op.packetno;
 
-                for(int s=0; s<header->nb_streams; s++) {
+                /* Streams past the last selected one are never looked at, and
+                 * unselected streams are only parsed far enough to skip them */
+                for(int s=0; s<=last_selected; s++) {
                     int self_delimited = s != header->nb_streams-1;
-                    int fcount = opus_packet_parse_impl(data, len, self_delimited,
-                        &toc, NULL, size, NULL, &packet_offset);
-
-                    opo.packet = (unsigned char*)malloc(packet_offset);
-                    opo.bytes = packet_offset;
-                    opo.b_o_s = 0;
-                    opo.e_o_s = op.e_o_s;
-                    opo.granulepos = op.granulepos;
-                    opo.packetno = op.packetno;
-
-                    if(self_delimited) {
-                        opo.packet[0] = toc;
-                        if(opo.packet[1] < 252) {
-                            memcpy(opo.packet+1, data+2, packet_offset-2);
-                            opo.bytes = packet_offset-1;
-                        } else {
-                            memcpy(opo.packet+1, data+3, packet_offset-3);
-                            opo.bytes = packet_offset-2;
-                        }
+                    opus_int32 bytes;
+
+                    if(selected[s] && self_delimited && (!opt->merge || s == last_selected)) {
+                        unsigned char *out = opt->merge ? packet_buf + merged_bytes : packet_buf;
+                        bytes = opus_packet_undelimit(data, len, out, &packet_offset);
+                        opo.packet = out;
                     } else {
-                        memcpy(opo.packet, data, packet_offset);
+                        bytes = opus_packet_parse_impl(data, len, self_delimited,
+                            NULL, NULL, size, NULL, &packet_offset);
+                        if(bytes >= 0) bytes = packet_offset;
+                        if(opt->merge && selected[s] && bytes >= 0) {
+                            memcpy(packet_buf + merged_bytes, data, bytes);
+                        }
+                        opo.packet = (unsigned char*)data;
                     }
 
-                    file_writer_input(file_writers[s], &opo);
+                    if(bytes < 0) {
+                        fprintf(stderr, "warning: %s: invalid packet %lld in stream %d\n",
+                            filename, (long long)op.packetno, s+1);
+                        valid = false;
+                        break;
+                    }
 
-                    if(op.granulepos >= 0) {
-                        file_writer_update_granulepos(file_writers[s], op.granulepos);
+                    if(selected[s]) {
+                        if(opt->merge) {
+                            merged_bytes += bytes;
+                        } else if(decoders) {
+                            stream_decoder_packet(decoders[s], opo.packet, bytes);
+                        } else {
+                            opo.bytes = bytes;
+                            if(file_writer_input(file_writers[s], &opo) < 0) {
+                                status = 13;
+                                goto cleanup;
+                            }
+                            if(op.granulepos >= 0) {
+                                file_writer_update_granulepos(file_writers[s], op.granulepos);
+                            }
+                        }
                     }
 
                     data += packet_offset;
                     len -= packet_offset;
-
-                    free(opo.packet);
                 }
 
-                //printf("packet %d %d %d %d\n", op.granulepos, op.bytes, op.packetno,
-                //    valid);
-                if(op.granulepos > 0) {
-                    granulepos = op.granulepos;
-
+                if(opt->merge && valid) {
+                    opo.packet = packet_buf;
+                    opo.bytes = merged_bytes;
+                    if(file_writer_input(merged, &opo) < 0) {
+                        status = 13;
+                        goto cleanup;
+                    }
+                    if(op.granulepos >= 0) {
+                        file_writer_update_granulepos(merged, op.granulepos);
+                    }
                 }
-
             }
         }
 
@@ -272,20 +528,172 @@ int main(int argc, char **argv) {
         size_t n = fread(buf, 1, 4096, fp);
         int err = ogg_sync_wrote(&oy, n);
         if(err) {
-            fprintf(stderr, "error: ogg sync error\n");
+            fprintf(stderr, "error: %s: ogg sync error\n", filename);
+        }
+    }
+
+    if(opt->verbose) printf("Closing file writers\n");
+
+    item->streams = header->nb_streams;
+    item->bytes = file_size;
+    if(last_granulepos > header->preskip) {
+        item->duration = (last_granulepos - header->preskip) / 48000.0;
+    }
+
+  cleanup:
+    if(decoders) {
+        for(int s=0; s<header->nb_streams; s++) {
+            if(decoders[s] && stream_decoder_close(decoders[s]) < 0 && !status) {
+                status = 13;
+            }
         }
+        free(decoders);
     }
+    if(file_writers) {
+        for(int s=0; s<header->nb_streams; s++) {
+            if(file_writers[s]) {
+                file_writer_free(file_writers[s]);
+                free(file_writers[s]);
+            }
+        }
+        free(file_writers);
+    }
+    if(merged) {
+        file_writer_free(merged);
+        free(merged);
+    }
+    free(packet_buf);
+    free(selected);
+    free(comment_header);
+    free(header);
+    if(stream_init) ogg_stream_clear(&os);
+    ogg_sync_clear(&oy);
+    fclose(fp);
+    return status;
+}
+
+static int split_batch_item(batch_item_t *item, void *arg) {
+    return split_file(item->filename, (const split_options_t*)arg, item);
+}
+
+
+int main(int argc, char **argv) {
+    int status = 0;
+    split_options_t opt;
+    bool pooled = false;
+    int n_threads = WRITE_POOL_THREADS;
+    int buffer_size = 0;
+    const char *listfile = NULL;
+    int n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int per_device = BATCH_PER_DEVICE;
+    int c;
+
+    memset(&opt, 0, sizeof(opt));
+
+    while((c = getopt(argc, argv, "bj:B:s:md:P:L:J:I:")) != -1) {
+        switch(c) {
+            case 'b':
+                pooled = true;
+                break;
+            case 'j':
+                n_threads = atoi(optarg);
+                break;
+            case 'B':
+                buffer_size = atoi(optarg) * 1024;
+                break;
+            case 's':
+                opt.stream_list = optarg;
+                break;
+            case 'm':
+                opt.merge = true;
+                break;
+            case 'd':
+                opt.decode = true;
+                if(strcmp(optarg, "wav") == 0) {
+                    opt.format = DECODE_WAV;
+                } else if(strcmp(optarg, "raw") == 0) {
+                    opt.format = DECODE_RAW;
+                } else {
+                    fprintf(stderr, "error: unknown decode format: %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'P':
+                opt.page_size = atoi(optarg);
+                break;
+            case 'L':
+                listfile = optarg;
+                break;
+            case 'J':
+                n_workers = atoi(optarg);
+                break;
+            case 'I':
+                per_device = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    struct stat st;
+    bool batch_mode = listfile || argc - optind > 1 ||
+        (optind < argc && stat(argv[optind], &st) == 0 && S_ISDIR(st.st_mode));
 
-    printf("Closing file writers\n");
-    for(int s=0; s<header->nb_streams; s++) {
-        file_writer_close(file_writers[s]);
+    if(optind >= argc && !listfile) {
+        fprintf(stderr, "error: no input file specified\n");
+        usage(argv[0]);
+        return 2;
     }
 
+    if(opt.decode && opt.merge) {
+        fprintf(stderr, "error: -d and -m cannot be used together\n");
+        return 2;
+    }
 
+    /* decoded output is written through the pool, with larger buffers since
+     * PCM is much bigger than the packets it came from */
+    if(opt.decode) pooled = true;
+    if(buffer_size <= 0) {
+        buffer_size = opt.decode ? STREAM_DECODER_BUFFER_SIZE : WRITE_POOL_BUFFER_SIZE;
+    }
+
+    if(pooled) {
+        opt.pool = write_pool_new(n_threads, buffer_size, WRITE_POOL_BUFFERS);
+    }
+
+    if(!batch_mode) {
+        batch_item_t item;
+        memset(&item, 0, sizeof(item));
+        opt.verbose = true;
+
+        struct timespec t_start, t_end;
+        clock_gettime(CLOCK_MONOTONIC, &t_start);
+        status = split_file(argv[optind], &opt, &item);
+        if(opt.pool) write_pool_free(opt.pool);
+        clock_gettime(CLOCK_MONOTONIC, &t_end);
+
+        double elapsed = (t_end.tv_sec - t_start.tv_sec) +
+            (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+        if(status == 0) {
+            printf("Split %lld bytes in %0.02f s (%0.01f MB/s)\n",
+                (long long)item.bytes, elapsed, item.bytes / elapsed / 1e6);
+        }
+        return status;
+    }
+
+    batch_t b;
+    batch_init(&b);
+    for(int i=optind; i<argc; i++) {
+        if(batch_add(&b, argv[i]) < 0) status = 10;
+    }
+    if(listfile && batch_add_list(&b, listfile) < 0) status = 10;
+
+    if(batch_run(&b, split_batch_item, &opt, n_workers, per_device) > 0) {
+        status = 1;
+    }
+    batch_free(&b);
+    if(opt.pool) write_pool_free(opt.pool);
 
-  cleanup:
-    if(fp) fclose(fp);
-    if(header) free(header);
-    //ogg_sync_destroy(&oy);
     return status;
 }
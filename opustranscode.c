@@ -0,0 +1,441 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ogg/ogg.h>
+#include <opus/opus.h>
+
+#include "opus_header.h"
+#include "opus_utils.h"
+#include "opus_reader.h"
+#include "packet_queue.h"
+#include "file_writer.h"
+#include "ogg_mux.h"
+#include "util.h"
+
+/* compressed data queued per stream, in each direction */
+#define TRANSCODE_MAX_QUEUED (256 << 10)
+/* input packets decoded but not yet re-encoded; the encoder's lookahead
+ * delays the output by a few packets at most */
+#define TRANSCODE_MAX_PENDING 64
+#define TRANSCODE_MAX_PACKET 4000
+
+typedef struct {
+    const char *filename;
+    int index;
+    int channels;
+    int bitrate;
+    int complexity;
+
+    OpusDecoder *dec;
+    OpusEncoder *enc;
+    pthread_t thread;
+    packet_queue_t in;      /* packets of this stream from the input */
+    packet_queue_t out;     /* re-encoded packets, in the same order */
+
+    float *fifo;            /* decoded samples waiting to be encoded */
+    int fifo_len;
+    int drop;               /* decoded samples still to drop */
+
+    /* duration and granule position of each input packet not yet
+     * re-encoded, so every output packet matches its input packet */
+    int pending_samples[TRANSCODE_MAX_PENDING];
+    int64_t pending_granulepos[TRANSCODE_MAX_PENDING];
+    int pending_head;
+    int n_pending;
+
+    int errors;
+    int status;
+} transcode_stream_t;
+
+typedef struct {
+    transcode_stream_t *streams;
+    int nb_streams;
+    int64_t granule_shift;
+    ogg_mux_t mux;
+    FILE *fp;
+    int64_t packets;
+    int64_t bytes;
+} transcode_output_t;
+
+void usage(char *exe) {
+    fprintf(stderr, "usage: %s [options] -o outfile.opus infile.opus\n", exe);
+    fprintf(stderr, "    -o <file>       output file\n");
+    fprintf(stderr, "    -b <kbps>       bitrate of each stream (96)\n");
+    fprintf(stderr, "    -c <0-10>       encoder complexity (library default)\n");
+    fprintf(stderr, "    -P <bytes>      target size of output pages (%d)\n",
+        OGG_MUX_PAGE_SIZE);
+}
+
+static int transcode_page(void *arg, const unsigned char *data, size_t length) {
+    return fwrite(data, 1, length, (FILE*)arg) == length ? 0 : -1;
+}
+
+/**
+ * Encodes the oldest pending packet from the front of the FIFO, padding the
+ * FIFO with silence if the input has run out.
+ */
+static void transcode_encode(transcode_stream_t *ts, bool pad) {
+    unsigned char data[TRANSCODE_MAX_PACKET];
+    int n = ts->pending_samples[ts->pending_head];
+    int64_t granulepos = ts->pending_granulepos[ts->pending_head];
+
+    if(ts->fifo_len < n) {
+        if(!pad) return;
+        memset(ts->fifo + ts->fifo_len * ts->channels, 0,
+            (n - ts->fifo_len) * ts->channels * sizeof(float));
+        ts->fifo_len = n;
+    }
+
+    int bytes = opus_encode_float(ts->enc, ts->fifo, n, data, sizeof(data));
+    if(bytes < 0) {
+        fprintf(stderr, "error: %s: encoding stream %d: %s\n", ts->filename,
+            ts->index + 1, opus_strerror(bytes));
+        ts->status = -1;
+        bytes = 0;
+    }
+    packet_queue_push(&ts->out, data, bytes, granulepos, true);
+
+    ts->fifo_len -= n;
+    memmove(ts->fifo, ts->fifo + n * ts->channels,
+        ts->fifo_len * ts->channels * sizeof(float));
+    ts->pending_head = (ts->pending_head + 1) % TRANSCODE_MAX_PENDING;
+    ts->n_pending--;
+}
+
+/**
+ * Stream thread: decodes each packet and re-encodes it with the same
+ * duration.  The encoder's lookahead is taken out of the pre-skip by
+ * dropping that many samples at the start, so the re-encoded stream lines up
+ * with the original sample for sample.
+ */
+static void *transcode_thread(void *arg) {
+    transcode_stream_t *ts = (transcode_stream_t*)arg;
+    queued_packet_t *pkt;
+
+    while((pkt = packet_queue_pop(&ts->in)) != NULL) {
+        int samples = opus_packet_get_nb_samples(pkt->data, pkt->bytes, 48000);
+        float *pcm = ts->fifo + ts->fifo_len * ts->channels;
+
+        int n = opus_decode_float(ts->dec, pkt->data, pkt->bytes, pcm,
+            MAX_PACKET_SAMPLES, 0);
+        if(n < 0) {
+            if(ts->errors++ == 0) {
+                fprintf(stderr, "warning: %s: failed to decode packet in stream %d\n",
+                    ts->filename, ts->index + 1);
+            }
+            n = opus_decode_float(ts->dec, NULL, 0, pcm, samples, 0);
+            if(n < 0) n = 0;
+        }
+        if(ts->drop > 0) {
+            int d = n < ts->drop ? n : ts->drop;
+            memmove(pcm, pcm + d * ts->channels, (n - d) * ts->channels * sizeof(float));
+            ts->drop -= d;
+            n -= d;
+        }
+        ts->fifo_len += n;
+
+        int tail = (ts->pending_head + ts->n_pending) % TRANSCODE_MAX_PENDING;
+        ts->pending_samples[tail] = samples;
+        ts->pending_granulepos[tail] = pkt->granulepos;
+        ts->n_pending++;
+        free(pkt);
+
+        while(ts->n_pending > 0 &&
+          (ts->fifo_len >= ts->pending_samples[ts->pending_head] ||
+          ts->n_pending == TRANSCODE_MAX_PENDING)) {
+            transcode_encode(ts, ts->n_pending == TRANSCODE_MAX_PENDING);
+        }
+    }
+
+    while(ts->n_pending > 0) transcode_encode(ts, true);
+    packet_queue_close(&ts->out);
+
+    return NULL;
+}
+
+/**
+ * Writer thread: takes one packet from each stream in turn and joins them
+ * into multistream packets.  Packets are written once the next one has been
+ * assembled, so the last one can be marked as the end of the stream.
+ */
+static void *transcode_writer(void *arg) {
+    transcode_output_t *out = (transcode_output_t*)arg;
+    int nb_streams = out->nb_streams;
+    unsigned char *packet[2];
+    int len[2] = {-1, -1};
+    int64_t granulepos[2] = {0, 0};
+    int cur = 0;
+
+    for(int k=0; k<2; k++) {
+        packet[k] = (unsigned char*)malloc(nb_streams * (TRANSCODE_MAX_PACKET + 2));
+        CHECK_MALLOC(packet[k]);
+    }
+
+    for(;;) {
+        bool done = false;
+        len[cur] = 0;
+        for(int s=0; s<nb_streams; s++) {
+            queued_packet_t *pkt = packet_queue_pop(&out->streams[s].out);
+            if(!pkt) {
+                done = true;
+                break;
+            }
+            if(s == 0) granulepos[cur] = pkt->granulepos + out->granule_shift;
+
+            if(s < nb_streams - 1) {
+                len[cur] += opus_packet_delimit(pkt->data, pkt->bytes, packet[cur] + len[cur]);
+            } else {
+                memcpy(packet[cur] + len[cur], pkt->data, pkt->bytes);
+                len[cur] += pkt->bytes;
+            }
+            free(pkt);
+        }
+        if(done) break;
+
+        cur ^= 1;
+        if(len[cur] >= 0) {
+            ogg_mux_packet(&out->mux, packet[cur], len[cur], granulepos[cur], false);
+        }
+        out->packets++;
+        out->bytes += len[cur ^ 1];
+    }
+
+    cur ^= 1;
+    if(len[cur] >= 0) {
+        ogg_mux_packet(&out->mux, packet[cur], len[cur], granulepos[cur], true);
+    }
+    ogg_mux_flush(&out->mux);
+
+    free(packet[0]);
+    free(packet[1]);
+    return NULL;
+}
+
+static int transcode_stream_init(transcode_stream_t *ts, const char *filename,
+  int index, int channels, int bitrate, int complexity) {
+    int err;
+
+    memset(ts, 0, sizeof(transcode_stream_t));
+    ts->filename = filename;
+    ts->index = index;
+    ts->channels = channels;
+
+    ts->dec = opus_decoder_create(48000, channels, &err);
+    if(err != OPUS_OK) {
+        fprintf(stderr, "error: creating decoder: %s\n", opus_strerror(err));
+        return -1;
+    }
+    ts->enc = opus_encoder_create(48000, channels, OPUS_APPLICATION_AUDIO, &err);
+    if(err != OPUS_OK) {
+        fprintf(stderr, "error: creating encoder: %s\n", opus_strerror(err));
+        opus_decoder_destroy(ts->dec);
+        return -1;
+    }
+    int ret = opus_encoder_ctl(ts->enc, OPUS_SET_BITRATE(bitrate));
+    if(ret != OPUS_OK) {
+        fprintf(stderr, "failed to set bitrate: %s\n", opus_strerror(ret));
+    }
+    if(complexity >= 0) opus_encoder_ctl(ts->enc, OPUS_SET_COMPLEXITY(complexity));
+
+    ts->fifo = (float*)malloc(3 * MAX_PACKET_SAMPLES * channels * sizeof(float));
+    CHECK_MALLOC(ts->fifo);
+    packet_queue_init(&ts->in, TRANSCODE_MAX_QUEUED);
+    packet_queue_init(&ts->out, TRANSCODE_MAX_QUEUED);
+    return 0;
+}
+
+static void transcode_stream_free(transcode_stream_t *ts) {
+    packet_queue_destroy(&ts->in);
+    packet_queue_destroy(&ts->out);
+    opus_encoder_destroy(ts->enc);
+    opus_decoder_destroy(ts->dec);
+    free(ts->fifo);
+}
+
+int main(int argc, char **argv) {
+    const char *output = NULL;
+    int bitrate = 96000;
+    int complexity = -1;
+    int page_size = 0;
+    int status = 0;
+    int c;
+
+    while((c = getopt(argc, argv, "o:b:c:P:")) != -1) {
+        switch(c) {
+            case 'o':
+                output = optarg;
+                break;
+            case 'b':
+                bitrate = atoi(optarg) * 1000;
+                break;
+            case 'c':
+                complexity = atoi(optarg);
+                break;
+            case 'P':
+                page_size = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if(!output || optind != argc - 1) {
+        fprintf(stderr, "error: %s\n", output ? "expected one input file" :
+            "no output file specified");
+        usage(argv[0]);
+        return 2;
+    }
+    const char *filename = argv[optind];
+
+    OpusReader r;
+    int ret = opus_reader_open(&r, filename);
+    if(ret == -1) {
+        fprintf(stderr, "error: opening %s: ", filename);
+        perror(NULL);
+        return 10;
+    } else if(ret < 0) {
+        fprintf(stderr, "error: %s: not a usable opus stream\n", filename);
+        return 12;
+    }
+
+    struct timespec t_start, t_end;
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+    OpusHeader header;
+    memcpy(&header, &r.header, sizeof(OpusHeader));
+    int nb_streams = header.nb_streams;
+
+    transcode_output_t out;
+    memset(&out, 0, sizeof(out));
+    out.nb_streams = nb_streams;
+    out.streams = (transcode_stream_t*)calloc(nb_streams, sizeof(transcode_stream_t));
+    CHECK_MALLOC(out.streams);
+
+    int n_init = 0;
+    for(; n_init<nb_streams; n_init++) {
+        int channels = n_init < header.nb_coupled ? 2 : 1;
+        if(transcode_stream_init(&out.streams[n_init], filename, n_init, channels,
+          bitrate, complexity) < 0) {
+            status = 13;
+            break;
+        }
+    }
+    if(status) {
+        for(int s=0; s<n_init; s++) transcode_stream_free(&out.streams[s]);
+        free(out.streams);
+        opus_reader_close(&r);
+        return status;
+    }
+
+    /* Samples the new encoder delays its output by are dropped from the
+     * decoded pre-skip, so positions stay the same.  Only if the pre-skip is
+     * shorter than that does the new file need a longer one. */
+    opus_int32 lookahead = 0;
+    opus_encoder_ctl(out.streams[0].enc, OPUS_GET_LOOKAHEAD(&lookahead));
+    int drop = lookahead < header.preskip ? lookahead : header.preskip;
+    out.granule_shift = lookahead - drop;
+    header.preskip += out.granule_shift;
+    for(int s=0; s<nb_streams; s++) out.streams[s].drop = drop;
+
+    out.fp = fopen(output, "wb");
+    if(!out.fp) {
+        fprintf(stderr, "error: opening %s: ", output);
+        perror(NULL);
+        for(int s=0; s<nb_streams; s++) transcode_stream_free(&out.streams[s]);
+        free(out.streams);
+        opus_reader_close(&r);
+        return 10;
+    }
+    setvbuf(out.fp, NULL, _IOFBF, 1 << 20);
+
+    srand(time(NULL));
+    ogg_mux_init(&out.mux, rand(), page_size, transcode_page, out.fp);
+    unsigned char id_buf[300];
+    int id_size = opus_header_to_packet(&header, id_buf, sizeof(id_buf));
+    ogg_mux_packet(&out.mux, id_buf, id_size, 0, false);
+    ogg_mux_flush(&out.mux);
+    ogg_mux_packet(&out.mux, r.tags, r.tag_len, 0, false);
+    ogg_mux_flush(&out.mux);
+
+    for(int s=0; s<nb_streams; s++) {
+        pthread_create(&out.streams[s].thread, NULL, transcode_thread, &out.streams[s]);
+    }
+    pthread_t writer;
+    pthread_create(&writer, NULL, transcode_writer, &out);
+
+    ogg_packet op;
+    unsigned char *packet_buf = NULL;
+    int packet_buf_size = 0;
+    int64_t in_bytes = 0;
+
+    while(opus_reader_packet(&r, &op) == 1) {
+        /* streams of a broken packet would fall out of step; skip it */
+        if(opus_multistream_packet_validate(op.packet, op.bytes, nb_streams, 48000) < 0) {
+            fprintf(stderr, "warning: %s: skipping invalid packet %lld\n",
+                filename, (long long)op.packetno);
+            continue;
+        }
+        if(packet_buf_size < op.bytes) {
+            packet_buf_size = op.bytes;
+            packet_buf = (unsigned char*)realloc(packet_buf, packet_buf_size);
+            CHECK_MALLOC(packet_buf);
+        }
+        in_bytes += op.bytes;
+
+        const unsigned char *data = op.packet;
+        opus_int32 len = op.bytes;
+        for(int s=0; s<nb_streams; s++) {
+            opus_int32 bytes, packet_offset;
+            const unsigned char *packet = data;
+
+            if(s < nb_streams - 1) {
+                bytes = opus_packet_undelimit(data, len, packet_buf, &packet_offset);
+                packet = packet_buf;
+            } else {
+                bytes = packet_offset = len;
+            }
+            packet_queue_push(&out.streams[s].in, packet, bytes, r.granulepos, true);
+            data += packet_offset;
+            len -= packet_offset;
+        }
+    }
+
+    for(int s=0; s<nb_streams; s++) packet_queue_close(&out.streams[s].in);
+    for(int s=0; s<nb_streams; s++) {
+        pthread_join(out.streams[s].thread, NULL);
+        if(out.streams[s].status) status = 14;
+        if(out.streams[s].errors > 0) {
+            fprintf(stderr, "warning: %s: %d packets in stream %d could not be decoded\n",
+                filename, out.streams[s].errors, s + 1);
+        }
+    }
+    pthread_join(writer, NULL);
+
+    if(ferror(out.fp) | fclose(out.fp)) {
+        fprintf(stderr, "error: writing %s\n", output);
+        status = 13;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    double elapsed = (t_end.tv_sec - t_start.tv_sec) +
+        (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+    double duration = (r.granulepos - r.header.preskip) / 48000.0;
+    if(status == 0) {
+        printf("Transcoded %0.02f s in %0.02f s (%0.01fx realtime), %lld -> %lld bytes\n",
+            duration, elapsed, duration / elapsed, (long long)in_bytes,
+            (long long)out.bytes);
+    }
+
+    ogg_mux_clear(&out.mux);
+    for(int s=0; s<nb_streams; s++) transcode_stream_free(&out.streams[s]);
+    free(out.streams);
+    free(packet_buf);
+    opus_reader_close(&r);
+    return status;
+}
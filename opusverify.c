@@ -0,0 +1,603 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "opus_header.h"
+#include "opus_utils.h"
+#include "opus_reader.h"
+#include "ogg_mux.h"
+#include "batch.h"
+#include "util.h"
+
+#define VERIFY_RANGE_SIZE (64 << 20)
+#define VERIFY_READ_SIZE (4 << 20)
+#define VERIFY_MAX_ERRORS 100
+
+/* results of check_page other than a page length */
+#define PAGE_EOF 0
+#define PAGE_NONE -1        /* no capture pattern */
+#define PAGE_TRUNCATED -2
+#define PAGE_BAD_CRC -3
+
+typedef struct {
+    int64_t offset;
+    int64_t granulepos;     /* last known position before the error, or -1 */
+    char msg[96];
+} verify_error_t;
+
+struct verify_range;
+
+typedef struct {
+    const char *filename;
+    int64_t file_size;
+    bool have_header;
+    uint32_t serialno;
+    int nb_streams;
+    int preskip;
+
+    struct verify_range *ranges;
+    int n_ranges;
+} verify_file_t;
+
+typedef struct verify_range {
+    verify_file_t *file;
+    int64_t start;          /* pages starting in [start, end) belong here */
+    int64_t end;
+
+    int64_t first_offset;   /* first valid page at or after start, or -1 */
+    int64_t first_pageno;
+    int64_t first_granulepos;
+    int64_t next_offset;    /* where the page after the last one checked
+                               starts, or -1 if unknown */
+    int64_t last_pageno;
+    int64_t last_granulepos;
+
+    int64_t pages;
+    int64_t packets;
+    verify_error_t *errors;
+    int n_errors;
+} verify_range_t;
+
+typedef struct {
+    int fd;
+    unsigned char *buf;
+    int64_t buf_offset;
+    size_t fill;
+} range_reader_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    verify_range_t **ranges;
+    int n_ranges;
+    int next;
+} verify_queue_t;
+
+void usage(char *exe) {
+    fprintf(stderr, "usage: %s [options] infile.opus|directory...\n", exe);
+    fprintf(stderr, "    -j <threads>    number of threads (number of CPUs)\n");
+    fprintf(stderr, "    -r <MiB>        size of the byte ranges checked in parallel (%d)\n",
+        VERIFY_RANGE_SIZE >> 20);
+    fprintf(stderr, "    -L <file>       also check the files listed in <file> (- for stdin)\n");
+}
+
+static void range_error(verify_range_t *vr, int64_t offset, int64_t granulepos,
+  const char *fmt, ...) {
+    if(vr->n_errors == VERIFY_MAX_ERRORS) return;
+    if(!vr->errors) {
+        vr->errors = (verify_error_t*)malloc(VERIFY_MAX_ERRORS * sizeof(verify_error_t));
+        CHECK_MALLOC(vr->errors);
+    }
+
+    verify_error_t *e = &vr->errors[vr->n_errors++];
+    e->offset = offset;
+    e->granulepos = granulepos;
+
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(e->msg, sizeof(e->msg), fmt, ap);
+    va_end(ap);
+}
+
+/**
+ * Makes at least want bytes at offset available (fewer only at the end of
+ * the file), reading a new block if the buffer does not hold them.
+ * @return the number of bytes available at *p
+ */
+static size_t reader_at(range_reader_t *rd, int64_t offset, size_t want,
+  const unsigned char **p) {
+    if(offset < rd->buf_offset || offset + want > rd->buf_offset + rd->fill) {
+        rd->buf_offset = offset;
+        rd->fill = 0;
+        while(rd->fill < VERIFY_READ_SIZE) {
+            ssize_t n = pread(rd->fd, rd->buf + rd->fill, VERIFY_READ_SIZE - rd->fill,
+                offset + rd->fill);
+            if(n <= 0) break;
+            rd->fill += n;
+        }
+    }
+
+    *p = rd->buf + (offset - rd->buf_offset);
+    return rd->buf_offset + rd->fill - offset;
+}
+
+/**
+ * Checks for a complete page with a correct CRC at offset.
+ * @return the length of the page, or one of the PAGE_ values
+ */
+static int check_page(range_reader_t *rd, int64_t offset, const unsigned char **page) {
+    const unsigned char *p;
+    size_t n = reader_at(rd, offset, 27, &p);
+
+    if(n == 0) return PAGE_EOF;
+    if(n < 4 || memcmp(p, "OggS", 4) != 0) return PAGE_NONE;
+    if(n < 27) return PAGE_TRUNCATED;
+
+    int header_len = 27 + p[26];
+    if(reader_at(rd, offset, header_len, &p) < header_len) return PAGE_TRUNCATED;
+
+    int len = header_len;
+    for(int i=0; i<p[26]; i++) len += p[27 + i];
+    if(reader_at(rd, offset, len, &p) < len) return PAGE_TRUNCATED;
+
+    unsigned char header[OGG_MUX_HEADER_MAX];
+    memcpy(header, p, header_len);
+    memset(header + 22, 0, 4);
+    uint32_t crc = ogg_crc32(0, header, header_len);
+    crc = ogg_crc32(crc, p + header_len, len - header_len);
+    uint32_t stored = p[22] | (p[23] << 8) | (p[24] << 16) | ((uint32_t)p[25] << 24);
+    if(crc != stored) return PAGE_BAD_CRC;
+
+    *page = p;
+    return len;
+}
+
+/**
+ * Finds the first valid page starting in [from, limit).
+ * @return its offset, or -1 if there is none
+ */
+static int64_t find_page(range_reader_t *rd, int64_t from, int64_t limit) {
+    const unsigned char *page;
+    int64_t pos = from;
+
+    while(pos < limit) {
+        const unsigned char *p;
+        size_t n = reader_at(rd, pos, 65536, &p);
+        if(n < 4) return -1;
+
+        const unsigned char *q = (const unsigned char*)memmem(p, n, "OggS", 4);
+        if(!q) {
+            pos += n - 3;
+            continue;
+        }
+
+        int64_t candidate = pos + (q - p);
+        if(candidate >= limit) return -1;
+        if(check_page(rd, candidate, &page) > 0) return candidate;
+        pos = candidate + 1;
+    }
+
+    return -1;
+}
+
+static int64_t get_le64(const unsigned char *buf) {
+    uint64_t val = 0;
+    for(int i=7; i>=0; i--) val = (val << 8) | buf[i];
+    return (int64_t)val;
+}
+
+static uint32_t get_le32(const unsigned char *buf) {
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static const char *page_problem(int ret) {
+    switch(ret) {
+        case PAGE_NONE: return "lost sync: no page at expected position";
+        case PAGE_TRUNCATED: return "truncated page";
+        case PAGE_BAD_CRC: return "page CRC mismatch";
+        default: return "unknown page error";
+    }
+}
+
+/**
+ * Checks the pages starting in one byte range of a file, and every packet
+ * starting on them.  Pages past the end of the range are only read to
+ * finish the last packet; the next range checks them.
+ */
+static void verify_range(verify_range_t *vr) {
+    verify_file_t *vf = vr->file;
+    range_reader_t rd;
+
+    vr->first_offset = -1;
+    vr->next_offset = -1;
+    vr->first_pageno = vr->last_pageno = -1;
+    vr->first_granulepos = vr->last_granulepos = -1;
+
+    rd.fd = open(vf->filename, O_RDONLY);
+    if(rd.fd < 0) {
+        range_error(vr, vr->start, -1, "cannot open file");
+        return;
+    }
+    rd.buf = (unsigned char*)malloc(VERIFY_READ_SIZE);
+    CHECK_MALLOC(rd.buf);
+    rd.buf_offset = 0;
+    rd.fill = 0;
+
+    unsigned char *packet = NULL;
+    int packet_len = 0;
+    int packet_size = 0;
+    bool in_packet = false;         /* a packet continues onto the next page */
+    bool skipping = true;           /* dropping the tail of an unchecked packet */
+    int headers = vr->start == 0 ? 2 : 0;
+    int64_t pageno = -1;
+    int64_t granulepos = -1;        /* of the last page with one */
+    int64_t sample_pos = -1;        /* position of the current packet */
+
+    int64_t pos = find_page(&rd, vr->start, vr->end);
+    if(pos < 0) {
+        range_error(vr, vr->start, -1, "no valid page in range");
+        goto done;
+    }
+    if(vr->start == 0 && pos > 0) {
+        range_error(vr, 0, -1, "%lld bytes of garbage before the first page",
+            (long long)pos);
+    }
+    vr->first_offset = pos;
+
+    for(;;) {
+        const unsigned char *page;
+        bool owned = pos < vr->end;
+
+        if(!owned && vr->next_offset < 0) vr->next_offset = pos;
+        if(!owned && !in_packet) break;
+
+        int len = check_page(&rd, pos, &page);
+        if(len == PAGE_EOF) {
+            if(in_packet) {
+                range_error(vr, pos, granulepos, "file ends inside a packet");
+            }
+            if(vr->next_offset < 0) vr->next_offset = pos;
+            break;
+        }
+        if(len < 0) {
+            if(!owned) break;
+
+            range_error(vr, pos, granulepos, "%s", page_problem(len));
+            pos = find_page(&rd, pos + 1, vr->end);
+            if(pos < 0) break;
+
+            /* the sequence restarts after the damage, which was reported */
+            in_packet = false;
+            skipping = true;
+            pageno = -1;
+            continue;
+        }
+
+        int flags = page[5];
+        int64_t page_granulepos = get_le64(page + 6);
+        uint32_t serialno = get_le32(page + 14);
+        int64_t page_pageno = get_le32(page + 18);
+        int n_segments = page[26];
+        const unsigned char *lacing = page + 27;
+        const unsigned char *body = page + 27 + n_segments;
+
+        if(owned) {
+            if(vf->have_header && serialno != vf->serialno) {
+                range_error(vr, pos, granulepos, "unexpected serial number %08x",
+                    serialno);
+            }
+            if(pageno >= 0 && page_pageno != pageno + 1) {
+                range_error(vr, pos, granulepos, "page sequence jumps from %lld to %lld",
+                    (long long)pageno, (long long)page_pageno);
+            }
+            if(page_granulepos >= 0 && granulepos >= 0 && page_granulepos < granulepos) {
+                range_error(vr, pos, granulepos, "granule position goes back to %lld",
+                    (long long)page_granulepos);
+            }
+            if(vr->pages == 0) {
+                vr->first_pageno = page_pageno;
+                vr->first_granulepos = page_granulepos;
+            }
+            vr->pages++;
+        }
+
+        if(flags & 0x01) {
+            if(!in_packet && !skipping && owned) {
+                range_error(vr, pos, granulepos, "continued page without a packet to continue");
+            }
+            if(!in_packet) skipping = true;
+        } else {
+            if(in_packet) {
+                range_error(vr, pos, granulepos, "packet is not continued on the next page");
+            }
+            if(!owned) break;
+            in_packet = false;
+            skipping = false;
+            packet_len = 0;
+        }
+
+        sample_pos = granulepos;
+        for(int i=0; i<n_segments; i++) {
+            int lace = lacing[i];
+            const unsigned char *data = body;
+            body += lace;
+
+            if(skipping) {
+                if(lace < 255) skipping = false;
+                continue;
+            }
+
+            if(packet_len + lace > packet_size) {
+                packet_size = 2 * (packet_len + lace);
+                packet = (unsigned char*)realloc(packet, packet_size);
+                CHECK_MALLOC(packet);
+            }
+            memcpy(packet + packet_len, data, lace);
+            packet_len += lace;
+            in_packet = true;
+            if(lace == 255) continue;
+
+            /* a complete packet */
+            in_packet = false;
+            if(headers > 0) {
+                headers--;
+            } else if(vf->have_header) {
+                int samples = opus_multistream_packet_validate(packet, packet_len,
+                    vf->nb_streams, 48000);
+                if(samples < 0) {
+                    range_error(vr, pos, sample_pos, "invalid packet (%s)",
+                        opus_strerror(samples));
+                } else if(sample_pos >= 0) {
+                    sample_pos += samples;
+                }
+                vr->packets++;
+            }
+            packet_len = 0;
+
+            /* past the range, only the packet started inside it is checked */
+            if(!owned) break;
+        }
+
+        if(owned) {
+            pageno = page_pageno;
+            vr->last_pageno = page_pageno;
+            if(page_granulepos >= 0) {
+                granulepos = page_granulepos;
+                vr->last_granulepos = page_granulepos;
+            }
+        }
+        pos += len;
+    }
+
+  done:
+    free(packet);
+    free(rd.buf);
+    close(rd.fd);
+}
+
+static void *verify_worker(void *arg) {
+    verify_queue_t *q = (verify_queue_t*)arg;
+
+    for(;;) {
+        pthread_mutex_lock(&q->lock);
+        int i = q->next++;
+        pthread_mutex_unlock(&q->lock);
+        if(i >= q->n_ranges) break;
+
+        verify_range(q->ranges[i]);
+    }
+
+    return NULL;
+}
+
+static int compare_errors(const void *a, const void *b) {
+    int64_t oa = ((const verify_error_t*)a)->offset;
+    int64_t ob = ((const verify_error_t*)b)->offset;
+    return oa < ob ? -1 : oa > ob ? 1 : 0;
+}
+
+/**
+ * Checks the seams between ranges, then prints every problem found in the
+ * file in order of position.
+ * @return the number of problems
+ */
+static int report_file(verify_file_t *vf) {
+    verify_range_t seams;
+    memset(&seams, 0, sizeof(seams));
+
+    for(int k=1; k<vf->n_ranges; k++) {
+        verify_range_t *prev = &vf->ranges[k-1];
+        verify_range_t *cur = &vf->ranges[k];
+        if(prev->next_offset < 0 || cur->first_offset < 0) continue;
+
+        if(prev->next_offset < cur->first_offset) {
+            range_error(&seams, prev->next_offset, prev->last_granulepos,
+                "lost sync: %lld bytes before the next valid page",
+                (long long)(cur->first_offset - prev->next_offset));
+        } else if(prev->last_pageno >= 0 && cur->first_pageno != prev->last_pageno + 1) {
+            range_error(&seams, cur->first_offset, prev->last_granulepos,
+                "page sequence jumps from %lld to %lld",
+                (long long)prev->last_pageno, (long long)cur->first_pageno);
+        }
+        if(cur->first_granulepos >= 0 && prev->last_granulepos >= 0 &&
+                cur->first_granulepos < prev->last_granulepos) {
+            range_error(&seams, cur->first_offset, prev->last_granulepos,
+                "granule position goes back to %lld", (long long)cur->first_granulepos);
+        }
+    }
+
+    int n_errors = seams.n_errors;
+    int64_t pages = 0, packets = 0, last_granulepos = -1;
+    for(int k=0; k<vf->n_ranges; k++) {
+        n_errors += vf->ranges[k].n_errors;
+        pages += vf->ranges[k].pages;
+        packets += vf->ranges[k].packets;
+        if(vf->ranges[k].last_granulepos >= 0) {
+            last_granulepos = vf->ranges[k].last_granulepos;
+        }
+    }
+
+    verify_error_t *errors = (verify_error_t*)malloc((n_errors + 1) * sizeof(verify_error_t));
+    CHECK_MALLOC(errors);
+    int n = 0;
+    for(int k=0; k<vf->n_ranges; k++) {
+        memcpy(errors + n, vf->ranges[k].errors, vf->ranges[k].n_errors * sizeof(verify_error_t));
+        n += vf->ranges[k].n_errors;
+    }
+    memcpy(errors + n, seams.errors, seams.n_errors * sizeof(verify_error_t));
+    qsort(errors, n_errors, sizeof(verify_error_t), compare_errors);
+
+    if(!vf->have_header) {
+        printf("%s: no usable opus header, packets not checked\n", vf->filename);
+    }
+    for(int i=0; i<n_errors; i++) {
+        if(errors[i].granulepos >= 0) {
+            printf("%s: offset %lld (%0.03f s): %s\n", vf->filename,
+                (long long)errors[i].offset,
+                (errors[i].granulepos - vf->preskip) / 48000.0, errors[i].msg);
+        } else {
+            printf("%s: offset %lld: %s\n", vf->filename,
+                (long long)errors[i].offset, errors[i].msg);
+        }
+    }
+
+    if(n_errors == 0 && vf->have_header) {
+        printf("%s: OK, %lld pages, %lld packets, %0.02f s\n", vf->filename,
+            (long long)pages, (long long)packets,
+            last_granulepos > vf->preskip ? (last_granulepos - vf->preskip) / 48000.0 : 0);
+    } else {
+        printf("%s: %d problem%s\n", vf->filename, n_errors, n_errors == 1 ? "" : "s");
+    }
+
+    free(errors);
+    free(seams.errors);
+    return n_errors + (vf->have_header ? 0 : 1);
+}
+
+int main(int argc, char **argv) {
+    int n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int64_t range_size = VERIFY_RANGE_SIZE;
+    const char *listfile = NULL;
+    int status = 0;
+    int c;
+
+    while((c = getopt(argc, argv, "j:r:L:")) != -1) {
+        switch(c) {
+            case 'j':
+                n_threads = atoi(optarg);
+                break;
+            case 'r':
+                range_size = (int64_t)atoi(optarg) << 20;
+                break;
+            case 'L':
+                listfile = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if(optind >= argc && !listfile) {
+        fprintf(stderr, "error: no input file specified\n");
+        usage(argv[0]);
+        return 2;
+    }
+    if(n_threads < 1) n_threads = 1;
+    if(range_size < (1 << 20)) range_size = 1 << 20;
+
+    batch_t b;
+    batch_init(&b);
+    for(int i=optind; i<argc; i++) {
+        if(batch_add(&b, argv[i]) < 0) status = 10;
+    }
+    if(listfile && batch_add_list(&b, listfile) < 0) status = 10;
+
+    /* Split every file into ranges, and queue the ranges of all files */
+    verify_file_t *files = (verify_file_t*)calloc(b.n_items + 1, sizeof(verify_file_t));
+    CHECK_MALLOC(files);
+    verify_queue_t q;
+    pthread_mutex_init(&q.lock, NULL);
+    q.n_ranges = 0;
+    q.next = 0;
+
+    int64_t total_bytes = 0;
+    int total_ranges = 0;
+    for(int i=0; i<b.n_items; i++) {
+        total_ranges += (b.items[i].file_size + range_size - 1) / range_size + 1;
+    }
+    q.ranges = (verify_range_t**)malloc((total_ranges + 1) * sizeof(verify_range_t*));
+    CHECK_MALLOC(q.ranges);
+
+    for(int i=0; i<b.n_items; i++) {
+        verify_file_t *vf = &files[i];
+        vf->filename = b.items[i].filename;
+        vf->file_size = b.items[i].file_size;
+        total_bytes += vf->file_size;
+
+        OpusReader r;
+        if(opus_reader_open(&r, vf->filename) == 0) {
+            vf->have_header = true;
+            vf->serialno = r.serialno;
+            vf->nb_streams = r.header.nb_streams;
+            vf->preskip = r.header.preskip;
+            opus_reader_close(&r);
+        }
+
+        vf->n_ranges = (vf->file_size + range_size - 1) / range_size;
+        if(vf->n_ranges < 1) vf->n_ranges = 1;
+        vf->ranges = (verify_range_t*)calloc(vf->n_ranges, sizeof(verify_range_t));
+        CHECK_MALLOC(vf->ranges);
+        for(int k=0; k<vf->n_ranges; k++) {
+            verify_range_t *vr = &vf->ranges[k];
+            vr->file = vf;
+            vr->start = k * range_size;
+            vr->end = k == vf->n_ranges - 1 ? vf->file_size : (k + 1) * range_size;
+            q.ranges[q.n_ranges++] = vr;
+        }
+    }
+
+    struct timespec t_start, t_end;
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+    pthread_t *threads = (pthread_t*)malloc(n_threads * sizeof(pthread_t));
+    CHECK_MALLOC(threads);
+    for(int i=0; i<n_threads; i++) {
+        pthread_create(&threads[i], NULL, verify_worker, &q);
+    }
+    for(int i=0; i<n_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    double elapsed = (t_end.tv_sec - t_start.tv_sec) +
+        (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+
+    int bad_files = 0;
+    for(int i=0; i<b.n_items; i++) {
+        if(report_file(&files[i]) > 0) bad_files++;
+        for(int k=0; k<files[i].n_ranges; k++) {
+            free(files[i].ranges[k].errors);
+        }
+        free(files[i].ranges);
+    }
+
+    fprintf(stderr, "Verified %d files, %lld bytes in %0.02f s (%0.01f MB/s): "
+        "%d with problems\n", b.n_items, (long long)total_bytes, elapsed,
+        elapsed > 0 ? total_bytes / elapsed / 1e6 : 0, bad_files);
+
+    free(q.ranges);
+    free(files);
+    pthread_mutex_destroy(&q.lock);
+    batch_free(&b);
+
+    if(bad_files) status = 1;
+    return status;
+}
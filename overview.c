@@ -0,0 +1,339 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "util.h"
+#include "overview.h"
+
+/**
+ * Finds the peak magnitude and sum of squares of each channel of n
+ * interleaved frames of 1 or 2 channels.  Four lanes hold whole frames, so
+ * lane i always sees channel i % channels.
+ */
+static void overview_reduce(const float *pcm, int n, int channels,
+  float *peak, float *sum_sq) {
+    int total = n * channels;
+    int i = 0;
+    float p[4] = {0, 0, 0, 0};
+    float s[4] = {0, 0, 0, 0};
+
+#ifdef __SSE2__
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 vp = _mm_setzero_ps();
+    __m128 vs = _mm_setzero_ps();
+    for(; i + 4 <= total; i += 4) {
+        __m128 x = _mm_loadu_ps(pcm + i);
+        vp = _mm_max_ps(vp, _mm_and_ps(x, abs_mask));
+        vs = _mm_add_ps(vs, _mm_mul_ps(x, x));
+    }
+    _mm_storeu_ps(p, vp);
+    _mm_storeu_ps(s, vs);
+#endif
+
+    for(; i < total; i++) {
+        float a = fabsf(pcm[i]);
+        if(a > p[i & 3]) p[i & 3] = a;
+        s[i & 3] += pcm[i] * pcm[i];
+    }
+
+    for(int c=0; c<channels; c++) {
+        peak[c] = 0;
+        sum_sq[c] = 0;
+    }
+    for(int l=0; l<4; l++) {
+        int c = l % channels;
+        if(p[l] > peak[c]) peak[c] = p[l];
+        sum_sq[c] += s[l];
+    }
+}
+
+static uint16_t overview_quantise(double x) {
+    if(x >= 1.0) return 65535;
+    return (uint16_t)lrint(x * 65535);
+}
+
+static void overview_emit(overview_t *ov, overview_level_t *lv) {
+    if(lv->n_bins == lv->alloc) {
+        lv->alloc = lv->alloc ? 2 * lv->alloc : 1024;
+        for(int c=0; c<ov->channels; c++) {
+            lv->bins[c] = (uint16_t*)realloc(lv->bins[c], lv->alloc * 2 * sizeof(uint16_t));
+            CHECK_MALLOC(lv->bins[c]);
+        }
+    }
+
+    for(int c=0; c<ov->channels; c++) {
+        lv->bins[c][2 * lv->n_bins] = overview_quantise(lv->peak[c]);
+        lv->bins[c][2 * lv->n_bins + 1] = overview_quantise(sqrt(lv->sum_sq[c] / lv->count));
+        lv->peak[c] = 0;
+        lv->sum_sq[c] = 0;
+    }
+    lv->n_bins++;
+    lv->count = 0;
+}
+
+/**
+ * Starts an overview of one stream.
+ * @param bin_samples bin length of each level, ascending, each a multiple of
+ *  the first
+ */
+void overview_init(overview_t *ov, int channels, const int *bin_samples, int n_levels) {
+    memset(ov, 0, sizeof(overview_t));
+    ov->channels = channels;
+    ov->n_levels = n_levels;
+    for(int l=0; l<n_levels; l++) {
+        ov->levels[l].bin_samples = bin_samples[l];
+    }
+}
+
+/**
+ * Adds n frames of interleaved samples.  Samples are reduced once per finest
+ * bin, and every coarser bin is built from those partial results.
+ */
+void overview_add(overview_t *ov, const float *pcm, int n) {
+    overview_level_t *finest = &ov->levels[0];
+
+    while(n > 0) {
+        int m = finest->bin_samples - finest->count;
+        if(m > n) m = n;
+
+        float peak[2];
+        float sum_sq[2];
+        overview_reduce(pcm, m, ov->channels, peak, sum_sq);
+
+        for(int l=0; l<ov->n_levels; l++) {
+            overview_level_t *lv = &ov->levels[l];
+            for(int c=0; c<ov->channels; c++) {
+                if(peak[c] > lv->peak[c]) lv->peak[c] = peak[c];
+                lv->sum_sq[c] += sum_sq[c];
+            }
+            lv->count += m;
+            if(lv->count == lv->bin_samples) overview_emit(ov, lv);
+        }
+
+        pcm += m * ov->channels;
+        n -= m;
+    }
+}
+
+/**
+ * Finishes the last, partial, bin of each level.
+ */
+void overview_finish(overview_t *ov) {
+    for(int l=0; l<ov->n_levels; l++) {
+        if(ov->levels[l].count > 0) overview_emit(ov, &ov->levels[l]);
+    }
+}
+
+void overview_free(overview_t *ov) {
+    for(int l=0; l<ov->n_levels; l++) {
+        for(int c=0; c<ov->channels; c++) {
+            free(ov->levels[l].bins[c]);
+            ov->levels[l].bins[c] = NULL;
+        }
+    }
+}
+
+static void put_le32(unsigned char *buf, uint32_t val) {
+    for(int i=0; i<4; i++) buf[i] = (val >> (8*i)) & 0xff;
+}
+
+static void put_le64(unsigned char *buf, uint64_t val) {
+    for(int i=0; i<8; i++) buf[i] = (val >> (8*i)) & 0xff;
+}
+
+static uint64_t get_le64(const unsigned char *buf) {
+    uint64_t val = 0;
+    for(int i=7; i>=0; i--) val = (val << 8) | buf[i];
+    return val;
+}
+
+static uint32_t get_le32(const unsigned char *buf) {
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+/**
+ * Writes the overviews of several streams, which must share the same levels,
+ * to one sidecar.  The file is written under a temporary name and renamed
+ * into place, so a reader never maps a partial file.
+ * @param samples length of the decoded audio, per channel
+ * @return 0 on success, -1 on error
+ */
+int overview_write(const char *path, overview_t **ovs, int n_ovs, int64_t samples) {
+    static const unsigned char zeros[OVERVIEW_ALIGN];
+    int n_levels = ovs[0]->n_levels;
+    int channels = 0;
+    unsigned char header[OVERVIEW_HEADER_SIZE + OVERVIEW_MAX_LEVELS * OVERVIEW_LEVEL_SIZE];
+    int64_t n_bins[OVERVIEW_MAX_LEVELS];
+    int64_t offset[OVERVIEW_MAX_LEVELS];
+
+    for(int i=0; i<n_ovs; i++) channels += ovs[i]->channels;
+
+    /* streams are cut to the same length, but be safe if one came up short */
+    int64_t pos = OVERVIEW_HEADER_SIZE + n_levels * OVERVIEW_LEVEL_SIZE;
+    for(int l=0; l<n_levels; l++) {
+        n_bins[l] = 0;
+        for(int i=0; i<n_ovs; i++) {
+            if(ovs[i]->levels[l].n_bins > n_bins[l]) n_bins[l] = ovs[i]->levels[l].n_bins;
+        }
+        pos = (pos + OVERVIEW_ALIGN - 1) & ~(int64_t)(OVERVIEW_ALIGN - 1);
+        offset[l] = pos;
+        pos += n_bins[l] * channels * 2 * sizeof(uint16_t);
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, OVERVIEW_MAGIC, 4);
+    put_le32(header + 4, OVERVIEW_VERSION);
+    put_le32(header + 8, channels);
+    put_le32(header + 12, 48000);
+    put_le32(header + 16, n_levels);
+    put_le64(header + 24, samples);
+    for(int l=0; l<n_levels; l++) {
+        unsigned char *h = header + OVERVIEW_HEADER_SIZE + l * OVERVIEW_LEVEL_SIZE;
+        put_le32(h, ovs[0]->levels[l].bin_samples);
+        put_le64(h + 8, n_bins[l]);
+        put_le64(h + 16, offset[l]);
+    }
+
+    char tmpname[4096];
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", path);
+    FILE *fp = fopen(tmpname, "wb");
+    if(!fp) {
+        fprintf(stderr, "error: opening %s: ", tmpname);
+        perror(NULL);
+        return -1;
+    }
+
+    int64_t written = OVERVIEW_HEADER_SIZE + n_levels * OVERVIEW_LEVEL_SIZE;
+    fwrite(header, 1, written, fp);
+    for(int l=0; l<n_levels; l++) {
+        fwrite(zeros, 1, offset[l] - written, fp);
+        written = offset[l];
+
+        /* bins are kept in host order; the format is little-endian */
+        for(int i=0; i<n_ovs; i++) {
+            overview_level_t *lv = &ovs[i]->levels[l];
+            for(int c=0; c<ovs[i]->channels; c++) {
+                fwrite(lv->bins[c], 2 * sizeof(uint16_t), lv->n_bins, fp);
+                for(int64_t b=lv->n_bins; b<n_bins[l]; b++) {
+                    fwrite(zeros, 2 * sizeof(uint16_t), 1, fp);
+                }
+                written += n_bins[l] * 2 * sizeof(uint16_t);
+            }
+        }
+    }
+
+    if(ferror(fp) | fclose(fp)) {
+        fprintf(stderr, "error: writing %s\n", tmpname);
+        unlink(tmpname);
+        return -1;
+    }
+    if(rename(tmpname, path) < 0) {
+        fprintf(stderr, "error: renaming %s: ", tmpname);
+        perror(NULL);
+        unlink(tmpname);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Maps a sidecar into memory and checks its header.
+ * @return 0 on success, -1 on error
+ */
+int overview_map(overview_map_t *m, const char *path) {
+    struct stat st;
+
+    memset(m, 0, sizeof(overview_map_t));
+    int fd = open(path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "error: opening %s: ", path);
+        perror(NULL);
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    if(st.st_size < OVERVIEW_HEADER_SIZE) {
+        fprintf(stderr, "error: %s: not an overview file\n", path);
+        close(fd);
+        return -1;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        fprintf(stderr, "error: mapping %s: ", path);
+        perror(NULL);
+        return -1;
+    }
+    m->data = (const unsigned char*)data;
+    m->length = st.st_size;
+    m->channels = get_le32(m->data + 8);
+    m->n_levels = get_le32(m->data + 16);
+    m->samples = get_le64(m->data + 24);
+
+    if(memcmp(m->data, OVERVIEW_MAGIC, 4) != 0 ||
+      get_le32(m->data + 4) != OVERVIEW_VERSION ||
+      m->n_levels > OVERVIEW_MAX_LEVELS ||
+      OVERVIEW_HEADER_SIZE + m->n_levels * OVERVIEW_LEVEL_SIZE > m->length) {
+        fprintf(stderr, "error: %s: not an overview file\n", path);
+        overview_unmap(m);
+        return -1;
+    }
+
+    for(int l=0; l<m->n_levels; l++) {
+        int bin_samples;
+        int64_t n_bins;
+        overview_level(m, l, &bin_samples, &n_bins);
+        const unsigned char *h = m->data + OVERVIEW_HEADER_SIZE + l * OVERVIEW_LEVEL_SIZE;
+        uint64_t end = get_le64(h + 16) + (uint64_t)n_bins * m->channels * 2 * sizeof(uint16_t);
+        if(end > m->length) {
+            fprintf(stderr, "error: %s: truncated overview file\n", path);
+            overview_unmap(m);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void overview_unmap(overview_map_t *m) {
+    if(m->data) munmap((void*)m->data, m->length);
+    m->data = NULL;
+}
+
+/**
+ * Looks up the bin length and number of bins of a level.
+ * @return 0 on success, -1 if there is no such level
+ */
+int overview_level(const overview_map_t *m, int level, int *bin_samples,
+  int64_t *n_bins) {
+    if(level < 0 || level >= m->n_levels) return -1;
+    const unsigned char *h = m->data + OVERVIEW_HEADER_SIZE + level * OVERVIEW_LEVEL_SIZE;
+    *bin_samples = get_le32(h);
+    *n_bins = get_le64(h + 8);
+    return 0;
+}
+
+/**
+ * Finds the (peak, rms) pairs of one channel at one level, straight from the
+ * mapped file.
+ * @return pointer to n_bins pairs, or NULL if there is no such level/channel
+ */
+const uint16_t *overview_bins(const overview_map_t *m, int level, int channel) {
+    int bin_samples;
+    int64_t n_bins;
+
+    if(overview_level(m, level, &bin_samples, &n_bins) < 0) return NULL;
+    if(channel < 0 || channel >= m->channels) return NULL;
+
+    const unsigned char *h = m->data + OVERVIEW_HEADER_SIZE + level * OVERVIEW_LEVEL_SIZE;
+    return (const uint16_t*)(m->data + get_le64(h + 16)) + 2 * n_bins * channel;
+}
@@ -0,0 +1,63 @@
+#ifndef __overview_h_
+#define __overview_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Sidecar layout (all fields little-endian):
+ *
+ *   0  "OPOV", version, channels, sample rate, levels, reserved (u32 each)
+ *  24  total samples per channel after the pre-skip (u64)
+ *  32  per level: samples per bin (u32), reserved (u32), bins (u64) and the
+ *      file offset of the level's data (u64)
+ *
+ * Each level's data starts on a 64 byte boundary and holds, for each channel
+ * in turn, a (peak, rms) pair of u16 per bin, where 65535 is full scale.
+ * Channels are numbered in stream order, coupled streams giving two. */
+#define OVERVIEW_MAGIC "OPOV"
+#define OVERVIEW_VERSION 1
+#define OVERVIEW_HEADER_SIZE 32
+#define OVERVIEW_LEVEL_SIZE 24
+#define OVERVIEW_ALIGN 64
+#define OVERVIEW_MAX_LEVELS 8
+
+typedef struct {
+    int bin_samples;
+    float peak[2];          /* the bin being filled, per channel */
+    double sum_sq[2];
+    int count;              /* samples in the bin being filled */
+
+    uint16_t *bins[2];      /* finished bins, per channel */
+    int64_t n_bins;
+    int64_t alloc;
+} overview_level_t;
+
+/* overview of the channels of one stream, built as it is decoded */
+typedef struct {
+    int channels;
+    int n_levels;
+    overview_level_t levels[OVERVIEW_MAX_LEVELS];
+} overview_t;
+
+/* a sidecar mapped into memory */
+typedef struct {
+    const unsigned char *data;
+    size_t length;
+    int channels;
+    int n_levels;
+    int64_t samples;
+} overview_map_t;
+
+void overview_init(overview_t *ov, int channels, const int *bin_samples, int n_levels);
+void overview_add(overview_t *ov, const float *pcm, int n);
+void overview_finish(overview_t *ov);
+void overview_free(overview_t *ov);
+int overview_write(const char *path, overview_t **ovs, int n_ovs, int64_t samples);
+
+int overview_map(overview_map_t *m, const char *path);
+void overview_unmap(overview_map_t *m);
+int overview_level(const overview_map_t *m, int level, int *bin_samples,
+  int64_t *n_bins);
+const uint16_t *overview_bins(const overview_map_t *m, int level, int channel);
+
+#endif // __overview_h_
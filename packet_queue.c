@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "packet_queue.h"
+
+/**
+ * Initialises a queue of packets handed from one thread to another.
+ * @param max_queued bytes the queue may hold before push blocks or drops
+ */
+void packet_queue_init(packet_queue_t *q, size_t max_queued) {
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    q->head = NULL;
+    q->tail = NULL;
+    q->queued = 0;
+    q->max_queued = max_queued;
+    q->closed = false;
+}
+
+/**
+ * Queues a copy of a packet.  A packet always fits in an empty queue.
+ * @param block when the queue is full, wait for room instead of dropping
+ *  the packet
+ * @return 0 on success, -1 if the packet was dropped
+ */
+int packet_queue_push(packet_queue_t *q, const unsigned char *data, int bytes,
+  int64_t granulepos, bool block) {
+    queued_packet_t *pkt = (queued_packet_t*)malloc(sizeof(queued_packet_t) + bytes);
+    CHECK_MALLOC(pkt);
+    pkt->next = NULL;
+    pkt->bytes = bytes;
+    pkt->granulepos = granulepos;
+    memcpy(pkt->data, data, bytes);
+
+    pthread_mutex_lock(&q->lock);
+    while(q->head && q->queued + bytes > q->max_queued) {
+        if(!block) {
+            pthread_mutex_unlock(&q->lock);
+            free(pkt);
+            return -1;
+        }
+        pthread_cond_wait(&q->cond, &q->lock);
+    }
+
+    if(q->tail) {
+        q->tail->next = pkt;
+    } else {
+        q->head = pkt;
+    }
+    q->tail = pkt;
+    q->queued += bytes;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+
+    return 0;
+}
+
+/**
+ * Takes the next packet off the queue, waiting for one if it is empty.  The
+ * caller frees the packet.
+ * @return the packet, or NULL once the queue is closed and empty
+ */
+queued_packet_t *packet_queue_pop(packet_queue_t *q) {
+    pthread_mutex_lock(&q->lock);
+    while(!q->head && !q->closed) {
+        pthread_cond_wait(&q->cond, &q->lock);
+    }
+
+    queued_packet_t *pkt = q->head;
+    if(pkt) {
+        q->head = pkt->next;
+        if(!q->head) q->tail = NULL;
+        q->queued -= pkt->bytes;
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return pkt;
+}
+
+/**
+ * Marks the end of the packets; pop returns NULL once the rest are taken.
+ */
+void packet_queue_close(packet_queue_t *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void packet_queue_destroy(packet_queue_t *q) {
+    while(q->head) {
+        queued_packet_t *next = q->head->next;
+        free(q->head);
+        q->head = next;
+    }
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+}
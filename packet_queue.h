@@ -0,0 +1,33 @@
+#ifndef __packet_queue_h_
+#define __packet_queue_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+typedef struct queued_packet {
+    struct queued_packet *next;
+    int bytes;
+    int64_t granulepos;
+    unsigned char data[1];
+} queued_packet_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    /* signalled when a packet is queued or taken */
+    queued_packet_t *head;
+    queued_packet_t *tail;
+    size_t queued;          /* bytes waiting in the queue */
+    size_t max_queued;
+    bool closed;
+} packet_queue_t;
+
+void packet_queue_init(packet_queue_t *q, size_t max_queued);
+int packet_queue_push(packet_queue_t *q, const unsigned char *data, int bytes,
+  int64_t granulepos, bool block);
+queued_packet_t *packet_queue_pop(packet_queue_t *q);
+void packet_queue_close(packet_queue_t *q);
+void packet_queue_destroy(packet_queue_t *q);
+
+#endif // __packet_queue_h_
@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "util.h"
+#include "pipeline.h"
+#include "trace.h"
+
+/**
+ * Prints a message prefixed with the pipeline's name, as one line even
+ * with other pipelines printing at the same time.
+ */
+static void pipeline_log(pipeline_t *p, const char *fmt, ...) {
+    va_list ap;
+
+    flockfile(stderr);
+    if(p->cfg.name) fprintf(stderr, "%s: ", p->cfg.name);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    funlockfile(stderr);
+}
+
+/**
+ * Fills in the settings tidstream uses when given no options.
+ */
+void pipeline_config_defaults(pipeline_config_t *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->client_name = "tidstream";
+    cfg->codec = CODEC_VORBIS;
+    cfg->n_channels = 8;
+    cfg->min_bitrate = 128000;
+    cfg->avg_bitrate = 256000;
+    cfg->max_bitrate = 384000;
+    cfg->quality = NAN;
+    cfg->complexity = -1;
+    cfg->host = "doppler.media.mit.edu";
+    cfg->port = 8000;
+    cfg->mount = "tidmarsh_test.ogg";
+    cfg->password = "password";
+    cfg->stream_options.backend = STREAM_LIBSHOUT;
+    cfg->stream_options.tcp = STREAM_TCP_NODELAY;
+    cfg->archive_length = 3600;
+    cfg->archive_sync = 256;
+    cfg->auto_connect_offset = 1;
+}
+
+const char *pipeline_status_str(pipeline_status_t status) {
+    switch(status) {
+        case ERR_OK: return "OK";
+        case ERR_ENCODER_SETUP: return "encoder setup error";
+        case ERR_STREAM_SETUP: return "stream setup error";
+        case ERR_STREAM: return "streaming error";
+        case ERR_ENCODER: return "encoder/streaming error";
+        default: return "unknown error";
+    }
+}
+
+/**
+ * Checks settings that only make sense together.
+ * @return 0 if they are usable, -1 after printing why not
+ */
+static int pipeline_check(const pipeline_config_t *cfg, const char *prefix) {
+    const char *error = NULL;
+
+    if(cfg->n_channels < 1) {
+        error = "at least one channel is needed";
+    } else if(cfg->archive_name && cfg->codec != CODEC_OPUS) {
+        error = "archiving is only supported with opus";
+    } else if(cfg->adaptive_bitrate && cfg->codec != CODEC_OPUS) {
+        error = "adaptive bitrate is only supported with opus";
+    } else if((cfg->complexity >= 0 || cfg->cpu_budget) && cfg->codec != CODEC_OPUS) {
+        error = "complexity settings are only supported with opus";
+    } else if(cfg->complexity > 10 || cfg->cpu_budget < 0 || cfg->cpu_budget > 100) {
+        error = "complexity must be 0-10 and the CPU budget 1-100%";
+    } else if(cfg->no_stream && !cfg->archive_name) {
+        error = "archive-only streaming requires an archive";
+    }
+
+    if(error) {
+        fprintf(stderr, "error: %s%s%s\n", prefix ? prefix : "",
+            prefix ? ": " : "", error);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Sets up a pipeline: starts capturing from JACK straight away, and leaves
+ * connecting the stream to the first pipeline_step.
+ * @return the pipeline, or NULL if the settings are invalid or capture
+ *  could not start
+ */
+pipeline_t *pipeline_new(const pipeline_config_t *cfg) {
+    if(pipeline_check(cfg, cfg->name) < 0) return NULL;
+
+    pipeline_t *p = (pipeline_t*)calloc(1, sizeof(pipeline_t));
+    CHECK_MALLOC(p);
+    p->cfg = *cfg;
+    p->chunk_size = cfg->codec == CODEC_OPUS ? PIPELINE_OPUS_FRAMES :
+        PIPELINE_VORBIS_FRAMES;
+
+    p->data = malloc(sizeof(float*) * cfg->n_channels);
+    CHECK_MALLOC(p->data);
+    if(cfg->codec == CODEC_OPUS) {
+        p->interleaved = malloc(sizeof(float) * cfg->n_channels * p->chunk_size);
+        CHECK_MALLOC(p->interleaved);
+
+        p->opus = enc_opus_new(cfg->name);
+        if(cfg->adaptive_bitrate) enc_opus_set_adaptive(p->opus, cfg->adaptive_bitrate);
+        enc_opus_set_complexity(p->opus, cfg->complexity, cfg->cpu_budget / 100.0);
+        if(cfg->archive_name) {
+            enc_opus_set_archive(p->opus, cfg->archive_name,
+                (int64_t)cfg->archive_length * 48000, (size_t)cfg->archive_sync * 1024);
+        }
+    } else {
+        p->vorbis = enc_vorbis_new(cfg->name);
+    }
+
+    p->audio = audio_new(cfg->client_name, cfg->n_channels);
+    if(!p->audio) {
+        pipeline_free(p);
+        return NULL;
+    }
+    if(cfg->auto_connect) {
+        audio_connect_inputs(p->audio, cfg->auto_connect_offset);
+    }
+
+    if(cfg->control_path) {
+        p->control = control_new(cfg->control_path);
+        if(!p->control) {
+            pipeline_free(p);
+            return NULL;
+        }
+    }
+
+    return p;
+}
+
+/**
+ * Sets up the opus encoder, which then runs whether or not the stream is
+ * up, so that the archive has no gaps.  Vorbis is set up for each
+ * connection instead, in pipeline_connect.
+ */
+static int pipeline_start(pipeline_t *p) {
+    if(p->cfg.codec == CODEC_OPUS) {
+        int ret = enc_opus_setup(p->opus, 48000, p->cfg.n_channels,
+            p->cfg.avg_bitrate);
+        if(ret != 0) {
+            pipeline_log(p, "enc_opus_setup error\n");
+            p->status = ERR_ENCODER_SETUP;
+            return -1;
+        }
+    }
+
+    p->status = ERR_OK;
+    return 0;
+}
+
+static void pipeline_close_stream(pipeline_t *p) {
+    if(p->opus) enc_opus_detach(p->opus);
+    stream_close(p->stream);
+    p->stream = NULL;
+}
+
+/**
+ * Connects the stream and starts a new Ogg stream on it.
+ */
+static int pipeline_connect(pipeline_t *p) {
+    int ret;
+
+    p->stream = stream_setup(p->cfg.host, p->cfg.port, p->cfg.password,
+        p->cfg.mount, &p->cfg.stream_options);
+    if(!p->stream) {
+        pipeline_log(p, "shout error\n");
+        p->status = ERR_STREAM_SETUP;
+        return -1;
+    }
+
+    if(p->cfg.codec == CODEC_OPUS) {
+        ret = enc_opus_attach(p->opus, p->stream);
+        if(ret != 0) {
+            pipeline_log(p, "stream error\n");
+            p->status = ERR_STREAM;
+            pipeline_close_stream(p);
+            return -1;
+        }
+    } else {
+        ret = enc_vorbis_setup(p->vorbis, p->stream, 48000, p->cfg.n_channels,
+            p->cfg.min_bitrate,
+            isnan(p->cfg.quality) ? p->cfg.avg_bitrate : p->cfg.quality_bitrate,
+            p->cfg.max_bitrate, p->cfg.quality);
+        if(ret != 0) {
+            pipeline_log(p, "vorbis error\n");
+            p->status = ret == -4 ? ERR_STREAM : ERR_ENCODER_SETUP;
+            pipeline_close_stream(p);
+            return -1;
+        }
+    }
+
+    p->status = ERR_OK;
+    return 0;
+}
+
+/**
+ * @return true while encoded audio has somewhere to go: the stream, or the
+ *  archive, which keeps recording while the stream is down
+ */
+static bool pipeline_encoding(pipeline_t *p) {
+    return p->stream || (p->opus && p->opus->archive);
+}
+
+/**
+ * @return true if the stream is down and should be reconnected
+ */
+static bool pipeline_disconnected(pipeline_t *p) {
+    return !p->cfg.no_stream && !p->stream && !p->stream_failed;
+}
+
+/**
+ * Stops a pipeline that failed to start.  With retry on it starts again
+ * after a delay, otherwise it stays stopped.
+ */
+static void pipeline_stop(pipeline_t *p) {
+    p->running = false;
+    pipeline_close_stream(p);
+    if(!p->cfg.retry) {
+        pipeline_log(p, "stopped due to error: %s\n", pipeline_status_str(p->status));
+        p->failed = true;
+        return;
+    }
+    pipeline_log(p, "main loop terminated due to error: %s\n",
+        pipeline_status_str(p->status));
+    pipeline_log(p, "restarting after delay\n");
+    p->retry_at = time(NULL) + PIPELINE_RETRY_DELAY;
+}
+
+/**
+ * Gives up on a stream that failed to connect.  The encoder and archive
+ * carry on; with retry on the stream reconnects after a delay.  Without an
+ * archive there is nothing left to do, so the whole pipeline stops.
+ */
+static void pipeline_stop_stream(pipeline_t *p) {
+    if(!pipeline_encoding(p)) {
+        pipeline_stop(p);
+        return;
+    }
+
+    pipeline_log(p, "stream stopped due to error: %s\n",
+        pipeline_status_str(p->status));
+    if(!p->cfg.retry) {
+        pipeline_log(p, "archiving only from now on\n");
+        p->stream_failed = true;
+        return;
+    }
+    pipeline_log(p, "reconnecting after delay, archiving meanwhile\n");
+    p->retry_at = time(NULL) + PIPELINE_RETRY_DELAY;
+}
+
+/**
+ * @return true if pipeline_step has something to do: audio to encode or
+ *  discard, a command to answer, or a restart or reconnect that is due
+ */
+bool pipeline_pending(pipeline_t *p) {
+    if(p->failed) return false;
+    if(!p->running) {
+        return time(NULL) >= p->retry_at || audio_get_fill(p->audio) > 0.5;
+    }
+
+    return audio_get_available(p->audio) > p->chunk_size * sizeof(float) ||
+        control_pending(p->control) ||
+        (pipeline_disconnected(p) && time(NULL) >= p->retry_at);
+}
+
+/**
+ * Records a chunk taken from the capture buffer and how long it waited
+ * there, and tells the encoder when it was captured.
+ */
+static void pipeline_trace_dequeue(pipeline_t *p, uint64_t start) {
+    uint64_t captured = audio_capture_time(p->audio, p->chunk_size);
+
+    trace_complete("dequeue", p->cfg.name, start, "age_us",
+        captured ? (int64_t)(start - captured) / 1000 : -1);
+    if(p->opus) p->opus->capture_time = captured;
+    if(p->vorbis) p->vorbis->capture_time = captured;
+}
+
+/**
+ * Does whatever work the pipeline has waiting, without blocking: (re)starts
+ * it and (re)connects the stream when due, answers a command from the
+ * control socket, and encodes and sends all the audio captured so far.
+ * Audio with nowhere to go, while the pipeline or a stream without an
+ * archive is down, is discarded.  An encoder error restarts the pipeline,
+ * and a stream error reconnects the stream, straight away on the next step.
+ * @return 0 while the pipeline is alive, -1 once it has stopped for good
+ */
+int pipeline_step(pipeline_t *p) {
+    if(p->failed) return -1;
+
+    if(!p->running) {
+        if(time(NULL) < p->retry_at) {
+            /* audio captured while waiting to restart would be stale by
+             * then, and would overrun the buffer meanwhile */
+            while(audio_get_available(p->audio) > p->chunk_size * sizeof(float)) {
+                audio_consume(p->audio, p->chunk_size);
+            }
+            return 0;
+        }
+        if(pipeline_start(p) < 0) {
+            pipeline_stop(p);
+            return p->failed ? -1 : 0;
+        }
+        p->running = true;
+    }
+    if(pipeline_disconnected(p) && time(NULL) >= p->retry_at) {
+        if(pipeline_connect(p) < 0) pipeline_stop_stream(p);
+        if(p->failed) return -1;
+    }
+
+    if(p->cfg.codec == CODEC_OPUS) {
+        control_process(p->control, enc_opus_control, p->opus);
+    } else {
+        control_process(p->control, enc_vorbis_control, p->vorbis);
+    }
+
+    while(p->running &&
+            audio_get_available(p->audio) > p->chunk_size * sizeof(float)) {
+        int ret;
+        if(!pipeline_encoding(p)) {
+            /* stale by the time the stream is back */
+            audio_consume(p->audio, p->chunk_size);
+            continue;
+        }
+        uint64_t start = trace_enabled() ? trace_now() : 0;
+        /* the audio is read where JACK left it: interleaving it for opus
+         * or handing it to vorbis is the only copy */
+        audio_peek(p->audio, p->data);
+        if(start) pipeline_trace_dequeue(p, start);
+        if(p->cfg.codec == CODEC_OPUS) {
+            audio_interleave(p->data, p->interleaved, p->cfg.n_channels,
+                p->chunk_size);
+            audio_consume(p->audio, p->chunk_size);
+            ret = enc_opus_encode(p->opus, p->interleaved, p->chunk_size,
+                audio_get_fill(p->audio));
+        } else {
+            ret = enc_vorbis_encode(p->vorbis, p->data, p->chunk_size);
+            audio_consume(p->audio, p->chunk_size);
+        }
+        if(ret == -4) {
+            pipeline_log(p, "stream error\n");
+            p->status = ERR_STREAM;
+            pipeline_close_stream(p);
+        } else if(ret != 0) {
+            pipeline_log(p, "encoder error: %d\n", ret);
+            p->status = ERR_ENCODER;
+            p->running = false;
+            pipeline_close_stream(p);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Stops capturing, writes out the archive and closes the stream.
+ */
+void pipeline_free(pipeline_t *p) {
+    if(!p) return;
+
+    audio_free(p->audio);
+    control_free(p->control);
+    enc_opus_free(p->opus);
+    enc_vorbis_free(p->vorbis);
+    stream_close(p->stream);
+
+    free(p->data);
+    free(p->interleaved);
+    free(p);
+}
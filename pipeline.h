@@ -0,0 +1,93 @@
+#ifndef __pipeline_h_
+#define __pipeline_h_
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "audio.h"
+#include "enc_opus.h"
+#include "enc_vorbis.h"
+#include "stream.h"
+#include "control.h"
+
+#define PIPELINE_OPUS_FRAMES 960        /* 20 ms packets */
+#define PIPELINE_VORBIS_FRAMES 4096
+#define PIPELINE_RETRY_DELAY 10         /* seconds between restarts with retry on */
+
+typedef enum {
+    CODEC_VORBIS,
+    CODEC_OPUS
+} codec_mode_t;
+
+typedef enum {
+    ERR_OK,
+    ERR_ENCODER_SETUP,
+    ERR_STREAM_SETUP,
+    ERR_STREAM,
+    ERR_ENCODER,
+} pipeline_status_t;
+
+/* one group of JACK inputs, encoded and sent to one mount */
+typedef struct {
+    const char *name;           /* labels output, or NULL for a lone pipeline */
+    const char *client_name;    /* JACK client */
+    codec_mode_t codec;
+    int n_channels;
+    int min_bitrate;            /* bits per second */
+    int avg_bitrate;
+    int max_bitrate;
+    float quality;              /* vorbis, -1 to 10 instead of managing the
+                                   bitrate, or NAN */
+    int quality_bitrate;        /* soft average with quality, or 0 */
+    int adaptive_bitrate;       /* lowest opus bitrate, or 0 for a fixed one */
+    int complexity;             /* opus, 0-10 or -1 for the default */
+    int cpu_budget;             /* percent of real time for opus, or 0 */
+
+    const char *host;
+    int port;
+    const char *mount;
+    const char *password;
+    stream_options_t stream_options;
+    bool no_stream;             /* archive only */
+
+    const char *archive_name;
+    int archive_length;         /* seconds */
+    int archive_sync;           /* kbytes */
+
+    bool auto_connect;
+    int auto_connect_offset;    /* first system:capture port */
+    bool retry;
+    const char *control_path;
+} pipeline_config_t;
+
+typedef struct {
+    pipeline_config_t cfg;
+    int chunk_size;             /* frames encoded at a time */
+
+    audio_t *audio;
+    enc_opus_t *opus;
+    enc_vorbis_t *vorbis;
+    stream_t *stream;
+    control_t *control;
+
+    float **data;               /* each channel's audio, in its capture buffer */
+    float *interleaved;
+
+    pipeline_status_t status;   /* why the pipeline last stopped */
+    bool running;               /* the encoder is set up */
+    bool failed;                /* stopped for good */
+    bool stream_failed;         /* the stream stopped for good; archiving
+                                   carries on */
+    time_t retry_at;            /* when to restart a stopped pipeline, or
+                                   reconnect its stream */
+    int busy;                   /* being stepped by a worker; tidmanager */
+} pipeline_t;
+
+void pipeline_config_defaults(pipeline_config_t *cfg);
+const char *pipeline_status_str(pipeline_status_t status);
+pipeline_t *pipeline_new(const pipeline_config_t *cfg);
+bool pipeline_pending(pipeline_t *p);
+int pipeline_step(pipeline_t *p);
+void pipeline_free(pipeline_t *p);
+
+#endif // __pipeline_h_
@@ -0,0 +1,24 @@
+#ifndef __probes_h_
+#define __probes_h_
+
+/*
+ * USDT static probes, for bpftrace, perf and SystemTap.  Each is a single
+ * nop until a tracer attaches, and stays put however the code around it is
+ * inlined.  Built in when <sys/sdt.h> (systemtap-sdt-dev) is found; see
+ * bpftrace/ for examples.  All probes are in the "tidstream" provider.
+ */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(tidstream, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(tidstream, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(tidstream, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(tidstream, name, a, b, c, d)
+#else
+#define PROBE1(name, a) do {} while(0)
+#define PROBE2(name, a, b) do {} while(0)
+#define PROBE3(name, a, b, c) do {} while(0)
+#define PROBE4(name, a, b, c, d) do {} while(0)
+#endif
+
+#endif // __probes_h_
@@ -0,0 +1,69 @@
+#include <stdbool.h>
+
+#include "rate_control.h"
+
+/**
+ * Starts a controller at its maximum bitrate.
+ */
+void rate_control_init(rate_control_t *rc, int min_bitrate, int max_bitrate) {
+    rc->min_bitrate = min_bitrate < max_bitrate ? min_bitrate : max_bitrate;
+    rc->max_bitrate = max_bitrate;
+    rc->bitrate = max_bitrate;
+    rc->blocked_avg = 0;
+    rc->since_change = 0;
+    rc->clear = 0;
+    rc->change_backlog = 0;
+}
+
+/**
+ * Feeds the controller what the stream reported since the last update.  The
+ * bitrate drops multiplicatively as soon as the link is congested, and
+ * climbs back in small steps only once it has been clear for a while, so
+ * that a link on the edge does not make the bitrate oscillate.
+ * @param backlog bytes waiting to be sent
+ * @param blocked seconds spent sending since the last update
+ * @param elapsed seconds since the last update
+ * @return the bitrate the encoder should use
+ */
+int rate_control_update(rate_control_t *rc, size_t backlog, double blocked,
+  double elapsed) {
+    if(elapsed <= 0) return rc->bitrate;
+
+    /* smoothed over about a second */
+    double weight = elapsed < 1.0 ? elapsed : 1.0;
+    double fraction = blocked / elapsed;
+    rc->blocked_avg += weight * ((fraction < 1.0 ? fraction : 1.0) - rc->blocked_avg);
+    rc->since_change += elapsed;
+
+    double queued = backlog * 8.0 / rc->bitrate;
+    bool congested = queued > RATE_CONTROL_BACKLOG_HIGH ||
+        rc->blocked_avg > RATE_CONTROL_BLOCKED_HIGH;
+    bool clear = queued < RATE_CONTROL_BACKLOG_LOW &&
+        rc->blocked_avg < RATE_CONTROL_BLOCKED_LOW;
+
+    if(congested) {
+        rc->clear = 0;
+        /* a backlog that is already draining needs no further cut */
+        bool draining = backlog < rc->change_backlog &&
+            rc->blocked_avg <= RATE_CONTROL_BLOCKED_HIGH;
+        if(rc->since_change >= RATE_CONTROL_HOLD && rc->bitrate > rc->min_bitrate &&
+          !draining) {
+            rc->bitrate *= RATE_CONTROL_DECREASE;
+            if(rc->bitrate < rc->min_bitrate) rc->bitrate = rc->min_bitrate;
+            rc->since_change = 0;
+            rc->change_backlog = backlog;
+        }
+    } else if(clear) {
+        rc->clear += elapsed;
+        if(rc->clear >= RATE_CONTROL_RECOVER && rc->since_change >= RATE_CONTROL_HOLD &&
+          rc->bitrate < rc->max_bitrate) {
+            rc->bitrate += rc->max_bitrate * RATE_CONTROL_INCREASE;
+            if(rc->bitrate > rc->max_bitrate) rc->bitrate = rc->max_bitrate;
+            rc->since_change = 0;
+        }
+    } else {
+        rc->clear = 0;
+    }
+
+    return rc->bitrate;
+}
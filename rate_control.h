@@ -0,0 +1,33 @@
+#ifndef __rate_control_h_
+#define __rate_control_h_
+
+#include <stddef.h>
+
+/* the link counts as congested past either of these, and as clear below
+ * the lower ones; in between nothing changes */
+#define RATE_CONTROL_BACKLOG_HIGH 0.5   /* seconds of audio waiting to be sent */
+#define RATE_CONTROL_BACKLOG_LOW 0.1
+#define RATE_CONTROL_BLOCKED_HIGH 0.5   /* fraction of the time spent sending */
+#define RATE_CONTROL_BLOCKED_LOW 0.2
+
+#define RATE_CONTROL_DECREASE 0.75      /* bitrate is scaled by this on congestion */
+#define RATE_CONTROL_INCREASE 0.05      /* and raised by this fraction of the maximum */
+#define RATE_CONTROL_HOLD 2.0           /* seconds between changes */
+#define RATE_CONTROL_RECOVER 10.0       /* seconds clear before raising the bitrate */
+
+typedef struct {
+    int min_bitrate;
+    int max_bitrate;
+    int bitrate;            /* current target, in bits per second */
+
+    double blocked_avg;     /* smoothed fraction of the time spent sending */
+    double since_change;    /* seconds since the bitrate last changed */
+    double clear;           /* seconds the link has been clear */
+    size_t change_backlog;  /* backlog when the bitrate last dropped */
+} rate_control_t;
+
+void rate_control_init(rate_control_t *rc, int min_bitrate, int max_bitrate);
+int rate_control_update(rate_control_t *rc, size_t backlog, double blocked,
+  double elapsed);
+
+#endif // __rate_control_h_
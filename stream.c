@@ -1,18 +1,49 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <time.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
+#include "util.h"
 #include "stream.h"
+#include "trace.h"
+#include "probes.h"
 
-int n_channels;
+static void base64_encode(const char *in, char *out) {
+    static const char table[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t len = strlen(in);
 
-shout_t *stream_setup(const char *host, int port, const char *password, 
- const char *mount) {
+    for(size_t i=0; i<len; i+=3) {
+        unsigned int v = (unsigned char)in[i] << 16;
+        if(i + 1 < len) v |= (unsigned char)in[i + 1] << 8;
+        if(i + 2 < len) v |= (unsigned char)in[i + 2];
+        *out++ = table[(v >> 18) & 0x3f];
+        *out++ = table[(v >> 12) & 0x3f];
+        *out++ = i + 1 < len ? table[(v >> 6) & 0x3f] : '=';
+        *out++ = i + 2 < len ? table[v & 0x3f] : '=';
+    }
+    *out = '\0';
+}
+
+static pthread_once_t stream_shout_once = PTHREAD_ONCE_INIT;
+
+static shout_t *stream_shout_open(const char *host, int port,
+  const char *password, const char *mount) {
     shout_t *shout;
 
-    /* shoutcast initialization */
-    shout_init();
+    /* shoutcast initialization, once however many streams are opened */
+    pthread_once(&stream_shout_once, shout_init);
     shout = shout_new();
     if(!shout) {
         fprintf(stderr, "error creating shoutcast client\n");
@@ -32,10 +63,392 @@ shout_t *stream_setup(const char *host, int port, const char *password,
         return NULL;
     }
 
+    return shout;
+}
+
+static double stream_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Waits for a socket to become ready, for whatever time is left.
+ * @param events POLLIN or POLLOUT
+ * @param deadline stream_now() time to give up at
+ * @return 1 once ready, 0 at the deadline, -1 on error
+ */
+static int stream_wait(int fd, short events, double deadline) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    int n;
+
+    do {
+        int timeout = (deadline - stream_now()) * 1000;
+        n = poll(&pfd, 1, timeout > 0 ? timeout : 0);
+    } while(n < 0 && errno == EINTR);
+    return n;
+}
+
+/**
+ * Connects to the first address that answers within STREAM_CONNECT_TIMEOUT
+ * in all, so that an unreachable server holds up the encoder for seconds
+ * rather than minutes of SYN retries.
+ * @return a blocking socket, or -1
+ */
+static int stream_connect(const char *host, int port) {
+    struct addrinfo hints, *res, *ai;
+    char service[16];
+    int fd = -1;
+    int err = ETIMEDOUT;
+    double deadline = stream_now() + STREAM_CONNECT_TIMEOUT;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+
+    int ret = getaddrinfo(host, service, &hints, &res);
+    if(ret) {
+        fprintf(stderr, "stream: error resolving %s: %s\n", host, gai_strerror(ret));
+        return -1;
+    }
+
+    for(ai=res; ai && stream_now() < deadline; ai=ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(fd < 0) {
+            err = errno;
+            continue;
+        }
+        int flags = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            fcntl(fd, F_SETFL, flags);
+            break;
+        }
+        err = errno;
+        if(err == EINPROGRESS) {
+            int n = stream_wait(fd, POLLOUT, deadline);
+            socklen_t len = sizeof(err);
+            if(n == 0) {
+                err = ETIMEDOUT;
+            } else if(n < 0) {
+                err = errno;
+            } else if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+                err = errno;
+            } else if(err == 0) {
+                fcntl(fd, F_SETFL, flags);
+                break;
+            }
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if(fd < 0) {
+        fprintf(stderr, "stream: error connecting to %s:%d: %s\n", host, port,
+            strerror(err));
+    }
+    return fd;
+}
+
+/**
+ * Builds the source request.  Uses the SOURCE method, which every Icecast 2
+ * release accepts.
+ * @return the request's length, or -1 if it doesn't fit
+ */
+static int stream_source_request(char *request, size_t size, const char *password,
+  const char *mount) {
+    char credentials[256];
+    char auth[344];
+
+    snprintf(credentials, sizeof(credentials), "source:%s", password);
+    base64_encode(credentials, auth);
+    int len = snprintf(request, size,
+        "SOURCE %s%s HTTP/1.0\r\n"
+        "Authorization: Basic %s\r\n"
+        "User-Agent: tidstream\r\n"
+        "Content-Type: application/ogg\r\n"
+        "\r\n", mount[0] == '/' ? "" : "/", mount, auth);
+    if(len >= size) {
+        fprintf(stderr, "stream: mountpoint too long\n");
+        return -1;
+    }
+    return len;
+}
+
+/**
+ * Sends the source request and waits for the server to accept it, for
+ * STREAM_CONNECT_TIMEOUT in all: a server that trickles its answer must not
+ * hang the encoder any more than one that never answers.
+ */
+static int stream_handshake(int fd, const char *password, const char *mount) {
+    char request[1024];
+    char response[1024];
+    double deadline = stream_now() + STREAM_CONNECT_TIMEOUT;
+
+    int len = stream_source_request(request, sizeof(request), password, mount);
+    if(len < 0) return -1;
+    int ready = stream_wait(fd, POLLOUT, deadline);
+    if(ready <= 0 || send(fd, request, len, MSG_NOSIGNAL) != len) {
+        fprintf(stderr, "stream: error sending request: %s\n",
+            ready ? strerror(errno) : "timed out");
+        return -1;
+    }
+
+    size_t got = 0;
+    while(got < sizeof(response) - 1) {
+        ssize_t n = -1;
+        ready = stream_wait(fd, POLLIN, deadline);
+        if(ready > 0) n = recv(fd, response + got, sizeof(response) - 1 - got, 0);
+        if(n <= 0) {
+            fprintf(stderr, "stream: no response from server: %s\n",
+                !ready ? "timed out" : n < 0 ? strerror(errno) : "connection closed");
+            return -1;
+        }
+        got += n;
+        response[got] = '\0';
+        if(strstr(response, "\r\n\r\n") || strstr(response, "\n\n")) break;
+    }
+
+    int status = 0;
+    if(sscanf(response, "HTTP/%*d.%*d %d", &status) != 1 || status != 200) {
+        char *eol = strpbrk(response, "\r\n");
+        if(eol) *eol = '\0';
+        fprintf(stderr, "stream: server refused source: %s\n", response);
+        return -1;
+    }
+    return 0;
+}
+
+static int stream_native_open(stream_t *s, const char *host, int port,
+  const char *password, const char *mount, const stream_options_t *opts) {
+    s->fd = stream_connect(host, port);
+    if(s->fd < 0) return -1;
+
+    if(opts->sndbuf > 0 && setsockopt(s->fd, SOL_SOCKET, SO_SNDBUF,
+      &opts->sndbuf, sizeof(opts->sndbuf)) < 0) {
+        perror("stream: setting SO_SNDBUF");
+    }
+    int on = 1;
+    if(s->tcp == STREAM_TCP_NODELAY) {
+        setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    if(stream_handshake(s->fd, password, mount) < 0) return -1;
+
+    /* sends never wait: what the socket can't take stays in the buffer */
+    fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+    if(s->tcp == STREAM_TCP_CORK) {
+        setsockopt(s->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    }
+
+    s->buf_size = STREAM_BATCH_SIZE;
+    s->buf = (unsigned char*)malloc(s->buf_size);
+    CHECK_MALLOC(s->buf);
+    return 0;
+}
+
+/**
+ * Hands the connection to the engine, which connects in the background and
+ * keeps retrying until the server accepts the source.
+ */
+static int stream_engine_open(stream_t *s, const char *host, int port,
+  const char *password, const char *mount, const stream_options_t *opts) {
+    char request[1024];
+    char label[512];
+
+    if(!opts->engine) {
+        fprintf(stderr, "stream: no network engine\n");
+        return -1;
+    }
+    int len = stream_source_request(request, sizeof(request), password, mount);
+    if(len < 0) return -1;
+    snprintf(label, sizeof(label), "%s:%d%s%s", host, port,
+        mount[0] == '/' ? "" : "/", mount);
+
+    /* cork only means something to a client that syncs its own socket */
+    s->conn = net_conn_new(opts->engine, host, port, label, request, len,
+        opts->sndbuf, s->tcp == STREAM_TCP_NODELAY);
+    return s->conn ? 0 : -1;
+}
+
+/**
+ * Connects to an Icecast server as a source.  With the engine the connection
+ * is made in the background, and pages sent meanwhile wait for it.
+ * @param opts which client to use and how to set up its socket, or NULL for
+ *  libshout
+ * @return the stream, or NULL on error
+ */
+stream_t *stream_setup(const char *host, int port, const char *password,
+  const char *mount, const stream_options_t *opts) {
+    static const stream_options_t defaults = { STREAM_LIBSHOUT, 0, STREAM_TCP_NODELAY,
+        NULL };
+    if(!opts) opts = &defaults;
+
+    stream_t *s = (stream_t*)calloc(1, sizeof(stream_t));
+    CHECK_MALLOC(s);
+    s->backend = opts->backend;
+    s->tcp = opts->tcp;
+    s->fd = -1;
+
+    if(s->backend == STREAM_NATIVE) {
+        if(stream_native_open(s, host, port, password, mount, opts) < 0) {
+            stream_close(s);
+            return NULL;
+        }
+    } else if(s->backend == STREAM_ENGINE) {
+        if(stream_engine_open(s, host, port, password, mount, opts) < 0) {
+            free(s);
+            return NULL;
+        }
+        return s;
+    } else {
+        s->shout = stream_shout_open(host, port, password, mount);
+        if(!s->shout) {
+            free(s);
+            return NULL;
+        }
+    }
+
     fprintf(stderr, "connected to http://%s:%d/%s\n", host, port, mount);
 
-  
-    return shout;
+    return s;
+}
+
+/**
+ * Sends as much of the buffered pages as the socket will take.
+ */
+static int stream_native_flush(stream_t *s) {
+    size_t sent = 0;
+    double start = stream_now();
+    uint64_t trace_start = trace_enabled() ? trace_now() : 0;
+
+    PROBE1(send_start, s->buf_used);
+    while(sent < s->buf_used) {
+        ssize_t n = send(s->fd, s->buf + sent, s->buf_used - sent, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            fprintf(stderr, "stream error: %s\n", strerror(errno));
+            PROBE2(send_done, sent, -1);
+            return -1;
+        }
+        sent += n;
+    }
+    PROBE2(send_done, sent, 0);
+
+    memmove(s->buf, s->buf + sent, s->buf_used - sent);
+    s->buf_used -= sent;
+    s->blocked += stream_now() - start;
+    if(trace_start && sent) trace_complete("send", NULL, trace_start, "bytes", sent);
+    return 0;
+}
+
+/**
+ * Queues a page, or several contiguous pages, for the server.  The native
+ * client collects pages and sends them together on the next sync, or once
+ * STREAM_BATCH_SIZE bytes are waiting.
+ * @return 0 on success, -1 on error
+ */
+int stream_send(stream_t *s, const unsigned char *data, size_t len) {
+    if(s->backend == STREAM_LIBSHOUT) {
+        uint64_t trace_start = trace_enabled() ? trace_now() : 0;
+        double start = stream_now();
+        /* bytes; send_done adds the result, 0 on success */
+        PROBE1(send_start, len);
+        int ret = shout_send(s->shout, data, len);
+        PROBE2(send_done, len, ret);
+        s->blocked += stream_now() - start;
+        if(trace_start) trace_complete("send", NULL, trace_start, "bytes", len);
+        if(ret != SHOUTERR_SUCCESS) {
+            fprintf(stderr, "shout error: %s\n", shout_get_error(s->shout));
+            return -1;
+        }
+        return 0;
+    }
+    if(s->backend == STREAM_ENGINE) {
+        return net_conn_send(s->conn, data, len);
+    }
+
+    if(s->buf_used + len > STREAM_MAX_BACKLOG) {
+        fprintf(stderr, "stream error: server is not keeping up\n");
+        return -1;
+    }
+    if(s->buf_used + len > s->buf_size) {
+        while(s->buf_used + len > s->buf_size) s->buf_size *= 2;
+        s->buf = (unsigned char*)realloc(s->buf, s->buf_size);
+        CHECK_MALLOC(s->buf);
+    }
+    memcpy(s->buf + s->buf_used, data, len);
+    s->buf_used += len;
+
+    if(s->buf_used >= STREAM_BATCH_SIZE) return stream_native_flush(s);
+    return 0;
 }
 
+/**
+ * Called after each block of input: hands the pages queued since the last
+ * sync to the network.  With libshout this also waits to keep to real time.
+ * @return 0 on success, -1 on error
+ */
+int stream_sync(stream_t *s) {
+    if(s->backend == STREAM_LIBSHOUT) {
+        shout_sync(s->shout);
+        return 0;
+    }
+    if(s->backend == STREAM_ENGINE) {
+        net_conn_flush(s->conn);
+        return 0;
+    }
 
+    if(!s->buf_used) return 0;
+    int ret = stream_native_flush(s);
+    if(ret == 0 && s->tcp == STREAM_TCP_CORK) {
+        /* pulling the cork pushes out the partial segment left over */
+        int off = 0, on = 1;
+        setsockopt(s->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+        setsockopt(s->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    }
+    return ret;
+}
+
+/**
+ * Reports how well the network is keeping up, for adapting the bitrate.
+ * @param backlog set to the bytes waiting to be sent
+ * @param blocked set to the seconds spent sending since the last call; with
+ *  libshout, whose sends block, this is where congestion shows up
+ */
+void stream_feedback(stream_t *s, size_t *backlog, double *blocked) {
+    if(s->backend == STREAM_LIBSHOUT) {
+        ssize_t queued = shout_queuelen(s->shout);
+        *backlog = queued > 0 ? queued : 0;
+    } else if(s->backend == STREAM_ENGINE) {
+        *backlog = net_conn_backlog(s->conn);
+    } else {
+        *backlog = s->buf_used;
+    }
+    *blocked = s->blocked;
+    s->blocked = 0;
+}
+
+void stream_close(stream_t *s) {
+    if(!s) return;
+
+    if(s->shout) {
+        shout_close(s->shout);
+        shout_free(s->shout);
+    }
+    /* the engine sends what is left on its own */
+    net_conn_close(s->conn);
+    if(s->fd >= 0) {
+        /* give the last pages STREAM_CLOSE_TIMEOUT in all to go out */
+        double deadline = stream_now() + STREAM_CLOSE_TIMEOUT;
+        while(s->buf_used && stream_wait(s->fd, POLLOUT, deadline) > 0) {
+            if(stream_native_flush(s) < 0) break;
+        }
+        close(s->fd);
+    }
+    free(s->buf);
+    free(s);
+}
@@ -1,9 +1,63 @@
 #ifndef __stream_h_
 #define __stream_h_
 
+#include <stddef.h>
 #include <shout/shout.h>
 
-shout_t *stream_setup(const char *host, int port, const char *password, const char *mount);
+#include "net_engine.h"
 
-#endif // __stream_h_
+/* pages the native client holds while the server is not keeping up; past
+ * this the stream fails and is reconnected */
+#define STREAM_MAX_BACKLOG (4 << 20)
+/* pages are collected up to this size, or until the next sync */
+#define STREAM_BATCH_SIZE (64 << 10)
+/* seconds the native client waits to connect, and again to be accepted;
+ * both happen on the encoder's thread */
+#define STREAM_CONNECT_TIMEOUT 3
+/* seconds the native client spends sending what is left when it closes */
+#define STREAM_CLOSE_TIMEOUT 2
+
+typedef enum {
+    STREAM_LIBSHOUT,
+    STREAM_NATIVE,
+    STREAM_ENGINE           /* the native client, driven by a net_engine_t */
+} stream_backend_t;
+
+/* when the native client lets TCP put data on the wire */
+typedef enum {
+    STREAM_TCP_NODELAY,     /* every batch goes out at once */
+    STREAM_TCP_CORK,        /* only full segments, until a sync */
+    STREAM_TCP_NAGLE        /* the kernel's default */
+} stream_tcp_t;
+
+typedef struct {
+    stream_backend_t backend;
+    int sndbuf;             /* SO_SNDBUF in bytes, or 0 for the default */
+    stream_tcp_t tcp;
+    net_engine_t *engine;   /* for STREAM_ENGINE */
+} stream_options_t;
+
+typedef struct {
+    stream_backend_t backend;
+    shout_t *shout;
 
+    int fd;
+    stream_tcp_t tcp;
+    unsigned char *buf;     /* pages not yet taken by the socket */
+    size_t buf_used;
+    size_t buf_size;
+
+    net_conn_t *conn;
+
+    double blocked;         /* seconds spent in send calls since the last
+                               stream_feedback */
+} stream_t;
+
+stream_t *stream_setup(const char *host, int port, const char *password,
+  const char *mount, const stream_options_t *opts);
+int stream_send(stream_t *s, const unsigned char *data, size_t len);
+int stream_sync(stream_t *s);
+void stream_feedback(stream_t *s, size_t *backlog, double *blocked);
+void stream_close(stream_t *s);
+
+#endif // __stream_h_
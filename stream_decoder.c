@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "file_writer.h"
+#include "stream_decoder.h"
+
+static void put_le16(unsigned char *buf, uint16_t val) {
+    buf[0] = val & 0xff;
+    buf[1] = val >> 8;
+}
+
+static void put_le32(unsigned char *buf, uint32_t val) {
+    for(int i=0; i<4; i++) buf[i] = (val >> (8*i)) & 0xff;
+}
+
+static void put_le64(unsigned char *buf, uint64_t val) {
+    for(int i=0; i<8; i++) buf[i] = (val >> (8*i)) & 0xff;
+}
+
+/**
+ * Fills in a WAV header for 48 kHz float samples.  The header has the same
+ * size either way: below 4 GiB the ds64 chunk is written as a JUNK chunk,
+ * so the file can be turned into RF64 once its final size is known.
+ * @param samples number of samples per channel in the data chunk
+ */
+static void wav_header(unsigned char *h, int channels, int64_t samples) {
+    uint64_t data_bytes = (uint64_t)samples * channels * sizeof(float);
+    uint64_t riff_size = WAV_HEADER_SIZE - 8 + data_bytes;
+    bool rf64 = riff_size > 0xffffffffu;
+
+    memset(h, 0, WAV_HEADER_SIZE);
+    memcpy(h, rf64 ? "RF64" : "RIFF", 4);
+    put_le32(h + 4, rf64 ? 0xffffffffu : riff_size);
+    memcpy(h + 8, "WAVE", 4);
+
+    memcpy(h + 12, rf64 ? "ds64" : "JUNK", 4);
+    put_le32(h + 16, 28);
+    if(rf64) {
+        put_le64(h + 20, riff_size);
+        put_le64(h + 28, data_bytes);
+        put_le64(h + 36, samples);
+        put_le32(h + 44, 0);
+    }
+
+    memcpy(h + 48, "fmt ", 4);
+    put_le32(h + 52, 18);
+    put_le16(h + 56, 3);    /* WAVE_FORMAT_IEEE_FLOAT */
+    put_le16(h + 58, channels);
+    put_le32(h + 60, 48000);
+    put_le32(h + 64, 48000 * channels * sizeof(float));
+    put_le16(h + 68, channels * sizeof(float));
+    put_le16(h + 70, 32);
+    put_le16(h + 72, 0);
+
+    memcpy(h + 74, "fact", 4);
+    put_le32(h + 78, 4);
+    put_le32(h + 82, rf64 ? 0xffffffffu : samples);
+
+    memcpy(h + 86, "data", 4);
+    put_le32(h + 90, rf64 ? 0xffffffffu : data_bytes);
+}
+
+/**
+ * Writes decoded samples, dropping the pre-skip at the start and anything
+ * past the end of the stream.
+ */
+static void stream_decoder_output(stream_decoder_t *sd, const float *pcm, int n) {
+    if(sd->skip > 0) {
+        int drop = n < sd->skip ? n : sd->skip;
+        sd->skip -= drop;
+        pcm += drop * sd->channels;
+        n -= drop;
+    }
+    if(sd->remaining >= 0 && n > sd->remaining) {
+        n = sd->remaining;
+    }
+    if(n <= 0 || sd->status) return;
+
+    if(sd->write(sd->arg, pcm, n) < 0) {
+        sd->status = -1;
+        return;
+    }
+    sd->samples += n;
+    if(sd->remaining >= 0) sd->remaining -= n;
+}
+
+static int stream_decoder_file_write(void *arg, const float *pcm, int n) {
+    stream_decoder_t *sd = (stream_decoder_t*)arg;
+
+    if(write_stream_write(sd->ws, pcm, (size_t)n * sd->channels * sizeof(float)) < 0) {
+        fprintf(stderr, "error: writing %s: %s\n", sd->path, strerror(sd->ws->error));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Decoder thread: decodes packets as they are queued.  A packet that fails
+ * to decode is replaced by concealment of the same duration so the output
+ * stays in step with the other streams.
+ */
+static void *stream_decoder_thread(void *arg) {
+    stream_decoder_t *sd = (stream_decoder_t*)arg;
+    queued_packet_t *pkt;
+
+    while((pkt = packet_queue_pop(&sd->queue)) != NULL) {
+        int n = opus_decode_float(sd->dec, pkt->data, pkt->bytes, sd->pcm,
+            MAX_PACKET_SAMPLES, 0);
+        if(n < 0) {
+            if(sd->errors++ == 0) {
+                fprintf(stderr, "warning: %s: failed to decode packet, concealing\n",
+                    sd->path);
+            }
+            n = opus_packet_get_nb_samples(pkt->data, pkt->bytes, 48000);
+            if(n <= 0 || n > MAX_PACKET_SAMPLES) n = 960;
+            n = opus_decode_float(sd->dec, NULL, 0, sd->pcm, n, 0);
+        }
+        if(n > 0) stream_decoder_output(sd, sd->pcm, n);
+        free(pkt);
+    }
+
+    return NULL;
+}
+
+static stream_decoder_t *stream_decoder_alloc(const char *name, int channels,
+  int preskip, int gain, int64_t length) {
+    int err;
+
+    stream_decoder_t *sd = (stream_decoder_t*)calloc(1, sizeof(stream_decoder_t));
+    CHECK_MALLOC(sd);
+    sd->path = strdup(name);
+    CHECK_MALLOC(sd->path);
+    sd->channels = channels;
+    sd->skip = preskip;
+    sd->remaining = length;
+
+    sd->dec = opus_decoder_create(48000, channels, &err);
+    if(err != OPUS_OK) {
+        fprintf(stderr, "error: creating decoder for %s: %s\n", name,
+            opus_strerror(err));
+        free(sd->path);
+        free(sd);
+        return NULL;
+    }
+    if(gain) opus_decoder_ctl(sd->dec, OPUS_SET_GAIN(gain));
+
+    sd->pcm = (float*)malloc(MAX_PACKET_SAMPLES * channels * sizeof(float));
+    CHECK_MALLOC(sd->pcm);
+
+    return sd;
+}
+
+static void stream_decoder_destroy(stream_decoder_t *sd) {
+    opus_decoder_destroy(sd->dec);
+    free(sd->pcm);
+    free(sd->path);
+    free(sd);
+}
+
+static int stream_decoder_start(stream_decoder_t *sd) {
+    packet_queue_init(&sd->queue, STREAM_DECODER_MAX_QUEUED);
+
+    if(pthread_create(&sd->thread, NULL, stream_decoder_thread, sd) != 0) {
+        perror("error: starting decoder thread");
+        packet_queue_destroy(&sd->queue);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Starts decoding one elementary stream to a file.
+ * @param channels 1, or 2 for a coupled stream
+ * @param preskip samples to drop from the start of the decoded audio
+ * @param gain output gain from the ID header, in Q7.8 dB
+ * @param length samples to write after the pre-skip, or -1 to write them all
+ * @param prealloc bytes to reserve for the output file
+ * @return the decoder, or NULL on error
+ */
+stream_decoder_t *stream_decoder_new(const char *path, decode_format_t format,
+  int channels, int preskip, int gain, int64_t length, write_pool_t *pool,
+  int64_t prealloc) {
+    stream_decoder_t *sd = stream_decoder_alloc(path, channels, preskip, gain, length);
+    if(!sd) return NULL;
+    sd->format = format;
+    sd->write = stream_decoder_file_write;
+    sd->arg = sd;
+
+    sd->ws = write_stream_open(pool, path, prealloc);
+    if(!sd->ws) {
+        fprintf(stderr, "error: opening %s: ", path);
+        perror(NULL);
+        stream_decoder_destroy(sd);
+        return NULL;
+    }
+    if(format == DECODE_WAV) {
+        /* placeholder; the sizes are filled in on close */
+        unsigned char header[WAV_HEADER_SIZE];
+        wav_header(header, channels, 0);
+        write_stream_write(sd->ws, header, sizeof(header));
+    }
+
+    if(stream_decoder_start(sd) < 0) {
+        write_stream_close(sd->ws);
+        stream_decoder_destroy(sd);
+        return NULL;
+    }
+    return sd;
+}
+
+/**
+ * Starts decoding one elementary stream, handing the samples to a function
+ * on the decoder thread.
+ * @param name used in messages
+ * @return the decoder, or NULL on error
+ */
+stream_decoder_t *stream_decoder_new_fn(const char *name, int channels,
+  int preskip, int gain, int64_t length, stream_decoder_write_fn write, void *arg) {
+    stream_decoder_t *sd = stream_decoder_alloc(name, channels, preskip, gain, length);
+    if(!sd) return NULL;
+    sd->write = write;
+    sd->arg = arg;
+
+    if(stream_decoder_start(sd) < 0) {
+        stream_decoder_destroy(sd);
+        return NULL;
+    }
+    return sd;
+}
+
+/**
+ * Queues a (non self-delimited) packet for decoding, waiting if the decoder
+ * is too far behind.
+ */
+int stream_decoder_packet(stream_decoder_t *sd, const unsigned char *data, int bytes) {
+    return packet_queue_push(&sd->queue, data, bytes, -1, true);
+}
+
+/**
+ * Decodes the remaining packets, closes the output file (if any) and fills
+ * in the WAV header.  Frees the decoder.
+ * @return 0 on success, -1 if the output could not be written
+ */
+int stream_decoder_close(stream_decoder_t *sd) {
+    packet_queue_close(&sd->queue);
+    pthread_join(sd->thread, NULL);
+
+    int status = sd->status;
+    if(sd->ws && write_stream_close(sd->ws) < 0 && !status) {
+        fprintf(stderr, "error: writing %s: %s\n", sd->path, strerror(errno));
+        status = -1;
+    }
+
+    if(sd->ws && sd->format == DECODE_WAV && !status) {
+        unsigned char header[WAV_HEADER_SIZE];
+        wav_header(header, sd->channels, sd->samples);
+
+        int fd = open(sd->path, O_WRONLY);
+        if(fd < 0 || pwrite(fd, header, sizeof(header), 0) != sizeof(header)) {
+            fprintf(stderr, "error: writing header of %s: ", sd->path);
+            perror(NULL);
+            status = -1;
+        }
+        if(fd >= 0) close(fd);
+    }
+
+    if(sd->errors > 0) {
+        fprintf(stderr, "warning: %s: %d packets could not be decoded\n",
+            sd->path, sd->errors);
+    }
+
+    packet_queue_destroy(&sd->queue);
+    stream_decoder_destroy(sd);
+
+    return status;
+}
@@ -0,0 +1,55 @@
+#ifndef __stream_decoder_h_
+#define __stream_decoder_h_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <opus/opus.h>
+
+#include "packet_queue.h"
+#include "write_pool.h"
+
+/* compressed data queued per decoder before the demuxer has to wait */
+#define STREAM_DECODER_MAX_QUEUED (1 << 20)
+/* decoded audio is ~10x the size of the input, so buffer more per output */
+#define STREAM_DECODER_BUFFER_SIZE (4 << 20)
+/* RIFF + JUNK/ds64 + fmt + fact + data chunk headers */
+#define WAV_HEADER_SIZE 94
+
+typedef enum {
+    DECODE_WAV,     /* 32-bit float WAV, RF64 once it passes 4 GiB */
+    DECODE_RAW      /* headerless interleaved 32-bit float */
+} decode_format_t;
+
+/* receives decoded, trimmed samples; returns < 0 to stop writing */
+typedef int (*stream_decoder_write_fn)(void *arg, const float *pcm, int samples);
+
+typedef struct {
+    char *path;             /* output file, or a name for messages */
+    decode_format_t format;
+    int channels;
+
+    OpusDecoder *dec;
+    write_stream_t *ws;     /* NULL when decoding to a write function */
+    stream_decoder_write_fn write;
+    void *arg;
+    float *pcm;
+
+    pthread_t thread;
+    packet_queue_t queue;   /* packets waiting to be decoded */
+
+    int skip;               /* samples still to drop from the start */
+    int64_t remaining;      /* samples still to write, or -1 if unknown */
+    int64_t samples;        /* samples written so far */
+    int errors;             /* packets that failed to decode */
+    int status;             /* first write error */
+} stream_decoder_t;
+
+stream_decoder_t *stream_decoder_new(const char *path, decode_format_t format,
+  int channels, int preskip, int gain, int64_t length, write_pool_t *pool,
+  int64_t prealloc);
+stream_decoder_t *stream_decoder_new_fn(const char *name, int channels,
+  int preskip, int gain, int64_t length, stream_decoder_write_fn write, void *arg);
+int stream_decoder_packet(stream_decoder_t *sd, const unsigned char *data, int bytes);
+int stream_decoder_close(stream_decoder_t *sd);
+
+#endif // __stream_decoder_h_
@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <opus/opus.h>
+#include <opus/opus_multistream.h>
+#include <vorbis/vorbisenc.h>
+
+#include "enc_opus.h"
+#include "enc_vorbis.h"
+#include "opus_header.h"
+#include "ogg_mux.h"
+#include "wav_reader.h"
+#include "util.h"
+
+/* packets encoded before each chunk and thrown away, so the chunk's
+ * encoder has converged by the time its packets are kept */
+#define ENCODE_OVERLAP 50
+#define ENCODE_CHUNK_SECONDS 60
+/* chunks encoded ahead of the one being written, per thread */
+#define ENCODE_WINDOW 2
+
+typedef struct {
+    int64_t first;          /* index of the first packet of the chunk */
+    int64_t end;
+    unsigned char *data;    /* the chunk's packets, back to back */
+    int *lengths;
+    size_t used;
+    size_t size;
+    bool done;
+} encode_chunk_t;
+
+typedef struct {
+    const wav_reader_t *wav;
+    int bitrate;
+    int frame_size;         /* samples per packet at the input rate */
+
+    encode_chunk_t *chunks;
+    int n_chunks;
+    int next;               /* next chunk for a worker to take */
+    int written;            /* chunks written out so far */
+    int window;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int status;
+} encode_job_t;
+
+void usage(char *exe) {
+    fprintf(stderr, "usage: %s [options] infile.wav outfile\n", exe);
+    fprintf(stderr, "    -o              use opus (default vorbis)\n");
+    fprintf(stderr, "    -m <min bitrate>    (128) (vorbis)\n");
+    fprintf(stderr, "    -a <avg bitrate>    (256)\n");
+    fprintf(stderr, "    -x <max bitrate>    (384) (vorbis)\n");
+    fprintf(stderr, "    -q <quality>    vorbis quality, -1 to 10, instead of -m/-a/-x\n");
+    fprintf(stderr, "    -Q <avg bitrate>    keep the average near this with -q (vorbis)\n");
+    fprintf(stderr, "    -j <threads>    number of encoder threads (number of CPUs) (opus)\n");
+    fprintf(stderr, "    -C <seconds>    length of the chunks encoded in parallel (%d) (opus)\n",
+        ENCODE_CHUNK_SECONDS);
+    fprintf(stderr, "    -P <bytes>      target ogg page size (%d)\n", OGG_MUX_PAGE_SIZE);
+}
+
+static int encode_page(void *arg, const unsigned char *data, size_t length) {
+    return fwrite(data, 1, length, (FILE*)arg) == length ? 0 : -1;
+}
+
+/**
+ * Encodes one chunk with a fresh encoder, starting ENCODE_OVERLAP packets
+ * early.  Every encoder is fed the same samples for a given packet index,
+ * and delays them by the same lookahead, so the kept packets of consecutive
+ * chunks follow on from each other.
+ */
+static int encode_chunk(encode_job_t *job, encode_chunk_t *chunk) {
+    const wav_reader_t *wav = job->wav;
+    int channels = wav->channels;
+    int max_bytes = (1275 * 3 + 7) * channels;
+    OpusHeader header;
+
+    OpusMSEncoder *enc = enc_opus_create(wav->rate, channels, job->bitrate, &header);
+    if(!enc) return -1;
+
+    float *pcm = (float*)malloc(job->frame_size * channels * sizeof(float));
+    CHECK_MALLOC(pcm);
+    chunk->lengths = (int*)malloc((chunk->end - chunk->first) * sizeof(int));
+    CHECK_MALLOC(chunk->lengths);
+
+    int64_t start = chunk->first > ENCODE_OVERLAP ? chunk->first - ENCODE_OVERLAP : 0;
+    for(int64_t j=start; j<chunk->end; j++) {
+        if(chunk->size - chunk->used < max_bytes) {
+            chunk->size = chunk->size ? 2 * chunk->size : 64 * max_bytes;
+            chunk->data = (unsigned char*)realloc(chunk->data, chunk->size);
+            CHECK_MALLOC(chunk->data);
+        }
+
+        wav_reader_read(wav, j * job->frame_size, job->frame_size, pcm);
+        int bytes = opus_multistream_encode_float(enc, pcm, job->frame_size,
+            chunk->data + chunk->used, max_bytes);
+        if(bytes < 0) {
+            fprintf(stderr, "opus encoding failed: %s\n", opus_strerror(bytes));
+            free(pcm);
+            opus_multistream_encoder_destroy(enc);
+            return -1;
+        }
+        if(j >= chunk->first) {
+            chunk->lengths[j - chunk->first] = bytes;
+            chunk->used += bytes;
+        }
+    }
+
+    free(pcm);
+    opus_multistream_encoder_destroy(enc);
+    return 0;
+}
+
+static void *encode_worker(void *arg) {
+    encode_job_t *job = (encode_job_t*)arg;
+
+    for(;;) {
+        pthread_mutex_lock(&job->lock);
+        while(job->next < job->n_chunks && job->next >= job->written + job->window &&
+          !job->status) {
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+        if(job->next >= job->n_chunks || job->status) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        encode_chunk_t *chunk = &job->chunks[job->next++];
+        pthread_mutex_unlock(&job->lock);
+
+        int ret = encode_chunk(job, chunk);
+
+        pthread_mutex_lock(&job->lock);
+        if(ret < 0) job->status = ret;
+        chunk->done = true;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Encodes the file to Opus in chunks on several threads, and writes the
+ * chunks' packets out in order as one stream.
+ */
+static int encode_opus(const wav_reader_t *wav, FILE *fp, int page_size,
+  int bitrate, int n_threads, int chunk_seconds) {
+    encode_job_t job;
+    OpusHeader header;
+
+    if(wav->rate != 8000 && wav->rate != 12000 && wav->rate != 16000 &&
+      wav->rate != 24000 && wav->rate != 48000) {
+        fprintf(stderr, "error: opus needs 8, 12, 16, 24 or 48 kHz input, not %d Hz\n",
+            wav->rate);
+        return -1;
+    }
+    if(wav->channels > 255) {
+        fprintf(stderr, "error: too many channels (%d)\n", wav->channels);
+        return -1;
+    }
+
+    OpusMSEncoder *enc = enc_opus_create(wav->rate, wav->channels, bitrate, &header);
+    if(!enc) return -1;
+    opus_multistream_encoder_destroy(enc);
+
+    /* the last packet has to take in the encoder's lookahead too */
+    int scale = 48000 / wav->rate;
+    memset(&job, 0, sizeof(job));
+    job.wav = wav;
+    job.bitrate = bitrate;
+    job.frame_size = wav->rate / 50;
+    int64_t n_packets = (wav->frames + header.preskip / scale + job.frame_size - 1) /
+        job.frame_size;
+    int64_t chunk_packets = (int64_t)chunk_seconds * 50;
+    if(chunk_packets < 1) chunk_packets = 1;
+
+    job.n_chunks = (n_packets + chunk_packets - 1) / chunk_packets;
+    job.chunks = (encode_chunk_t*)calloc(job.n_chunks, sizeof(encode_chunk_t));
+    CHECK_MALLOC(job.chunks);
+    for(int c=0; c<job.n_chunks; c++) {
+        job.chunks[c].first = c * chunk_packets;
+        job.chunks[c].end = c == job.n_chunks - 1 ? n_packets : (c + 1) * chunk_packets;
+    }
+    job.window = n_threads * ENCODE_WINDOW;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    ogg_mux_t mux;
+    srand(time(NULL));
+    ogg_mux_init(&mux, rand(), page_size, encode_page, fp);
+
+    unsigned char id_buf[300];
+    int id_size = opus_header_to_packet(&header, id_buf, sizeof(id_buf));
+    ogg_mux_packet(&mux, id_buf, id_size, 0, false);
+    ogg_mux_flush(&mux);
+    char comment_buf[1024];
+    int comment_size = enc_opus_comments(comment_buf);
+    ogg_mux_packet(&mux, (unsigned char*)comment_buf, comment_size, 0, false);
+    ogg_mux_flush(&mux);
+
+    pthread_t *threads = (pthread_t*)malloc(n_threads * sizeof(pthread_t));
+    CHECK_MALLOC(threads);
+    for(int i=0; i<n_threads; i++) {
+        pthread_create(&threads[i], NULL, encode_worker, &job);
+    }
+
+    int64_t end_granulepos = header.preskip + wav->frames * scale;
+    for(int c=0; c<job.n_chunks; c++) {
+        encode_chunk_t *chunk = &job.chunks[c];
+
+        pthread_mutex_lock(&job.lock);
+        while(!chunk->done && !job.status) {
+            pthread_cond_wait(&job.cond, &job.lock);
+        }
+        pthread_mutex_unlock(&job.lock);
+        if(job.status) break;
+
+        size_t offset = 0;
+        for(int64_t j=chunk->first; j<chunk->end; j++) {
+            int64_t granulepos = (j + 1) * job.frame_size * scale;
+            bool eos = j == n_packets - 1;
+            if(eos) granulepos = end_granulepos;
+            int bytes = chunk->lengths[j - chunk->first];
+            if(ogg_mux_packet(&mux, chunk->data + offset, bytes, granulepos, eos) < 0) {
+                fprintf(stderr, "error: writing output file\n");
+                job.status = -1;
+                break;
+            }
+            offset += bytes;
+        }
+        free(chunk->data);
+        free(chunk->lengths);
+
+        pthread_mutex_lock(&job.lock);
+        job.written++;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.lock);
+    }
+
+    /* wake up any workers waiting for room if the writer stopped early */
+    pthread_mutex_lock(&job.lock);
+    if(job.status == 0 && job.written < job.n_chunks) job.status = -1;
+    pthread_cond_broadcast(&job.cond);
+    pthread_mutex_unlock(&job.lock);
+    for(int i=0; i<n_threads; i++) pthread_join(threads[i], NULL);
+
+    ogg_mux_flush(&mux);
+    ogg_mux_clear(&mux);
+    for(int c=job.written; c<job.n_chunks; c++) {
+        free(job.chunks[c].data);
+        free(job.chunks[c].lengths);
+    }
+    free(job.chunks);
+    free(threads);
+    pthread_cond_destroy(&job.cond);
+    pthread_mutex_destroy(&job.lock);
+
+    return job.status;
+}
+
+/**
+ * Encodes the file to Vorbis.  Vorbis blocks overlap their neighbours, so
+ * independently encoded chunks cannot be joined; this runs on one thread.
+ */
+static int encode_vorbis(const wav_reader_t *wav, FILE *fp, int page_size,
+  int min_bitrate, int avg_bitrate, int max_bitrate, float quality) {
+    vorbis_info vi;
+    vorbis_comment vc;
+    vorbis_dsp_state vd;
+    vorbis_block vb;
+    ogg_packet op;
+    ogg_mux_t mux;
+    int channels = wav->channels;
+    int ret;
+
+    ret = enc_vorbis_init(&vi, &vc, wav->rate, channels, min_bitrate,
+        avg_bitrate, max_bitrate, quality);
+    if(ret) return ret;
+    vorbis_analysis_init(&vd, &vi);
+    vorbis_block_init(&vd, &vb);
+
+    srand(time(NULL));
+    ogg_mux_init(&mux, rand(), page_size, encode_page, fp);
+    ret = enc_vorbis_headers(&vd, &vc, &mux);
+
+    const int block = 4096;
+    float *pcm = (float*)malloc(block * channels * sizeof(float));
+    CHECK_MALLOC(pcm);
+
+    for(int64_t pos=0; ret == 0; pos += block) {
+        int n = wav->frames - pos < block ? wav->frames - pos : block;
+        if(n > 0) {
+            wav_reader_read(wav, pos, n, pcm);
+            float **buffer = vorbis_analysis_buffer(&vd, n);
+            for(int i=0; i<n; i++) {
+                for(int c=0; c<channels; c++) {
+                    buffer[c][i] = pcm[i * channels + c];
+                }
+            }
+        }
+        /* zero frames marks the end of the input */
+        vorbis_analysis_wrote(&vd, n > 0 ? n : 0);
+
+        while(ret == 0 && vorbis_analysis_blockout(&vd, &vb) == 1) {
+            vorbis_analysis(&vb, NULL);
+            vorbis_bitrate_addblock(&vb);
+            while(ret == 0 && vorbis_bitrate_flushpacket(&vd, &op)) {
+                ret = ogg_mux_packet(&mux, op.packet, op.bytes, op.granulepos,
+                    op.e_o_s);
+            }
+        }
+        if(n <= 0) break;
+    }
+    if(ret == 0) ret = ogg_mux_flush(&mux);
+    if(ret < 0) fprintf(stderr, "error: writing output file\n");
+
+    free(pcm);
+    ogg_mux_clear(&mux);
+    vorbis_block_clear(&vb);
+    vorbis_dsp_clear(&vd);
+    vorbis_comment_clear(&vc);
+    vorbis_info_clear(&vi);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    bool opus = false;
+    int min_bitrate = 128000;
+    int avg_bitrate = 256000;
+    int max_bitrate = 384000;
+    float quality = NAN;
+    int quality_bitrate = 0;
+    int n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int chunk_seconds = ENCODE_CHUNK_SECONDS;
+    int page_size = OGG_MUX_PAGE_SIZE;
+    int c;
+
+    while((c = getopt(argc, argv, "om:a:x:q:Q:j:C:P:")) != -1) {
+        switch(c) {
+            case 'o':
+                opus = true;
+                break;
+            case 'm':
+                min_bitrate = atoi(optarg) * 1000;
+                break;
+            case 'a':
+                avg_bitrate = atoi(optarg) * 1000;
+                break;
+            case 'x':
+                max_bitrate = atoi(optarg) * 1000;
+                break;
+            case 'q':
+                quality = atof(optarg);
+                break;
+            case 'Q':
+                quality_bitrate = atoi(optarg) * 1000;
+                break;
+            case 'j':
+                n_threads = atoi(optarg);
+                break;
+            case 'C':
+                chunk_seconds = atoi(optarg);
+                break;
+            case 'P':
+                page_size = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if(argc - optind != 2) {
+        usage(argv[0]);
+        return 2;
+    }
+    if(n_threads < 1) n_threads = 1;
+
+    wav_reader_t wav;
+    int ret = wav_reader_open(&wav, argv[optind]);
+    if(ret == -1) {
+        fprintf(stderr, "error: opening %s: ", argv[optind]);
+        perror(NULL);
+        return 10;
+    } else if(ret < 0) {
+        fprintf(stderr, "error: %s: not a supported WAV file\n", argv[optind]);
+        return 12;
+    }
+
+    FILE *fp = fopen(argv[optind + 1], "wb");
+    if(!fp) {
+        fprintf(stderr, "error: opening %s: ", argv[optind + 1]);
+        perror(NULL);
+        wav_reader_close(&wav);
+        return 10;
+    }
+    setvbuf(fp, NULL, _IOFBF, 1 << 20);
+
+    struct timespec t_start, t_end;
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+    if(opus) {
+        ret = encode_opus(&wav, fp, page_size, avg_bitrate, n_threads, chunk_seconds);
+    } else {
+        ret = encode_vorbis(&wav, fp, page_size, min_bitrate,
+            isnan(quality) ? avg_bitrate : quality_bitrate, max_bitrate, quality);
+    }
+
+    if(ferror(fp) | fclose(fp)) {
+        fprintf(stderr, "error: writing %s\n", argv[optind + 1]);
+        if(!ret) ret = -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    double elapsed = (t_end.tv_sec - t_start.tv_sec) +
+        (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+    double duration = (double)wav.frames / wav.rate;
+    if(ret == 0) {
+        printf("Encoded %0.02f s of %d channels in %0.02f s (%0.01fx realtime)\n",
+            duration, wav.channels, elapsed, duration / elapsed);
+    }
+
+    wav_reader_close(&wav);
+    return ret == 0 ? 0 : 1;
+}
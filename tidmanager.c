@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include "util.h"
+#include "config.h"
+#include "pipeline.h"
+#include "work_pool.h"
+#include "net_engine.h"
+#include "trace.h"
+
+#define MANAGER_SECTION_PREFIX "stream "
+
+volatile sig_atomic_t running = 1;
+volatile sig_atomic_t trace_requested = 0;
+
+void usage(char *exe) {
+    fprintf(stderr, "usage: %s [options] <config file>\n", exe);
+    fprintf(stderr, "    -j <threads>    number of encoder threads (threads in [global],\n");
+    fprintf(stderr, "                    or the number of CPUs)\n");
+}
+
+void handle_signal(int sig) {
+    running = 0;
+}
+
+void handle_trace_signal(int sig) {
+    trace_requested = 1;
+}
+
+static int parse_int(const char *value, int *out) {
+    char *end;
+    long v = strtol(value, &end, 10);
+    if(!*value || *end) return -1;
+    *out = v;
+    return 0;
+}
+
+static int parse_float(const char *value, float *out) {
+    char *end;
+    float v = strtof(value, &end);
+    if(!*value || *end) return -1;
+    *out = v;
+    return 0;
+}
+
+static int parse_bool(const char *value, bool *out) {
+    if(!strcmp(value, "yes") || !strcmp(value, "true") || !strcmp(value, "1")) {
+        *out = true;
+    } else if(!strcmp(value, "no") || !strcmp(value, "false") || !strcmp(value, "0")) {
+        *out = false;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Applies one key of a [stream NAME] section.
+ * @return 0 on success, -1 if the value is invalid, -2 if the key is unknown
+ */
+static int manager_set(pipeline_config_t *pc, const char *key, const char *value) {
+    int v;
+    bool b;
+
+    if(!strcmp(key, "codec")) {
+        if(!strcmp(value, "opus")) pc->codec = CODEC_OPUS;
+        else if(!strcmp(value, "vorbis")) pc->codec = CODEC_VORBIS;
+        else return -1;
+    } else if(!strcmp(key, "channels")) {
+        if(parse_int(value, &pc->n_channels) < 0) return -1;
+    } else if(!strcmp(key, "client")) {
+        pc->client_name = value;
+    } else if(!strcmp(key, "connect")) {
+        if(parse_int(value, &pc->auto_connect_offset) < 0) return -1;
+        pc->auto_connect = true;
+    } else if(!strcmp(key, "bitrate")) {
+        if(parse_int(value, &v) < 0) return -1;
+        pc->avg_bitrate = v * 1000;
+    } else if(!strcmp(key, "min_bitrate")) {
+        if(parse_int(value, &v) < 0) return -1;
+        pc->min_bitrate = v * 1000;
+    } else if(!strcmp(key, "max_bitrate")) {
+        if(parse_int(value, &v) < 0) return -1;
+        pc->max_bitrate = v * 1000;
+    } else if(!strcmp(key, "quality")) {
+        if(parse_float(value, &pc->quality) < 0) return -1;
+    } else if(!strcmp(key, "quality_bitrate")) {
+        if(parse_int(value, &v) < 0) return -1;
+        pc->quality_bitrate = v * 1000;
+    } else if(!strcmp(key, "adaptive")) {
+        if(parse_int(value, &v) < 0) return -1;
+        pc->adaptive_bitrate = v * 1000;
+    } else if(!strcmp(key, "complexity")) {
+        if(parse_int(value, &pc->complexity) < 0) return -1;
+    } else if(!strcmp(key, "cpu_budget")) {
+        if(parse_int(value, &pc->cpu_budget) < 0) return -1;
+    } else if(!strcmp(key, "host")) {
+        pc->host = value;
+    } else if(!strcmp(key, "port")) {
+        if(parse_int(value, &pc->port) < 0) return -1;
+    } else if(!strcmp(key, "mount")) {
+        pc->mount = value;
+    } else if(!strcmp(key, "password")) {
+        pc->password = value;
+    } else if(!strcmp(key, "backend")) {
+        if(!strcmp(value, "libshout")) pc->stream_options.backend = STREAM_LIBSHOUT;
+        else if(!strcmp(value, "native")) pc->stream_options.backend = STREAM_NATIVE;
+        else if(!strcmp(value, "engine")) pc->stream_options.backend = STREAM_ENGINE;
+        else return -1;
+    } else if(!strcmp(key, "sndbuf")) {
+        if(parse_int(value, &pc->stream_options.sndbuf) < 0) return -1;
+    } else if(!strcmp(key, "tcp")) {
+        if(!strcmp(value, "nodelay")) pc->stream_options.tcp = STREAM_TCP_NODELAY;
+        else if(!strcmp(value, "cork")) pc->stream_options.tcp = STREAM_TCP_CORK;
+        else if(!strcmp(value, "nagle")) pc->stream_options.tcp = STREAM_TCP_NAGLE;
+        else return -1;
+    } else if(!strcmp(key, "stream")) {
+        if(parse_bool(value, &b) < 0) return -1;
+        pc->no_stream = !b;
+    } else if(!strcmp(key, "archive")) {
+        pc->archive_name = value;
+    } else if(!strcmp(key, "archive_length")) {
+        if(parse_int(value, &pc->archive_length) < 0) return -1;
+    } else if(!strcmp(key, "archive_sync")) {
+        if(parse_int(value, &pc->archive_sync) < 0) return -1;
+    } else if(!strcmp(key, "retry")) {
+        if(parse_bool(value, &pc->retry) < 0) return -1;
+    } else if(!strcmp(key, "control")) {
+        pc->control_path = value;
+    } else {
+        return -2;
+    }
+    return 0;
+}
+
+/**
+ * Turns the [stream NAME] sections of a config file into pipeline settings,
+ * in the order they first appear.  Settings not given are tidstream's
+ * defaults, except that each stream gets its own JACK client and mount
+ * named after it.
+ * @return the number of streams, or -1 on error
+ */
+static int manager_configure(config_t *cfg, pipeline_config_t **out) {
+    pipeline_config_t *pcs = NULL;
+    int n = 0;
+
+    for(int i=0; i<cfg->n_entries; i++) {
+        config_entry_t *e = &cfg->entries[i];
+        if(!strcmp(e->section, "global")) continue;
+
+        size_t prefix_len = strlen(MANAGER_SECTION_PREFIX);
+        if(strncmp(e->section, MANAGER_SECTION_PREFIX, prefix_len) ||
+          !e->section[prefix_len]) {
+            fprintf(stderr, "%s:%d: %s outside a [stream NAME] or [global] section\n",
+                cfg->path, e->line, e->key);
+            free(pcs);
+            return -1;
+        }
+        const char *name = e->section + prefix_len;
+
+        int s;
+        for(s=0; s<n && strcmp(pcs[s].name, name); s++);
+        if(s == n) {
+            pcs = (pipeline_config_t*)realloc(pcs, (n + 1) * sizeof(pipeline_config_t));
+            CHECK_MALLOC(pcs);
+            pipeline_config_defaults(&pcs[n]);
+            pcs[n].name = name;
+            pcs[n].client_name = name;
+            pcs[n].mount = name;
+            n++;
+        }
+
+        int ret = manager_set(&pcs[s], e->key, e->value);
+        if(ret < 0) {
+            fprintf(stderr, "%s:%d: %s %s\n", cfg->path, e->line,
+                ret == -2 ? "unknown setting" : "bad value for", e->key);
+            free(pcs);
+            return -1;
+        }
+    }
+
+    *out = pcs;
+    return n;
+}
+
+static void manager_step(void *arg) {
+    pipeline_t *p = (pipeline_t*)arg;
+
+    pipeline_step(p);
+    __atomic_store_n(&p->busy, 0, __ATOMIC_RELEASE);
+}
+
+int main(int argc, char **argv) {
+    int n_threads = -1;
+    int c;
+
+    while((c = getopt(argc, argv, "j:")) != -1) {
+        switch(c) {
+            case 'j':
+                n_threads = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if(optind != argc - 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    config_t *cfg = config_load(argv[optind]);
+    if(!cfg) return 2;
+
+    const char *threads = config_get(cfg, "global", "threads");
+    const char *net_threads = config_get(cfg, "global", "net_threads");
+    const char *trace_path = config_get(cfg, "global", "trace");
+    const char *trace_seconds = config_get(cfg, "global", "trace_seconds");
+    for(int i=0; i<cfg->n_entries; i++) {
+        config_entry_t *e = &cfg->entries[i];
+        if(!strcmp(e->section, "global") && strcmp(e->key, "threads") &&
+          strcmp(e->key, "net_threads") && strcmp(e->key, "trace") &&
+          strcmp(e->key, "trace_seconds")) {
+            fprintf(stderr, "%s:%d: unknown setting %s\n", cfg->path, e->line, e->key);
+            return 2;
+        }
+    }
+    if(n_threads < 0 && threads && parse_int(threads, &n_threads) < 0) {
+        fprintf(stderr, "%s: bad value for threads\n", cfg->path);
+        return 2;
+    }
+    int n_net_threads = 1;
+    if(net_threads && (parse_int(net_threads, &n_net_threads) < 0 ||
+      n_net_threads < 1)) {
+        fprintf(stderr, "%s: bad value for net_threads\n", cfg->path);
+        return 2;
+    }
+    int trace_window = TRACE_WINDOW;
+    if(trace_seconds && (parse_int(trace_seconds, &trace_window) < 0 ||
+      trace_window < 1)) {
+        fprintf(stderr, "%s: bad value for trace_seconds\n", cfg->path);
+        return 2;
+    }
+
+    pipeline_config_t *pcs;
+    int n_pipelines = manager_configure(cfg, &pcs);
+    if(n_pipelines < 0) return 2;
+    if(n_pipelines == 0) {
+        fprintf(stderr, "%s: no [stream NAME] sections\n", cfg->path);
+        return 2;
+    }
+
+    /* streams on the engine backend share its threads, rather than each
+     * blocking an encoder thread on its own socket */
+    net_engine_t *engine = NULL;
+    for(int i=0; i<n_pipelines; i++) {
+        if(pcs[i].stream_options.backend != STREAM_ENGINE) continue;
+        if(!engine) {
+            engine = net_engine_new(n_net_threads);
+            if(!engine) return 1;
+        }
+        pcs[i].stream_options.engine = engine;
+    }
+
+    /* seeded once: every new Ogg stream draws its serial number from here */
+    srand(time(NULL));
+    pipeline_t **pipelines = (pipeline_t**)calloc(n_pipelines, sizeof(pipeline_t*));
+    CHECK_MALLOC(pipelines);
+    for(int i=0; i<n_pipelines; i++) {
+        pipelines[i] = pipeline_new(&pcs[i]);
+        if(!pipelines[i]) {
+            for(int j=0; j<i; j++) pipeline_free(pipelines[j]);
+            net_engine_free(engine);
+            return 2;
+        }
+    }
+
+    work_pool_t *pool = work_pool_new(n_threads > 0 ? n_threads : 0);
+    if(!pool) return 1;
+    fprintf(stderr, "running %d streams on %d threads\n", n_pipelines,
+        pool->n_threads);
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    if(trace_path) {
+        trace_init(trace_path);
+        trace_requested = 1;
+        signal(SIGUSR1, handle_trace_signal);
+    }
+
+    /* each pipeline is stepped by one worker at a time; a pipeline with
+     * nothing to do is skipped until it has */
+    int status = 0;
+    while(running) {
+        int alive = 0;
+        for(int i=0; i<n_pipelines; i++) {
+            pipeline_t *p = pipelines[i];
+            if(__atomic_load_n(&p->busy, __ATOMIC_ACQUIRE)) {
+                alive++;
+                continue;
+            }
+            if(p->failed) continue;
+            alive++;
+            if(pipeline_pending(p)) {
+                __atomic_store_n(&p->busy, 1, __ATOMIC_RELAXED);
+                work_pool_submit(pool, manager_step, p);
+            }
+        }
+        if(!alive) {
+            fprintf(stderr, "all streams have stopped\n");
+            status = 1;
+            break;
+        }
+        if(trace_requested) {
+            trace_requested = 0;
+            trace_start(trace_window);
+        }
+        trace_poll();
+        usleep(1000);
+    }
+
+    /* lets the steps under way finish before the pipelines go away */
+    work_pool_free(pool);
+    trace_stop();
+    for(int i=0; i<n_pipelines; i++) pipeline_free(pipelines[i]);
+    /* waits for the closed streams to send what they had left */
+    net_engine_free(engine);
+    trace_free();
+    free(pipelines);
+    free(pcs);
+    config_free(cfg);
+
+    return status;
+}
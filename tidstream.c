@@ -2,127 +2,163 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
 
-#include "audio.h"
-#include "enc_vorbis.h"
-#include "enc_opus.h"
-#include "stream.h"
+#include "pipeline.h"
+#include "trace.h"
 
-typedef enum {
-    CODEC_VORBIS,
-    CODEC_OPUS
-} codec_mode_t;
+pipeline_config_t cfg;
 
-codec_mode_t codec = CODEC_VORBIS;
-const char *client_name = "tidstream";
-int n_channels = 8;
-int min_bitrate = 128000;
-int max_bitrate = 384000;
-int avg_bitrate = 256000;
-const char *shout_host = "doppler.media.mit.edu";
-const char *shout_mount = "tidmarsh_test.ogg";
-const char *shout_password = "password";
-int shout_port = 8000;
-int chunk_size = 4096;
-int auto_connect = 0;
-int auto_connect_offset=1;
-int retry = 0;
+volatile sig_atomic_t running = 1;
+volatile sig_atomic_t trace_requested = 0;
 
 void show_help(int argc, char **argv) {
     printf("usage: %s <options>\n", argv[0]);
     printf("");
     printf("    -A (autoconnect jack)\n");
-    printf("    -O (connect offset) (%d)\n", auto_connect_offset);
+    printf("    -O (connect offset) (%d)\n", cfg.auto_connect_offset);
     printf("    -r (retry on error)\n");
-    printf("    -c <channels>       (%d)\n", n_channels);
-    printf("    -h <hostname>       (%s)\n", shout_host);
-    printf("    -p <port>           (%d)\n", shout_port);
-    printf("    -u <mountpoint>     (%s)\n", shout_mount);
-    printf("    -w <password>       (%s)\n", shout_password);
-    printf("    -m <min bitrate>    (%d)\n", min_bitrate / 1000);
-    printf("    -a <avg bitrate>    (%d)\n", avg_bitrate / 1000);
-    printf("    -x <max bitrate>    (%d)\n", max_bitrate / 1000);
+    printf("    -c <channels>       (%d)\n", cfg.n_channels);
+    printf("    -h <hostname>       (%s)\n", cfg.host);
+    printf("    -p <port>           (%d)\n", cfg.port);
+    printf("    -u <mountpoint>     (%s)\n", cfg.mount);
+    printf("    -w <password>       (%s)\n", cfg.password);
+    printf("    -m <min bitrate>    (%d)\n", cfg.min_bitrate / 1000);
+    printf("    -a <avg bitrate>    (%d)\n", cfg.avg_bitrate / 1000);
+    printf("    -x <max bitrate>    (%d)\n", cfg.max_bitrate / 1000);
+    printf("    -q <quality>        (vorbis quality, -1 to 10, instead of -m/-a/-x)\n");
+    printf("    -Q <avg bitrate>    (keep the average near <avg bitrate> with -q)\n");
     printf("    -o (use opus)           \n");
+    printf("    -R <min bitrate>    (adapt opus bitrate to the link, down to <min bitrate>)\n");
+    printf("    -k <complexity>     (opus encoder complexity, 0-10)\n");
+    printf("    -L <percent>        (lower opus complexity to keep encoding under <percent> of real time)\n");
+    printf("    -f <name>           (archive opus to <name>-<n>.opus)\n");
+    printf("    -l <seconds>        (%d) (archive file length)\n", cfg.archive_length);
+    printf("    -S <kbytes>         (%d) (flush archive files to disk every <kbytes>, 0 on close only)\n",
+        cfg.archive_sync);
+    printf("    -n (archive only, do not stream)\n");
+    printf("    -X <path>           (control socket for changing settings while running)\n");
+    printf("    -N (use the built-in Icecast client instead of libshout)\n");
+    printf("    -B <bytes>          (socket send buffer) (-N)\n");
+    printf("    -T nodelay|cork|nagle (TCP send policy) (nodelay) (-N)\n");
+    printf("    -t <file>           (trace the first seconds, and again on SIGUSR1, to <file>)\n");
+    printf("    -W <seconds>        (%d) (length of a trace)\n", TRACE_WINDOW);
 }
 
-typedef enum {
-    ERR_OK,
-    ERR_ENCODER_SETUP,
-    ERR_STREAM_SETUP,
-    ERR_STREAM,
-    ERR_ENCODER,
-} tidstream_err_status_t;
-
-const char *status_str(tidstream_err_status_t status) {
-    switch(status) {
-        case ERR_OK: return "OK";
-        case ERR_ENCODER_SETUP: "encoder setup error";
-        case ERR_STREAM_SETUP: "stream setup error";
-        case ERR_STREAM: "streaming error";
-        case ERR_ENCODER: "encoder/streaming error";
-        default: return "unknown error";
-    }
+void handle_signal(int sig) {
+    running = 0;
 }
 
-bool check_retry(tidstream_err_status_t status) {
-    if(retry) {
-        fprintf(stderr, "main loop terminated due to error: %s\n", 
-            status_str(status));
-        fprintf(stderr, "restarting after delay\n");
-        sleep(10);
-        return true;
-    } else {
-        return false;
-    }
+void handle_trace_signal(int sig) {
+    trace_requested = 1;
 }
 
 int main(int argc, char **argv) {
-    float **data;
-    float *interleaved;
     char c;
+    const char *trace_path = NULL;
+    int trace_window = TRACE_WINDOW;
+
+    pipeline_config_defaults(&cfg);
+    /* seeded once: every new Ogg stream draws its serial number from here */
+    srand(time(NULL));
 
     opterr = 0;
-    while((c = getopt(argc, argv, "AO:c:h:p:u:w:m:a:x:or")) != -1) {
+    while((c = getopt(argc, argv, "AO:c:h:p:u:w:m:a:x:q:Q:oR:k:L:rf:l:S:nNB:T:X:t:W:")) != -1) {
         switch(c) {
             case 'A':
-                auto_connect = 1;
+                cfg.auto_connect = true;
                 break;
             case 'O':
-                auto_connect_offset = atoi(optarg);
+                cfg.auto_connect_offset = atoi(optarg);
                 break;
             case 'c':
-                n_channels = atoi(optarg);
+                cfg.n_channels = atoi(optarg);
                 break;
             case 'h':
-                shout_host = optarg;
+                cfg.host = optarg;
                 break;
             case 'p':
-                shout_port = atoi(optarg);
+                cfg.port = atoi(optarg);
                 break;
             case 'u':
-                shout_mount = optarg;
+                cfg.mount = optarg;
                 break;
             case 'w':
-                shout_password = optarg;
+                cfg.password = optarg;
                 break;
             case 'm':
-                min_bitrate = atoi(optarg) * 1000;
+                cfg.min_bitrate = atoi(optarg) * 1000;
                 break;
             case 'a':
-                avg_bitrate = atoi(optarg) * 1000;
+                cfg.avg_bitrate = atoi(optarg) * 1000;
                 break;
             case 'x':
-                max_bitrate = atoi(optarg) * 1000;
+                cfg.max_bitrate = atoi(optarg) * 1000;
+                break;
+            case 'q':
+                cfg.quality = atof(optarg);
+                break;
+            case 'Q':
+                cfg.quality_bitrate = atoi(optarg) * 1000;
                 break;
             case '?':
                 fprintf(stderr, "error parsing option -%c\n", optopt);
                 break;
             case 'o':
-                codec = CODEC_OPUS;
-                chunk_size = 960;
+                cfg.codec = CODEC_OPUS;
+                break;
+            case 'R':
+                cfg.adaptive_bitrate = atoi(optarg) * 1000;
+                break;
+            case 'k':
+                cfg.complexity = atoi(optarg);
+                break;
+            case 'L':
+                cfg.cpu_budget = atoi(optarg);
                 break;
             case 'r':
-                retry = 1;
+                cfg.retry = true;
+                break;
+            case 'f':
+                cfg.archive_name = optarg;
+                break;
+            case 'l':
+                cfg.archive_length = atoi(optarg);
+                break;
+            case 'S':
+                cfg.archive_sync = atoi(optarg);
+                break;
+            case 'n':
+                cfg.no_stream = true;
+                break;
+            case 'N':
+                cfg.stream_options.backend = STREAM_NATIVE;
+                break;
+            case 'X':
+                cfg.control_path = optarg;
+                break;
+            case 'B':
+                cfg.stream_options.sndbuf = atoi(optarg);
+                break;
+            case 'T':
+                if(!strcmp(optarg, "nodelay")) {
+                    cfg.stream_options.tcp = STREAM_TCP_NODELAY;
+                } else if(!strcmp(optarg, "cork")) {
+                    cfg.stream_options.tcp = STREAM_TCP_CORK;
+                } else if(!strcmp(optarg, "nagle")) {
+                    cfg.stream_options.tcp = STREAM_TCP_NAGLE;
+                } else {
+                    fprintf(stderr, "error: unknown TCP policy %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 't':
+                trace_path = optarg;
+                break;
+            case 'W':
+                trace_window = atoi(optarg);
                 break;
             default:
                 abort();
@@ -131,74 +167,31 @@ int main(int argc, char **argv) {
 
     show_help(argc, argv);
 
-    data = malloc(sizeof(float*) * n_channels);
-    for(int i=0; i<n_channels; i++) {
-        data[i] = malloc(sizeof(float) * chunk_size);
-    }
+    pipeline_t *p = pipeline_new(&cfg);
+    if(!p) return 2;
 
-    if(codec == CODEC_OPUS) {
-        interleaved = malloc(sizeof(float) * n_channels * chunk_size);
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    if(trace_path) {
+        trace_init(trace_path);
+        trace_requested = 1;
+        signal(SIGUSR1, handle_trace_signal);
     }
 
-    audio_setup(client_name, n_channels);
-
-    if(auto_connect) {
-        audio_connect_inputs(auto_connect_offset);
-    }
-
-    tidstream_err_status_t status = ERR_OK;
-
-    do {
-        reinitialize:
-        status = ERR_OK;
-
-        shout_t *shout = stream_setup(shout_host, shout_port, shout_password,
-            shout_mount);
-        if(!shout) {
-            fprintf(stderr, "shout error\n");
-            status = ERR_STREAM_SETUP;
-            continue;
-        }
-
-        if(codec == CODEC_OPUS) {
-            int ret = enc_opus_setup(shout, 48000, n_channels, avg_bitrate);
-            if(ret != 0) {
-                fprintf(stderr, "enc_opus_setup error\n");
-                status = ERR_ENCODER_SETUP;
-                continue;
-            }
-        } else {
-            int ret = enc_vorbis_setup(shout, 48000, n_channels, min_bitrate,
-                avg_bitrate, max_bitrate);
-            if(ret != 0) {
-                fprintf(stderr, "vorbis error\n");
-                status = ERR_ENCODER_SETUP;
-                continue;
-            }
+    while(running && pipeline_step(p) == 0) {
+        if(trace_requested) {
+            trace_requested = 0;
+            trace_start(trace_window);
         }
+        trace_poll();
+        usleep(1000);
+    }
 
-
-        for(;;) {
-            int ret = 0;
-            if(audio_get_available() > chunk_size * sizeof(float)) {
-                if(codec == CODEC_OPUS) {
-                    audio_get_data(data, chunk_size);
-                    audio_interleave(data, interleaved, n_channels, chunk_size);
-                    ret = enc_opus_encode(shout, interleaved, chunk_size);
-                } else {
-                    audio_get_data(data, chunk_size);
-                    ret = enc_vorbis_encode(shout, data, chunk_size);
-                }
-                if(ret != 0) {
-                    fprintf(stderr, "encoder error: %d\n", ret);
-                    status = ERR_ENCODER;
-                    goto reinitialize;
-                }
-            }
-            usleep(1000);
-        }
-    } while(check_retry(status));
+    /* the events name streams that go away with the pipeline */
+    trace_stop();
+    pipeline_status_t status = p->status;
+    pipeline_free(p);
+    trace_free();
 
     return status;
 }
-
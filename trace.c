@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include "util.h"
+#include "trace.h"
+
+int trace_on;
+
+static char *trace_path;
+static trace_chunk_t *trace_chunks;
+static size_t trace_next_chunk;     /* chunks claimed this window */
+static size_t trace_dropped;        /* events that found no room */
+static unsigned trace_window;       /* windows started */
+static double trace_deadline;
+static int trace_writers;           /* threads recording an event right now */
+
+/* the chunk this thread is filling, and the window it was claimed in */
+static __thread trace_chunk_t *trace_current;
+static __thread unsigned trace_current_window;
+
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Sets where traces are written, and sets aside the memory for them, so
+ * that recording never allocates; the JACK threads record too.
+ */
+void trace_init(const char *path) {
+    trace_path = strdup(path);
+    CHECK_MALLOC(trace_path);
+    trace_chunks = (trace_chunk_t*)calloc(TRACE_CHUNKS, sizeof(trace_chunk_t));
+    CHECK_MALLOC(trace_chunks);
+}
+
+/**
+ * Stops recording, and waits for threads still recording an event to be
+ * done with the chunks, so that none of their events lands in the next
+ * window, or in freed memory.  Recording only ever takes a moment.
+ */
+static void trace_quiesce(void) {
+    __atomic_store_n(&trace_on, 0, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&trace_writers, __ATOMIC_SEQ_CST)) sched_yield();
+}
+
+/**
+ * Registers a thread about to record an event, unless recording has
+ * stopped.  Pairs with trace_quiesce.
+ */
+static bool trace_enter(void) {
+    __atomic_add_fetch(&trace_writers, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&trace_on, __ATOMIC_SEQ_CST)) return true;
+    __atomic_sub_fetch(&trace_writers, 1, __ATOMIC_RELEASE);
+    return false;
+}
+
+static void trace_leave(void) {
+    __atomic_sub_fetch(&trace_writers, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Starts recording a window of events, which trace_poll writes out once it
+ * is over.  Starting a window while one is recorded starts it over.
+ */
+void trace_start(double seconds) {
+    if(!trace_chunks) return;
+
+    trace_quiesce();
+    for(size_t i=0; i<TRACE_CHUNKS; i++) trace_chunks[i].used = 0;
+    trace_next_chunk = 0;
+    trace_dropped = 0;
+    __atomic_add_fetch(&trace_window, 1, __ATOMIC_RELEASE);
+    trace_deadline = trace_now() / 1e9 + seconds;
+    __atomic_store_n(&trace_on, 1, __ATOMIC_RELEASE);
+    fprintf(stderr, "trace: recording %0.0f s to %s\n", seconds, trace_path);
+}
+
+/**
+ * Finds room for one more event from this thread.  Each thread fills a
+ * chunk of its own, so recording takes no locks.
+ */
+static trace_event_t *trace_claim(void) {
+    unsigned window = __atomic_load_n(&trace_window, __ATOMIC_ACQUIRE);
+    trace_chunk_t *c = trace_current;
+
+    if(!c || trace_current_window != window || c->used == TRACE_CHUNK_EVENTS) {
+        size_t i = __atomic_fetch_add(&trace_next_chunk, 1, __ATOMIC_RELAXED);
+        if(i >= TRACE_CHUNKS) {
+            __atomic_add_fetch(&trace_dropped, 1, __ATOMIC_RELAXED);
+            trace_current = NULL;
+            return NULL;
+        }
+        c = &trace_chunks[i];
+        c->tid = syscall(SYS_gettid);
+        pthread_getname_np(pthread_self(), c->thread_name, sizeof(c->thread_name));
+        trace_current = c;
+        trace_current_window = window;
+    }
+    return &c->events[c->used];
+}
+
+/* publishes the event trace_claim returned */
+static void trace_commit(void) {
+    __atomic_store_n(&trace_current->used, trace_current->used + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Records something that took from start until now.
+ * @param arg_name name of arg in the trace, or NULL for none
+ */
+void trace_complete(const char *name, const char *label, uint64_t start,
+  const char *arg_name, int64_t arg) {
+    if(!trace_enabled() || !trace_enter()) return;
+    trace_event_t *e = trace_claim();
+    if(e) {
+        uint64_t now = trace_now();
+        *e = (trace_event_t){ start, now > start ? now - start : 0, name, label,
+            arg_name, arg, 'X' };
+        trace_commit();
+    }
+    trace_leave();
+}
+
+void trace_instant(const char *name, const char *label, const char *arg_name,
+  int64_t arg) {
+    if(!trace_enabled() || !trace_enter()) return;
+    trace_event_t *e = trace_claim();
+    if(e) {
+        *e = (trace_event_t){ trace_now(), 0, name, label, arg_name, arg, 'i' };
+        trace_commit();
+    }
+    trace_leave();
+}
+
+static void trace_write_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for(; *s; s++) {
+        if(*s == '"' || *s == '\\') fputc('\\', f);
+        if((unsigned char)*s >= 0x20) fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+/**
+ * Writes the chunks recorded in the window as Chrome trace event JSON, which
+ * chrome://tracing and Perfetto open.  Each thread gets a track; events
+ * carry the stream they belong to.
+ */
+static int trace_write(size_t n_chunks) {
+    FILE *f = fopen(trace_path, "w");
+    if(!f) {
+        perror(trace_path);
+        return -1;
+    }
+
+    int pid = getpid();
+    size_t n_events = 0;
+    bool first = true;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for(size_t i=0; i<n_chunks; i++) {
+        trace_chunk_t *c = &trace_chunks[i];
+        size_t used = __atomic_load_n(&c->used, __ATOMIC_ACQUIRE);
+        if(!used) continue;
+
+        fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"name\":", first ? "" : ",\n", pid, (int)c->tid);
+        trace_write_string(f, c->thread_name);
+        fprintf(f, "}}");
+        first = false;
+
+        for(size_t j=0; j<used; j++) {
+            trace_event_t *e = &c->events[j];
+            fprintf(f, ",\n{\"ph\":\"%c\",\"name\":\"%s\",\"cat\":\"tidstream\","
+                "\"pid\":%d,\"tid\":%d,\"ts\":%0.3f", e->phase, e->name, pid,
+                (int)c->tid, e->ts / 1e3);
+            if(e->phase == 'X') fprintf(f, ",\"dur\":%0.3f", e->dur / 1e3);
+            else fprintf(f, ",\"s\":\"t\"");
+            if(e->label || e->arg_name) {
+                fprintf(f, ",\"args\":{");
+                if(e->label) {
+                    fprintf(f, "\"stream\":");
+                    trace_write_string(f, e->label);
+                }
+                if(e->arg_name) {
+                    fprintf(f, "%s\"%s\":%lld", e->label ? "," : "", e->arg_name,
+                        (long long)e->arg);
+                }
+                fprintf(f, "}");
+            }
+            fprintf(f, "}");
+        }
+        n_events += used;
+    }
+    fprintf(f, "\n]}\n");
+
+    if(fclose(f) != 0) {
+        perror(trace_path);
+        return -1;
+    }
+    size_t dropped = __atomic_load_n(&trace_dropped, __ATOMIC_RELAXED);
+    fprintf(stderr, "trace: wrote %zu events to %s", n_events, trace_path);
+    if(dropped) fprintf(stderr, " (%zu dropped, out of room)", dropped);
+    fprintf(stderr, "\n");
+    return 0;
+}
+
+/**
+ * Ends the window being recorded, if any, and writes it out.
+ */
+void trace_stop(void) {
+    if(!trace_enabled()) return;
+
+    trace_quiesce();
+    size_t n_chunks = __atomic_load_n(&trace_next_chunk, __ATOMIC_ACQUIRE);
+    trace_write(n_chunks < TRACE_CHUNKS ? n_chunks : TRACE_CHUNKS);
+}
+
+/**
+ * Writes out the window once it is over.  Called regularly from the main
+ * loop.
+ */
+void trace_poll(void) {
+    if(trace_enabled() && trace_now() / 1e9 >= trace_deadline) trace_stop();
+}
+
+/**
+ * Frees the trace memory, once nothing is recording into it.  A window
+ * still being recorded is lost; trace_stop writes it out while the streams
+ * its events name are still there.
+ */
+void trace_free(void) {
+    trace_quiesce();
+    free(trace_chunks);
+    free(trace_path);
+    trace_chunks = NULL;
+    trace_path = NULL;
+}
@@ -0,0 +1,49 @@
+#ifndef __trace_h_
+#define __trace_h_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define TRACE_CHUNK_EVENTS 256      /* events a thread claims at a time */
+#define TRACE_CHUNKS 2048           /* chunks per window; later events are dropped */
+#define TRACE_WINDOW 10             /* default seconds recorded per window */
+
+typedef struct {
+    uint64_t ts;                /* nanoseconds, CLOCK_MONOTONIC */
+    uint64_t dur;               /* for complete events */
+    const char *name;
+    const char *label;          /* the stream, or NULL */
+    const char *arg_name;       /* or NULL */
+    int64_t arg;
+    char phase;                 /* 'X' complete, 'i' instant */
+} trace_event_t;
+
+/* events recorded by one thread; only that thread adds to it */
+typedef struct {
+    pid_t tid;
+    char thread_name[16];
+    size_t used;
+    trace_event_t events[TRACE_CHUNK_EVENTS];
+} trace_chunk_t;
+
+/* set while a window is being recorded */
+extern int trace_on;
+
+static inline bool trace_enabled(void) {
+    return __atomic_load_n(&trace_on, __ATOMIC_RELAXED);
+}
+
+void trace_init(const char *path);
+void trace_start(double seconds);
+void trace_poll(void);
+void trace_stop(void);
+void trace_free(void);
+
+uint64_t trace_now(void);
+void trace_complete(const char *name, const char *label, uint64_t start,
+  const char *arg_name, int64_t arg);
+void trace_instant(const char *name, const char *label, const char *arg_name,
+  int64_t arg);
+
+#endif // __trace_h_
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wav_reader.h"
+
+#define WAVE_FORMAT_PCM 1
+#define WAVE_FORMAT_IEEE_FLOAT 3
+#define WAVE_FORMAT_EXTENSIBLE 0xfffe
+
+static uint16_t get_le16(const unsigned char *buf) {
+    return buf[0] | (buf[1] << 8);
+}
+
+static uint32_t get_le32(const unsigned char *buf) {
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static uint64_t get_le64(const unsigned char *buf) {
+    return get_le32(buf) | ((uint64_t)get_le32(buf + 4) << 32);
+}
+
+/**
+ * Maps a WAV (or RF64) file and parses its format.  Integer PCM of 8 to 32
+ * bits and 32-bit float are supported, plain or in WAVE_FORMAT_EXTENSIBLE.
+ * @return 0 on success, -1 if the file could not be opened, -2 if it is not
+ *  a supported WAV file
+ */
+int wav_reader_open(wav_reader_t *w, const char *path) {
+    struct stat st;
+
+    memset(w, 0, sizeof(wav_reader_t));
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return -1;
+    if(fstat(fd, &st) < 0 || st.st_size < 12) {
+        close(fd);
+        return st.st_size < 12 ? -2 : -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return -1;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    const unsigned char *p = (const unsigned char*)map;
+    size_t length = st.st_size;
+    w->map = p;
+    w->map_length = length;
+
+    bool rf64 = memcmp(p, "RF64", 4) == 0;
+    if((!rf64 && memcmp(p, "RIFF", 4) != 0) || memcmp(p + 8, "WAVE", 4) != 0) {
+        wav_reader_close(w);
+        return -2;
+    }
+
+    uint64_t ds64_data_size = 0;
+    int format = 0;
+    size_t pos = 12;
+    while(pos + 8 <= length) {
+        const unsigned char *chunk = p + pos;
+        uint64_t size = get_le32(chunk + 4);
+
+        if(memcmp(chunk, "ds64", 4) == 0 && size >= 24 && pos + 8 + 24 <= length) {
+            ds64_data_size = get_le64(chunk + 16);
+        } else if(memcmp(chunk, "fmt ", 4) == 0 && size >= 16 && pos + 8 + size <= length) {
+            format = get_le16(chunk + 8);
+            w->channels = get_le16(chunk + 10);
+            w->rate = get_le32(chunk + 12);
+            w->block_align = get_le16(chunk + 20);
+            w->bits = get_le16(chunk + 22);
+            if(format == WAVE_FORMAT_EXTENSIBLE && size >= 40) {
+                /* the sub-format GUID starts with the format tag */
+                format = get_le16(chunk + 32);
+            }
+        } else if(memcmp(chunk, "data", 4) == 0) {
+            if(rf64 && size == 0xffffffffu) size = ds64_data_size;
+            if(size > length - pos - 8) size = length - pos - 8;
+            w->data = chunk + 8;
+            if(w->block_align > 0) w->frames = size / w->block_align;
+            break;
+        }
+
+        pos += 8 + size + (size & 1);
+    }
+
+    if(format == WAVE_FORMAT_PCM && w->bits >= 8 && w->bits <= 32 && w->bits % 8 == 0) {
+        w->format = WAV_PCM;
+    } else if(format == WAVE_FORMAT_IEEE_FLOAT && w->bits == 32) {
+        w->format = WAV_FLOAT;
+    } else {
+        wav_reader_close(w);
+        return -2;
+    }
+    if(!w->data || w->channels < 1 || w->block_align != w->channels * w->bits / 8) {
+        wav_reader_close(w);
+        return -2;
+    }
+
+    return 0;
+}
+
+/**
+ * Converts n frames starting at frame start to interleaved floats.  Frames
+ * past the end of the file are silent.
+ */
+void wav_reader_read(const wav_reader_t *w, int64_t start, int n, float *out) {
+    int64_t avail = w->frames - start;
+    int count = avail < 0 ? 0 : avail < n ? avail : n;
+    int samples = count * w->channels;
+    const unsigned char *p = w->data + start * w->block_align;
+
+    if(w->format == WAV_FLOAT) {
+        memcpy(out, p, samples * sizeof(float));
+    } else if(w->bits == 16) {
+        for(int i=0; i<samples; i++) {
+            out[i] = (int16_t)get_le16(p + 2*i) / 32768.0f;
+        }
+    } else if(w->bits == 24) {
+        for(int i=0; i<samples; i++) {
+            int32_t v = (p[3*i] << 8) | (p[3*i+1] << 16) | ((uint32_t)p[3*i+2] << 24);
+            out[i] = v / 2147483648.0f;
+        }
+    } else if(w->bits == 32) {
+        for(int i=0; i<samples; i++) {
+            out[i] = (int32_t)get_le32(p + 4*i) / 2147483648.0f;
+        }
+    } else {
+        for(int i=0; i<samples; i++) {
+            out[i] = (p[i] - 128) / 128.0f;
+        }
+    }
+
+    memset(out + samples, 0, (n - count) * w->channels * sizeof(float));
+}
+
+void wav_reader_close(wav_reader_t *w) {
+    if(w->map) munmap((void*)w->map, w->map_length);
+    w->map = NULL;
+}
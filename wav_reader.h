@@ -0,0 +1,30 @@
+#ifndef __wav_reader_h_
+#define __wav_reader_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {
+    WAV_PCM,        /* unsigned 8-bit, or signed 16, 24 or 32-bit integers */
+    WAV_FLOAT       /* 32-bit float */
+} wav_sample_format_t;
+
+/* a WAV or RF64 file mapped into memory; reads are safe from any thread */
+typedef struct {
+    const unsigned char *map;
+    size_t map_length;
+    const unsigned char *data;  /* start of the sample data */
+
+    int channels;
+    int rate;
+    int bits;
+    int block_align;            /* bytes per frame */
+    wav_sample_format_t format;
+    int64_t frames;
+} wav_reader_t;
+
+int wav_reader_open(wav_reader_t *w, const char *path);
+void wav_reader_read(const wav_reader_t *w, int64_t start, int n, float *out);
+void wav_reader_close(wav_reader_t *w);
+
+#endif // __wav_reader_h_
@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "work_pool.h"
+
+typedef struct {
+    work_pool_t *pool;
+    int index;
+} work_worker_t;
+
+/* the pool and deque of the worker running on this thread, if any */
+static __thread work_pool_t *work_pool_current;
+static __thread int work_pool_self;
+
+static void work_deque_push(work_deque_t *d, work_fn fn, void *arg) {
+    pthread_mutex_lock(&d->lock);
+    if(d->bottom - d->top == d->size) {
+        work_item_t *items = (work_item_t*)malloc(2 * d->size * sizeof(work_item_t));
+        CHECK_MALLOC(items);
+        for(size_t i=d->top; i<d->bottom; i++) {
+            items[i & (2 * d->size - 1)] = d->items[i & (d->size - 1)];
+        }
+        free(d->items);
+        d->items = items;
+        d->size *= 2;
+    }
+    d->items[d->bottom & (d->size - 1)] = (work_item_t){ fn, arg };
+    d->bottom++;
+    pthread_mutex_unlock(&d->lock);
+}
+
+/**
+ * Takes a job off one end of a deque.
+ * @param steal take the oldest job rather than the newest
+ */
+static bool work_deque_take(work_deque_t *d, bool steal, work_item_t *item) {
+    bool found = false;
+
+    pthread_mutex_lock(&d->lock);
+    if(d->bottom != d->top) {
+        if(steal) {
+            *item = d->items[d->top & (d->size - 1)];
+            d->top++;
+        } else {
+            d->bottom--;
+            *item = d->items[d->bottom & (d->size - 1)];
+        }
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return found;
+}
+
+/**
+ * Finds a job for worker self: its own newest, or failing that the oldest
+ * of another worker, looking at the others in turn.
+ */
+static bool work_pool_take(work_pool_t *pool, int self, work_item_t *item) {
+    bool found = work_deque_take(&pool->deques[self], false, item);
+    for(int i=1; !found && i<pool->n_threads; i++) {
+        found = work_deque_take(&pool->deques[(self + i) % pool->n_threads], true, item);
+    }
+    if(found) {
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return found;
+}
+
+static void *work_pool_worker(void *arg) {
+    work_worker_t *w = (work_worker_t*)arg;
+    work_pool_t *pool = w->pool;
+    work_item_t item;
+
+    work_pool_current = pool;
+    work_pool_self = w->index;
+    free(w);
+
+    for(;;) {
+        if(work_pool_take(pool, work_pool_self, &item)) {
+            item.fn(item.arg);
+            continue;
+        }
+
+        /* sleep until there is something to take; jobs already queued are
+         * all run before the pool shuts down */
+        pthread_mutex_lock(&pool->lock);
+        while(pool->queued == 0 && pool->running) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        bool done = pool->queued == 0 && !pool->running;
+        pthread_mutex_unlock(&pool->lock);
+        if(done) break;
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts a pool of worker threads, each with its own queue of jobs.  Idle
+ * workers take jobs from the others' queues, so the load evens out however
+ * the jobs were submitted.
+ * @param n_threads number of workers, or 0 for one per online CPU
+ * @return the pool, or NULL if no worker could be started
+ */
+work_pool_t *work_pool_new(int n_threads) {
+    if(n_threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = cpus > 0 ? cpus : 1;
+    }
+
+    work_pool_t *pool = (work_pool_t*)calloc(1, sizeof(work_pool_t));
+    CHECK_MALLOC(pool);
+    pool->threads = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+    pool->deques = (work_deque_t*)calloc(n_threads, sizeof(work_deque_t));
+    CHECK_MALLOC(pool->threads);
+    CHECK_MALLOC(pool->deques);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->running = true;
+
+    for(int i=0; i<n_threads; i++) {
+        work_deque_t *d = &pool->deques[i];
+        pthread_mutex_init(&d->lock, NULL);
+        d->size = WORK_POOL_DEQUE_SIZE;
+        d->items = (work_item_t*)malloc(d->size * sizeof(work_item_t));
+        CHECK_MALLOC(d->items);
+    }
+
+    /* deques exist for every worker before any of them starts stealing */
+    pool->n_threads = n_threads;
+    for(int i=0; i<n_threads; i++) {
+        work_worker_t *w = (work_worker_t*)malloc(sizeof(work_worker_t));
+        CHECK_MALLOC(w);
+        w->pool = pool;
+        w->index = i;
+        if(pthread_create(&pool->threads[i], NULL, work_pool_worker, w) != 0) {
+            perror("error: starting worker thread");
+            free(w);
+            /* stops the workers that did start */
+            work_pool_free(pool);
+            return NULL;
+        }
+        /* names the thread in traces and top, which take 15 characters */
+        char name[16];
+        snprintf(name, sizeof(name), "worker %d", i % 10000000);
+        pthread_setname_np(pool->threads[i], name);
+        pool->started++;
+    }
+
+    return pool;
+}
+
+/**
+ * Queues a job.  A job submitted by a worker goes on that worker's own
+ * queue; others are spread over the workers in turn.
+ */
+void work_pool_submit(work_pool_t *pool, work_fn fn, void *arg) {
+    int index;
+
+    if(work_pool_current == pool) {
+        index = work_pool_self;
+    } else {
+        pthread_mutex_lock(&pool->lock);
+        index = pool->next;
+        pool->next = (pool->next + 1) % pool->n_threads;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    work_deque_push(&pool->deques[index], fn, arg);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Runs the jobs still queued, then stops the workers and frees the pool.
+ */
+void work_pool_free(work_pool_t *pool) {
+    if(!pool) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->running = false;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(int i=0; i<pool->started; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    for(int i=0; i<pool->n_threads; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].items);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
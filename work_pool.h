@@ -0,0 +1,44 @@
+#ifndef __work_pool_h_
+#define __work_pool_h_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define WORK_POOL_DEQUE_SIZE 64     /* initial jobs per worker; grows as needed */
+
+typedef void (*work_fn)(void *arg);
+
+typedef struct {
+    work_fn fn;
+    void *arg;
+} work_item_t;
+
+/* a worker's jobs: the owner takes the newest from the bottom, idle workers
+ * steal the oldest from the top */
+typedef struct {
+    pthread_mutex_t lock;
+    work_item_t *items;
+    size_t size;                /* a power of two */
+    size_t top;
+    size_t bottom;
+} work_deque_t;
+
+typedef struct work_pool {
+    int n_threads;
+    int started;                /* workers running */
+    pthread_t *threads;
+    work_deque_t *deques;       /* one per worker */
+
+    pthread_mutex_t lock;       /* idle workers sleep on cond */
+    pthread_cond_t cond;
+    int queued;                 /* jobs in all the deques */
+    int next;                   /* deque for the next job from outside */
+    bool running;
+} work_pool_t;
+
+work_pool_t *work_pool_new(int n_threads);
+void work_pool_submit(work_pool_t *pool, work_fn fn, void *arg);
+void work_pool_free(work_pool_t *pool);
+
+#endif // __work_pool_h_
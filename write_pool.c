@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+
+#include "util.h"
+#include "write_pool.h"
+
+static int write_pool_pwrite(int fd, const unsigned char *data, size_t length,
+  int64_t offset) {
+    while(length > 0) {
+        ssize_t n = pwrite(fd, data, length, offset);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return errno;
+        }
+        data += n;
+        length -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static void *write_pool_worker(void *arg) {
+    write_pool_t *pool = (write_pool_t*)arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;) {
+        while(!pool->head && !pool->shutdown) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if(!pool->head) break;
+
+        write_buffer_t *wb = pool->head;
+        pool->head = wb->next;
+        if(!pool->head) pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        write_stream_t *ws = wb->ws;
+        int err = write_pool_pwrite(ws->fd, wb->data, wb->length, wb->offset);
+
+        /* syncing here keeps the flush off the producer's thread */
+        if(!err && pool->sync_bytes) {
+            bool sync = false;
+            pthread_mutex_lock(&pool->lock);
+            ws->unsynced += wb->length;
+            if(ws->unsynced >= pool->sync_bytes) {
+                ws->unsynced = 0;
+                sync = true;
+            }
+            pthread_mutex_unlock(&pool->lock);
+            if(sync && fdatasync(ws->fd) < 0) err = errno;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if(err && !ws->error) ws->error = err;
+        wb->length = 0;
+        wb->next = ws->free;
+        ws->free = wb;
+        ws->in_flight--;
+        pthread_cond_broadcast(&ws->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+write_pool_t *write_pool_new(int n_threads, size_t buffer_size, int n_buffers) {
+    write_pool_t *pool = (write_pool_t*)malloc(sizeof(write_pool_t));
+    CHECK_MALLOC(pool);
+
+    /* keep buffers a whole number of pages so every write but the last one
+     * of a file stays page aligned */
+    size_t page_size = getpagesize();
+    buffer_size += page_size - 1;
+    buffer_size -= buffer_size & (page_size - 1);
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->n_threads = n_threads > 0 ? n_threads : 1;
+    pool->buffer_size = buffer_size;
+    pool->n_buffers = n_buffers > 0 ? n_buffers : 1;
+    pool->sync_bytes = 0;
+    pool->atomic = false;
+    pool->shutdown = false;
+
+    pool->threads = (pthread_t*)malloc(pool->n_threads * sizeof(pthread_t));
+    CHECK_MALLOC(pool->threads);
+    for(int i=0; i<pool->n_threads; i++) {
+        if(pthread_create(&pool->threads[i], NULL, write_pool_worker, pool)) {
+            fprintf(stderr, "write_pool: cannot create writer thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return pool;
+}
+
+/**
+ * Sets how hard the pool works to keep files consistent on disk.  Must be
+ * called before any stream is opened.
+ * @param sync_bytes flush each file to disk with fdatasync after this many
+ *  bytes, from the writer threads; 0 leaves it to the kernel
+ * @param atomic write each file as <path>.part and only rename it to <path>
+ *  once it has been closed and flushed, so that a crash never leaves a
+ *  truncated file under its final name
+ */
+void write_pool_set_durability(write_pool_t *pool, size_t sync_bytes, bool atomic) {
+    pool->sync_bytes = sync_bytes;
+    pool->atomic = atomic;
+}
+
+void write_pool_free(write_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(int i=0; i<pool->n_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+write_stream_t *write_stream_open(write_pool_t *pool, const char *path,
+  int64_t prealloc) {
+    char *tmp_path = NULL;
+    if(pool->atomic) {
+        tmp_path = (char*)malloc(strlen(path) + 6);
+        CHECK_MALLOC(tmp_path);
+        sprintf(tmp_path, "%s.part", path);
+    }
+
+    int fd = open(tmp_path ? tmp_path : path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        free(tmp_path);
+        return NULL;
+    }
+
+#ifdef __linux__
+    /* reserve the space up front so the file is laid out contiguously even
+     * though many files are growing at the same time; this is only a hint */
+    if(prealloc > 0) {
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, prealloc);
+    }
+#endif
+
+    write_stream_t *ws = (write_stream_t*)malloc(sizeof(write_stream_t));
+    CHECK_MALLOC(ws);
+    ws->pool = pool;
+    ws->fd = fd;
+    ws->path = NULL;
+    ws->tmp_path = tmp_path;
+    if(tmp_path) {
+        ws->path = strdup(path);
+        CHECK_MALLOC(ws->path);
+    }
+    ws->unsynced = 0;
+    ws->cur = NULL;
+    ws->free = NULL;
+    ws->allocated = 0;
+    ws->in_flight = 0;
+    ws->offset = 0;
+    ws->error = 0;
+    pthread_cond_init(&ws->cond, NULL);
+
+    return ws;
+}
+
+/* Makes a rename in the file's directory durable. */
+static void write_pool_sync_dir(const char *path) {
+    char *copy = strdup(path);
+    CHECK_MALLOC(copy);
+
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+    if(fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(copy);
+}
+
+/* Take a free buffer for the stream, allocating one if the stream is below
+ * its quota, or waiting for a writer thread to return one otherwise. */
+static void write_stream_next_buffer(write_stream_t *ws) {
+    write_pool_t *pool = ws->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while(!ws->free && ws->allocated >= pool->n_buffers) {
+        pthread_cond_wait(&ws->cond, &pool->lock);
+    }
+    if(ws->free) {
+        ws->cur = ws->free;
+        ws->free = ws->cur->next;
+    } else {
+        ws->allocated++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if(!ws->cur) {
+        write_buffer_t *wb = (write_buffer_t*)malloc(sizeof(write_buffer_t));
+        CHECK_MALLOC(wb);
+        if(posix_memalign((void**)&wb->data, getpagesize(), pool->buffer_size)) {
+            printf("Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        wb->ws = ws;
+        wb->length = 0;
+        ws->cur = wb;
+    }
+
+    ws->cur->offset = ws->offset;
+    ws->cur->next = NULL;
+}
+
+static void write_stream_submit(write_stream_t *ws) {
+    write_pool_t *pool = ws->pool;
+    write_buffer_t *wb = ws->cur;
+
+    ws->cur = NULL;
+    ws->offset += wb->length;
+
+    pthread_mutex_lock(&pool->lock);
+    ws->in_flight++;
+    if(pool->tail) {
+        pool->tail->next = wb;
+    } else {
+        pool->head = wb;
+    }
+    pool->tail = wb;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int write_stream_write(write_stream_t *ws, const void *data, size_t length) {
+    const unsigned char *p = (const unsigned char*)data;
+    size_t buffer_size = ws->pool->buffer_size;
+
+    while(length > 0) {
+        if(!ws->cur) write_stream_next_buffer(ws);
+
+        size_t n = buffer_size - ws->cur->length;
+        if(n > length) n = length;
+        memcpy(ws->cur->data + ws->cur->length, p, n);
+        ws->cur->length += n;
+        p += n;
+        length -= n;
+
+        if(ws->cur->length == buffer_size) write_stream_submit(ws);
+    }
+
+    /* set by the writer threads under the lock */
+    pthread_mutex_lock(&ws->pool->lock);
+    int err = ws->error;
+    pthread_mutex_unlock(&ws->pool->lock);
+    return err ? -1 : 0;
+}
+
+int write_stream_close(write_stream_t *ws) {
+    write_pool_t *pool = ws->pool;
+
+    if(ws->cur && ws->cur->length > 0) {
+        write_stream_submit(ws);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while(ws->in_flight > 0) {
+        pthread_cond_wait(&ws->cond, &pool->lock);
+    }
+    int err = ws->error;
+    pthread_mutex_unlock(&pool->lock);
+
+    /* release any preallocated space beyond what was actually written */
+    if(ftruncate(ws->fd, ws->offset) < 0 && !err) err = errno;
+    if((ws->tmp_path || pool->sync_bytes) && fdatasync(ws->fd) < 0 && !err) {
+        err = errno;
+    }
+    if(close(ws->fd) < 0 && !err) err = errno;
+
+    /* a file that failed keeps its temporary name */
+    if(ws->tmp_path && !err) {
+        if(rename(ws->tmp_path, ws->path) < 0) {
+            err = errno;
+        } else {
+            write_pool_sync_dir(ws->path);
+        }
+    }
+    free(ws->tmp_path);
+    free(ws->path);
+
+    if(ws->cur) {
+        ws->cur->next = ws->free;
+        ws->free = ws->cur;
+    }
+    while(ws->free) {
+        write_buffer_t *wb = ws->free;
+        ws->free = wb->next;
+        free(wb->data);
+        free(wb);
+    }
+    pthread_cond_destroy(&ws->cond);
+    free(ws);
+
+    if(err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
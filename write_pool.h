@@ -0,0 +1,62 @@
+#ifndef __write_pool_h_
+#define __write_pool_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define WRITE_POOL_THREADS 4
+#define WRITE_POOL_BUFFER_SIZE (1 << 20)
+#define WRITE_POOL_BUFFERS 2
+
+struct write_stream;
+
+typedef struct write_buffer {
+    struct write_stream *ws;
+    unsigned char *data;
+    size_t length;              /* bytes of valid data in the buffer */
+    int64_t offset;             /* file offset the buffer is written to */
+    struct write_buffer *next;  /* link in job queue or free list */
+} write_buffer_t;
+
+typedef struct write_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* signalled when a job is queued */
+    write_buffer_t *head;       /* queue of buffers waiting to be written */
+    write_buffer_t *tail;
+
+    pthread_t *threads;
+    int n_threads;
+    size_t buffer_size;         /* size of each aligned buffer */
+    int n_buffers;              /* maximum buffers per stream */
+    size_t sync_bytes;          /* fdatasync a stream after this many bytes */
+    bool atomic;                /* write to <path>.part, rename on close */
+    bool shutdown;
+} write_pool_t;
+
+typedef struct write_stream {
+    write_pool_t *pool;
+    int fd;
+    char *path;                 /* final name, if writing to a temp file */
+    char *tmp_path;
+    size_t unsynced;            /* bytes written since the last fdatasync */
+    write_buffer_t *cur;        /* buffer currently being filled */
+    write_buffer_t *free;       /* buffers returned by the writer threads */
+    int allocated;              /* number of buffers allocated so far */
+    int in_flight;              /* number of buffers queued or being written */
+    int64_t offset;             /* file offset of the start of cur */
+    int error;                  /* first errno reported by a writer thread */
+    pthread_cond_t cond;        /* signalled when a buffer is returned */
+} write_stream_t;
+
+write_pool_t *write_pool_new(int n_threads, size_t buffer_size, int n_buffers);
+void write_pool_set_durability(write_pool_t *pool, size_t sync_bytes, bool atomic);
+void write_pool_free(write_pool_t *pool);
+
+write_stream_t *write_stream_open(write_pool_t *pool, const char *path,
+    int64_t prealloc);
+int write_stream_write(write_stream_t *ws, const void *data, size_t length);
+int write_stream_close(write_stream_t *ws);
+
+#endif // __write_pool_h_